@@ -0,0 +1,155 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <fadec.h>
+
+
+#define LIKELY(x) __builtin_expect((x), 1)
+#define UNLIKELY(x) __builtin_expect((x), 0)
+
+// The addresses of all entries of a set are stored consecutively in a separate
+// tag array, so that a lookup only touches the entry that actually matches.
+static inline size_t
+cache_set(const FdDecodeCache* cache, uint64_t address)
+{
+    // Fibonacci hashing, so that consecutive instructions use different sets.
+    size_t set = (address * 0x9e3779b97f4a7c15ull) >> 32 & cache->set_mask;
+    return set * cache->ways;
+}
+
+int
+fd_cache_init(FdDecodeCache* cache, void* mem, size_t mem_size, unsigned ways)
+{
+    if (((uintptr_t) mem & 7) || !ways)
+        return FD_ERR_INTERNAL;
+    size_t max_sets = mem_size / FD_CACHE_ENTRY_SIZE / ways;
+    if (!max_sets)
+        return FD_ERR_INTERNAL;
+
+    size_t sets = 1;
+    while (sets <= max_sets / 2 && sets < ((size_t) 1 << 31))
+        sets *= 2;
+
+    cache->tags = mem;
+    cache->entries = (FdDecodeCacheEntry*) (cache->tags + sets * ways);
+    cache->set_mask = sets - 1;
+    cache->ways = ways;
+    cache->next_victim = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    for (size_t i = 0; i < sets * ways; i++)
+    {
+        cache->tags[i] = 0;
+        cache->entries[i].mode = 0;
+    }
+    return 0;
+}
+
+int
+fd_cache_decode(FdDecodeCache* cache, const uint8_t* buffer, size_t len,
+                int mode, uint64_t address, FdInstr* instr)
+{
+    size_t set = cache_set(cache, address);
+    const uint64_t* tags = &cache->tags[set];
+    FdDecodeCacheEntry* entries = &cache->entries[set];
+    FdDecodeCacheEntry* victim = NULL;
+    for (unsigned i = 0; i < cache->ways; i++)
+    {
+        if (tags[i] != address)
+            continue;
+        FdDecodeCacheEntry* entry = &entries[i];
+        if (entry->mode != mode)
+            continue;
+
+        // The code might have changed without invalidation, so compare the
+        // instruction bytes. If they differ, replace this entry.
+        size_t size = FD_SIZE(&entry->instr);
+        if (UNLIKELY(size > len))
+            goto replace;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        if (LIKELY(len >= 16))
+        {
+            // Compare 16 bytes at once; the last entry byte is masked out.
+            uint64_t lo_mask = size >= 8 ? ~(uint64_t) 0 : ((uint64_t) 1 << 8 * size) - 1;
+            uint64_t hi_mask = size > 8 ? ((uint64_t) 1 << 8 * (size - 8)) - 1 : 0;
+            uint64_t cached[2], cur[2];
+            __builtin_memcpy(cached, entry->bytes, 16);
+            __builtin_memcpy(cur, buffer, 16);
+            if ((((cached[0] ^ cur[0]) & lo_mask) | ((cached[1] ^ cur[1]) & hi_mask)))
+                goto replace;
+        }
+        else
+#endif
+        {
+            for (size_t j = 0; j < size; j++)
+                if (entry->bytes[j] != buffer[j])
+                    goto replace;
+        }
+
+        cache->hits++;
+        *instr = entry->instr;
+        return size;
+
+    replace:
+        victim = entry;
+        break;
+    }
+
+    cache->misses++;
+    int res = fd_decode(buffer, len, mode, 0, instr);
+    if (UNLIKELY(res < 0))
+        return res;
+
+    for (unsigned i = 0; !victim && i < cache->ways; i++)
+        if (!entries[i].mode)
+            victim = &entries[i];
+    if (!victim)
+        victim = &entries[cache->next_victim++ % cache->ways];
+
+    cache->tags[victim - cache->entries] = address;
+    victim->instr = *instr;
+    victim->address = address;
+    victim->mode = mode;
+    for (int j = 0; j < res; j++)
+        victim->bytes[j] = buffer[j];
+    return res;
+}
+
+static inline void
+cache_invalidate_entry(FdDecodeCacheEntry* entry, uint64_t address,
+                       uint64_t last)
+{
+    uint64_t start = entry->address;
+    if (entry->mode && start <= last &&
+        (start >= address || address - start < FD_SIZE(&entry->instr)))
+        entry->mode = 0;
+}
+
+void
+fd_cache_invalidate(FdDecodeCache* cache, uint64_t address, uint64_t len)
+{
+    if (!len)
+        return;
+
+    // Instructions starting up to 14 bytes before the range can overlap.
+    uint64_t first = address >= 14 ? address - 14 : 0;
+    uint64_t last = address + len - 1 >= address ? address + len - 1 : UINT64_MAX;
+
+    size_t sets = cache->set_mask + 1;
+    if (last - first >= sets)
+    {
+        for (size_t i = 0; i < sets * cache->ways; i++)
+            cache_invalidate_entry(&cache->entries[i], address, last);
+        return;
+    }
+
+    // For small ranges, only look at the sets of all possible addresses.
+    for (uint64_t cur = first; cur <= last && cur >= first; cur++)
+    {
+        size_t set = cache_set(cache, cur);
+        for (unsigned i = 0; i < cache->ways; i++)
+            if (cache->tags[set + i] == cur)
+                cache_invalidate_entry(&cache->entries[set + i], address, last);
+    }
+}
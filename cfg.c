@@ -0,0 +1,289 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <fadec.h>
+
+
+#define UNLIKELY(x) __builtin_expect((x), 0)
+
+#define BIT_TEST(bits, off) (((bits)[(off) / 8] >> ((off) % 8)) & 1)
+#define BIT_SET(bits, off) ((bits)[(off) / 8] |= 1 << ((off) % 8))
+
+// Placeholder for a branch target inside an already decoded block, which is
+// replaced by splitting that block after the traversal.
+#define BLOCK_SPLIT 0xff
+
+static unsigned
+cfg_kind(const FdInstr* instr)
+{
+    bool direct = FD_OP_TYPE(instr, 0) == FD_OT_OFF;
+    switch (FD_TYPE(instr)) {
+    case FDI_JMP: return direct ? FD_BLOCK_JUMP : FD_BLOCK_JUMP_INDIRECT;
+    case FDI_JMPF: return FD_BLOCK_JUMP_INDIRECT;
+    case FDI_CALL: return direct ? FD_BLOCK_CALL : FD_BLOCK_CALL_INDIRECT;
+    case FDI_CALLF: return FD_BLOCK_CALL_INDIRECT;
+    case FDI_RET:
+    case FDI_RETF:
+    case FDI_IRET:
+    case FDI_SYSRET:
+    case FDI_SYSEXIT:
+        return FD_BLOCK_RET;
+    case FDI_UD0:
+    case FDI_UD1:
+    case FDI_UD2:
+        return FD_BLOCK_TRAP;
+    // Jcc, LOOPcc, JCXZ, XBEGIN; all other instructions have no offset.
+    default: return direct ? FD_BLOCK_COND : FD_BLOCK_FALLTHROUGH;
+    }
+}
+
+// Queue a new block at off, unless an instruction starts there already or off
+// is outside of the code region. Returns false if no block is left.
+static bool
+cfg_queue(FdBlock* blocks, size_t* count, size_t max, uint8_t* visited,
+          size_t len, size_t off)
+{
+    if (off >= len || BIT_TEST(visited, off))
+        return true;
+    if (UNLIKELY(*count == max))
+        return false;
+    BIT_SET(visited, off);
+    blocks[*count] = (FdBlock) { .start = off, .end = off };
+    *count += 1;
+    return true;
+}
+
+static bool
+cfg_less(const FdBlock* a, const FdBlock* b)
+{
+    if (a->start != b->start)
+        return a->start < b->start;
+    return a->kind != BLOCK_SPLIT && b->kind == BLOCK_SPLIT;
+}
+
+#define SORT_DIGIT(block, shift) ((block)->start >> (shift) & 0xff)
+
+// In-place radix sort by the start offset (most significant byte first), which
+// requires no memory allocation and recurses at most once per byte of len.
+static void
+cfg_sort(FdBlock* blocks, size_t count, unsigned shift)
+{
+    if (count <= 32)
+    {
+        for (size_t i = 1; i < count; i++)
+        {
+            FdBlock tmp = blocks[i];
+            size_t j = i;
+            for (; j > 0 && cfg_less(&tmp, &blocks[j - 1]); j--)
+                blocks[j] = blocks[j - 1];
+            blocks[j] = tmp;
+        }
+        return;
+    }
+
+    size_t heads[256] = {0};
+    size_t ends[256];
+    for (size_t i = 0; i < count; i++)
+        heads[SORT_DIGIT(&blocks[i], shift)]++;
+    for (size_t d = 0, sum = 0; d < 256; d++)
+    {
+        sum += heads[d];
+        heads[d] = sum - heads[d];
+        ends[d] = sum;
+    }
+    // Swap every block into its bucket; afterwards, heads equals ends.
+    for (size_t d = 0; d < 256; d++)
+    {
+        while (heads[d] < ends[d])
+        {
+            FdBlock tmp = blocks[heads[d]];
+            size_t tmp_d = SORT_DIGIT(&tmp, shift);
+            while (tmp_d != d)
+            {
+                FdBlock next = blocks[heads[tmp_d]];
+                blocks[heads[tmp_d]++] = tmp;
+                tmp = next;
+                tmp_d = SORT_DIGIT(&tmp, shift);
+            }
+            blocks[heads[d]++] = tmp;
+        }
+    }
+
+    if (shift == 0)
+        return;
+    for (size_t d = 0, start = 0; d < 256; start = ends[d++])
+        if (ends[d] - start > 1)
+            cfg_sort(blocks + start, ends[d] - start, shift - 8);
+}
+
+static bool
+cfg_is_start(const FdBlock* blocks, size_t count, size_t off)
+{
+    size_t lo = 0, hi = count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (blocks[mid].start == off)
+            return true;
+        if (blocks[mid].start < off)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return false;
+}
+
+// Split a block at off, if one of its instructions starts there. Only the
+// lengths of the instructions before off are determined again.
+static bool
+cfg_split(const uint8_t* buf, size_t len, int mode, FdBlock* block,
+          size_t off, FdBlock* out_tail)
+{
+    if (off <= block->start || off >= block->end)
+        return false;
+    size_t cur = block->start;
+    uint32_t instrs = 0;
+    while (cur < off)
+    {
+        int res = fd_insn_length(buf + cur, len - cur, mode);
+        if (res <= 0)
+            return false;
+        cur += res;
+        instrs++;
+    }
+    if (cur != off)
+        return false;
+
+    *out_tail = *block;
+    out_tail->start = off;
+    out_tail->count -= instrs;
+    block->end = off;
+    block->target = 0;
+    block->kind = FD_BLOCK_FALLTHROUGH;
+    block->count = instrs;
+    return true;
+}
+
+size_t
+fd_cfg(const uint8_t* buf, size_t len, int mode, const size_t* entries,
+       size_t entry_count, uint8_t* visited, FdBlock* blocks, size_t max)
+{
+    for (size_t i = 0; i < (len + 7) / 8; i++)
+        visited[i] = 0;
+
+    size_t count = 0;
+    for (size_t i = 0; i < entry_count; i++)
+        if (!cfg_queue(blocks, &count, max, visited, len, entries[i]))
+            return 0;
+
+    // Queued blocks are the worklist, they are decoded in order of discovery.
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t off = blocks[i].start;
+        size_t target = 0;
+        unsigned kind = FD_BLOCK_FALLTHROUGH;
+        uint32_t instrs = 0;
+        while (true)
+        {
+            if (UNLIKELY(off >= len))
+            {
+                kind = FD_BLOCK_END;
+                break;
+            }
+            // Stop at instructions of other blocks, they are not decoded again.
+            if (instrs && BIT_TEST(visited, off))
+                break;
+
+            FdInstr instr;
+            int res = fd_decode(buf + off, len - off, mode, 0, &instr);
+            if (UNLIKELY(res < 0))
+            {
+                kind = res == FD_ERR_PARTIAL ? FD_BLOCK_END : FD_BLOCK_INVALID;
+                break;
+            }
+            BIT_SET(visited, off);
+            off += res;
+            instrs++;
+
+            kind = cfg_kind(&instr);
+            if (kind != FD_BLOCK_FALLTHROUGH)
+            {
+                if (FD_OP_TYPE(&instr, 0) == FD_OT_OFF)
+                    target = off + (size_t) FD_OP_IMM(&instr, 0);
+                break;
+            }
+        }
+
+        blocks[i].end = off;
+        blocks[i].target = target;
+        blocks[i].kind = kind;
+        blocks[i].count = instrs;
+        if (kind == FD_BLOCK_JUMP || kind == FD_BLOCK_COND || kind == FD_BLOCK_CALL)
+            if (!cfg_queue(blocks, &count, max, visited, len, target))
+                return 0;
+        if (kind == FD_BLOCK_COND || kind == FD_BLOCK_CALL ||
+            kind == FD_BLOCK_CALL_INDIRECT)
+            if (!cfg_queue(blocks, &count, max, visited, len, off))
+                return 0;
+    }
+
+    // All successors inside the code region are decoded instructions, but may
+    // be in the middle of a block if it was decoded before the branch to them.
+    // Add placeholders for these and split the blocks after sorting.
+    unsigned shift = 0;
+    while (shift + 8 < sizeof(size_t) * 8 && (len - 1) >> shift >> 8)
+        shift += 8;
+    size_t decoded = count;
+    cfg_sort(blocks, decoded, shift);
+    for (size_t i = 0; i < decoded; i++)
+    {
+        unsigned kind = blocks[i].kind;
+        size_t succs[2];
+        unsigned succ_count = 0;
+        if (kind == FD_BLOCK_JUMP || kind == FD_BLOCK_COND || kind == FD_BLOCK_CALL)
+            succs[succ_count++] = blocks[i].target;
+        if (kind == FD_BLOCK_FALLTHROUGH || kind == FD_BLOCK_COND ||
+            kind == FD_BLOCK_CALL || kind == FD_BLOCK_CALL_INDIRECT)
+            succs[succ_count++] = blocks[i].end;
+        for (unsigned j = 0; j < succ_count; j++)
+        {
+            if (succs[j] >= len || cfg_is_start(blocks, decoded, succs[j]))
+                continue;
+            if (UNLIKELY(count == max))
+                return 0;
+            blocks[count++] = (FdBlock) { .start = succs[j], .kind = BLOCK_SPLIT };
+        }
+    }
+    if (count == decoded)
+        return count;
+
+    // Placeholders follow the block containing them. Tails of split blocks are
+    // appended in order, as no other block starts between them and the
+    // placeholder.
+    cfg_sort(blocks, count, shift);
+    size_t res_count = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (blocks[i].kind != BLOCK_SPLIT)
+        {
+            blocks[res_count++] = blocks[i];
+            continue;
+        }
+
+        size_t split = blocks[i].start;
+        if (blocks[res_count - 1].start == split)
+            continue; // duplicate
+        // Usually, the previous block contains the target. With overlapping
+        // instructions, the containing block may be further in front.
+        for (size_t j = res_count; j-- > 0 && res_count - j <= 16;)
+        {
+            if (cfg_split(buf, len, mode, &blocks[j], split, &blocks[res_count]))
+            {
+                res_count++;
+                break;
+            }
+        }
+    }
+    return res_count;
+}
@@ -9,11 +9,44 @@
 #define LIKELY(x) __builtin_expect((x), 1)
 #define UNLIKELY(x) __builtin_expect((x), 0)
 
+#if defined(FD_WITH_STATS)
+// Counters of the calling thread, see fd_stats. Only full decodes are counted,
+// i.e. not when determining only the length.
+static __thread FdStats decode_stats;
+#define STAT(...) do { if (!length_only) { __VA_ARGS__; } } while (0)
+#else
+#define STAT(...) do { } while (0)
+#endif
+
+#define RETURN_PARTIAL(reason) do { \
+            STAT(decode_stats.errors[FD_STAT_ERR_PARTIAL_ ## reason]++); \
+            return FD_ERR_PARTIAL; \
+        } while (0)
+#define RETURN_UD(reason) do { \
+            STAT(decode_stats.errors[FD_STAT_ERR_UD_ ## reason]++); \
+            return FD_ERR_UD; \
+        } while (0)
+
 // Defines FD_TABLE_OFFSET_32 and FD_TABLE_OFFSET_64, if available
 #define FD_DECODE_TABLE_DEFINES
 #include <fadec-table.inc>
 #undef FD_DECODE_TABLE_DEFINES
 
+// Prefix tables exist only for supported modes, the offset is never used
+// otherwise.
+#if !defined(FD_PREFIX_OFFSET_32)
+#define FD_PREFIX_OFFSET_32 0
+#endif
+#if !defined(FD_PREFIX_OFFSET_64)
+#define FD_PREFIX_OFFSET_64 0
+#endif
+#if !defined(FD_FAST_OFFSET_32)
+#define FD_FAST_OFFSET_32 0
+#endif
+#if !defined(FD_FAST_OFFSET_64)
+#define FD_FAST_OFFSET_64 0
+#endif
+
 enum DecodeMode {
     DECODE_64 = 0,
     DECODE_32 = 1,
@@ -33,7 +66,7 @@ typedef enum DecodeMode DecodeMode;
 
 static inline unsigned
 table_walk(unsigned cur_idx, unsigned entry_idx, unsigned* out_kind) {
-    static __attribute__((aligned(16))) const uint16_t _decode_table[] = {
+    static __attribute__((aligned(64))) const uint16_t _decode_table[] = {
 #define FD_DECODE_TABLE_DATA
 #include <fadec-table.inc>
 #undef FD_DECODE_TABLE_DATA
@@ -57,6 +90,16 @@ enum
     PREFIX_REXW = 0x08,
     PREFIX_REX = 0x40,
     PREFIX_VEXL = 0x10,
+    PREFIX_EVEXRR = 0x20,
+};
+
+enum
+{
+    PREFIX_CLASS_REP = 0x03, // 1 = REX, 2 = F3, 3 = F2
+    PREFIX_CLASS_SEG = 0x1c, // segment + 1, 7 = ignored
+    PREFIX_CLASS_66 = 0x20,
+    PREFIX_CLASS_67 = 0x40,
+    PREFIX_CLASS_LOCK = 0x80,
 };
 
 struct InstrDesc
@@ -84,105 +127,93 @@ struct InstrDesc
 #define DESC_SIZE_FIX1(desc) (((desc)->operand_sizes >> 10) & 7)
 #define DESC_SIZE_FIX2(desc) (((desc)->operand_sizes >> 13) & 3)
 #define DESC_INSTR_WIDTH(desc) (((desc)->operand_sizes >> 15) & 1)
+#define DESC_EVEX_BCST(desc) (((desc)->reg_types >> 9) & 3)
+#define DESC_EVEX_RC(desc) (((desc)->reg_types >> 11) & 3)
+#define DESC_FAST(desc) (((desc)->reg_types >> 13) & 1)
 #define DESC_MODRM(desc) (((desc)->reg_types >> 14) & 1)
 #define DESC_IGN66(desc) (((desc)->reg_types >> 15) & 1)
 
-int
-fd_decode(const uint8_t* buffer, size_t len_sz, int mode_int, uintptr_t address,
-          FdInstr* instr)
+// If length_only is set, only the instruction length is computed and instr is
+// not written at all. The decoding steps are identical otherwise, so that both
+// variants agree on the length and the errors of every instruction. If hdr is
+// given (only together with length_only), the header is stored there.
+static inline __attribute__((always_inline)) int
+fd_decode_impl(const uint8_t* buffer, int len, DecodeMode mode,
+               unsigned table_idx, uintptr_t address, FdInstr* instr,
+               bool length_only, FdHeader* hdr)
 {
-    int len = len_sz > 15 ? 15 : len_sz;
-
-    // Ensure that we can actually handle the decode request
-    DecodeMode mode;
-    unsigned table_idx;
     unsigned kind = ENTRY_TABLE_ROOT;
-    switch (mode_int)
+    int off = 0;
+
+    if (hdr)
     {
-#if defined(FD_TABLE_OFFSET_32)
-    case 32: table_idx = FD_TABLE_OFFSET_32; mode = DECODE_32; break;
-#endif
-#if defined(FD_TABLE_OFFSET_64)
-    case 64: table_idx = FD_TABLE_OFFSET_64; mode = DECODE_64; break;
-#endif
-    default: return FD_ERR_INTERNAL;
+        hdr->modrm_off = 0;
+        hdr->sib_off = 0;
+        hdr->disp_off = 0;
+        hdr->imm_off = 0;
     }
-
-    int off = 0;
     uint8_t vex_operand = 0;
+    // EVEX P2 byte (z, L'L, b, V', aaa) with bit 8 set, or zero without EVEX.
+    unsigned evex = 0;
+
+    static const uint8_t prefix_table[] = {
+#define FD_DECODE_TABLE_PREFIXES
+#include <fadec-table.inc>
+#undef FD_DECODE_TABLE_PREFIXES
+    };
+    const uint8_t* prefix_classes = &prefix_table[mode == DECODE_64 ?
+                                    FD_PREFIX_OFFSET_64 : FD_PREFIX_OFFSET_32];
 
     unsigned prefix_rep = 0;
-    bool prefix_lock = false;
-    bool prefix_66 = false;
-    bool prefix_67 = false;
     unsigned prefix_rex = 0;
-    int rex_off = -1;
-    instr->segment = FD_REG_NONE;
+    unsigned prefix_seen = 0;
+    uint8_t segment = FD_REG_NONE;
+#if defined(FD_WITH_STATS)
+    unsigned stat_escape = FD_STAT_ESC_NONE;
+    unsigned stat_walks = 0;
+#endif
 
-    if (mode == DECODE_32) {
-        while (LIKELY(off < len))
-        {
-            uint8_t prefix = buffer[off];
-            switch (UNLIKELY(prefix))
-            {
-            default: goto prefix_end;
-            // From segment overrides, the last one wins.
-            case 0x26: instr->segment = FD_REG_ES; break;
-            case 0x2e: instr->segment = FD_REG_CS; break;
-            case 0x36: instr->segment = FD_REG_SS; break;
-            case 0x3e: instr->segment = FD_REG_DS; break;
-            case 0x64: instr->segment = FD_REG_FS; break;
-            case 0x65: instr->segment = FD_REG_GS; break;
-            case 0x66: prefix_66 = true; break;
-            case 0x67: prefix_67 = true; break;
-            case 0xf0: prefix_lock = true; break;
-            case 0xf3: prefix_rep = 2; break;
-            case 0xf2: prefix_rep = 3; break;
-            }
-            off++;
-        }
-    }
-    if (mode == DECODE_64) {
-        while (LIKELY(off < len))
-        {
-            uint8_t prefix = buffer[off];
-            switch (UNLIKELY(prefix))
-            {
-            default: goto prefix_end;
-            // ES/CS/SS/DS overrides are ignored.
-            case 0x26: case 0x2e: case 0x36: case 0x3e: break;
-            // From segment overrides, the last one wins.
-            case 0x64: instr->segment = FD_REG_FS; break;
-            case 0x65: instr->segment = FD_REG_GS; break;
-            case 0x66: prefix_66 = true; break;
-            case 0x67: prefix_67 = true; break;
-            case 0xf0: prefix_lock = true; break;
-            case 0xf3: prefix_rep = 2; break;
-            case 0xf2: prefix_rep = 3; break;
-            case 0x40: case 0x41: case 0x42: case 0x43: case 0x44: case 0x45:
-            case 0x46: case 0x47: case 0x48: case 0x49: case 0x4a: case 0x4b:
-            case 0x4c: case 0x4d: case 0x4e: case 0x4f:
-                prefix_rex = prefix;
-                rex_off = off;
-                break;
-            }
-            off++;
-        }
+    // The class of each prefix is looked up in a table (see parseinstrs.py),
+    // so that the updates can be done with conditional moves instead of a
+    // jump table with one unpredictable branch per prefix.
+    while (LIKELY(off < len))
+    {
+        uint8_t prefix = buffer[off];
+        unsigned prefix_class = prefix_classes[prefix];
+        if (!prefix_class)
+            break;
+        // From REP/REPNZ and from segment overrides, the last one wins.
+        unsigned rep = prefix_class & PREFIX_CLASS_REP;
+        prefix_rep = rep >= 2 ? rep : prefix_rep;
+        unsigned seg = ((prefix_class & PREFIX_CLASS_SEG) >> 2) - 1;
+        segment = seg < 6 ? seg : segment;
+        // REX prefix is only considered if it is the last prefix.
+        prefix_rex = rep == 1 ? prefix : 0;
+        prefix_seen |= prefix_class;
+        off++;
     }
 
-prefix_end:
-    // REX prefix is only considered if it is the last prefix.
-    if (rex_off != off - 1)
-        prefix_rex = 0;
+    bool prefix_66 = prefix_seen & PREFIX_CLASS_66;
+    bool prefix_67 = prefix_seen & PREFIX_CLASS_67;
+    bool prefix_lock = prefix_seen & PREFIX_CLASS_LOCK;
+
+    STAT(decode_stats.prefix_bytes[off < 3 ? off : 3]++;
+         decode_stats.prefix_66 += prefix_66;
+         decode_stats.prefix_67 += prefix_67;
+         decode_stats.prefix_lock += prefix_lock;
+         decode_stats.prefix_rep += prefix_rep == 2;
+         decode_stats.prefix_repnz += prefix_rep == 3;
+         decode_stats.prefix_seg += segment != FD_REG_NONE;
+         decode_stats.prefix_rex += prefix_rex != 0);
 
     if (UNLIKELY(off >= len))
-        return FD_ERR_PARTIAL;
+        RETURN_PARTIAL(PREFIX);
 
     unsigned opcode_escape = 0;
     if (buffer[off] == 0x0f)
     {
         if (UNLIKELY(off + 1 >= len))
-            return FD_ERR_PARTIAL;
+            RETURN_PARTIAL(PREFIX);
         if (buffer[off + 1] == 0x38)
             opcode_escape = 2;
         else if (buffer[off + 1] == 0x3a)
@@ -190,11 +221,12 @@ prefix_end:
         else
             opcode_escape = 1;
         off += opcode_escape >= 2 ? 2 : 1;
+        STAT(stat_escape = opcode_escape); // same values as FD_STAT_ESC_*
     }
     else if (UNLIKELY((buffer[off] & 0xfe) == 0xc4)) // VEX c4/c5
     {
         if (UNLIKELY(off + 1 >= len))
-            return FD_ERR_PARTIAL;
+            RETURN_PARTIAL(PREFIX);
         if (mode == DECODE_32 && (buffer[off + 1] & 0xc0) != 0xc0)
             goto skipvex;
 
@@ -202,7 +234,7 @@ prefix_end:
         // Note: REX is also here only respected if it immediately precedes the
         // opcode, in this case the VEX "prefix".
         if (prefix_66 || prefix_rep || prefix_rex)
-            return FD_ERR_UD;
+            RETURN_UD(PREFIX);
 
         uint8_t byte = buffer[off + 1];
         prefix_rex |= byte & 0x80 ? 0 : PREFIX_REXR;
@@ -212,12 +244,12 @@ prefix_end:
             // SDM Vol 2A 2-15 (Dec. 2016): Ignored in 32-bit mode
             prefix_rex |= mode != DECODE_64 || (byte & 0x20) ? 0 : PREFIX_REXB;
             if (byte & 0x1c) // Bits 4:2 of opcode_escape must be clear.
-                return FD_ERR_UD;
+                RETURN_UD(PREFIX);
             opcode_escape = (byte & 0x03) | 4; // 4 is table index with VEX
 
             // Load third byte of VEX prefix
             if (UNLIKELY(off + 2 >= len))
-                return FD_ERR_PARTIAL;
+                RETURN_PARTIAL(PREFIX);
             byte = buffer[off + 2];
             prefix_rex |= byte & 0x80 ? PREFIX_REXW : 0;
         }
@@ -229,13 +261,87 @@ prefix_end:
         prefix_66 = (byte & 3) == 1;
         vex_operand = ((byte & 0x78) >> 3) ^ 0xf;
 
+        STAT(stat_escape = buffer[off] == 0xc4 ? FD_STAT_ESC_VEX3 : FD_STAT_ESC_VEX2);
         off += buffer[off] == 0xc4 ? 3 : 2;
     skipvex:;
     }
+    else if (UNLIKELY(buffer[off] == 0x62)) // EVEX
+    {
+        if (UNLIKELY(off + 1 >= len))
+            RETURN_PARTIAL(PREFIX);
+        if (mode == DECODE_32 && (buffer[off + 1] & 0xc0) != 0xc0)
+            goto skipevex;
+
+        // EVEX + 66/F3/F2/REX will #UD, like VEX.
+        if (prefix_66 || prefix_rep || prefix_rex)
+            RETURN_UD(PREFIX);
+        if (UNLIKELY(off + 3 >= len))
+            RETURN_PARTIAL(PREFIX);
+
+        uint8_t byte = buffer[off + 1];
+        // Bits 3:2 must be clear, bit 2 of P1 must be set; mm=0 is reserved.
+        if ((byte & 0x0c) || !(byte & 0x03) || !(buffer[off + 2] & 0x04))
+            RETURN_UD(PREFIX);
+        prefix_rex |= byte & 0x80 ? 0 : PREFIX_REXR;
+        // X and B are ignored in 32-bit mode, R' and V' only have one value.
+        if (mode == DECODE_64)
+        {
+            prefix_rex |= byte & 0x40 ? 0 : PREFIX_REXX;
+            prefix_rex |= byte & 0x20 ? 0 : PREFIX_REXB;
+            prefix_rex |= byte & 0x10 ? 0 : PREFIX_EVEXRR;
+        }
+        opcode_escape = (byte & 0x03) | 8; // 8 is table index with EVEX
+
+        byte = buffer[off + 2];
+        prefix_rex |= byte & 0x80 ? PREFIX_REXW : 0;
+        prefix_rep = (byte & 2) ? (byte & 3) : 0;
+        prefix_66 = (byte & 3) == 1;
+        vex_operand = ((byte & 0x78) >> 3) ^ 0xf;
+
+        evex = buffer[off + 3] | 0x100;
+        vex_operand |= evex & 0x08 ? 0 : 0x10;
+        // The table distinguishes only between 128-bit and larger vectors.
+        prefix_rex |= evex & 0x60 ? PREFIX_VEXL : 0;
+
+        STAT(stat_escape = FD_STAT_ESC_EVEX);
+        off += 4;
+    skipevex:;
+    }
+
+    STAT(decode_stats.escape[stat_escape]++);
+
+    static __attribute__((aligned(64))) const struct InstrDesc descs[] = {
+#define FD_DECODE_TABLE_DESCS
+#include <fadec-table.inc>
+#undef FD_DECODE_TABLE_DESCS
+    };
+    // Descriptors of one-byte and 0f opcodes which need no further table
+    // lookup, indexed by escape and opcode; see parseinstrs.py. This avoids
+    // the dependent loads of the table walk for most common instructions.
+    static __attribute__((aligned(64))) const struct InstrDesc fast_descs[] = {
+#define FD_DECODE_TABLE_FAST_DESCS
+#include <fadec-table.inc>
+#undef FD_DECODE_TABLE_FAST_DESCS
+    };
+    const struct InstrDesc* desc;
+    if (LIKELY(opcode_escape < 2 && off < len))
+    {
+        desc = &fast_descs[(mode == DECODE_64 ? FD_FAST_OFFSET_64 : FD_FAST_OFFSET_32) +
+                           opcode_escape * 256 + buffer[off]];
+        if (LIKELY(DESC_FAST(desc)))
+        {
+            off++;
+            goto have_desc;
+        }
+    }
 
     table_idx = table_walk(table_idx, opcode_escape, &kind);
+    STAT(stat_walks++);
     if (kind == ENTRY_TABLE256 && LIKELY(off < len))
+    {
         table_idx = table_walk(table_idx, buffer[off++], &kind);
+        STAT(stat_walks++);
+    }
 
     // Handle mandatory prefixes (which behave like an opcode ext.).
     if (kind == ENTRY_TABLE_PREFIX)
@@ -243,43 +349,43 @@ prefix_end:
         // If there is no REP/REPNZ prefix offer 66h as mandatory prefix. If
         // there is a REP prefix, then the 66h prefix is ignored here.
         uint8_t mandatory_prefix = prefix_rep ? prefix_rep : !!prefix_66;
+        STAT(decode_stats.table_prefix++; stat_walks++);
         table_idx = table_walk(table_idx, mandatory_prefix, &kind);
     }
 
     // Then, walk through ModR/M-encoded opcode extensions.
     if (kind == ENTRY_TABLE16 && LIKELY(off < len)) {
         unsigned isreg = (buffer[off] & 0xc0) == 0xc0 ? 8 : 0;
+        STAT(decode_stats.table16++; stat_walks++);
         table_idx = table_walk(table_idx, ((buffer[off] >> 3) & 7) | isreg, &kind);
         if (kind == ENTRY_TABLE8E)
+        {
+            STAT(decode_stats.table8e++; stat_walks++);
             table_idx = table_walk(table_idx, buffer[off] & 7, &kind);
+        }
     }
 
-    // For VEX prefix, we have to distinguish between VEX.W and VEX.L which may
-    // be part of the opcode.
+    // For VEX/EVEX prefix, we have to distinguish between VEX.W and VEX.L which
+    // may be part of the opcode.
     if (UNLIKELY(kind == ENTRY_TABLE_VEX))
     {
         uint8_t index = 0;
         index |= prefix_rex & PREFIX_REXW ? (1 << 0) : 0;
         index |= prefix_rex & PREFIX_VEXL ? (1 << 1) : 0;
+        STAT(decode_stats.table_vex++; stat_walks++);
         table_idx = table_walk(table_idx, index, &kind);
     }
 
     if (UNLIKELY(kind != ENTRY_INSTR))
-        return kind == 0 ? FD_ERR_UD : FD_ERR_PARTIAL;
-
-    static __attribute__((aligned(16))) const struct InstrDesc descs[] = {
-#define FD_DECODE_TABLE_DESCS
-#include <fadec-table.inc>
-#undef FD_DECODE_TABLE_DESCS
-    };
-    const struct InstrDesc* desc = &descs[table_idx >> 2];
+    {
+        if (kind == ENTRY_NONE)
+            RETURN_UD(OPCODE);
+        RETURN_PARTIAL(OPCODE);
+    }
 
-    instr->type = desc->type;
-    instr->flags = prefix_rep == 2 ? FD_FLAG_REP :
-                   prefix_rep == 3 ? FD_FLAG_REPNZ : 0;
-    if (mode == DECODE_64)
-        instr->flags |= FD_FLAG_64;
-    instr->address = address;
+    desc = &descs[table_idx >> 2];
+have_desc:;
+    STAT(decode_stats.walk_depth[stat_walks]++);
 
     unsigned op_size;
     if (DESC_OPSIZE(desc) == 1)
@@ -300,55 +406,128 @@ prefix_end:
     uint8_t addr_size = mode == DECODE_64 ? 8 : 4;
     if (UNLIKELY(prefix_67))
         addr_size >>= 1;
-    instr->addrsz = addr_size;
-
-    __builtin_memset(instr->operands, 0, sizeof(instr->operands));
 
-    // Reg operand 4 is only possible with RVMR encoding, which implies VEC.
-    for (int i = 0; i < 3; i++)
+    if (!length_only)
     {
-        uint32_t reg_type = (desc->reg_types >> 3 * i) & 0x7;
-        // GPL FPU VEC MSK MMX BND SEG NVR
-        instr->operands[i].misc = (0xf3857641 >> (4 * reg_type)) & 0xf;
+        instr->type = desc->type;
+        instr->flags = prefix_rep == 2 ? FD_FLAG_REP :
+                       prefix_rep == 3 ? FD_FLAG_REPNZ : 0;
+        if (mode == DECODE_64)
+            instr->flags |= FD_FLAG_64;
+        instr->segment = segment;
+        instr->address = address;
+        instr->addrsz = addr_size;
+        instr->evex = 0;
+
+        __builtin_memset(instr->operands, 0, sizeof(instr->operands));
+
+        // Reg operand 4 is only possible with RVMR encoding, which implies VEC.
+        for (int i = 0; i < 3; i++)
+        {
+            uint32_t reg_type = (desc->reg_types >> 3 * i) & 0x7;
+            // GPL FPU VEC MSK MMX BND SEG NVR
+            instr->operands[i].misc = (0xf3857641 >> (4 * reg_type)) & 0xf;
+        }
     }
 
+    // Whether the first operand is a memory operand, required for LOCK.
+    bool op0_mem = false;
+
     if (DESC_MODRM(desc) && UNLIKELY(off++ >= len))
-        return FD_ERR_PARTIAL;
+        RETURN_PARTIAL(MODRM);
     unsigned op_byte = buffer[off - 1] | (!DESC_MODRM(desc) ? 0xc0 : 0);
+    if (hdr && DESC_MODRM(desc))
+        hdr->modrm_off = off - 1;
 
-    if (UNLIKELY(instr->type == FDI_MOV_CR || instr->type == FDI_MOV_DR)) {
+    if (UNLIKELY(evex))
+    {
+        // EVEX.b selects static rounding/SAE for register operands, where
+        // EVEX.L'L is the rounding mode and the vector length is 512 bits, and
+        // broadcast for memory operands.
+        if ((evex & 0x10) && (op_byte & 0xc0) == 0xc0)
+        {
+            if (!DESC_EVEX_RC(desc))
+                RETURN_UD(EVEX);
+            vec_size = 64;
+        }
+        else
+        {
+            if ((evex & 0x10) && !DESC_EVEX_BCST(desc))
+                RETURN_UD(EVEX);
+            if ((evex & 0x60) == 0x60)
+                RETURN_UD(EVEX);
+            vec_size = 16 << ((evex >> 5) & 3);
+        }
+        // Scalar compares ignore EVEX.L'L, but the descriptor cannot express
+        // the full XMM register of the first source next to two fixed sizes.
+        if (UNLIKELY(desc->type == FDI_VCMPSS || desc->type == FDI_VCMPSD))
+            vec_size = 16;
+        // The 64x4 inserts/extracts only exist with 512 bits, the descriptor
+        // only distinguishes 128 bits from 256 and 512 bits.
+        if (UNLIKELY(vec_size != 64 &&
+                     (desc->type == FDI_VINSERTF64X4 ||
+                      desc->type == FDI_VEXTRACTF64X4 ||
+                      desc->type == FDI_VINSERTI64X4 ||
+                      desc->type == FDI_VEXTRACTI64X4)))
+            RETURN_UD(EVEX);
+
+        // EVEX.z (zeroing-masking) requires a mask register in EVEX.aaa and
+        // is not supported for memory or mask register destinations. VMOVD
+        // and VMOVQ do not support masking at all.
+        if (evex & 0x80)
+        {
+            bool mem_dest = DESC_HAS_MODRM(desc) && DESC_MODRM_IDX(desc) == 0 &&
+                            (op_byte & 0xc0) != 0xc0;
+            // Operand 0 has register type 3 (MASK) in the descriptor.
+            if (!(evex & 0x07) || mem_dest || (desc->reg_types & 7) == 3)
+                RETURN_UD(EVEX);
+        }
+        if ((evex & 0x07) &&
+            UNLIKELY(desc->type == FDI_VMOVD || desc->type == FDI_VMOVQ))
+            RETURN_UD(EVEX);
+    }
+
+    if (UNLIKELY(desc->type == FDI_MOV_CR || desc->type == FDI_MOV_DR)) {
         unsigned modreg = (op_byte >> 3) & 0x7;
         unsigned modrm = op_byte & 0x7;
 
-        FdOp* op_modreg = &instr->operands[DESC_MODREG_IDX(desc)];
-        op_modreg->type = FD_OT_REG;
-        op_modreg->reg = modreg | (prefix_rex & PREFIX_REXR ? 8 : 0);
-        op_modreg->misc = instr->type == FDI_MOV_CR ? FD_RT_CR : FD_RT_DR;
-        if (instr->type == FDI_MOV_CR && (~0x011d >> op_modreg->reg) & 1)
-            return FD_ERR_UD;
-        else if (instr->type == FDI_MOV_DR && prefix_rex & PREFIX_REXR)
-            return FD_ERR_UD;
+        unsigned reg = modreg | (prefix_rex & PREFIX_REXR ? 8 : 0);
+        if (desc->type == FDI_MOV_CR && (~0x011d >> reg) & 1)
+            RETURN_UD(OPERAND);
+        else if (desc->type == FDI_MOV_DR && prefix_rex & PREFIX_REXR)
+            RETURN_UD(OPERAND);
 
-        FdOp* op_modrm = &instr->operands[DESC_MODRM_IDX(desc)];
-        op_modrm->type = FD_OT_REG;
-        op_modrm->reg = modrm | (prefix_rex & PREFIX_REXB ? 8 : 0);
-        op_modrm->misc = FD_RT_GPL;
+        if (!length_only)
+        {
+            FdOp* op_modreg = &instr->operands[DESC_MODREG_IDX(desc)];
+            op_modreg->type = FD_OT_REG;
+            op_modreg->reg = reg;
+            op_modreg->misc = desc->type == FDI_MOV_CR ? FD_RT_CR : FD_RT_DR;
+
+            FdOp* op_modrm = &instr->operands[DESC_MODRM_IDX(desc)];
+            op_modrm->type = FD_OT_REG;
+            op_modrm->reg = modrm | (prefix_rex & PREFIX_REXB ? 8 : 0);
+            op_modrm->misc = FD_RT_GPL;
+        }
         goto skip_modrm;
     }
 
-    if (UNLIKELY(DESC_HAS_IMPLICIT(desc)))
+    if (UNLIKELY(DESC_HAS_IMPLICIT(desc)) && !length_only)
     {
         FdOp* operand = &instr->operands[DESC_IMPLICIT_IDX(desc)];
         operand->type = FD_OT_REG;
         operand->reg = DESC_IMPLICIT_VAL(desc);
     }
 
-    if (DESC_HAS_MODREG(desc))
+    if (DESC_HAS_MODREG(desc) && !length_only)
     {
         FdOp* op_modreg = &instr->operands[DESC_MODREG_IDX(desc)];
         unsigned reg_idx = (op_byte & 0x38) >> 3;
-        if (!UNLIKELY(op_modreg->misc == FD_RT_MMX || op_modreg->misc == FD_RT_SEG))
+        if (!UNLIKELY(op_modreg->misc == FD_RT_MMX || op_modreg->misc == FD_RT_SEG ||
+                      op_modreg->misc == FD_RT_MASK))
             reg_idx += prefix_rex & PREFIX_REXR ? 8 : 0;
+        if (UNLIKELY(prefix_rex & PREFIX_EVEXRR) && op_modreg->misc == FD_RT_VEC)
+            reg_idx += 16;
         op_modreg->type = FD_OT_REG;
         op_modreg->reg = reg_idx;
     }
@@ -361,66 +540,108 @@ prefix_end:
         unsigned rm = op_byte & 0x07;
         if (mod == 3)
         {
-            uint8_t reg_idx = rm;
-            if (LIKELY(op_modrm->misc == FD_RT_GPL || op_modrm->misc == FD_RT_VEC))
-                reg_idx += prefix_rex & PREFIX_REXB ? 8 : 0;
-            op_modrm->type = FD_OT_REG;
-            op_modrm->reg = reg_idx;
+            if (!length_only)
+            {
+                uint8_t reg_idx = rm;
+                if (LIKELY(op_modrm->misc == FD_RT_GPL || op_modrm->misc == FD_RT_VEC))
+                    reg_idx += prefix_rex & PREFIX_REXB ? 8 : 0;
+                // EVEX.X extends vector registers in ModRM.rm to 32.
+                if (UNLIKELY(evex) && op_modrm->misc == FD_RT_VEC)
+                    reg_idx += prefix_rex & PREFIX_REXX ? 16 : 0;
+                op_modrm->type = FD_OT_REG;
+                op_modrm->reg = reg_idx;
+            }
         }
         else
         {
             bool vsib = UNLIKELY(DESC_VSIB(desc));
+            op0_mem = DESC_MODRM_IDX(desc) == 0;
 
             // SIB byte
             uint8_t base = rm;
             if (rm == 4)
             {
                 if (UNLIKELY(off >= len))
-                    return FD_ERR_PARTIAL;
+                    RETURN_PARTIAL(MODRM);
+                if (hdr)
+                    hdr->sib_off = off;
                 uint8_t sib = buffer[off++];
-                unsigned scale = (sib & 0xc0) >> 6;
-                unsigned idx = (sib & 0x38) >> 3;
-                idx += prefix_rex & PREFIX_REXX ? 8 : 0;
+                STAT(decode_stats.sib++);
                 base = sib & 0x07;
-                if (!vsib && idx == 4)
-                    idx = FD_REG_NONE;
-                op_modrm->misc = (scale << 6) | idx;
+                if (!length_only)
+                {
+                    unsigned scale = (sib & 0xc0) >> 6;
+                    unsigned idx = (sib & 0x38) >> 3;
+                    idx += prefix_rex & PREFIX_REXX ? 8 : 0;
+                    if (!vsib && idx == 4)
+                        idx = FD_REG_NONE;
+                    op_modrm->misc = (scale << 6) | idx;
+                }
             }
             else
             {
                 // VSIB must have a memory operand with SIB byte.
                 if (vsib)
-                    return FD_ERR_UD;
-                op_modrm->misc = FD_REG_NONE;
+                    RETURN_UD(OPERAND);
+                if (!length_only)
+                    op_modrm->misc = FD_REG_NONE;
             }
 
-            op_modrm->type = FD_OT_MEM;
-
-            // RIP-relative addressing only if SIB-byte is absent
-            if (mod == 0 && rm == 5 && mode == DECODE_64)
-                op_modrm->reg = FD_REG_IP;
-            else if (mod == 0 && base == 5)
-                op_modrm->reg = FD_REG_NONE;
-            else
-                op_modrm->reg = base + (prefix_rex & PREFIX_REXB ? 8 : 0);
+            if (!length_only)
+            {
+                op_modrm->type = FD_OT_MEM;
+
+                // RIP-relative addressing only if SIB-byte is absent
+                if (mod == 0 && rm == 5 && mode == DECODE_64)
+                    op_modrm->reg = FD_REG_IP;
+                else if (mod == 0 && base == 5)
+                    op_modrm->reg = FD_REG_NONE;
+                else
+                    op_modrm->reg = base + (prefix_rex & PREFIX_REXB ? 8 : 0);
+            }
 
             if (mod == 1)
             {
                 if (UNLIKELY(off + 1 > len))
-                    return FD_ERR_PARTIAL;
-                instr->disp = (int8_t) LOAD_LE_1(&buffer[off]);
+                    RETURN_PARTIAL(MODRM);
+                if (hdr)
+                    hdr->disp_off = off;
+                if (!length_only)
+                    instr->disp = (int8_t) LOAD_LE_1(&buffer[off]);
                 off += 1;
+                STAT(decode_stats.disp[1]++);
+                // EVEX disp8 is scaled with the accessed memory size (disp8*N).
+                if (UNLIKELY(evex) && !length_only)
+                {
+                    unsigned n;
+                    if ((evex & 0x10))
+                        n = 2 << DESC_EVEX_BCST(desc);
+                    else switch ((desc->operand_sizes >> 2 * DESC_MODRM_IDX(desc)) & 3)
+                    {
+                    case 0: n = 1 << DESC_SIZE_FIX1(desc) >> 1; break;
+                    case 1: n = 1 << DESC_SIZE_FIX2(desc); break;
+                    case 2: n = op_size; break;
+                    default: n = vec_size; break;
+                    }
+                    instr->disp *= n;
+                }
             }
             else if (mod == 2 || (mod == 0 && base == 5))
             {
                 if (UNLIKELY(off + 4 > len))
-                    return FD_ERR_PARTIAL;
-                instr->disp = (int32_t) LOAD_LE_4(&buffer[off]);
+                    RETURN_PARTIAL(MODRM);
+                if (hdr)
+                    hdr->disp_off = off;
+                if (!length_only)
+                    instr->disp = (int32_t) LOAD_LE_4(&buffer[off]);
                 off += 4;
+                STAT(decode_stats.disp[2]++);
             }
             else
             {
-                instr->disp = 0;
+                STAT(decode_stats.disp[0]++);
+                if (!length_only)
+                    instr->disp = 0;
             }
         }
     }
@@ -428,64 +649,77 @@ skip_modrm:
 
     if (UNLIKELY(DESC_HAS_VEXREG(desc)))
     {
-        FdOp* operand = &instr->operands[DESC_VEXREG_IDX(desc)];
-        operand->type = FD_OT_REG;
-        if (mode == DECODE_32)
-            vex_operand &= 0x7;
-        operand->reg = vex_operand;
+        if (!length_only)
+        {
+            FdOp* operand = &instr->operands[DESC_VEXREG_IDX(desc)];
+            operand->type = FD_OT_REG;
+            if (mode == DECODE_32 || operand->misc == FD_RT_MASK)
+                vex_operand &= 0x7;
+            operand->reg = vex_operand;
+        }
     }
     else if (vex_operand != 0)
     {
-        return FD_ERR_UD;
+        RETURN_UD(OPERAND);
     }
 
     uint32_t imm_control = DESC_IMM_CONTROL(desc);
     if (UNLIKELY(imm_control == 1))
     {
         // 1 = immediate constant 1, used for shifts
-        FdOp* operand = &instr->operands[DESC_IMM_IDX(desc)];
-        operand->type = FD_OT_IMM;
-        instr->imm = 1;
+        if (!length_only)
+        {
+            FdOp* operand = &instr->operands[DESC_IMM_IDX(desc)];
+            operand->type = FD_OT_IMM;
+            instr->imm = 1;
+        }
     }
     else if (UNLIKELY(imm_control == 2))
     {
         // 2 = memory, address-sized, used for mov with moffs operand
-        FdOp* operand = &instr->operands[DESC_IMM_IDX(desc)];
-        operand->type = FD_OT_MEM;
-        operand->reg = FD_REG_NONE;
-        operand->misc = FD_REG_NONE;
-
+        op0_mem |= DESC_IMM_IDX(desc) == 0;
         if (UNLIKELY(off + addr_size > len))
-            return FD_ERR_PARTIAL;
-        if (addr_size == 2)
-            instr->disp = LOAD_LE_2(&buffer[off]);
-        if (addr_size == 4)
-            instr->disp = LOAD_LE_4(&buffer[off]);
-        if (LIKELY(addr_size == 8))
-            instr->disp = LOAD_LE_8(&buffer[off]);
+            RETURN_PARTIAL(IMM);
+        if (hdr)
+            hdr->disp_off = off;
+        if (!length_only)
+        {
+            FdOp* operand = &instr->operands[DESC_IMM_IDX(desc)];
+            operand->type = FD_OT_MEM;
+            operand->reg = FD_REG_NONE;
+            operand->misc = FD_REG_NONE;
+
+            if (addr_size == 2)
+                instr->disp = LOAD_LE_2(&buffer[off]);
+            if (addr_size == 4)
+                instr->disp = LOAD_LE_4(&buffer[off]);
+            if (LIKELY(addr_size == 8))
+                instr->disp = LOAD_LE_8(&buffer[off]);
+        }
         off += addr_size;
     }
     else if (UNLIKELY(imm_control == 3))
     {
         // 3 = register in imm8[7:4], used for RVMR encoding with VBLENDVP[SD]
-        FdOp* operand = &instr->operands[DESC_IMM_IDX(desc)];
-        operand->type = FD_OT_REG;
-        operand->misc = FD_RT_VEC;
-
         if (UNLIKELY(off + 1 > len))
-            return FD_ERR_PARTIAL;
-        uint8_t reg = (uint8_t) LOAD_LE_1(&buffer[off]);
+            RETURN_PARTIAL(IMM);
+        if (hdr)
+            hdr->imm_off = off;
+        if (!length_only)
+        {
+            FdOp* operand = &instr->operands[DESC_IMM_IDX(desc)];
+            operand->type = FD_OT_REG;
+            operand->misc = FD_RT_VEC;
+
+            uint8_t reg = (uint8_t) LOAD_LE_1(&buffer[off]);
+            if (mode == DECODE_32)
+                reg &= 0x7f;
+            operand->reg = reg >> 4;
+        }
         off += 1;
-
-        if (mode == DECODE_32)
-            reg &= 0x7f;
-        operand->reg = reg >> 4;
     }
     else if (imm_control != 0)
     {
-        FdOp* operand = &instr->operands[DESC_IMM_IDX(desc)];
-        operand->type = FD_OT_IMM;
-
         // 4/5 = immediate, operand-sized/8 bit
         // 6/7 = offset, operand-sized/8 bit (used for jumps/calls)
         int imm_byte = imm_control & 1;
@@ -494,45 +728,90 @@ skip_modrm:
         uint8_t imm_size;
         if (imm_byte)
             imm_size = 1;
-        else if (UNLIKELY(instr->type == FDI_RET || instr->type == FDI_RETF ||
-                          instr->type == FDI_SSE_EXTRQ ||
-                          instr->type == FDI_SSE_INSERTQ))
+        else if (UNLIKELY(desc->type == FDI_RET || desc->type == FDI_RETF ||
+                          desc->type == FDI_SSE_EXTRQ ||
+                          desc->type == FDI_SSE_INSERTQ))
             imm_size = 2;
         else if (UNLIKELY(desc->type == FDI_JMPF || desc->type == FDI_CALLF))
             imm_size = op_size + 2;
-        else if (UNLIKELY(instr->type == FDI_ENTER))
+        else if (UNLIKELY(desc->type == FDI_ENTER))
             imm_size = 3;
-        else if (instr->type == FDI_MOVABS)
+        else if (desc->type == FDI_MOVABS)
             imm_size = op_size;
         else
             imm_size = op_size == 2 ? 2 : 4;
 
         if (UNLIKELY(off + imm_size > len))
-            return FD_ERR_PARTIAL;
-
-        if (imm_size == 1)
-            instr->imm = (int8_t) LOAD_LE_1(&buffer[off]);
-        else if (imm_size == 2)
-            instr->imm = (int16_t) LOAD_LE_2(&buffer[off]);
-        else if (imm_size == 3)
-            instr->imm = LOAD_LE_3(&buffer[off]);
-        else if (imm_size == 4)
-            instr->imm = (int32_t) LOAD_LE_4(&buffer[off]);
-        else if (imm_size == 6)
-            instr->imm = LOAD_LE_4(&buffer[off]) | LOAD_LE_2(&buffer[off+4]) << 32;
-        else if (imm_size == 8)
-            instr->imm = (int64_t) LOAD_LE_8(&buffer[off]);
-        off += imm_size;
+            RETURN_PARTIAL(IMM);
+        if (hdr)
+            hdr->imm_off = off;
 
-        if (imm_offset)
+        if (!length_only)
         {
-            if (instr->address != 0)
-                instr->imm += instr->address + off;
-            else
-                operand->type = FD_OT_OFF;
+            FdOp* operand = &instr->operands[DESC_IMM_IDX(desc)];
+            operand->type = FD_OT_IMM;
+
+            if (imm_size == 1)
+                instr->imm = (int8_t) LOAD_LE_1(&buffer[off]);
+            else if (imm_size == 2)
+                instr->imm = (int16_t) LOAD_LE_2(&buffer[off]);
+            else if (imm_size == 3)
+                instr->imm = LOAD_LE_3(&buffer[off]);
+            else if (imm_size == 4)
+                instr->imm = (int32_t) LOAD_LE_4(&buffer[off]);
+            else if (imm_size == 6)
+                instr->imm = LOAD_LE_4(&buffer[off]) | LOAD_LE_2(&buffer[off+4]) << 32;
+            else if (imm_size == 8)
+                instr->imm = (int64_t) LOAD_LE_8(&buffer[off]);
+
+            if (imm_offset)
+            {
+                if (address != 0)
+                    instr->imm += address + off + imm_size;
+                else
+                    operand->type = FD_OT_OFF;
+            }
         }
+        off += imm_size;
+    }
+
+    if (UNLIKELY(desc->type == FDI_3DNOW))
+    {
+        // The 3DNow! opcode is encoded in the trailing imm8.
+        unsigned opc3dn = buffer[off - 1];
+        if (opc3dn & 0x40)
+            RETURN_UD(OPCODE);
+        uint64_t msk = opc3dn & 0x80 ? 0x88d144d144d14400 : 0x30003000;
+        if (!(msk >> (opc3dn & 0x3f) & 1))
+            RETURN_UD(OPCODE);
+    }
+
+    if (UNLIKELY(prefix_lock)) {
+        if (!DESC_LOCK(desc) || !op0_mem)
+            RETURN_UD(LOCK);
+    }
+
+    if (hdr)
+    {
+        hdr->type = desc->type;
+        // Same as below; 90 has no ModRM byte, so the register is in the last
+        // byte of the instruction.
+        if (desc->type == FDI_XCHG_NOP)
+            hdr->type = (buffer[off - 1] & 7) == 0 &&
+                        !(prefix_rex & PREFIX_REXB) ? FDI_NOP : FDI_XCHG;
+        hdr->flags = prefix_rep == 2 ? FD_FLAG_REP :
+                     prefix_rep == 3 ? FD_FLAG_REPNZ : 0;
+        if (mode == DECODE_64)
+            hdr->flags |= FD_FLAG_64;
+        if (UNLIKELY(prefix_lock))
+            hdr->flags |= FD_FLAG_LOCK;
+        hdr->segment = segment;
+        hdr->size = off;
     }
 
+    if (length_only)
+        return off;
+
     if (instr->type == FDI_XCHG_NOP)
     {
         // Only 4890, 90, and 6690 are true NOPs.
@@ -548,26 +827,12 @@ skip_modrm:
         }
     }
 
-    if (UNLIKELY(instr->type == FDI_3DNOW))
-    {
-        unsigned opc3dn = instr->imm;
-        if (opc3dn & 0x40)
-            return FD_ERR_UD;
-        uint64_t msk = opc3dn & 0x80 ? 0x88d144d144d14400 : 0x30003000;
-        if (!(msk >> (opc3dn & 0x3f) & 1))
-            return FD_ERR_UD;
-    }
-
-    if (UNLIKELY(prefix_lock)) {
-        if (!DESC_LOCK(desc) || instr->operands[0].type != FD_OT_MEM)
-            return FD_ERR_UD;
+    if (UNLIKELY(prefix_lock))
         instr->flags |= FD_FLAG_LOCK;
-    }
 
     uint8_t operand_sizes[4] = {
         1 << DESC_SIZE_FIX1(desc) >> 1, 1 << DESC_SIZE_FIX2(desc), op_size, vec_size
     };
-
     for (int i = 0; i < 4; i++)
     {
         FdOp* operand = &instr->operands[i];
@@ -590,8 +855,466 @@ skip_modrm:
         }
     }
 
+    if (UNLIKELY(evex))
+    {
+        unsigned info = 0;
+        if ((evex & 0x10) && (op_byte & 0xc0) == 0xc0)
+            info = DESC_EVEX_RC(desc) == 2 ? ((evex >> 5) & 3) + FD_RC_RN : FD_RC_SAE;
+        else if (evex & 0x10)
+            info = 0x8 | DESC_EVEX_BCST(desc); // see FD_OP_BCSTSZ
+        instr->evex = (evex & 0x07) | ((evex >> 4) & 0x08) | info << 4;
+    }
+
     instr->size = off;
     instr->operandsz = DESC_INSTR_WIDTH(desc) ? op_size : 0;
 
+    STAT(decode_stats.decoded++);
     return off;
 }
+
+int
+fd_decode32(const uint8_t* buffer, size_t len_sz, uintptr_t address,
+            FdInstr* instr)
+{
+#if defined(FD_TABLE_OFFSET_32)
+    int len = len_sz > 15 ? 15 : len_sz;
+    return fd_decode_impl(buffer, len, DECODE_32, FD_TABLE_OFFSET_32, address,
+                          instr, false, NULL);
+#else
+    (void) buffer; (void) len_sz; (void) address; (void) instr;
+    return FD_ERR_INTERNAL;
+#endif
+}
+
+int
+fd_decode64(const uint8_t* buffer, size_t len_sz, uintptr_t address,
+            FdInstr* instr)
+{
+#if defined(FD_TABLE_OFFSET_64)
+    int len = len_sz > 15 ? 15 : len_sz;
+    return fd_decode_impl(buffer, len, DECODE_64, FD_TABLE_OFFSET_64, address,
+                          instr, false, NULL);
+#else
+    (void) buffer; (void) len_sz; (void) address; (void) instr;
+    return FD_ERR_INTERNAL;
+#endif
+}
+
+int
+fd_decode(const uint8_t* buffer, size_t len, int mode_int, uintptr_t address,
+          FdInstr* instr)
+{
+    switch (mode_int)
+    {
+    case 32: return fd_decode32(buffer, len, address, instr);
+    case 64: return fd_decode64(buffer, len, address, instr);
+    default: return FD_ERR_INTERNAL;
+    }
+}
+
+int
+fd_stats(FdStats* out_stats)
+{
+#if defined(FD_WITH_STATS)
+    *out_stats = decode_stats;
+    return 0;
+#else
+    __builtin_memset(out_stats, 0, sizeof(*out_stats));
+    return FD_ERR_INTERNAL;
+#endif
+}
+
+static inline __attribute__((always_inline)) int
+fd_decode_lite_impl(const uint8_t* buffer, int len, DecodeMode mode,
+                    unsigned table_idx, FdInstrLite* lite)
+{
+    // Decode into a full instruction first; after inlining, this stays mostly
+    // in registers. disp/imm are only written when used, so clear them here.
+    FdInstr instr;
+    instr.disp = 0;
+    instr.imm = 0;
+    int res = fd_decode_impl(buffer, len, mode, table_idx, 0, &instr, false,
+                             NULL);
+    if (UNLIKELY(res < 0))
+        return res;
+
+    lite->type = instr.type;
+    lite->flags = instr.flags;
+    lite->segment = instr.segment;
+    lite->addrsz = instr.addrsz;
+    lite->operandsz = instr.operandsz;
+    lite->size = instr.size;
+    lite->evex = instr.evex;
+    for (int i = 0; i < 4; i++)
+        lite->operands[i] = instr.operands[i];
+
+    int64_t disp = instr.disp;
+    int64_t imm = instr.imm;
+    if (UNLIKELY(disp != (int32_t) disp || imm != (int32_t) imm))
+    {
+        // Only moffs and 48/64-bit immediates are that large; these never
+        // occur together with another displacement or immediate.
+        uint64_t wide = disp != (int32_t) disp ? disp : imm;
+        lite->flags |= FD_FLAG_WIDE;
+        lite->disp = (int32_t) (uint32_t) wide;
+        lite->imm = (int32_t) (uint32_t) (wide >> 32);
+    }
+    else
+    {
+        lite->disp = disp;
+        lite->imm = imm;
+    }
+    return res;
+}
+
+int
+fd_decode_lite(const uint8_t* buffer, size_t len_sz, int mode_int,
+               FdInstrLite* lite)
+{
+    int len = len_sz > 15 ? 15 : len_sz;
+
+    switch (mode_int)
+    {
+#if defined(FD_TABLE_OFFSET_32)
+    case 32: return fd_decode_lite_impl(buffer, len, DECODE_32,
+                                        FD_TABLE_OFFSET_32, lite);
+#endif
+#if defined(FD_TABLE_OFFSET_64)
+    case 64: return fd_decode_lite_impl(buffer, len, DECODE_64,
+                                        FD_TABLE_OFFSET_64, lite);
+#endif
+    default: return FD_ERR_INTERNAL;
+    }
+}
+
+void
+fd_lite_expand(const FdInstrLite* lite, FdInstr* instr)
+{
+    instr->type = lite->type;
+    instr->flags = lite->flags & ~FD_FLAG_WIDE;
+    instr->segment = lite->segment;
+    instr->addrsz = lite->addrsz;
+    instr->operandsz = lite->operandsz;
+    instr->size = lite->size;
+    instr->evex = lite->evex;
+    for (int i = 0; i < 4; i++)
+        instr->operands[i] = lite->operands[i];
+    instr->disp = FD_LITE_OP_DISP(lite, 0);
+    instr->imm = FD_LITE_OP_IMM(lite, 0);
+    instr->address = 0;
+}
+
+// Exactly one of instrs and lites is non-NULL, which is a constant after
+// inlining.
+static inline __attribute__((always_inline)) size_t
+fd_decode_block_impl(const uint8_t* buffer, size_t len, DecodeMode mode,
+                     unsigned table_idx, FdInstr* instrs, FdInstrLite* lites,
+                     size_t max, size_t* consumed)
+{
+    size_t off = 0;
+    size_t count = 0;
+    while (count < max && off < len)
+    {
+        size_t remaining = len - off;
+        int sublen = remaining > 15 ? 15 : remaining;
+        int res;
+        if (lites)
+            res = fd_decode_lite_impl(buffer + off, sublen, mode, table_idx,
+                                      &lites[count]);
+        else
+            res = fd_decode_impl(buffer + off, sublen, mode, table_idx, 0,
+                                 &instrs[count], false, NULL);
+        if (UNLIKELY(res < 0))
+            break;
+        off += res;
+        count++;
+    }
+
+    if (consumed)
+        *consumed = off;
+    return count;
+}
+
+size_t
+fd_decode_block(const uint8_t* buffer, size_t len, int mode_int,
+                FdInstr* instrs, size_t max, size_t* consumed)
+{
+    switch (mode_int)
+    {
+#if defined(FD_TABLE_OFFSET_32)
+    case 32:
+        return fd_decode_block_impl(buffer, len, DECODE_32, FD_TABLE_OFFSET_32,
+                                    instrs, NULL, max, consumed);
+#endif
+#if defined(FD_TABLE_OFFSET_64)
+    case 64:
+        return fd_decode_block_impl(buffer, len, DECODE_64, FD_TABLE_OFFSET_64,
+                                    instrs, NULL, max, consumed);
+#endif
+    default:
+        if (consumed)
+            *consumed = 0;
+        return 0;
+    }
+}
+
+size_t
+fd_decode_block_lite(const uint8_t* buffer, size_t len, int mode_int,
+                     FdInstrLite* lites, size_t max, size_t* consumed)
+{
+    switch (mode_int)
+    {
+#if defined(FD_TABLE_OFFSET_32)
+    case 32:
+        return fd_decode_block_impl(buffer, len, DECODE_32, FD_TABLE_OFFSET_32,
+                                    NULL, lites, max, consumed);
+#endif
+#if defined(FD_TABLE_OFFSET_64)
+    case 64:
+        return fd_decode_block_impl(buffer, len, DECODE_64, FD_TABLE_OFFSET_64,
+                                    NULL, lites, max, consumed);
+#endif
+    default:
+        if (consumed)
+            *consumed = 0;
+        return 0;
+    }
+}
+
+#define LENGTH_MODRM 0x10
+#define LENGTH_MEM 0x20
+#define LENGTH_REXW 0x40
+
+// Length of common instructions from a lookup table without any prefix
+// except for REX, or zero if the full decoder is required. All bytes of the
+// instruction must be available, i.e., the buffer must have 15 bytes.
+static inline __attribute__((always_inline)) int
+fd_insn_length_fast(const uint8_t* buffer, DecodeMode mode)
+{
+    static __attribute__((aligned(64))) const uint8_t length_table[] = {
+#define FD_DECODE_TABLE_LENGTHS
+#include <fadec-table.inc>
+#undef FD_DECODE_TABLE_LENGTHS
+    };
+    const uint8_t* lengths = &length_table[mode == DECODE_64 ?
+                                           FD_FAST_OFFSET_64 : FD_FAST_OFFSET_32];
+
+    unsigned off = 0;
+    unsigned rexw = 0;
+    if (mode == DECODE_64 && (buffer[0] & 0xf0) == 0x40)
+    {
+        rexw = buffer[0] & 0x08;
+        off = 1;
+    }
+    unsigned escape = buffer[off] == 0x0f;
+    off += escape;
+    unsigned entry = lengths[escape * 256 + buffer[off]];
+    if (UNLIKELY(!entry || (rexw && (entry & LENGTH_REXW))))
+        return 0;
+
+    unsigned len = off - escape + (entry & 0xf);
+    if (entry & LENGTH_MODRM)
+    {
+        unsigned modrm = buffer[off + 1];
+        unsigned mod = modrm >> 6;
+        unsigned base = modrm & 7;
+        len += 1;
+        if (mod == 3)
+            return entry & LENGTH_MEM ? 0 : len;
+        if (base == 4)
+        {
+            base = buffer[off + 2] & 7;
+            len += 1;
+        }
+        len += mod == 1 ? 1 : mod == 2 || base == 5 ? 4 : 0;
+    }
+    return len;
+}
+
+int
+fd_insn_length(const uint8_t* buffer, size_t len_sz, int mode_int)
+{
+    int len = len_sz > 15 ? 15 : len_sz;
+
+    switch (mode_int)
+    {
+#if defined(FD_TABLE_OFFSET_32)
+    case 32:
+        if (LIKELY(len == 15))
+        {
+            int res = fd_insn_length_fast(buffer, DECODE_32);
+            if (LIKELY(res))
+                return res;
+        }
+        return fd_decode_impl(buffer, len, DECODE_32, FD_TABLE_OFFSET_32,
+                              0, NULL, true, NULL);
+#endif
+#if defined(FD_TABLE_OFFSET_64)
+    case 64:
+        if (LIKELY(len == 15))
+        {
+            int res = fd_insn_length_fast(buffer, DECODE_64);
+            if (LIKELY(res))
+                return res;
+        }
+        return fd_decode_impl(buffer, len, DECODE_64, FD_TABLE_OFFSET_64,
+                              0, NULL, true, NULL);
+#endif
+    default: return FD_ERR_INTERNAL;
+    }
+}
+
+int
+fd_decode_header(const uint8_t* buffer, size_t len_sz, int mode_int,
+                 FdHeader* hdr)
+{
+    int len = len_sz > 15 ? 15 : len_sz;
+
+    switch (mode_int)
+    {
+#if defined(FD_TABLE_OFFSET_32)
+    case 32:
+        return fd_decode_impl(buffer, len, DECODE_32, FD_TABLE_OFFSET_32,
+                              0, NULL, true, hdr);
+#endif
+#if defined(FD_TABLE_OFFSET_64)
+    case 64:
+        return fd_decode_impl(buffer, len, DECODE_64, FD_TABLE_OFFSET_64,
+                              0, NULL, true, hdr);
+#endif
+    default: return FD_ERR_INTERNAL;
+    }
+}
+
+int
+fd_header_expand(const uint8_t* buffer, const FdHeader* hdr, FdInstr* instr)
+{
+    // The header guarantees that the instruction decodes successfully with
+    // exactly this length.
+    return fd_decode(buffer, hdr->size, hdr->flags & FD_FLAG_64 ? 64 : 32, 0,
+                     instr);
+}
+
+size_t
+fd_sweep(const uint8_t* buffer, size_t len, int mode_int, uint8_t* starts)
+{
+    for (size_t i = 0; i < (len + 7) / 8; i++)
+        starts[i] = 0;
+
+    size_t count = 0;
+    for (size_t off = 0; off < len;)
+    {
+        int res = fd_insn_length(buffer + off, len - off, mode_int);
+        if (LIKELY(res > 0))
+        {
+            starts[off / 8] |= 1 << (off % 8);
+            off += res;
+            count++;
+        }
+        else
+            off++;
+    }
+    return count;
+}
+
+void
+fd_stream_init(FdStream* stream, int mode)
+{
+    stream->chunk = NULL;
+    stream->chunk_len = 0;
+    stream->chunk_off = 0;
+    stream->offset = 0;
+    stream->mode = mode;
+    stream->tail_len = 0;
+}
+
+void
+fd_stream_feed(FdStream* stream, const uint8_t* buffer, size_t len)
+{
+    stream->chunk = buffer;
+    stream->chunk_len = len;
+    stream->chunk_off = 0;
+}
+
+int
+fd_stream_next(FdStream* stream, FdInstr* instr)
+{
+    const uint8_t* cur = stream->chunk + stream->chunk_off;
+    size_t avail = stream->chunk_len - stream->chunk_off;
+
+    if (LIKELY(!stream->tail_len))
+    {
+        if (UNLIKELY(!avail))
+            return 0;
+        int res = fd_decode(cur, avail, stream->mode, 0, instr);
+        if (LIKELY(res > 0))
+        {
+            stream->chunk_off += res;
+            stream->offset += res;
+            return res;
+        }
+        if (res != FD_ERR_PARTIAL)
+            return res;
+        // Instructions are never longer than 15 bytes.
+        if (avail >= 15)
+            return FD_ERR_UD;
+        for (size_t i = 0; i < avail; i++)
+            stream->tail[i] = cur[i];
+        stream->tail_len = avail;
+        stream->chunk_off = stream->chunk_len;
+        return 0;
+    }
+
+    // The instruction straddles a chunk boundary, so assemble it in a buffer.
+    uint8_t buf[15];
+    unsigned tail_len = stream->tail_len;
+    unsigned take = avail < 15 - tail_len ? avail : 15 - tail_len;
+    for (unsigned i = 0; i < tail_len; i++)
+        buf[i] = stream->tail[i];
+    for (unsigned i = 0; i < take; i++)
+        buf[tail_len + i] = cur[i];
+
+    // Usually, the instruction is longer than the tail, as decoding the tail
+    // alone failed with FD_ERR_PARTIAL. After fd_stream_skip, however, the
+    // tail can start with shorter instructions.
+    int res = fd_decode(buf, tail_len + take, stream->mode, 0, instr);
+    if (res > 0)
+    {
+        if ((unsigned) res <= tail_len)
+        {
+            for (unsigned i = res; i < tail_len; i++)
+                stream->tail[i - res] = stream->tail[i];
+            stream->tail_len = tail_len - res;
+        }
+        else
+        {
+            stream->chunk_off += res - tail_len;
+            stream->tail_len = 0;
+        }
+        stream->offset += res;
+        return res;
+    }
+    if (res != FD_ERR_PARTIAL)
+        return res;
+    if (tail_len + take >= 15)
+        return FD_ERR_UD;
+    for (unsigned i = 0; i < take; i++)
+        stream->tail[tail_len + i] = cur[i];
+    stream->tail_len = tail_len + take;
+    stream->chunk_off += take;
+    return 0;
+}
+
+void
+fd_stream_skip(FdStream* stream, size_t count)
+{
+    size_t from_tail = count < stream->tail_len ? count : stream->tail_len;
+    for (size_t i = from_tail; i < stream->tail_len; i++)
+        stream->tail[i - from_tail] = stream->tail[i];
+    stream->tail_len -= from_tail;
+
+    size_t avail = stream->chunk_len - stream->chunk_off;
+    size_t from_chunk = count - from_tail < avail ? count - from_tail : avail;
+    stream->chunk_off += from_chunk;
+    stream->offset += from_tail + from_chunk;
+}
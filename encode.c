@@ -34,6 +34,8 @@ enum {
 #define OPC_SEG_MSK (0x7l << OPC_SEG_IDX)
 #define OPC_VEXOP_IDX 34
 #define OPC_VEXOP_MSK (0xfl << OPC_VEXOP_IDX)
+// Not an encoding bit: encode for 32-bit mode.
+#define OPC_MODE32 (1l << 38)
 
 static bool op_mem(FeOp op) { return op < 0; }
 static bool op_reg(FeOp op) { return op >= 0; }
@@ -58,6 +60,16 @@ static bool op_imm_n(FeOp imm, unsigned immsz) {
     return false;
 }
 
+// Store a byte, or only advance the buffer when computing the size.
+static inline
+void
+put(uint8_t** restrict buf, bool emit, unsigned byte)
+{
+    if (emit)
+        **buf = byte;
+    (*buf)++;
+}
+
 static
 unsigned
 opc_size(uint64_t opc)
@@ -85,36 +97,42 @@ opc_size(uint64_t opc)
 
 static
 int
-enc_opc(uint8_t** restrict buf, uint64_t opc)
+enc_opc(uint8_t** restrict buf, bool emit, uint64_t opc)
 {
+    if (opc & OPC_MODE32) {
+        // No REX prefix and only eight registers; VEX.W is available.
+        if (opc & (OPC_REX|OPC_REXR|OPC_REXX|OPC_REXB)) return -1;
+        if ((opc & OPC_REXW) && !(opc & OPC_VEX)) return -1;
+        if ((opc & OPC_VEXOP_MSK) >> OPC_VEXOP_IDX & 0x8) return -1;
+    }
     if (opc & OPC_SEG_MSK)
-        *(*buf)++ = (0x65643e362e2600 >> (8 * ((opc >> OPC_SEG_IDX) & 7))) & 0xff;
-    if (opc & OPC_67) *(*buf)++ = 0x67;
+        put(buf, emit, (0x65643e362e2600 >> (8 * ((opc >> OPC_SEG_IDX) & 7))) & 0xff);
+    if (opc & OPC_67) put(buf, emit, 0x67);
     if (opc & OPC_VEX) {
         bool vex3 = (opc & (OPC_REXW|OPC_REXX|OPC_REXB|OPC_ESCAPE_MSK)) != OPC_0F;
         unsigned pp = 0;
         if (opc & OPC_66) pp = 1;
         if (opc & OPC_F3) pp = 2;
         if (opc & OPC_F2) pp = 3;
-        *(*buf)++ = 0xc4 | !vex3;
+        put(buf, emit, 0xc4 | !vex3);
         unsigned b2 = pp | (opc & OPC_VEXL ? 0x4 : 0);
         if (vex3) {
             unsigned b1 = (opc & OPC_ESCAPE_MSK) >> 16;
             if (!(opc & OPC_REXR)) b1 |= 0x80;
             if (!(opc & OPC_REXX)) b1 |= 0x40;
             if (!(opc & OPC_REXB)) b1 |= 0x20;
-            *(*buf)++ = b1;
+            put(buf, emit, b1);
             if (opc & OPC_REXW) b2 |= 0x80;
         } else {
             if (!(opc & OPC_REXR)) b2 |= 0x80;
         }
         b2 |= (~((opc & OPC_VEXOP_MSK) >> OPC_VEXOP_IDX) & 0xf) << 3;
-        *(*buf)++ = b2;
+        put(buf, emit, b2);
     } else {
-        if (opc & OPC_LOCK) *(*buf)++ = 0xF0;
-        if (opc & OPC_66) *(*buf)++ = 0x66;
-        if (opc & OPC_F2) *(*buf)++ = 0xF2;
-        if (opc & OPC_F3) *(*buf)++ = 0xF3;
+        if (opc & OPC_LOCK) put(buf, emit, 0xF0);
+        if (opc & OPC_66) put(buf, emit, 0x66);
+        if (opc & OPC_F2) put(buf, emit, 0xF2);
+        if (opc & OPC_F3) put(buf, emit, 0xF3);
         if (opc & (OPC_REX|OPC_REXW|OPC_REXR|OPC_REXX|OPC_REXB))
         {
             unsigned rex = 0x40;
@@ -122,45 +140,46 @@ enc_opc(uint8_t** restrict buf, uint64_t opc)
             if (opc & OPC_REXR) rex |= 4;
             if (opc & OPC_REXX) rex |= 2;
             if (opc & OPC_REXB) rex |= 1;
-            *(*buf)++ = rex;
+            put(buf, emit, rex);
         }
-        if (opc & OPC_ESCAPE_MSK) *(*buf)++ = 0x0F;
-        if ((opc & OPC_ESCAPE_MSK) == OPC_0F38) *(*buf)++ = 0x38;
-        if ((opc & OPC_ESCAPE_MSK) == OPC_0F3A) *(*buf)++ = 0x3A;
+        if (opc & OPC_ESCAPE_MSK) put(buf, emit, 0x0F);
+        if ((opc & OPC_ESCAPE_MSK) == OPC_0F38) put(buf, emit, 0x38);
+        if ((opc & OPC_ESCAPE_MSK) == OPC_0F3A) put(buf, emit, 0x3A);
     }
-    *(*buf)++ = opc & 0xff;
-    if ((opc & 0xc000) == 0xc000) *(*buf)++ = (opc >> 8) & 0xff;
+    put(buf, emit, opc & 0xff);
+    if ((opc & 0xc000) == 0xc000) put(buf, emit, (opc >> 8) & 0xff);
     return 0;
 }
 
 static
 int
-enc_imm(uint8_t** restrict buf, uint64_t imm, unsigned immsz)
+enc_imm(uint8_t** restrict buf, bool emit, uint64_t imm, unsigned immsz)
 {
     if (!op_imm_n(imm, immsz)) return -1;
     for (unsigned i = 0; i < immsz; i++)
-        *(*buf)++ = imm >> 8 * i;
+        put(buf, emit, imm >> 8 * i);
     return 0;
 }
 
 static
 int
-enc_o(uint8_t** restrict buf, uint64_t opc, uint64_t op0)
+enc_o(uint8_t** restrict buf, bool emit, uint64_t opc, uint64_t op0)
 {
     if (op_reg_idx(op0) & 0x8) opc |= OPC_REXB;
 
     bool has_rex = !!(opc & (OPC_REX|OPC_REXW|OPC_REXR|OPC_REXX|OPC_REXB));
     if (has_rex && op_reg_gph(op0)) return -1;
 
-    if (enc_opc(buf, opc)) return -1;
-    *(*buf - 1) = (*(*buf - 1) & 0xf8) | (op_reg_idx(op0) & 0x7);
+    if (enc_opc(buf, emit, opc)) return -1;
+    if (emit)
+        *(*buf - 1) = (*(*buf - 1) & 0xf8) | (op_reg_idx(op0) & 0x7);
     return 0;
 }
 
 static
 int
-enc_mr(uint8_t** restrict buf, uint64_t opc, uint64_t op0, uint64_t op1,
-       unsigned immsz)
+enc_mr(uint8_t** restrict buf, bool emit, uint64_t opc, uint64_t op0,
+       uint64_t op1, unsigned immsz)
 {
     // If !op_reg(op1), it is a constant value for ModRM.reg
     if (op_reg(op0) && (op_reg_idx(op0) & 0x8)) opc |= OPC_REXB;
@@ -209,10 +228,13 @@ enc_mr(uint8_t** restrict buf, uint64_t opc, uint64_t op0, uint64_t op1,
         {
             rm = 5;
             mod0off = true;
-            withsib = true;
+            // In 64-bit mode, rm=5 without SIB is RIP-relative.
+            if (!(opc & OPC_MODE32))
+                withsib = true;
         }
         else if (op_mem_base(op0) == FE_IP)
         {
+            if (opc & OPC_MODE32) return -1;
             rm = 5;
             mod0off = true;
             // Adjust offset, caller doesn't know instruction length.
@@ -241,11 +263,11 @@ enc_mr(uint8_t** restrict buf, uint64_t opc, uint64_t op0, uint64_t op1,
     unsigned dispsz = mod == 1 ? 1 : (mod == 2 || mod0off) ? 4 : 0;
     if (opcsz + 1 + (mod != 3 && rm == 4) + dispsz + immsz > 15) return -1;
 
-    if (enc_opc(buf, opc)) return -1;
-    *(*buf)++ = (mod << 6) | (reg << 3) | rm;
+    if (enc_opc(buf, emit, opc)) return -1;
+    put(buf, emit, (mod << 6) | (reg << 3) | rm);
     if (mod != 3 && rm == 4)
-        *(*buf)++ = (scale << 6) | (idx << 3) | base;
-    return enc_imm(buf, off, dispsz);
+        put(buf, emit, (scale << 6) | (idx << 3) | base);
+    return enc_imm(buf, emit, off, dispsz);
 }
 
 typedef enum {
@@ -299,7 +321,7 @@ const struct EncodingInfo encoding_infos[ENC_MAX] = {
     [ENC_RMV]     = { .modrm = 1^3, .modreg = 0^3, .vexreg = 2^3 },
     [ENC_VM]      = { .modrm = 1^3, .vexreg = 0^3 },
     [ENC_VMI]     = { .modrm = 1^3, .vexreg = 0^3, .immctl = 4, .immidx = 2 },
-    [ENC_MVR]     = { .modrm = 0^3, .modreg = 1^3, .vexreg = 1^3 },
+    [ENC_MVR]     = { .modrm = 0^3, .modreg = 2^3, .vexreg = 1^3 },
 };
 
 struct EncodeDesc {
@@ -310,99 +332,603 @@ struct EncodeDesc {
     uint64_t tys : 16;
 };
 
-static const struct EncodeDesc descs[] = {
+static const struct EncodeDesc descs64[] = {
+#define FE_ENCODE_TABLE_64
 #include <fadec-enc-cases.inc>
+#undef FE_ENCODE_TABLE_64
 };
 
+static const struct EncodeDesc descs32[] = {
+#define FE_ENCODE_TABLE_32
+#include <fadec-enc-cases.inc>
+#undef FE_ENCODE_TABLE_32
+};
+
+// Encode a single variant of a mnemonic. Returns the size of the immediate
+// (i.e., the trailing bytes after a displacement) for success, ENC_NEXT if the
+// operands don't match this variant, or ENC_FAIL if the instruction cannot be
+// encoded. If emit is false, only the buffer is advanced, nothing is written.
+// mode is 32 or 64. pos_adj is the difference between the address where the
+// instruction will be executed and *buf, used for offset operands.
+#define ENC_FAIL (-1)
+#define ENC_NEXT (-2)
+
+static inline __attribute__((always_inline))
 int
-fe_enc64_impl(uint8_t** restrict buf, uint64_t mnem, FeOp op0, FeOp op1,
-              FeOp op2, FeOp op3)
+enc_variant(uint8_t** restrict buf, bool emit, int mode, int64_t pos_adj,
+            uint64_t mnem, const struct EncodeDesc* desc, const uint64_t* ops)
+{
+    const struct EncodingInfo* ei = &encoding_infos[desc->enc];
+    uint64_t opc = desc->opc | (mode == 32 ? OPC_MODE32 : 0);
+    int64_t imm = 0xcc;
+    unsigned immsz = desc->immsz;
+
+    if (ei->zregidx)
+        if (op_reg_idx(ops[ei->zregidx^3]) != ei->zregval) return ENC_NEXT;
+
+    for (int i = 0; i < 4; i++) {
+        unsigned ty = (desc->tys >> (4 * i)) & 0xf;
+        FeOp op = ops[i];
+        if (ty == 0x0) continue;
+        if (ty == 0xf && !op_mem(op)) return ENC_NEXT;
+        if (ty == 0x1 && !op_reg_gpl(op)) return ENC_NEXT;
+        if (ty == 0x2 && !op_reg_gpl(op) && !op_reg_gph(op)) return ENC_NEXT;
+        if (ty == 0x2 && op_reg_gpl(op) && op >= FE_SP) opc |= OPC_REX;
+        if (ty == 0x3 && !op_reg_seg(op)) return ENC_NEXT;
+        if (ty == 0x4 && !op_reg_fpu(op)) return ENC_NEXT;
+        if (ty == 0x5 && !op_reg_mmx(op)) return ENC_NEXT;
+        if (ty == 0x6 && !op_reg_xmm(op)) return ENC_NEXT;
+        if (UNLIKELY(ty >= 7 && ty < 0xf)) return ENC_NEXT; // TODO: support BND, CR, DR
+    }
+
+    // 32-bit addressing is the default in 32-bit mode.
+    if (UNLIKELY(mnem & FE_ADDR32) && mode == 64)
+        opc |= OPC_67;
+    if (UNLIKELY(mnem & FE_SEG_MASK))
+        opc |= (mnem & FE_SEG_MASK) << (OPC_SEG_IDX - 16);
+    if (UNLIKELY(desc->enc == ENC_S)) {
+        if ((op_reg_idx(ops[0]) << 3 & 0x20) != (opc & 0x20)) return ENC_NEXT;
+        opc |= op_reg_idx(ops[0]) << 3;
+        // 0f would be POP CS, which doesn't exist.
+        if ((opc & 0xff) == 0x0f && !(opc & OPC_ESCAPE_MSK)) return ENC_NEXT;
+    }
+
+    if (ei->immctl > 0) {
+        imm = ops[ei->immidx];
+        if (ei->immctl == 2) {
+            immsz = mode == 32 || UNLIKELY(mnem & FE_ADDR32) ? 4 : 8;
+            if (immsz == 4) imm = (int32_t) imm; // address are zero-extended
+        }
+        if (ei->immctl == 3)
+            imm = (int8_t) (op_reg_idx(imm) << 4);
+        if (ei->immctl == 6) {
+            if (UNLIKELY(mnem & FE_JMPL) && desc->alt) return ENC_NEXT;
+            imm -= (int64_t) ((uintptr_t) *buf + pos_adj) + opc_size(opc) + immsz;
+        }
+        if (UNLIKELY(ei->immctl == 1) && imm != 1) return ENC_NEXT;
+        if (ei->immctl >= 2 && !op_imm_n(imm, immsz)) return ENC_NEXT;
+    }
+
+    // NOP has no operands, so this must be the 32-bit OA XCHG
+    if ((desc->opc & ~7) == 0x90 && ops[0] == FE_AX) return ENC_NEXT;
+
+    if (ei->vexreg)
+        opc |= ((uint64_t) op_reg_idx(ops[ei->vexreg^3])) << OPC_VEXOP_IDX;
+
+    if (ei->modrm) {
+        FeOp modreg = ei->modreg ? ops[ei->modreg^3] : (opc & 0xff00) >> 8;
+        if (enc_mr(buf, emit, opc, ops[ei->modrm^3], modreg, immsz)) return ENC_FAIL;
+    } else if (ei->modreg) {
+        if (enc_o(buf, emit, opc, ops[ei->modreg^3])) return ENC_FAIL;
+    } else {
+        if (enc_opc(buf, emit, opc)) return ENC_FAIL;
+    }
+
+    if (ei->immctl >= 2) {
+        if (enc_imm(buf, emit, imm, immsz)) return ENC_FAIL;
+        return immsz;
+    }
+
+    return 0;
+}
+
+// Instructions with smaller operand size, which are equivalent (including all
+// status flags) if the condition holds; used for FE_OPTSIZE. Writes to 32-bit
+// registers clear the upper half; for TEST and AND, the sign flag is zero if
+// the immediate operand is non-negative in the smaller size as well.
+enum {
+    NARROW_SAME, // both register operands are the same, i.e., the result is 0
+    NARROW_IMM7, // 0 <= imm < 0x80
+    NARROW_IMM31, // 0 <= imm < 0x80000000
+    NARROW_IMM32, // 0 <= imm <= 0xffffffff
+};
+
+static const struct {
+    uint16_t from;
+    uint16_t to;
+    uint8_t cond;
+} narrow_table[] = {
+    { FE_MOV64ri, FE_MOV32ri, NARROW_IMM32 },
+    { FE_AND64ri, FE_AND32ri, NARROW_IMM31 },
+    { FE_TEST64ri, FE_TEST32ri, NARROW_IMM31 },
+    { FE_TEST64mi, FE_TEST32mi, NARROW_IMM31 },
+    { FE_TEST32ri, FE_TEST8ri, NARROW_IMM7 },
+    { FE_TEST32mi, FE_TEST8mi, NARROW_IMM7 },
+    { FE_XOR64rr, FE_XOR32rr, NARROW_SAME },
+    { FE_SUB64rr, FE_SUB32rr, NARROW_SAME },
+};
+
+static
+uint64_t
+enc_narrow(uint64_t mnem, uint64_t* ops)
+{
+    for (size_t i = 0; i < sizeof narrow_table / sizeof narrow_table[0]; i++) {
+        if ((mnem & FE_MNEM_MASK) != narrow_table[i].from)
+            continue;
+        int64_t imm = ops[1];
+        bool ok = false;
+        switch (narrow_table[i].cond) {
+        case NARROW_SAME: ok = ops[0] == ops[1]; break;
+        case NARROW_IMM7: ok = imm >= 0 && imm < 0x80; break;
+        case NARROW_IMM31: ok = imm >= 0 && imm < 0x80000000; break;
+        case NARROW_IMM32: ok = imm >= 0 && imm <= 0xffffffff; break;
+        default: break;
+        }
+        if (!ok)
+            break;
+        // 32-bit immediates are sign-extended.
+        if (narrow_table[i].cond != NARROW_SAME)
+            ops[1] = (int32_t) imm;
+        return (mnem & ~(uint64_t) FE_MNEM_MASK) | narrow_table[i].to;
+    }
+    return 0;
+}
+
+// For FE_OPTSIZE, determine the size of all variants of the mnemonic and of
+// equivalent narrower mnemonics, and encode the shortest one.
+static
+int
+enc_optsize(uint8_t** restrict buf, bool emit, int mode, int64_t pos_adj,
+            uint64_t mnem, const uint64_t* orig_ops)
+{
+    const struct EncodeDesc* descs = mode == 32 ? descs32 : descs64;
+    const struct EncodeDesc* best = NULL;
+    uint64_t best_mnem = 0;
+    uint64_t ops[4] = {orig_ops[0], orig_ops[1], orig_ops[2], orig_ops[3]};
+    uint64_t best_ops[4];
+    ptrdiff_t best_size = FE_MAX_INSTR_SIZE + 1;
+
+    for (; mnem; mnem = enc_narrow(mnem, ops)) {
+        uint64_t desc_idx = mnem & FE_MNEM_MASK;
+        if (UNLIKELY(desc_idx >= FE_MNEM_MAX))
+            break;
+        do {
+            const struct EncodeDesc* desc = &descs[desc_idx];
+            if (UNLIKELY(desc->enc == ENC_INVALID))
+                break;
+            uint8_t* cur = *buf;
+            if (enc_variant(&cur, false, mode, pos_adj, mnem, desc, ops) >= 0 &&
+                cur - *buf < best_size) {
+                best = desc;
+                best_mnem = mnem;
+                best_size = cur - *buf;
+                for (int i = 0; i < 4; i++)
+                    best_ops[i] = ops[i];
+            }
+            desc_idx = desc->alt;
+        } while (desc_idx != 0);
+    }
+
+    if (!best)
+        return ENC_FAIL;
+    return enc_variant(buf, emit, mode, pos_adj, best_mnem, best, best_ops);
+}
+
+// Returns the size of the immediate for success or a negative value in case of
+// an error, see enc_variant.
+static inline __attribute__((always_inline))
+int
+enc_core(uint8_t** restrict buf, bool emit, int mode, int64_t pos_adj,
+         uint64_t mnem, FeOp op0, FeOp op1, FeOp op2, FeOp op3)
 {
     uint8_t* buf_start = *buf;
     uint64_t ops[4] = {op0, op1, op2, op3};
 
+    if (UNLIKELY(mnem & FE_OPTSIZE)) {
+        int res = enc_optsize(buf, emit, mode, pos_adj, mnem, ops);
+        if (res < 0)
+            goto fail;
+        return res;
+    }
+
     uint64_t desc_idx = mnem & FE_MNEM_MASK;
     if (UNLIKELY(desc_idx >= FE_MNEM_MAX)) goto fail;
 
     do
     {
-        const struct EncodeDesc* desc = &descs[desc_idx];
-        const struct EncodingInfo* ei = &encoding_infos[desc->enc];
-        uint64_t opc = desc->opc;
-        int64_t imm = 0xcc;
-        unsigned immsz = desc->immsz;
-
+        const struct EncodeDesc* desc = mode == 32 ? &descs32[desc_idx]
+                                                   : &descs64[desc_idx];
         if (UNLIKELY(desc->enc == ENC_INVALID)) goto fail;
 
-        if (ei->zregidx)
-            if (op_reg_idx(ops[ei->zregidx^3]) != ei->zregval) goto next;
-
-        for (int i = 0; i < 4; i++) {
-            unsigned ty = (desc->tys >> (4 * i)) & 0xf;
-            FeOp op = ops[i];
-            if (ty == 0x0) continue;
-            if (ty == 0xf && !op_mem(op)) goto next;
-            if (ty == 0x1 && !op_reg_gpl(op)) goto next;
-            if (ty == 0x2 && !op_reg_gpl(op) && !op_reg_gph(op)) goto next;
-            if (ty == 0x2 && op_reg_gpl(op) && op >= FE_SP) opc |= OPC_REX;
-            if (ty == 0x3 && !op_reg_seg(op)) goto next;
-            if (ty == 0x4 && !op_reg_fpu(op)) goto next;
-            if (ty == 0x5 && !op_reg_mmx(op)) goto next;
-            if (ty == 0x6 && !op_reg_xmm(op)) goto next;
-            if (UNLIKELY(ty >= 7 && ty < 0xf)) goto next; // TODO: support BND, CR, DR
-        }
+        int res = enc_variant(buf, emit, mode, pos_adj, mnem, desc, ops);
+        if (res >= 0)
+            return res;
+        if (res == ENC_FAIL)
+            goto fail;
 
-        if (UNLIKELY(mnem & FE_ADDR32))
-            opc |= OPC_67;
-        if (UNLIKELY(mnem & FE_SEG_MASK))
-            opc |= (mnem & FE_SEG_MASK) << (OPC_SEG_IDX - 16);
-        if (UNLIKELY(desc->enc == ENC_S)) {
-            if ((op_reg_idx(op0) << 3 & 0x20) != (opc & 0x20)) goto next;
-            opc |= op_reg_idx(op0) << 3;
-        }
+        desc_idx = desc->alt;
+    } while (desc_idx != 0);
 
-        if (ei->immctl > 0) {
-            imm = ops[ei->immidx];
-            if (ei->immctl == 2) {
-                immsz = UNLIKELY(mnem & FE_ADDR32) ? 4 : 8;
-                if (immsz == 4) imm = (int32_t) imm; // address are zero-extended
-            }
-            if (ei->immctl == 3)
-                imm = op_reg_idx(imm) << 4;
-            if (ei->immctl == 6) {
-                if (UNLIKELY(mnem & FE_JMPL) && desc->alt) goto next;
-                imm -= (int64_t) *buf + opc_size(opc) + immsz;
-            }
-            if (UNLIKELY(ei->immctl == 1) && imm != 1) goto next;
-            if (ei->immctl >= 2 && !op_imm_n(imm, immsz)) goto next;
-        }
+fail:
+    // Don't advance buffer on error; though we shouldn't write anything.
+    *buf = buf_start;
+    return -1;
+}
 
-        // NOP has no operands, so this must be the 32-bit OA XCHG
-        if ((desc->opc & ~7) == 0x90 && ops[0] == FE_AX) goto next;
+static
+int
+enc64(uint8_t** restrict buf, uint64_t mnem, FeOp op0, FeOp op1, FeOp op2,
+      FeOp op3)
+{
+    return enc_core(buf, true, 64, 0, mnem, op0, op1, op2, op3);
+}
 
-        if (ei->vexreg)
-            opc |= ((uint64_t) op_reg_idx(ops[ei->vexreg^3])) << OPC_VEXOP_IDX;
+int
+fe_enc64_impl(uint8_t** restrict buf, uint64_t mnem, FeOp op0, FeOp op1,
+              FeOp op2, FeOp op3)
+{
+    return enc64(buf, mnem, op0, op1, op2, op3) < 0 ? -1 : 0;
+}
 
-        if (ei->modrm) {
-            FeOp modreg = ei->modreg ? ops[ei->modreg^3] : (opc & 0xff00) >> 8;
-            if (enc_mr(buf, opc, ops[ei->modrm^3], modreg, immsz)) goto fail;
-        } else if (ei->modreg) {
-            if (enc_o(buf, opc, ops[ei->modreg^3])) goto fail;
-        } else {
-            if (enc_opc(buf, opc)) goto fail;
-        }
+int
+fe_enc64_at_impl(uint8_t** restrict buf, uint64_t addr, uint64_t mnem,
+                 FeOp op0, FeOp op1, FeOp op2, FeOp op3)
+{
+    int64_t pos_adj = addr - (uintptr_t) *buf;
+    return enc_core(buf, true, 64, pos_adj, mnem, op0, op1, op2, op3) < 0 ? -1 : 0;
+}
+
+int
+fe_enc32_impl(uint8_t** restrict buf, uint64_t mnem, FeOp op0, FeOp op1,
+              FeOp op2, FeOp op3)
+{
+    return enc_core(buf, true, 32, 0, mnem, op0, op1, op2, op3) < 0 ? -1 : 0;
+}
+
+int
+fe_enc64_size_impl(const uint8_t* pos, uint64_t mnem, FeOp op0, FeOp op1,
+                   FeOp op2, FeOp op3)
+{
+    // Advance a cursor in a local buffer instead of pos, which is const; the
+    // address adjustment keeps relative offsets computed from pos.
+    uint8_t scratch[FE_MAX_INSTR_SIZE];
+    uint8_t* cur = scratch;
+    int64_t pos_adj = (uintptr_t) pos - (uintptr_t) scratch;
+    if (enc_core(&cur, false, 64, pos_adj, mnem, op0, op1, op2, op3) < 0)
+        return -1;
+    return cur - scratch;
+}
 
-        if (ei->immctl >= 2)
-            if (enc_imm(buf, imm, immsz)) goto fail;
+ptrdiff_t
+fe_enc64_size_block(const FeInstr* instrs, size_t count, const uint8_t* pos)
+{
+    const uint8_t* cur = pos;
+    for (size_t i = 0; i < count; i++) {
+        const FeInstr* instr = &instrs[i];
+        int size = fe_enc64_size_impl(cur, instr->mnem, instr->ops[0],
+                                      instr->ops[1], instr->ops[2],
+                                      instr->ops[3]);
+        if (UNLIKELY(size < 0))
+            return -1;
+        cur += size;
+    }
+    return cur - pos;
+}
+
+int
+fe_cb_init(FeCodeBuf* cb, uint8_t* buf, size_t len, FeCodeBufGrow grow,
+           void* user)
+{
+    cb->grow = grow;
+    cb->user = user;
+    cb->error = 0;
+    cb->base = cb->cur = cb->end = buf;
+    if (UNLIKELY(len < FE_CB_CHAIN_RESERVE)) {
+        cb->error = -1;
+        return -1;
+    }
+    cb->end = buf + len - FE_CB_CHAIN_RESERVE;
+    return 0;
+}
 
+int
+fe_cb_grow(FeCodeBuf* cb, size_t size)
+{
+    if (cb->grow && !cb->grow(cb, size) && (size_t) (cb->end - cb->cur) >= size)
         return 0;
+    cb->error = -1;
+    return -1;
+}
 
-    next:
-        desc_idx = desc->alt;
-    } while (desc_idx != 0);
+int
+fe_cb_chain(FeCodeBuf* cb, uint8_t* buf, size_t len)
+{
+    if (UNLIKELY(len < FE_CB_CHAIN_RESERVE))
+        return -1;
+    // There is always space for the jump, even if the current chunk is full.
+    if (fe_enc64(&cb->cur, FE_JMP, (intptr_t) buf))
+        return -1;
+    cb->base = cb->cur = buf;
+    cb->end = buf + len - FE_CB_CHAIN_RESERVE;
+    return 0;
+}
+
+#define LABEL_UNBOUND UINT64_MAX
+// Maximum number of relaxation passes of fe_asm_finalize.
+#define ASM_RELAX_PASSES 4
+
+enum {
+    FIXUP_REL8 = 0, // jcxz, loop: only rel8
+    FIXUP_REL32 = 1, // call, memory operands: only rel32
+    FIXUP_JMP = 2, // jmp rel32, can be shrunk to jmp rel8
+    FIXUP_JCC = 3, // jcc rel32, can be shrunk to jcc rel8
+    FIXUP_TYPE_MASK = 3,
+    FIXUP_SHORT = 1 << 2,
+    FIXUP_ABS = 1 << 3,
+};
+
+void
+fe_asm_init(FeAsm* as, FeCodeBuf* cb, uint64_t* labels, size_t label_cap,
+            FeAsmFixup* fixups, size_t fixup_cap)
+{
+    as->cb = cb;
+    as->labels = labels;
+    as->fixups = fixups;
+    as->label_count = 0;
+    as->label_abs = label_cap < 0x80000000 ? label_cap : 0x80000000;
+    as->fixup_count = 0;
+    as->fixup_cap = fixup_cap < UINT32_MAX ? fixup_cap : UINT32_MAX;
+}
+
+FeLabel
+fe_asm_label(FeAsm* as)
+{
+    if (UNLIKELY(as->label_count == as->label_abs)) {
+        as->cb->error = -1;
+        return FE_LABEL_INVALID;
+    }
+    as->labels[as->label_count] = LABEL_UNBOUND;
+    return as->label_count++;
+}
+
+FeLabel
+fe_asm_label_abs(FeAsm* as, uint64_t addr)
+{
+    if (UNLIKELY(as->label_count == as->label_abs)) {
+        as->cb->error = -1;
+        return FE_LABEL_INVALID;
+    }
+    as->labels[--as->label_abs] = addr;
+    return as->label_abs;
+}
+
+void
+fe_asm_bind(FeAsm* as, FeLabel label)
+{
+    if (UNLIKELY(label >= as->label_count || as->labels[label] != LABEL_UNBOUND)) {
+        as->cb->error = -1;
+        return;
+    }
+    as->labels[label] = as->cb->cur - as->cb->base;
+}
+
+static
+void
+asm_fixup(FeAsm* as, FeLabel label, uint8_t* start, unsigned field,
+          unsigned kind)
+{
+    FeCodeBuf* cb = as->cb;
+    if (UNLIKELY(as->fixup_count == as->fixup_cap))
+        goto fail;
+
+    FeAsmFixup* fixup = &as->fixups[as->fixup_count++];
+    if (label < as->label_count) {
+        fixup->target = label;
+    } else if (label >= as->label_abs && label != FE_LABEL_INVALID) {
+        fixup->target = as->labels[label];
+        kind |= FIXUP_ABS;
+    } else {
+        goto fail;
+    }
+    fixup->pos = start - cb->base;
+    fixup->shift = 0;
+    fixup->len = cb->cur - start;
+    fixup->field = field;
+    fixup->kind = kind;
+    return;
 
 fail:
-    // Don't advance buffer on error; though we shouldn't write anything.
-    *buf = buf_start;
+    cb->error = -1;
+    // Don't keep an instruction with an incomplete offset.
+    cb->cur = start;
+}
+
+void
+fe_asm_jmp(FeAsm* as, uint64_t mnem, FeLabel label)
+{
+    FeCodeBuf* cb = as->cb;
+    uint8_t* start = cb->cur;
+    // Encode with the longest offset and a target within the instruction, so
+    // that the stored offset is -length as for fe_asm_ref_impl.
+    int immsz = enc64(&cb->cur, mnem | FE_JMPL, (intptr_t) start, 0, 0, 0);
+    if (UNLIKELY(immsz <= 0)) {
+        cb->error = -1;
+        return;
+    }
+
+    unsigned len = cb->cur - start;
+    unsigned kind = FIXUP_REL32;
+    if (immsz == 1)
+        kind = FIXUP_REL8;
+    else if (cb->cur[-5] == 0xe9)
+        kind = FIXUP_JMP;
+    else if (len >= 6 && cb->cur[-6] == 0x0f && (cb->cur[-5] & 0xf0) == 0x80)
+        kind = FIXUP_JCC;
+    asm_fixup(as, label, start, len - immsz, kind);
+}
+
+void
+fe_asm_ref_impl(FeAsm* as, FeLabel label, uint64_t mnem, FeOp op0, FeOp op1,
+                FeOp op2, FeOp op3)
+{
+    FeCodeBuf* cb = as->cb;
+    uint8_t* start = cb->cur;
+    FeOp ops[4] = {op0, op1, op2, op3};
+    bool has_ref = false;
+    for (int i = 0; i < 4; i++)
+        if (op_mem(ops[i]) && op_mem_base(ops[i]) == FE_IP && !op_mem_idx(ops[i]))
+            has_ref = true;
+
+    int immsz = enc64(&cb->cur, mnem, op0, op1, op2, op3);
+    if (UNLIKELY(!has_ref || immsz < 0)) {
+        cb->error = -1;
+        cb->cur = start;
+        return;
+    }
+    // The displacement is stored as offset - length, see enc_mr.
+    asm_fixup(as, label, start, cb->cur - start - immsz - 4, FIXUP_REL32);
+}
+
+// Offset after moving the code, given the shifts of all references.
+static
+uint64_t
+asm_new_offset(const FeAsm* as, uint64_t off)
+{
+    // Find the last reference starting before off.
+    size_t lo = 0, hi = as->fixup_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (as->fixups[mid].pos < off)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo ? off - as->fixups[lo - 1].shift : off;
+}
+
+static
+int64_t
+asm_target(const FeAsm* as, const FeAsmFixup* fixup)
+{
+    if (fixup->kind & FIXUP_ABS)
+        return fixup->target - (uintptr_t) as->cb->base;
+    return asm_new_offset(as, as->labels[fixup->target]);
+}
+
+int
+fe_asm_finalize(FeAsm* as)
+{
+    FeCodeBuf* cb = as->cb;
+    FeAsmFixup* fixups = as->fixups;
+    size_t count = as->fixup_count;
+
+    if (cb->error)
+        return -1;
+    for (size_t i = 0; i < count; i++)
+        if (!(fixups[i].kind & FIXUP_ABS) && as->labels[fixups[i].target] == LABEL_UNBOUND)
+            goto fail;
+
+    // Relaxation: all jumps start with rel32. Shrinking a jump never increases
+    // any distance, so jumps which fit into rel8 remain valid. Repeat until no
+    // more jumps can be shrunk, but at most ASM_RELAX_PASSES times: chains of
+    // jumps where each one only fits after shrinking the next would otherwise
+    // need one pass per jump. The remaining jumps keep their rel32 offset.
+    bool changed = true;
+    for (unsigned pass = 0; changed && pass < ASM_RELAX_PASSES; pass++) {
+        changed = false;
+        for (size_t i = 0; i < count; i++) {
+            FeAsmFixup* fixup = &fixups[i];
+            unsigned type = fixup->kind & FIXUP_TYPE_MASK;
+            if ((type != FIXUP_JMP && type != FIXUP_JCC) ||
+                (fixup->kind & (FIXUP_SHORT|FIXUP_ABS)))
+                continue;
+            unsigned short_len = fixup->len - (type == FIXUP_JMP ? 3 : 4);
+            int64_t pos = fixup->pos - (i ? fixups[i - 1].shift : 0);
+            int64_t target = asm_target(as, fixup);
+            // Shrinking the jump moves forward targets along with its end.
+            int64_t rel = target - (pos + (target > pos ? fixup->len : short_len));
+            if (rel == (int8_t) rel) {
+                fixup->kind |= FIXUP_SHORT;
+                changed = true;
+            }
+        }
+
+        uint32_t shift = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (fixups[i].kind & FIXUP_SHORT)
+                shift += (fixups[i].kind & FIXUP_TYPE_MASK) == FIXUP_JMP ? 3 : 4;
+            fixups[i].shift = shift;
+        }
+    }
+
+    // Move the code and patch all references. Code is only moved towards the
+    // start, so copying forwards is fine.
+    uint8_t* code = cb->base;
+    size_t src = 0, dst = 0;
+    for (size_t i = 0; i <= count; i++) {
+        FeAsmFixup* fixup = &fixups[i];
+        size_t copy_end = i < count ? fixup->pos + fixup->len : (size_t) (cb->cur - code);
+        bool shrink = i < count && (fixup->kind & FIXUP_SHORT);
+        unsigned type = i < count ? fixup->kind & FIXUP_TYPE_MASK : 0;
+        uint8_t opc = 0;
+        if (shrink) {
+            // Keep prefixes, replace opcode and offset.
+            copy_end = fixup->pos + fixup->field - (type == FIXUP_JMP ? 1 : 2);
+            opc = type == FIXUP_JMP ? 0xeb : 0x70 | (code[fixup->pos + fixup->field - 1] & 0xf);
+        }
+        if (dst != src)
+            for (size_t j = src; j < copy_end; j++)
+                code[dst + j - src] = code[j];
+        dst += copy_end - src;
+        src = copy_end;
+        if (i == count)
+            break;
+
+        int64_t target = asm_target(as, fixup);
+        if (shrink) {
+            int64_t rel = target - (int64_t) (dst + 2);
+            if (rel != (int8_t) rel)
+                goto fail;
+            code[dst++] = opc;
+            code[dst++] = rel;
+            src = fixup->pos + fixup->len;
+        } else {
+            size_t pos = dst - fixup->len;
+            uint8_t* field = code + pos + fixup->field;
+            if (type == FIXUP_REL8) {
+                int64_t rel = (int8_t) *field + target - (int64_t) pos;
+                if (rel != (int8_t) rel)
+                    goto fail;
+                *field = rel;
+            } else {
+                uint32_t old = field[0] | field[1] << 8 | field[2] << 16 |
+                               (uint32_t) field[3] << 24;
+                int64_t rel = (int32_t) old + target - (int64_t) pos;
+                if (rel != (int32_t) rel)
+                    goto fail;
+                for (unsigned j = 0; j < 4; j++)
+                    field[j] = rel >> 8 * j;
+            }
+        }
+    }
+    cb->cur = code + dst;
+
+    for (size_t i = 0; i < as->label_count; i++)
+        if (as->labels[i] != LABEL_UNBOUND)
+            as->labels[i] = asm_new_offset(as, as->labels[i]);
+    return 0;
+
+fail:
+    cb->error = -1;
     return -1;
 }
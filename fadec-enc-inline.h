@@ -0,0 +1,65 @@
+#ifndef FD_FADEC_ENC_INLINE_H_
+#define FD_FADEC_ENC_INLINE_H_
+
+#include <stdint.h>
+
+#include <fadec-enc.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** fe_enc64_inl and fe_cb_enc64_inl encode instructions with a compile-time
+ * constant mnemonic inline, if the first encoding of the mnemonic only has
+ * register and immediate operands (e.g. FE_ADD64rr, FE_SUB64ri, FE_PUSHr,
+ * FE_RET). Such instructions are reduced to a few operand checks and byte
+ * stores. In all other cases, and if the operands do not fit the first
+ * encoding of the mnemonic, the table-based encoder is used. The result is
+ * always identical to fe_enc64.
+ *
+ * This requires support for __builtin_constant_p (GCC, Clang); otherwise, the
+ * table-based encoder is always used. **/
+
+/** Do not use. **/
+#define FE_INL_GP(op) (((op) & ~(FeOp) 0xf) == 0x100)
+/** Do not use. **/
+#define FE_INL_MMX(op) (((op) & ~(FeOp) 0x7) == 0x500)
+/** Do not use. **/
+#define FE_INL_XMM(op) (((op) & ~(FeOp) 0xf) == 0x600)
+
+/** Do not use. **/
+static inline __attribute__((always_inline))
+int
+fe_enc64_inl_impl(uint8_t** buf, uint64_t mnem, FeOp op0, FeOp op1, FeOp op2,
+                  FeOp op3)
+{
+    switch (mnem) {
+#include <fadec-enc-inline.inc>
+    default:
+        break;
+    }
+    return fe_enc64_impl(buf, mnem, op0, op1, op2, op3);
+}
+
+#if defined(__GNUC__)
+/** Do not use. **/
+#define fe_enc64_inl_1(buf, mnem, op0, op1, op2, op3, ...) \
+        (__builtin_constant_p(mnem) ? \
+         fe_enc64_inl_impl(buf, mnem, op0, op1, op2, op3) : \
+         fe_enc64_impl(buf, mnem, op0, op1, op2, op3))
+#else
+#define fe_enc64_inl_1(buf, mnem, op0, op1, op2, op3, ...) \
+        fe_enc64_impl(buf, mnem, op0, op1, op2, op3)
+#endif
+
+/** Encode a single instruction for 64-bit mode, see fe_enc64. Instructions
+ * with constant mnemonic are encoded inline where possible. **/
+#define fe_enc64_inl(buf, ...) fe_enc64_inl_1(buf, __VA_ARGS__, 0, 0, 0, 0, 0)
+/** Encode a single instruction into a code buffer, see fe_cb_enc64. **/
+#define fe_cb_enc64_inl(cb, ...) ((cb)->error |= fe_enc64_inl(&(cb)->cur, __VA_ARGS__))
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
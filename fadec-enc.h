@@ -41,6 +41,15 @@ typedef int64_t FeOp;
  * when the target offset is still unknown; if the jump is re-encoded later on,
  * FE_JMPL must be specified there, too, so that the encoding lengths match. **/
 #define FE_JMPL 0x100000
+/** Select the shortest encoding: all variants of the mnemonic are tried instead
+ * of the first matching one (e.g., for a 2-byte VEX prefix with the register
+ * operands swapped between ModRM.reg and ModRM.rm), as well as equivalent
+ * instructions with smaller operand size, which are used only if the result
+ * and all status flags are identical: MOV64ri with a zero-extended 32-bit
+ * immediate, AND64ri/TEST64ri/TEST64mi with a non-negative 32-bit immediate,
+ * TEST32ri/TEST32mi with a non-negative 8-bit immediate, and XOR64rr/SUB64rr
+ * with the same register. Encoding is slower, as every variant is tried. **/
+#define FE_OPTSIZE 0x200000
 /** Do not use. **/
 #define FE_MNEM_MASK 0xffff
 
@@ -57,7 +66,8 @@ enum {
  * \param buf Pointer to the buffer for instruction bytes, must have a size of
  *        15 bytes. The pointer is advanced by the number of bytes used for
  *        encoding the specified instruction.
- * \param mnem Mnemonic, optionally or-ed with FE_SEG(), FE_ADDR32, or FE_JMPL.
+ * \param mnem Mnemonic, optionally or-ed with FE_SEG(), FE_ADDR32, FE_JMPL, or
+ *        FE_OPTSIZE.
  * \param operands... Instruction operands. Immediate operands are passed as
  *        plain value; register operands using the FeReg enum; memory operands
  *        using FE_MEM(); and offset operands for RIP-relative jumps/calls are
@@ -69,6 +79,388 @@ enum {
 /** Do not use. **/
 int fe_enc64_impl(uint8_t** buf, uint64_t mnem, FeOp op0, FeOp op1, FeOp op2, FeOp op3);
 
+/** Do not use. **/
+#define fe_enc64_at_1(buf, addr, mnem, op0, op1, op2, op3, ...) fe_enc64_at_impl(buf, addr, mnem, op0, op1, op2, op3)
+/** Encode a single instruction for 64-bit mode into a buffer which is not at
+ * the address where the instruction will be executed, e.g. a staging buffer
+ * for code of another process. Parameters are the same as for fe_enc64, except
+ * that the targets of offset operands for RIP-relative jumps/calls are
+ * addresses in the address space of addr instead of buf.
+ * \param addr The address where the instruction will be executed.
+ * \return Zero for success or a negative value in case of an error.
+ **/
+#define fe_enc64_at(buf, addr, ...) fe_enc64_at_1(buf, addr, __VA_ARGS__, 0, 0, 0, 0, 0)
+/** Do not use. **/
+int fe_enc64_at_impl(uint8_t** buf, uint64_t addr, uint64_t mnem, FeOp op0, FeOp op1, FeOp op2, FeOp op3);
+
+/** Do not use. **/
+#define fe_enc32_1(buf, mnem, op0, op1, op2, op3, ...) fe_enc32_impl(buf, mnem, op0, op1, op2, op3)
+/** Encode a single instruction for 32-bit mode. Parameters are the same as for
+ * fe_enc64, but only the first eight registers and no 64-bit operand sizes are
+ * available; FE_IP cannot be used as base register and FE_ADDR32 is ignored.
+ * Mnemonics without operand size that use 64-bit operands in 64-bit mode
+ * (e.g., FE_PUSHr, FE_CALLr) use 32-bit operands here. 16-bit addressing and
+ * far direct calls/jumps with a ptr16:32 immediate (opcodes 9a and ea) are
+ * not supported. If the library was built without 32-bit support, this always
+ * fails.
+ * \return Zero for success or a negative value in case of an error.
+ **/
+#define fe_enc32(buf, ...) fe_enc32_1(buf, __VA_ARGS__, 0, 0, 0, 0, 0)
+/** Do not use. **/
+int fe_enc32_impl(uint8_t** buf, uint64_t mnem, FeOp op0, FeOp op1, FeOp op2, FeOp op3);
+
+/** Do not use. **/
+#define fe_enc64_size_1(pos, mnem, op0, op1, op2, op3, ...) fe_enc64_size_impl(pos, mnem, op0, op1, op2, op3)
+/** Compute the size of an instruction for 64-bit mode without encoding it.
+ * \param pos The address where the instruction would be encoded, used for
+ *        RIP-relative jumps/calls, whose size depends on the distance to the
+ *        target. Nothing is written to pos.
+ * \param mnem Mnemonic, same as for fe_enc64.
+ * \param operands... Instruction operands, same as for fe_enc64.
+ * \return The size of the instruction in bytes, or a negative value if the
+ *         instruction cannot be encoded.
+ **/
+#define fe_enc64_size(pos, ...) fe_enc64_size_1(pos, __VA_ARGS__, 0, 0, 0, 0, 0)
+/** Do not use. **/
+int fe_enc64_size_impl(const uint8_t* pos, uint64_t mnem, FeOp op0, FeOp op1, FeOp op2, FeOp op3);
+
+/** An instruction with mnemonic and operands as for fe_enc64, unused operands
+ * must be zero. **/
+typedef struct FeInstr {
+    uint64_t mnem;
+    FeOp ops[4];
+} FeInstr;
+
+/** Compute the total size of a sequence of instructions for 64-bit mode
+ * without encoding them; the instructions are assumed to be placed
+ * consecutively starting at pos.
+ * \param instrs The instructions.
+ * \param count The number of instructions.
+ * \param pos The address of the first instruction, see fe_enc64_size.
+ * \return The size in bytes, or a negative value if any instruction cannot be
+ *         encoded.
+ **/
+ptrdiff_t fe_enc64_size_block(const FeInstr* instrs, size_t count,
+                              const uint8_t* pos);
+
+/** Maximum number of bytes of a single encoded instruction. **/
+#define FE_MAX_INSTR_SIZE 15
+/** Number of bytes at the end of a FeCodeBuf chunk kept free for the jump to
+ * the next chunk, see fe_cb_chain. **/
+#define FE_CB_CHAIN_RESERVE 5
+
+typedef struct FeCodeBuf FeCodeBuf;
+
+/** Callback to provide more space to a code buffer.
+ * \param cb The code buffer.
+ * \param size The number of bytes required after cb->cur.
+ * \return Zero for success or a negative value in case of an error.
+ *
+ * The callback can either move the code (e.g., using realloc), in which case
+ * it has to update the pointers base, cur and end of the code buffer; or it
+ * can continue the code in a different chunk of memory using fe_cb_chain.
+ * Note that moving the code invalidates all addresses inside the buffer. **/
+typedef int (*FeCodeBufGrow)(FeCodeBuf* cb, size_t size);
+
+/** A code buffer for emitting a sequence of instructions. Buffer space is
+ * checked only once for a batch of instructions (fe_cb_reserve), errors are
+ * accumulated and can be checked at the end (FE_CB_ERROR).
+ * Fields other than base, cur, end, and user must not be accessed directly;
+ * base/cur/end may only be modified by a grow callback. **/
+struct FeCodeBuf {
+    /** Start of the current chunk. **/
+    uint8_t* base;
+    /** Current position, instructions are written here. **/
+    uint8_t* cur;
+    /** End of the usable space of the current chunk. **/
+    uint8_t* end;
+    FeCodeBufGrow grow;
+    /** Arbitrary data for the grow callback. **/
+    void* user;
+    int error;
+};
+
+/** Initialize a code buffer.
+ * \param cb The code buffer.
+ * \param buf The initial chunk of memory.
+ * \param len The size of buf in bytes. The last FE_CB_CHAIN_RESERVE bytes are
+ *        never used for instructions.
+ * \param grow Callback for more space, may be NULL.
+ * \param user Arbitrary data for the grow callback.
+ * \return Zero for success or a negative value if buf is too small.
+ **/
+int fe_cb_init(FeCodeBuf* cb, uint8_t* buf, size_t len, FeCodeBufGrow grow,
+               void* user);
+
+/** Ensure that the code buffer has space for count instructions, calling the
+ * grow callback if required. Afterwards, up to count instructions can be
+ * emitted with fe_cb_enc64 without further checks.
+ * NOTE: cb is evaluated more than once.
+ * \return Zero for success or a negative value if the buffer could not be
+ *         grown; the error is also recorded in the code buffer.
+ **/
+#define fe_cb_reserve(cb, count) \
+        ((size_t) ((cb)->end - (cb)->cur) >= (size_t) (count) * FE_MAX_INSTR_SIZE ? 0 : \
+         fe_cb_grow((cb), (size_t) (count) * FE_MAX_INSTR_SIZE))
+
+/** Encode a single instruction into a code buffer; space must have been
+ * reserved before using fe_cb_reserve. Errors are recorded in the code buffer
+ * and do not advance its position. Parameters as for fe_enc64. **/
+#define fe_cb_enc64(cb, ...) ((cb)->error |= fe_enc64(&(cb)->cur, __VA_ARGS__))
+
+/** Non-zero if any operation on the code buffer failed since initialization
+ * or the last call to fe_cb_clear_error. **/
+#define FE_CB_ERROR(cb) ((cb)->error)
+#define fe_cb_clear_error(cb) ((cb)->error = 0)
+
+/** Do not use; slow path of fe_cb_reserve. **/
+int fe_cb_grow(FeCodeBuf* cb, size_t size);
+
+/** Continue the code in a new chunk of memory: emit a jump to buf at the
+ * current position and use buf for all following instructions. This can be
+ * used in a grow callback.
+ * \param cb The code buffer.
+ * \param buf The new chunk, must be within +/-2 GiB of the current chunk.
+ * \param len The size of buf in bytes, see also fe_cb_init.
+ * \return Zero for success or a negative value in case of an error.
+ **/
+int fe_cb_chain(FeCodeBuf* cb, uint8_t* buf, size_t len);
+
+/** A label, i.e. a reference to a position in a code buffer or to an absolute
+ * address outside of the code buffer. **/
+typedef uint32_t FeLabel;
+/** Returned for failed label allocations; using it in fe_asm_* functions will
+ * result in an error. **/
+#define FE_LABEL_INVALID ((FeLabel) -1)
+
+/** A reference to a label, for internal use. **/
+typedef struct FeAsmFixup {
+    uint64_t target;
+    uint32_t pos;
+    uint32_t shift;
+    uint8_t len;
+    uint8_t field;
+    uint8_t kind;
+    uint8_t _pad[5];
+} FeAsmFixup;
+
+/** Assembler state for labels and jumps on top of a code buffer. Jumps to
+ * labels are first emitted with the longest encoding and shrunk by
+ * fe_asm_finalize wherever possible, moving the following code.
+ *
+ * The code buffer must be contiguous (it must not use fe_cb_chain), but may
+ * be moved by its grow callback. As code is moved during finalization, all
+ * position-dependent operands (jump targets, FE_IP-relative memory operands)
+ * must be specified using labels.
+ *
+ * Memory for labels and references is provided by the user; if one of them
+ * is exhausted, an error is recorded in the code buffer.
+ * Never(!) access struct fields directly. **/
+typedef struct FeAsm {
+    FeCodeBuf* cb;
+    uint64_t* labels;
+    FeAsmFixup* fixups;
+    // Labels in the code buffer are allocated from the start of labels,
+    // absolute labels from the end.
+    uint32_t label_count;
+    uint32_t label_abs;
+    uint32_t fixup_count;
+    uint32_t fixup_cap;
+} FeAsm;
+
+/** Initialize an assembler state.
+ * \param as The assembler state.
+ * \param cb The code buffer to emit code into.
+ * \param labels Memory for labels.
+ * \param label_cap The number of entries in labels, at most 2^31.
+ * \param fixups Memory for label references, one per emitted jump or memory
+ *        reference to a label.
+ * \param fixup_cap The number of entries in fixups.
+ **/
+void fe_asm_init(FeAsm* as, FeCodeBuf* cb, uint64_t* labels, size_t label_cap,
+                 FeAsmFixup* fixups, size_t fixup_cap);
+
+/** Create a new, unbound label. **/
+FeLabel fe_asm_label(FeAsm* as);
+/** Create a label referring to an absolute address outside of the code
+ * buffer, e.g. a function or global data. References to such labels are
+ * never shrunk. **/
+FeLabel fe_asm_label_abs(FeAsm* as, uint64_t addr);
+/** Bind a label to the current position. Every label can be bound once. **/
+void fe_asm_bind(FeAsm* as, FeLabel label);
+
+/** Emit a jump to a label; space must have been reserved in the code buffer.
+ * \param as The assembler state.
+ * \param mnem FE_JMP, FE_Jcc, FE_CALL, FE_JCXZ, FE_LOOPcc, optionally or-ed
+ *        with FE_SEG() or FE_ADDR32.
+ * \param label The jump target.
+ **/
+void fe_asm_jmp(FeAsm* as, uint64_t mnem, FeLabel label);
+/** Emit an instruction with a memory operand relative to a label; space must
+ * have been reserved in the code buffer. The instruction must have exactly
+ * one memory operand, which must be specified as FE_MEM(FE_IP, 0, 0, off);
+ * off is added to the address of the label. Other parameters as for fe_enc64.
+ **/
+#define fe_asm_enc64_ref(as, label, ...) fe_asm_enc64_ref_1(as, label, __VA_ARGS__, 0, 0, 0, 0, 0)
+/** Do not use. **/
+#define fe_asm_enc64_ref_1(as, label, mnem, op0, op1, op2, op3, ...) fe_asm_ref_impl(as, label, mnem, op0, op1, op2, op3)
+/** Do not use. **/
+void fe_asm_ref_impl(FeAsm* as, FeLabel label, uint64_t mnem, FeOp op0, FeOp op1, FeOp op2, FeOp op3);
+
+/** Shrink jumps, move the code accordingly and patch all label references.
+ * Afterwards, the end of the code is at cb->cur and label offsets can be
+ * queried with FE_ASM_LABEL_OFFSET. No more code must be emitted afterwards.
+ * This takes O((labels + references) * log(references)) time: relaxation
+ * stops after at most four passes, which usually suffice. Jumps which would
+ * only fit into an 8-bit offset after more passes keep a 32-bit offset.
+ * \return Zero for success or a negative value if any label was not bound,
+ *         a jump target is out of range, or the code buffer has an error. **/
+int fe_asm_finalize(FeAsm* as);
+
+/** The offset of a bound label from the start of the code buffer. Only valid
+ * after fe_asm_finalize. **/
+#define FE_ASM_LABEL_OFFSET(as, label) ((as)->labels[label])
+
+/** Maximum size of a patch window, see FePatch. **/
+#define FE_PATCH_MAX_SIZE 32
+/** Maximum number of writes of a patch, see FePatch. **/
+#define FE_PATCH_MAX_WRITES 8
+
+/** A single store of a patch. It must be done with one naturally aligned
+ * store of size bytes, i.e. a byte store, an 8-byte store, or a 16-byte store
+ * (LOCK CMPXCHG16B), so that other threads see either the old or the new
+ * bytes. The bytes outside of the patch window are the current code. **/
+typedef struct FePatchWrite {
+    uint64_t addr;
+    /** Store size in bytes: 1, 8, or 16. **/
+    uint8_t size;
+    /** If set, the write must be visible to all threads and all threads must
+     * execute a serializing instruction before the next write, e.g. using
+     * membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE) on Linux. **/
+    uint8_t sync;
+    uint8_t bytes[16];
+} FePatchWrite;
+
+/** Plan for replacing the code of an instruction-aligned window by new code,
+ * safe for concurrently executing threads (cross-modifying code). If the
+ * window lies within an aligned 8-byte or 16-byte block, it is written with a
+ * single store. Otherwise, an INT3 is written to the first byte, then the rest
+ * of the window, and finally the first byte; a thread hitting the INT3 in the
+ * meantime must be resumed at the start of the window by the caller's SIGTRAP
+ * handler (after the patch is complete). In both cases, no thread must be
+ * about to execute an instruction inside the window other than the first one.
+ * Fields addr, size, and code can be accessed directly. **/
+typedef struct FePatch {
+    /** Address of the patch window. **/
+    uint64_t addr;
+    /** Size of the patch window, which covers complete instructions. **/
+    uint32_t size;
+    uint32_t write_count;
+    /** New code of the window. **/
+    uint8_t code[FE_PATCH_MAX_SIZE];
+    /** The writes to perform in order. **/
+    FePatchWrite writes[FE_PATCH_MAX_WRITES];
+} FePatch;
+
+/** Determine an instruction-aligned patch window for 64-bit code. This and
+ * the other functions that decode the current code always fail if the decoder
+ * is built without 64-bit support (archmode only32).
+ * \param code The current code, starting at an instruction boundary.
+ * \param len The length of code.
+ * \param min_size The minimum size of the window.
+ * \return The size of the window, i.e. the size of the smallest sequence of
+ *         complete instructions with at least min_size bytes; or a negative
+ *         value if an instruction cannot be decoded or the window would exceed
+ *         len or FE_PATCH_MAX_SIZE.
+ **/
+int fe_patch_window(const uint8_t* code, size_t len, size_t min_size);
+
+/** Fill a buffer with the fewest multi-byte NOPs, each at most 11 bytes long.
+ * \param buf The buffer.
+ * \param len The number of bytes to fill.
+ **/
+void fe_patch_nops(uint8_t* buf, size_t len);
+
+/** Copy complete instructions of 64-bit code to a new address, e.g. to a
+ * trampoline for instructions displaced by a patch. Jumps and calls with an
+ * offset operand are re-encoded for the new address as with fe_relocate64;
+ * the displacement of RIP-relative memory operands is adjusted. All other
+ * instructions are copied unmodified.
+ * \param buf Pointer to the output buffer, which requires up to 5 * len bytes.
+ *        The pointer is advanced by the number of bytes written.
+ * \param buf_addr The address where the output will be executed.
+ * \param code The instructions to copy.
+ * \param len The length of code, must end at an instruction boundary.
+ * \param code_addr The address where code is executed.
+ * \return Zero for success or a negative value if an instruction cannot be
+ *         decoded (see fe_patch_window) or a target is out of range for the new address; in this
+ *         case, *buf is not advanced.
+ **/
+int fe_patch_relocate(uint8_t** buf, uint64_t buf_addr, const uint8_t* code,
+                      size_t len, uint64_t code_addr);
+
+/** Compute the writes for replacing the window of a patch by the new code.
+ * \param patch The patch, where addr, size, and code must be set.
+ * \param code The current code at patch->addr. The enclosing aligned 16-byte
+ *        blocks of the window must be readable.
+ * \return Zero for success or a negative value if the size is invalid.
+ **/
+int fe_patch_writes(FePatch* patch, const uint8_t* code);
+
+/** Plan a patch to replace instructions of 64-bit code by new instructions.
+ * The new instructions are encoded for addr; the window covers all
+ * instructions overlapping with the new code, any remaining bytes are filled
+ * with NOPs. Displaced instructions, i.e. the first patch->size bytes of code,
+ * can be moved elsewhere using fe_patch_relocate.
+ * \param patch The patch plan.
+ * \param code The current code, see fe_patch_writes.
+ * \param len The length of code.
+ * \param addr The address of code.
+ * \param instrs The new instructions, see fe_enc64_at for offset operands.
+ * \param count The number of new instructions.
+ * \return Zero for success or a negative value if an instruction cannot be
+ *         encoded or decoded (see fe_patch_window), or if the window would
+ *         be too large.
+ **/
+int fe_patch_plan(FePatch* patch, const uint8_t* code, size_t len,
+                  uint64_t addr, const FeInstr* instrs, size_t count);
+
+/* The following functions use decoded instructions and are only declared if
+ * fadec.h is included before this header. */
+#ifdef FD_FADEC_H_
+/** Convert a decoded instruction into a mnemonic and operands for fe_enc64,
+ * using a mapping generated from the instruction tables. Encoding the result
+ * at addr gives an equivalent instruction, though not necessarily the same
+ * bytes (e.g., redundant prefixes are dropped, moffs operands become ModRM
+ * memory operands).
+ * \param out The encoder instruction.
+ * \param instr The instruction, decoded in 64-bit mode with address 0 (i.e.,
+ *        with FD_OT_OFF operands).
+ * \param addr The address of the instruction. Offset operands become absolute
+ *        targets; RIP-relative memory operands stay relative to addr.
+ * \return Zero for success or a negative value if the instruction cannot be
+ *         reproduced by the encoder (e.g., EVEX, control registers, operand
+ *         sizes without a mnemonic, or REPNZ/XACQUIRE/XRELEASE prefixes).
+ **/
+int fe_from_fd(FeInstr* out, const FdInstr* instr, uint64_t addr);
+
+/** Encode a decoded 64-bit instruction for a different address, e.g. when
+ * copying code into a code cache. Offset operands and RIP-relative memory
+ * operands are adjusted to refer to the original targets; jumps with an 8-bit
+ * offset are widened if required. JRCXZ and LOOP, which only have an 8-bit
+ * offset, are emitted with a short jump over a near jump to the target.
+ * \param buf Pointer to the output buffer, which requires 15 bytes. The
+ *        pointer is advanced by the number of bytes written.
+ * \param buf_addr The address where the output will be executed.
+ * \param instr The instruction, see fe_from_fd.
+ * \param instr_addr The original address of the instruction.
+ * \return Zero for success or a negative value if the instruction is not
+ *         supported or a target is out of range for the new address.
+ **/
+int fe_relocate64(uint8_t** buf, uint64_t buf_addr, const FdInstr* instr,
+                  uint64_t instr_addr);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,33 @@
+#ifndef FD_FADEC_SWEEP_H_
+#define FD_FADEC_SWEEP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Perform a linear sweep over a code region using multiple threads. The
+ * result is identical to fd_sweep: the region is split into chunks, each of
+ * which is decoded speculatively from its start by a separate thread.
+ * Afterwards, the chunks are resynchronized sequentially by re-decoding from
+ * the end of the previous chunk until an instruction boundary of the
+ * speculative sweep is reached, which usually happens within a few
+ * instructions. Note that this requires libpthread.
+ * \param buf Buffer for instruction bytes.
+ * \param len Length of the buffer (in bytes).
+ * \param mode Decoding mode, either 32 or 64, see fd_decode.
+ * \param out_starts Bitmap with at least (len+7)/8 bytes, see fd_sweep.
+ * \param threads Maximum number of threads to use. Small regions are decoded
+ *        with fewer threads.
+ * \return The number of decoded instructions.
+ **/
+size_t fd_sweep_parallel(const uint8_t* buf, size_t len, int mode,
+                         uint8_t* out_starts, unsigned threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
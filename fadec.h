@@ -28,17 +28,42 @@ typedef enum {
     FD_REG_NONE = 0x3f
 } FdReg;
 
+/** Rounding control of an EVEX-encoded instruction, see FD_ROUNDCONTROL. **/
+typedef enum {
+    /** Rounding mode from MXCSR, no static rounding or SAE **/
+    FD_RC_MXCSR = 0,
+    /** Round to nearest even, suppress all exceptions **/
+    FD_RC_RN = 1,
+    /** Round down (toward -inf), suppress all exceptions **/
+    FD_RC_RD = 2,
+    /** Round up (toward +inf), suppress all exceptions **/
+    FD_RC_RU = 3,
+    /** Round toward zero, suppress all exceptions **/
+    FD_RC_RZ = 4,
+    /** Suppress all exceptions, no static rounding **/
+    FD_RC_SAE = 5,
+} FdRoundControl;
+
 typedef enum {
 #define FD_MNEMONIC(name,value) FDI_ ## name = value,
 #include <fadec-mnems.inc>
 #undef FD_MNEMONIC
 } FdInstrType;
 
+/** Number of instruction types, i.e. one more than the largest FdInstrType. **/
+enum {
+    FD_TYPE_COUNT = 0
+#define FD_MNEMONIC(name,value) + 1
+#include <fadec-mnems.inc>
+#undef FD_MNEMONIC
+};
+
 /** Internal use only. **/
 enum {
     FD_FLAG_LOCK = 1 << 0,
     FD_FLAG_REP = 1 << 1,
     FD_FLAG_REPNZ = 1 << 2,
+    FD_FLAG_WIDE = 1 << 3,
     FD_FLAG_64 = 1 << 7,
 };
 
@@ -94,7 +119,7 @@ typedef struct {
     uint8_t addrsz;
     uint8_t operandsz;
     uint8_t size;
-    uint8_t _pad0;
+    uint8_t evex;
 
     FdOp operands[4];
 
@@ -104,6 +129,199 @@ typedef struct {
     uint64_t address;
 } FdInstr;
 
+/** Compact variant of FdInstr with a size of 32 bytes, which has no address and
+ * stores displacement and immediate as 32-bit values. Never(!) access struct
+ * fields directly. All macros defined below except for FD_ADDRESS, FD_OP_DISP,
+ * and FD_OP_IMM can be used; use FD_LITE_OP_DISP and FD_LITE_OP_IMM instead. **/
+typedef struct {
+    uint16_t type;
+    uint8_t flags;
+    uint8_t segment;
+    uint8_t addrsz;
+    uint8_t operandsz;
+    uint8_t size;
+    uint8_t evex;
+
+    FdOp operands[4];
+
+    // If FD_FLAG_WIDE is set, the only used displacement or immediate did not
+    // fit into 32 bits and is split into the low (disp) and high (imm) part.
+    int32_t disp;
+    int32_t imm;
+} FdInstrLite;
+
+/** Header of an instruction without operands, see fd_decode_header. Never(!)
+ * access struct fields directly. FD_TYPE, FD_SIZE, FD_SEGMENT, FD_HAS_REP,
+ * FD_HAS_REPNZ, FD_HAS_LOCK, and FD_IS64 can be used as for FdInstr. **/
+typedef struct {
+    uint16_t type;
+    uint8_t flags;
+    uint8_t segment;
+    uint8_t size;
+    // Offsets of the parts of the instruction, zero if absent.
+    uint8_t modrm_off;
+    uint8_t sib_off;
+    uint8_t disp_off;
+    uint8_t imm_off;
+} FdHeader;
+
+/** State of a streaming decoder, see fd_stream_init. Never(!) access struct
+ * fields directly. **/
+typedef struct {
+    const uint8_t* chunk;
+    size_t chunk_len;
+    size_t chunk_off;
+    uint64_t offset;
+    uint8_t mode;
+    uint8_t tail_len;
+    uint8_t tail[15];
+} FdStream;
+
+/** Entry of a decode cache. Never(!) access struct fields directly. **/
+typedef struct {
+    FdInstr instr;
+    uint64_t address;
+    uint8_t bytes[15];
+    uint8_t mode;
+} FdDecodeCacheEntry;
+
+/** Set-associative cache of decoded instructions, see fd_cache_init.
+ * Never(!) access struct fields directly. **/
+typedef struct {
+    uint64_t* tags;
+    FdDecodeCacheEntry* entries;
+    size_t set_mask;
+    unsigned ways;
+    unsigned next_victim;
+    uint64_t hits;
+    uint64_t misses;
+} FdDecodeCache;
+
+/** Kind of the last instruction of a basic block, see FdBlock. **/
+typedef enum {
+    /** The block continues at its end, which is the start of another block. **/
+    FD_BLOCK_FALLTHROUGH = 0,
+    /** Direct jump to target. **/
+    FD_BLOCK_JUMP,
+    /** Indirect or far jump. **/
+    FD_BLOCK_JUMP_INDIRECT,
+    /** Conditional jump (including LOOP, JCXZ, and XBEGIN) to target, otherwise
+     * the block continues at its end. **/
+    FD_BLOCK_COND,
+    /** Direct call to target, which is assumed to return to the end. **/
+    FD_BLOCK_CALL,
+    /** Indirect or far call, which is assumed to return to the end. **/
+    FD_BLOCK_CALL_INDIRECT,
+    /** Return (RET, RETF, IRET, SYSRET, SYSEXIT). **/
+    FD_BLOCK_RET,
+    /** Undefined instruction (UD0, UD1, UD2). **/
+    FD_BLOCK_TRAP,
+    /** The instruction at the end of the block cannot be decoded. **/
+    FD_BLOCK_INVALID,
+    /** The block runs into the end of the code region. **/
+    FD_BLOCK_END,
+} FdBlockKind;
+
+/** Basic block, see fd_cfg. All offsets are relative to the start of the code
+ * region. **/
+typedef struct {
+    /** Offset of the first instruction. **/
+    size_t start;
+    /** Offset after the last instruction, i.e. of the fall-through successor. **/
+    size_t end;
+    /** Offset of the branch target for FD_BLOCK_JUMP, FD_BLOCK_COND, and
+     * FD_BLOCK_CALL, otherwise zero. May be outside of the code region. **/
+    size_t target;
+    /** Kind of the last instruction, an FdBlockKind. **/
+    uint32_t kind;
+    /** Number of instructions in the block. **/
+    uint32_t count;
+} FdBlock;
+
+/** Fields checked by an FdOpPattern. **/
+enum {
+    /** Operand type is type. **/
+    FD_MATCH_OPTYPE = 1 << 0,
+    /** Operand size is size. **/
+    FD_MATCH_SIZE = 1 << 1,
+    /** Register operand with register type reg_type. **/
+    FD_MATCH_REGTYPE = 1 << 2,
+    /** Register operand with register reg, or memory operand with base register
+     * reg (FD_REG_NONE for no base register, FD_REG_IP for RIP-relative). **/
+    FD_MATCH_REG = 1 << 3,
+    /** Memory operand with index register index (FD_REG_NONE for none). **/
+    FD_MATCH_INDEX = 1 << 4,
+    /** Memory operand with a displacement in [min, max]. **/
+    FD_MATCH_DISP = 1 << 5,
+    /** Immediate or offset operand with a value in [min, max]. Offsets are
+     * relative to the end of the instruction, see FD_OT_OFF. **/
+    FD_MATCH_IMM = 1 << 6,
+};
+
+/** Predicate on an operand of an instruction, see FdPattern. **/
+typedef struct {
+    /** Fields to check, a combination of FD_MATCH_* flags. An entry where this
+     * is zero is unused. **/
+    uint8_t check;
+    /** Operand index, or -1 if any operand may satisfy the predicate. **/
+    int8_t idx;
+    /** Operand type (FdOpType) for FD_MATCH_OPTYPE. **/
+    uint8_t type;
+    /** Operand size in bytes for FD_MATCH_SIZE. **/
+    uint8_t size;
+    /** Register type (FdRegType) for FD_MATCH_REGTYPE. **/
+    uint8_t reg_type;
+    /** Register or base register (FdReg) for FD_MATCH_REG. **/
+    uint8_t reg;
+    /** Index register (FdReg) for FD_MATCH_INDEX. **/
+    uint8_t index;
+    /** Inclusive range of the value for FD_MATCH_DISP and FD_MATCH_IMM. **/
+    int64_t min;
+    int64_t max;
+} FdOpPattern;
+
+/** Instruction pattern, see fd_matcher_compile. **/
+typedef struct {
+    /** Instruction types (FdInstrType) to match. If type_count is zero, all
+     * instruction types match. **/
+    const uint16_t* types;
+    size_t type_count;
+    /** Predicates on operands, all of which must hold. **/
+    FdOpPattern ops[4];
+} FdPattern;
+
+/** Maximum number of patterns of a single FdMatcher. **/
+#define FD_MATCH_MAX_PATTERNS 32
+
+/** Compiled operand predicate. Never(!) access struct fields directly. **/
+typedef struct {
+    uint8_t check;
+    uint8_t op_mask;
+    uint8_t type_mask;
+    uint8_t size;
+    uint8_t reg_type;
+    uint8_t reg;
+    uint8_t index;
+    int64_t min;
+    int64_t max;
+} FdMatchOp;
+
+/** Compiled set of instruction patterns, see fd_matcher_compile. Never(!)
+ * access struct fields directly. **/
+typedef struct {
+    uint32_t type_patterns[FD_TYPE_COUNT];
+    uint32_t op_patterns;
+    FdMatchOp ops[FD_MATCH_MAX_PATTERNS][4];
+} FdMatcher;
+
+/** Instruction found by fd_match. **/
+typedef struct {
+    /** Offset of the instruction relative to the start of the buffer. **/
+    size_t offset;
+    /** Bitmask of the matching patterns, bit i corresponds to pattern i. **/
+    uint32_t patterns;
+} FdMatch;
+
 typedef enum {
     FD_ERR_UD = -1,
     FD_ERR_INTERNAL = -2,
@@ -129,6 +347,240 @@ typedef enum {
 int fd_decode(const uint8_t* buf, size_t len, int mode, uintptr_t address,
               FdInstr* out_instr);
 
+/** Decode an instruction in 32-bit mode; equivalent to fd_decode with mode 32.
+ * This variant is specialized for the mode and therefore slightly faster. If
+ * the library is built without support for 32-bit mode (archmode=only64), this
+ * always returns FD_ERR_INTERNAL. **/
+int fd_decode32(const uint8_t* buf, size_t len, uintptr_t address,
+                FdInstr* out_instr);
+
+/** Decode an instruction in 64-bit mode; equivalent to fd_decode with mode 64.
+ * This variant is specialized for the mode and therefore slightly faster. If
+ * the library is built without support for 64-bit mode (archmode=only32), this
+ * always returns FD_ERR_INTERNAL. **/
+int fd_decode64(const uint8_t* buf, size_t len, uintptr_t address,
+                FdInstr* out_instr);
+
+/** Decode a sequence of consecutive instructions.
+ * Decoding stops at the end of the buffer, after max instructions, or at the
+ * first instruction that cannot be decoded. In the latter case, the failing
+ * instruction starts at buf + *consumed and calling fd_decode there yields the
+ * error. Operands which require adding EIP/RIP are stored as FD_OT_OFF.
+ * \param buf Buffer for instruction bytes.
+ * \param len Length of the buffer (in bytes).
+ * \param mode Decoding mode, either 32 or 64, see fd_decode.
+ * \param out_instrs Array for decoded instructions, must hold max elements.
+ *        Note that the element after the last decoded instruction may get
+ *        partially written.
+ * \param max Maximum number of instructions to decode.
+ * \param consumed Pointer to store the number of bytes consumed by the decoded
+ *        instructions, i.e. the offset to resume decoding at. May be NULL.
+ * \return The number of decoded instructions. If mode is not supported, zero.
+ **/
+size_t fd_decode_block(const uint8_t* buf, size_t len, int mode,
+                       FdInstr* out_instrs, size_t max, size_t* consumed);
+
+/** Compute the length of an instruction without decoding its operands. This
+ * is faster than fd_decode and returns the same value for every input.
+ * \param buf Buffer for instruction bytes.
+ * \param len Length of the buffer (in bytes).
+ * \param mode Decoding mode, either 32 or 64, see fd_decode.
+ * \return The number of bytes of the instruction, or a negative number
+ *         indicating an error.
+ **/
+int fd_insn_length(const uint8_t* buf, size_t len, int mode);
+
+/** Decode an instruction into the compact FdInstrLite representation.
+ * Operands which require adding EIP/RIP are stored as FD_OT_OFF operands.
+ * \param buf Buffer for instruction bytes.
+ * \param len Length of the buffer (in bytes).
+ * \param mode Decoding mode, either 32 or 64, see fd_decode.
+ * \param out_instr Pointer to the instruction buffer. Note that this may get
+ *        partially written even if an error is returned.
+ * \return The number of bytes consumed by the instruction, or a negative number
+ *         indicating an error.
+ **/
+int fd_decode_lite(const uint8_t* buf, size_t len, int mode,
+                   FdInstrLite* out_instr);
+
+/** Decode a sequence of consecutive instructions into FdInstrLite structures.
+ * Parameters and return value are the same as for fd_decode_block. **/
+size_t fd_decode_block_lite(const uint8_t* buf, size_t len, int mode,
+                            FdInstrLite* out_instrs, size_t max,
+                            size_t* consumed);
+
+/** Expand a compact instruction into an FdInstr, e.g., for formatting.
+ * \param lite The compact instruction.
+ * \param out_instr Pointer to the instruction buffer.
+ **/
+void fd_lite_expand(const FdInstrLite* lite, FdInstr* out_instr);
+
+/** Decode only the header of an instruction, i.e. its length, type, and
+ * prefixes, and the offsets of ModRM byte, SIB byte, displacement, and
+ * immediate. This skips all operand work and is therefore faster than
+ * fd_decode, but returns the same length or error for every input.
+ * \param buf Buffer for instruction bytes.
+ * \param len Length of the buffer (in bytes).
+ * \param mode Decoding mode, either 32 or 64, see fd_decode.
+ * \param out_hdr Pointer to the header buffer. Note that this may get
+ *        partially written even if an error is returned.
+ * \return The number of bytes of the instruction, or a negative number
+ *         indicating an error.
+ **/
+int fd_decode_header(const uint8_t* buf, size_t len, int mode,
+                     FdHeader* out_hdr);
+
+/** Decode the full instruction for a header from fd_decode_header. This is
+ * equivalent to fd_decode with address 0 on the same bytes.
+ * \param buf Buffer for instruction bytes, at least FD_SIZE(hdr) bytes long.
+ * \param hdr The header of the instruction.
+ * \param out_instr Pointer to the instruction buffer.
+ * \return The number of bytes of the instruction.
+ **/
+int fd_header_expand(const uint8_t* buf, const FdHeader* hdr,
+                     FdInstr* out_instr);
+
+/** Perform a linear sweep over a code region and mark the start of every
+ * decoded instruction in a bitmap. Decoding starts at the beginning of the
+ * buffer; when an instruction cannot be decoded, one byte is skipped.
+ * \param buf Buffer for instruction bytes.
+ * \param len Length of the buffer (in bytes).
+ * \param mode Decoding mode, either 32 or 64, see fd_decode.
+ * \param out_starts Bitmap with at least (len+7)/8 bytes. Bit i%8 of byte i/8 is
+ *        set iff an instruction starts at offset i; all other bits are cleared.
+ * \return The number of decoded instructions.
+ **/
+size_t fd_sweep(const uint8_t* buf, size_t len, int mode, uint8_t* out_starts);
+
+/** Build the control flow graph of a code region by recursive descent from a
+ * set of entry points. Direct jumps, conditional jumps and calls are followed;
+ * blocks end at branches, returns, undefined instructions, and undecodable
+ * instructions. Branch targets within other blocks split these blocks, so that
+ * every instruction belongs to exactly one block (unless the code contains
+ * overlapping instructions). Targets outside of the code region are not
+ * followed.
+ * \param buf Buffer for instruction bytes.
+ * \param len Length of the buffer (in bytes).
+ * \param mode Decoding mode, either 32 or 64, see fd_decode.
+ * \param entries Offsets of the entry points. Entries outside of the code
+ *        region are ignored.
+ * \param entry_count Number of entry points.
+ * \param visited Bitmap with at least (len+7)/8 bytes, see fd_sweep. It is set
+ *        to the start offsets of all reached instructions, so every instruction
+ *        is decoded only once.
+ * \param out_blocks Array for the basic blocks, which are sorted by their start
+ *        offset. Also used as worklist during the traversal.
+ * \param max_blocks Number of elements of out_blocks.
+ * \return The number of basic blocks, or zero if out_blocks is too small.
+ **/
+size_t fd_cfg(const uint8_t* buf, size_t len, int mode, const size_t* entries,
+              size_t entry_count, uint8_t* visited, FdBlock* out_blocks,
+              size_t max_blocks);
+
+/** Compile a set of instruction patterns into a matcher for fd_match. An
+ * instruction matches a pattern if its type is one of the types of the pattern
+ * and all operand predicates hold.
+ * \param matcher The matcher to initialize.
+ * \param patterns Array of patterns; not referenced after compilation.
+ * \param count Number of patterns, at most FD_MATCH_MAX_PATTERNS.
+ * \return Zero, or FD_ERR_INTERNAL if there are too many patterns, a type is
+ *         out of range, or an operand predicate can never hold.
+ **/
+int fd_matcher_compile(FdMatcher* matcher, const FdPattern* patterns,
+                       size_t count);
+
+/** Find instructions matching the patterns of a matcher with a linear sweep
+ * over a code region. Only the header of every instruction is decoded (see
+ * fd_decode_header); operands are only decoded when the type matches a pattern
+ * with operand predicates. When an instruction cannot be decoded, one byte is
+ * skipped, as in fd_sweep.
+ * \param matcher The compiled matcher.
+ * \param buf Buffer for instruction bytes.
+ * \param len Length of the buffer (in bytes).
+ * \param mode Decoding mode, either 32 or 64, see fd_decode.
+ * \param out_matches Array for matching instructions, must hold max elements.
+ * \param max Maximum number of matches to return.
+ * \param consumed Pointer to store the offset to resume the search at, which
+ *        is after the last returned match if max matches were found and len
+ *        otherwise. May be NULL.
+ * \return The number of matches. If mode is not supported, zero.
+ **/
+size_t fd_match(const FdMatcher* matcher, const uint8_t* buf, size_t len,
+                int mode, FdMatch* out_matches, size_t max, size_t* consumed);
+
+/** Initialize a streaming decoder, which decodes instructions from a sequence
+ * of chunks, where instructions may straddle chunk boundaries.
+ * \param stream The stream state.
+ * \param mode Decoding mode, either 32 or 64, see fd_decode.
+ **/
+void fd_stream_init(FdStream* stream, int mode);
+
+/** Provide the next chunk of instruction bytes to a streaming decoder. Must
+ * only be called after initialization or after fd_stream_next returned zero.
+ * The buffer must remain valid until fd_stream_next returns zero again.
+ * \param stream The stream state.
+ * \param buf Buffer for instruction bytes.
+ * \param len Length of the buffer (in bytes).
+ **/
+void fd_stream_feed(FdStream* stream, const uint8_t* buf, size_t len);
+
+/** Decode the next instruction of a stream. Instructions are decoded directly
+ * from the chunk; only bytes of an instruction which straddles a chunk
+ * boundary are copied. Use FD_STREAM_OFFSET to get the stream offset of the
+ * instruction before calling this function.
+ * \param stream The stream state.
+ * \param out_instr Pointer to the instruction buffer, see fd_decode.
+ * \return The number of bytes consumed by the instruction; zero, if more input
+ *         is required (remaining bytes are stored in the stream state); or a
+ *         negative number indicating an error. In the last case, the stream is
+ *         not advanced, use fd_stream_skip to continue.
+ **/
+int fd_stream_next(FdStream* stream, FdInstr* out_instr);
+
+/** Skip bytes of a stream, e.g. after an error. At most the bytes of the
+ * current chunk and the bytes kept from previous chunks are skipped.
+ * \param stream The stream state.
+ * \param count Number of bytes to skip.
+ **/
+void fd_stream_skip(FdStream* stream, size_t count);
+
+/** Initialize a cache of decoded instructions in caller-provided memory.
+ * \param cache The cache state.
+ * \param mem Memory for cache entries, aligned to 8 bytes.
+ * \param mem_size Size of the memory. Every entry requires FD_CACHE_ENTRY_SIZE
+ *        bytes; the number of sets is the largest power of two such that all
+ *        entries fit into the memory.
+ * \param ways Associativity, e.g. 1 for a direct-mapped cache.
+ * \return Zero on success, or FD_ERR_INTERNAL if mem is not sufficiently aligned
+ *         or too small for a single set.
+ **/
+int fd_cache_init(FdDecodeCache* cache, void* mem, size_t mem_size,
+                  unsigned ways);
+
+/** Decode an instruction using the cache. Instructions are looked up by address
+ * and mode; a cached instruction is only used if its bytes match the buffer.
+ * On a miss, the instruction is decoded with fd_decode and inserted into the
+ * cache. Errors are not cached.
+ * \param cache The cache state.
+ * \param buf Buffer for instruction bytes.
+ * \param len Length of the buffer (in bytes).
+ * \param mode Decoding mode, either 32 or 64, see fd_decode.
+ * \param address Virtual address of the instruction, used as key only. The
+ *        instruction itself is decoded with address 0, see fd_decode.
+ * \param out_instr Pointer to the instruction buffer.
+ * \return Same as fd_decode.
+ **/
+int fd_cache_decode(FdDecodeCache* cache, const uint8_t* buf, size_t len,
+                    int mode, uint64_t address, FdInstr* out_instr);
+
+/** Remove all cached instructions which overlap with an address range, e.g.
+ * after the code was modified.
+ * \param cache The cache state.
+ * \param address Start of the address range.
+ * \param len Length of the address range.
+ **/
+void fd_cache_invalidate(FdDecodeCache* cache, uint64_t address, uint64_t len);
+
 /** Format an instruction to a string.
  * \param instr The instruction.
  * \param buf The buffer to hold the formatted string.
@@ -147,6 +599,40 @@ void fd_format(const FdInstr* instr, char* buf, size_t len);
  **/
 void fd_format_abs(const FdInstr* instr, uint64_t addr, char* buf, size_t len);
 
+/** Format an instruction to a string and return the length of the string.
+ * NOTE: API stability is currently not guaranteed for this function; its name
+ * and/or signature may change in future.
+ *
+ * \param instr The instruction.
+ * \param addr The base address to use for printing FD_OT_OFF operands.
+ * \param buf The buffer to hold the formatted string.
+ * \param len The length of the buffer.
+ * \return The number of characters written, excluding the terminating null
+ *         character. If the string was truncated, this is len - 1.
+ **/
+size_t fd_format_ex(const FdInstr* instr, uint64_t addr, char* buf, size_t len);
+
+/** Format a sequence of consecutive instructions into a single string, where
+ * every instruction is followed by a separator.
+ * NOTE: API stability is currently not guaranteed for this function; its name
+ * and/or signature may change in future.
+ *
+ * \param instrs The instructions, e.g. from fd_decode_block.
+ * \param count The number of instructions.
+ * \param addr The address of the first instruction, used for printing
+ *        FD_OT_OFF operands. The address is advanced by the instruction sizes.
+ * \param sep The separator, e.g. "\n".
+ * \param buf The buffer to hold the formatted string.
+ * \param len The length of the buffer.
+ * \param formatted Pointer to store the number of formatted instructions. Only
+ *        complete instructions and separators are written. May be NULL.
+ * \return The number of characters written, excluding the terminating null
+ *         character, which is written if len is non-zero.
+ **/
+size_t fd_format_block(const FdInstr* instrs, size_t count, uint64_t addr,
+                       const char* sep, char* buf, size_t len,
+                       size_t* formatted);
+
 /** Get the stringified name of an instruction type.
  * NOTE: API stability is currently not guaranteed for this function; changes
  * to the signature and/or the returned string can be expected. E.g., a future
@@ -159,6 +645,129 @@ void fd_format_abs(const FdInstr* instr, uint64_t addr, char* buf, size_t len);
  **/
 const char* fdi_name(FdInstrType ty);
 
+/** Bits of the register masks of fd_instr_regs: general purpose registers at
+ * bits 0-15, vector registers at bits 16-47, mask registers at bits 48-55, and
+ * MMX registers at bits 56-63. High-byte registers are part of rAX-rBX. **/
+#define FD_REGMASK_GP(reg) ((uint64_t) 1 << (reg))
+#define FD_REGMASK_VEC(reg) ((uint64_t) 1 << (16 + (reg)))
+#define FD_REGMASK_MASK(reg) ((uint64_t) 1 << (48 + (reg)))
+#define FD_REGMASK_MMX(reg) ((uint64_t) 1 << (56 + (reg)))
+
+/** Status flags in the flag masks of fd_instr_regs, at their EFLAGS bit. **/
+enum {
+    FD_EFL_CF = 1 << 0,
+    FD_EFL_PF = 1 << 2,
+    FD_EFL_AF = 1 << 4,
+    FD_EFL_ZF = 1 << 6,
+    FD_EFL_SF = 1 << 7,
+    FD_EFL_TF = 1 << 8,
+    FD_EFL_IF = 1 << 9,
+    FD_EFL_DF = 1 << 10,
+    FD_EFL_OF = 1 << 11,
+};
+
+/** Get the registers and status flags read and written by an instruction,
+ * including implicit ones (e.g., rDX:rAX for MUL, rSI/rDI/rCX for REP MOVS)
+ * and registers used for addressing memory. Writes to 8/16-bit general purpose
+ * registers and merge-masked vector registers are also reads, as parts of the
+ * register remain; undefined flags count as written, and flags that are kept
+ * for some operands (e.g., a shift count of 0) count as read and written.
+ * Segment, control, debug, bound, and x87 registers as well as the instruction
+ * pointer are not tracked.
+ * This only consults a small table, fd_decode is not affected.
+ *
+ * \param instr The instruction.
+ * \param read_mask Pointer to store the registers read, see FD_REGMASK_GP.
+ * \param write_mask Pointer to store the registers written.
+ * \param flags_rw Pointer to store the flags read (bits 0-15) and written
+ *        (bits 16-31), see FD_EFL_CF.
+ **/
+void fd_instr_regs(const FdInstr* instr, uint64_t* read_mask,
+                   uint64_t* write_mask, uint32_t* flags_rw);
+
+/** Opcode escapes, indices of FdStats.escape. **/
+enum {
+    FD_STAT_ESC_NONE = 0,
+    FD_STAT_ESC_0F,
+    FD_STAT_ESC_0F38,
+    FD_STAT_ESC_0F3A,
+    FD_STAT_ESC_VEX2,
+    FD_STAT_ESC_VEX3,
+    FD_STAT_ESC_EVEX,
+    FD_STAT_ESC_COUNT,
+};
+
+/** Reasons for decode errors, indices of FdStats.errors. **/
+enum {
+    /** FD_ERR_PARTIAL: buffer ends in prefixes or the opcode escape. **/
+    FD_STAT_ERR_PARTIAL_PREFIX = 0,
+    /** FD_ERR_PARTIAL: buffer ends in the opcode. **/
+    FD_STAT_ERR_PARTIAL_OPCODE,
+    /** FD_ERR_PARTIAL: buffer ends in ModRM, SIB, or displacement. **/
+    FD_STAT_ERR_PARTIAL_MODRM,
+    /** FD_ERR_PARTIAL: buffer ends in the immediate or memory offset. **/
+    FD_STAT_ERR_PARTIAL_IMM,
+    /** FD_ERR_UD: VEX/EVEX with legacy prefixes or reserved bits. **/
+    FD_STAT_ERR_UD_PREFIX,
+    /** FD_ERR_UD: no instruction with this opcode. **/
+    FD_STAT_ERR_UD_OPCODE,
+    /** FD_ERR_UD: EVEX rounding, broadcast, or vector length not supported. **/
+    FD_STAT_ERR_UD_EVEX,
+    /** FD_ERR_UD: invalid operand encoding, e.g. VSIB without SIB byte. **/
+    FD_STAT_ERR_UD_OPERAND,
+    /** FD_ERR_UD: LOCK prefix not allowed. **/
+    FD_STAT_ERR_UD_LOCK,
+    FD_STAT_ERR_COUNT,
+};
+
+/** Counters of the paths taken by the decoder, see fd_stats. Except for
+ * decoded and errors, instructions are counted once they reach the respective
+ * step, even if decoding fails later on. **/
+typedef struct {
+    /** Successfully decoded instructions. **/
+    uint64_t decoded;
+    /** Failed decodes by reason, see FD_STAT_ERR_PARTIAL_PREFIX. **/
+    uint64_t errors[FD_STAT_ERR_COUNT];
+    /** Instructions with 0, 1, 2, and 3 or more prefix bytes (including REX). **/
+    uint64_t prefix_bytes[4];
+    /** Instructions with the respective prefix; for REX and REP/REPNZ/segment
+     * overrides, only the effective prefix is counted. **/
+    uint64_t prefix_66;
+    uint64_t prefix_67;
+    uint64_t prefix_lock;
+    uint64_t prefix_rep;
+    uint64_t prefix_repnz;
+    uint64_t prefix_seg;
+    uint64_t prefix_rex;
+    /** Instructions by opcode escape, see FD_STAT_ESC_NONE. **/
+    uint64_t escape[FD_STAT_ESC_COUNT];
+    /** Instructions by number of table lookups; 0 is the fast descriptor path
+     * for one-byte and 0f opcodes. **/
+    uint64_t walk_depth[7];
+    /** Table entries for mandatory prefixes, ModRM.reg, ModRM.rm with mod=3,
+     * and VEX.W/VEX.L encountered during table lookups. **/
+    uint64_t table_prefix;
+    uint64_t table16;
+    uint64_t table8e;
+    uint64_t table_vex;
+    /** Memory operands in ModRM with SIB byte. **/
+    uint64_t sib;
+    /** Memory operands in ModRM without, with 8-bit, and with 32-bit
+     * displacement. **/
+    uint64_t disp[3];
+} FdStats;
+
+/** Get the decoder statistics of the calling thread, which count all decodes
+ * performed by fd_decode and functions using it since the start of the thread;
+ * compute differences of two snapshots to measure a region. fd_insn_length and
+ * fd_sweep are not counted. The counters are only available if the library is
+ * built with the meson option with_stats; otherwise, decoding is not affected.
+ * \param out_stats Pointer to store the counters.
+ * \return Zero on success, or FD_ERR_INTERNAL if built without statistics, in
+ *         which case all counters are zero.
+ **/
+int fd_stats(FdStats* out_stats);
+
 
 /** Gets the type/mnemonic of the instruction.
  * ABI STABILITY NOTE: different versions or builds of the library may use
@@ -238,6 +847,60 @@ const char* fdi_name(FdInstrType ty);
 /** Gets the (sign-extended) encoded constant for an immediate operand.
  * Only valid if  FD_OP_TYPE == FD_OT_IMM  or  FD_OP_TYPE == FD_OT_OFF  **/
 #define FD_OP_IMM(instr,idx) ((instr)->imm)
+/** Gets the element size in bytes of a broadcast memory operand (EVEX.b), or
+ * zero if the operand is not broadcast. FD_OP_SIZE still returns the size of
+ * the full vector. **/
+#define FD_OP_BCSTSZ(instr,idx) ((instr)->evex & 0x80 && \
+                                 FD_OP_TYPE(instr,idx) == FD_OT_MEM ? \
+                                 2 << ((instr)->evex >> 4 & 7) : 0)
+
+/** Gets the opmask register of an EVEX-encoded instruction, where 0 means that
+ * the instruction is not masked. Always 0 for other instructions. **/
+#define FD_MASKREG(instr) ((instr)->evex & 7)
+/** Indicates whether masked elements are zeroed instead of merged (EVEX.z). **/
+#define FD_MASKZERO(instr) ((instr)->evex >> 3 & 1)
+/** Gets the static rounding control/exception suppression of an EVEX-encoded
+ * instruction with register operands, see FdRoundControl. **/
+#define FD_ROUNDCONTROL(instr) ((FdRoundControl) ((instr)->evex & 0x80 ? 0 : \
+                                                  (instr)->evex >> 4 & 7))
+
+/** Do not use. **/
+#define FD_LITE_WIDE(instr) ((int64_t) ((uint64_t) (uint32_t) (instr)->disp | \
+                                        (uint64_t) (uint32_t) (instr)->imm << 32))
+/** Gets the sign-extended displacement of a memory operand of an FdInstrLite.
+ * Only valid if  FD_OP_TYPE == FD_OT_MEM  **/
+#define FD_LITE_OP_DISP(instr,idx) ((instr)->flags & FD_FLAG_WIDE ? \
+                                    FD_LITE_WIDE(instr) : (int64_t) (instr)->disp)
+/** Gets the (sign-extended) encoded constant for an immediate operand of an
+ * FdInstrLite.
+ * Only valid if  FD_OP_TYPE == FD_OT_IMM  or  FD_OP_TYPE == FD_OT_OFF  **/
+#define FD_LITE_OP_IMM(instr,idx) ((instr)->flags & FD_FLAG_WIDE ? \
+                                   FD_LITE_WIDE(instr) : (int64_t) (instr)->imm)
+
+/** Gets the offset of the ModRM byte of an FdHeader, or zero if absent. **/
+#define FD_HDR_MODRM_OFF(hdr) ((hdr)->modrm_off)
+/** Gets the offset of the SIB byte of an FdHeader, or zero if absent. **/
+#define FD_HDR_SIB_OFF(hdr) ((hdr)->sib_off)
+/** Gets the offset of the displacement of an FdHeader, or zero if absent. This
+ * includes the memory offset of MOV with moffs operand. **/
+#define FD_HDR_DISP_OFF(hdr) ((hdr)->disp_off)
+/** Gets the offset of the immediate of an FdHeader, or zero if absent. The
+ * immediate extends up to the end of the instruction. **/
+#define FD_HDR_IMM_OFF(hdr) ((hdr)->imm_off)
+
+/** Size of memory required per cache entry, see fd_cache_init. **/
+#define FD_CACHE_ENTRY_SIZE (sizeof(FdDecodeCacheEntry) + sizeof(uint64_t))
+/** Gets the number of cache hits. **/
+#define FD_CACHE_HITS(cache) ((cache)->hits)
+/** Gets the number of cache misses. **/
+#define FD_CACHE_MISSES(cache) ((cache)->misses)
+
+/** Gets the offset of the next instruction of a stream, i.e. the number of
+ * bytes consumed or skipped so far. **/
+#define FD_STREAM_OFFSET(stream) ((stream)->offset)
+/** Gets the number of bytes kept from previous chunks, i.e. the length of a
+ * trailing incomplete instruction after the stream ended. **/
+#define FD_STREAM_PENDING(stream) ((stream)->tail_len)
 
 #ifdef __cplusplus
 }
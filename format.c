@@ -6,87 +6,182 @@
 #include <fadec.h>
 
 
-static const char*
-reg_name(unsigned rt, unsigned ri, unsigned size)
-{
-    unsigned max;
-    const char (* table)[6];
-
-#define TABLE(name, ...) \
-        case name: { \
-            static const char tab[][6] = { __VA_ARGS__ }; \
-            table = tab; max = sizeof(tab) / sizeof(*tab); \
-            break; \
-        }
+// Upper bound for the length of a formatted instruction (the longest possible
+// string has less than 250 characters), plus slack for 8-byte register name
+// stores. Formatting writes into a buffer of this size without bounds checks.
+#define FMT_BUF_SIZE 272
+
+#define FD_STRPCAT(buf, lit) \
+        (__builtin_memcpy(buf, lit, sizeof(lit) - 1), buf += sizeof(lit) - 1)
+
+// Register names are 8 bytes long, including the length in the last byte, so
+// that they can be copied with a single (unaligned) store.
+struct RegName {
+    char str[7];
+    uint8_t len;
+};
 
+#define R(name) { name, sizeof(name) - 1 }
+static const struct RegName reg_names[] = {
+    // GPL1
+    R("al"),R("cl"),R("dl"),R("bl"),R("spl"),R("bpl"),R("sil"),R("dil"),
+    R("r8b"),R("r9b"),R("r10b"),R("r11b"),R("r12b"),R("r13b"),R("r14b"),
+    R("r15b"),
+    // GPL2
+    R("ax"),R("cx"),R("dx"),R("bx"),R("sp"),R("bp"),R("si"),R("di"),R("r8w"),
+    R("r9w"),R("r10w"),R("r11w"),R("r12w"),R("r13w"),R("r14w"),R("r15w"),
+    R("ip"),
+    // GPL4
+    R("eax"),R("ecx"),R("edx"),R("ebx"),R("esp"),R("ebp"),R("esi"),R("edi"),
+    R("r8d"),R("r9d"),R("r10d"),R("r11d"),R("r12d"),R("r13d"),R("r14d"),
+    R("r15d"),R("eip"),
+    // GPL8
+    R("rax"),R("rcx"),R("rdx"),R("rbx"),R("rsp"),R("rbp"),R("rsi"),R("rdi"),
+    R("r8"),R("r9"),R("r10"),R("r11"),R("r12"),R("r13"),R("r14"),R("r15"),
+    R("rip"),
+    // GPH
+    R("(inv)"),R("(inv)"),R("(inv)"),R("(inv)"),R("ah"),R("ch"),R("dh"),R("bh"),
+    // SEG
+    R("es"),R("cs"),R("ss"),R("ds"),R("fs"),R("gs"),
+    // FPU
+    R("st(0)"),R("st(1)"),R("st(2)"),R("st(3)"),R("st(4)"),R("st(5)"),
+    R("st(6)"),R("st(7)"),
+    // MMX
+    R("mm0"),R("mm1"),R("mm2"),R("mm3"),R("mm4"),R("mm5"),R("mm6"),R("mm7"),
+    // CR
+    R("cr0"),R("(inv)"),R("cr2"),R("cr3"),R("cr4"),R("(inv)"),R("(inv)"),
+    R("(inv)"),R("cr8"),
+    // DR
+    R("dr0"),R("dr1"),R("dr2"),R("dr3"),R("dr4"),R("dr5"),R("dr6"),R("dr7"),
+    // BND
+    R("bnd0"),R("bnd1"),R("bnd2"),R("bnd3"),
+    // XMM
+    R("xmm0"),R("xmm1"),R("xmm2"),R("xmm3"),R("xmm4"),R("xmm5"),R("xmm6"),
+    R("xmm7"),R("xmm8"),R("xmm9"),R("xmm10"),R("xmm11"),R("xmm12"),R("xmm13"),
+    R("xmm14"),R("xmm15"),R("xmm16"),R("xmm17"),R("xmm18"),R("xmm19"),
+    R("xmm20"),R("xmm21"),R("xmm22"),R("xmm23"),R("xmm24"),R("xmm25"),
+    R("xmm26"),R("xmm27"),R("xmm28"),R("xmm29"),R("xmm30"),R("xmm31"),
+    // YMM
+    R("ymm0"),R("ymm1"),R("ymm2"),R("ymm3"),R("ymm4"),R("ymm5"),R("ymm6"),
+    R("ymm7"),R("ymm8"),R("ymm9"),R("ymm10"),R("ymm11"),R("ymm12"),R("ymm13"),
+    R("ymm14"),R("ymm15"),R("ymm16"),R("ymm17"),R("ymm18"),R("ymm19"),
+    R("ymm20"),R("ymm21"),R("ymm22"),R("ymm23"),R("ymm24"),R("ymm25"),
+    R("ymm26"),R("ymm27"),R("ymm28"),R("ymm29"),R("ymm30"),R("ymm31"),
+    // ZMM
+    R("zmm0"),R("zmm1"),R("zmm2"),R("zmm3"),R("zmm4"),R("zmm5"),R("zmm6"),
+    R("zmm7"),R("zmm8"),R("zmm9"),R("zmm10"),R("zmm11"),R("zmm12"),R("zmm13"),
+    R("zmm14"),R("zmm15"),R("zmm16"),R("zmm17"),R("zmm18"),R("zmm19"),
+    R("zmm20"),R("zmm21"),R("zmm22"),R("zmm23"),R("zmm24"),R("zmm25"),
+    R("zmm26"),R("zmm27"),R("zmm28"),R("zmm29"),R("zmm30"),R("zmm31"),
+    // MASK
+    R("k0"),R("k1"),R("k2"),R("k3"),R("k4"),R("k5"),R("k6"),R("k7"),
+};
+#undef R
+
+enum {
+    REG_NAMES_GPL1 = 0,
+    REG_NAMES_GPL2 = 16,
+    REG_NAMES_GPL4 = 33,
+    REG_NAMES_GPL8 = 50,
+    REG_NAMES_GPH = 67,
+    REG_NAMES_SEG = 75,
+    REG_NAMES_FPU = 81,
+    REG_NAMES_MMX = 89,
+    REG_NAMES_CR = 97,
+    REG_NAMES_DR = 106,
+    REG_NAMES_BND = 114,
+    REG_NAMES_XMM = 118,
+    REG_NAMES_YMM = 150,
+    REG_NAMES_ZMM = 182,
+    REG_NAMES_MASK = 214,
+};
+
+static char*
+fd_format_reg(char* buf, unsigned rt, unsigned ri, unsigned size)
+{
+    unsigned base, max;
     switch (rt) {
-    default: return "(inv-ty)";
+    default: FD_STRPCAT(buf, "(inv-ty)"); return buf;
     case FD_RT_GPL:
         switch (size) {
-        default: return "(inv-sz)";
-        TABLE(1,
-            "al","cl","dl","bl","spl","bpl","sil","dil",
-            "r8b","r9b","r10b","r11b","r12b","r13b","r14b","r15b")
-        TABLE(2,
-            "ax","cx","dx","bx","sp","bp","si","di",
-            "r8w","r9w","r10w","r11w","r12w","r13w","r14w","r15w","ip")
-        TABLE(4,
-            "eax","ecx","edx","ebx","esp","ebp","esi","edi",
-            "r8d","r9d","r10d","r11d","r12d","r13d","r14d","r15d","eip")
-        TABLE(8,
-            "rax","rcx","rdx","rbx","rsp","rbp","rsi","rdi",
-            "r8","r9","r10","r11","r12","r13","r14","r15","rip")
+        default: FD_STRPCAT(buf, "(inv-sz)"); return buf;
+        case 1: base = REG_NAMES_GPL1, max = 16; break;
+        case 2: base = REG_NAMES_GPL2, max = 17; break;
+        case 4: base = REG_NAMES_GPL4, max = 17; break;
+        case 8: base = REG_NAMES_GPL8, max = 17; break;
         }
         break;
-
-    TABLE(FD_RT_GPH, "(inv)","(inv)","(inv)","(inv)","ah","ch","dh","bh")
-    TABLE(FD_RT_SEG, "es","cs","ss","ds","fs","gs")
-    TABLE(FD_RT_FPU, "st(0)","st(1)","st(2)","st(3)","st(4)","st(5)","st(6)","st(7)")
-    TABLE(FD_RT_MMX, "mm0","mm1","mm2","mm3","mm4","mm5","mm6","mm7")
-    TABLE(FD_RT_CR, "cr0","(inv)","cr2","cr3","cr4","(inv)","(inv)","(inv)","cr8")
-    TABLE(FD_RT_DR, "dr0","dr1","dr2","dr3","dr4","dr5","dr6","dr7")
-    TABLE(FD_RT_BND, "bnd0","bnd1","bnd2","bnd3")
-
+    case FD_RT_GPH: base = REG_NAMES_GPH, max = 8; break;
+    case FD_RT_SEG: base = REG_NAMES_SEG, max = 6; break;
+    case FD_RT_FPU: base = REG_NAMES_FPU, max = 8; break;
+    case FD_RT_MMX: base = REG_NAMES_MMX, max = 8; break;
+    case FD_RT_CR: base = REG_NAMES_CR, max = 9; break;
+    case FD_RT_DR: base = REG_NAMES_DR, max = 8; break;
+    case FD_RT_BND: base = REG_NAMES_BND, max = 4; break;
+    case FD_RT_MASK: base = REG_NAMES_MASK, max = 8; break;
     case FD_RT_VEC:
         switch (size) {
-        default: return "(inv-sz)";
-        case 1:
-        case 2:
-        case 4:
-        case 8:
-        TABLE(16,
-            "xmm0","xmm1","xmm2","xmm3","xmm4","xmm5","xmm6","xmm7",
-            "xmm8","xmm9","xmm10","xmm11","xmm12","xmm13","xmm14","xmm15")
-        TABLE(32,
-            "ymm0","ymm1","ymm2","ymm3","ymm4","ymm5","ymm6","ymm7",
-            "ymm8","ymm9","ymm10","ymm11","ymm12","ymm13","ymm14","ymm15")
+        default: FD_STRPCAT(buf, "(inv-sz)"); return buf;
+        case 1: case 2: case 4: case 8: case 16:
+            base = REG_NAMES_XMM, max = 32; break;
+        case 32: base = REG_NAMES_YMM, max = 32; break;
+        case 64: base = REG_NAMES_ZMM, max = 32; break;
         }
         break;
     }
 
-    return ri < max ? table[ri] : "(inv-idx)";
+    if (ri >= max) {
+        FD_STRPCAT(buf, "(inv-idx)");
+        return buf;
+    }
+    const struct RegName* name = &reg_names[base + ri];
+    __builtin_memcpy(buf, name, 8);
+    return buf + name->len;
+}
+
+static char*
+fd_strpcat(char* buf, const char* src)
+{
+    while (*src)
+        *buf++ = *src++;
+    return buf;
 }
 
 static char*
-fd_strplcpy(char* dst, const char* src, size_t size)
+fd_format_hex(char* buf, uint64_t val)
 {
-    while (*src && size > 1)
-        *dst++ = *src++, size--;
-    if (size)
-        *dst = 0;
-    return dst;
+    static const char digits2[512] =
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+    "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+    "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+    "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+    "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+    unsigned digits = (64 - __builtin_clzll(val | 1) + 3) / 4;
+    *buf++ = '0';
+    *buf++ = 'x';
+    char* cur = buf + digits;
+    for (; cur - buf >= 2; val >>= 8, cur -= 2)
+        __builtin_memcpy(cur - 2, &digits2[2 * (val & 0xff)], 2);
+    if (cur != buf)
+        *buf = digits2[2 * val + 1];
+    return buf + digits;
 }
 
 static char*
-fd_format_hex(uint64_t val, char buf[static 19]) {
-    unsigned idx = 19;
-    buf[--idx] = 0;
-    do {
-        buf[--idx] = "0123456789abcdef"[val % 16];
-        val /= 16;
-    } while (val);
-    buf[--idx] = 'x', buf[--idx] = '0';
-    return &buf[idx];
+fd_format_rc(char* buf, FdRoundControl rc)
+{
+    switch (rc) {
+    default: return buf;
+    case FD_RC_RN: FD_STRPCAT(buf, ", {rn-sae}"); return buf;
+    case FD_RC_RD: FD_STRPCAT(buf, ", {rd-sae}"); return buf;
+    case FD_RC_RU: FD_STRPCAT(buf, ", {ru-sae}"); return buf;
+    case FD_RC_RZ: FD_STRPCAT(buf, ", {rz-sae}"); return buf;
+    case FD_RC_SAE: FD_STRPCAT(buf, ", {sae}"); return buf;
+    }
 }
 
 const char*
@@ -108,19 +203,9 @@ fdi_name(FdInstrType ty) {
     return &mnemonic_str[mnemonic_offs[ty]];
 }
 
-void
-fd_format(const FdInstr* instr, char* buffer, size_t len)
-{
-    fd_format_abs(instr, 0, buffer, len);
-}
-
-void
-fd_format_abs(const FdInstr* instr, uint64_t addr, char* buffer, size_t len)
+static char*
+fd_format_impl(const FdInstr* instr, uint64_t addr, char* buf)
 {
-    char tmp[21];
-
-    char* buf = buffer;
-    char* end = buffer + len;
 
     const char* mnemonic = fdi_name(FD_TYPE(instr));
 
@@ -230,44 +315,46 @@ fd_format_abs(const FdInstr* instr, uint64_t addr, char* buffer, size_t len)
 
     if (prefix_xacq_xrel || FD_HAS_LOCK(instr)) {
         if (FD_HAS_REP(instr))
-            buf = fd_strplcpy(buf, "xrelease ", end-buf);
+            FD_STRPCAT(buf, "xrelease ");
         if (FD_HAS_REPNZ(instr))
-            buf = fd_strplcpy(buf, "xacquire ", end-buf);
+            FD_STRPCAT(buf, "xacquire ");
     } else if (prefix_rep) {
         if (FD_HAS_REP(instr))
-            buf = fd_strplcpy(buf, "rep ", end-buf);
+            FD_STRPCAT(buf, "rep ");
         if (FD_HAS_REPNZ(instr))
-            buf = fd_strplcpy(buf, "repnz ", end-buf);
+            FD_STRPCAT(buf, "repnz ");
     }
     if (FD_HAS_LOCK(instr))
-        buf = fd_strplcpy(buf, "lock ", end-buf);
+        FD_STRPCAT(buf, "lock ");
     if (prefix_addrsize) {
         if (FD_IS64(instr) && FD_ADDRSIZE(instr) == 4)
-            buf = fd_strplcpy(buf, "addr32 ", end-buf);
+            FD_STRPCAT(buf, "addr32 ");
         if (!FD_IS64(instr) && FD_ADDRSIZE(instr) == 2)
-            buf = fd_strplcpy(buf, "addr16 ", end-buf);
+            FD_STRPCAT(buf, "addr16 ");
     }
     if (prefix_segment && FD_SEGMENT(instr) != FD_REG_NONE) {
-        buf = fd_strplcpy(buf, reg_name(FD_RT_SEG, FD_SEGMENT(instr), 2), end-buf);
-        buf = fd_strplcpy(buf, " ", end-buf);
+        buf = fd_format_reg(buf, FD_RT_SEG, FD_SEGMENT(instr), 2);
+        FD_STRPCAT(buf, " ");
     }
 
-    buf = fd_strplcpy(buf, mnemonic, end-buf);
-    buf = fd_strplcpy(buf, sizesuffix, end-buf);
+    buf = fd_strpcat(buf, mnemonic);
+    buf = fd_strpcat(buf, sizesuffix);
 
     for (int i = 0; i < 4; i++)
     {
         FdOpType op_type = FD_OP_TYPE(instr, i);
         if (op_type == FD_OT_NONE)
             break;
-        buf = fd_strplcpy(buf, &", "[i == 0], end-buf);
+        if (op_type == FD_OT_IMM && FD_ROUNDCONTROL(instr) != FD_RC_MXCSR)
+            buf = fd_format_rc(buf, FD_ROUNDCONTROL(instr));
+        buf = fd_strpcat(buf, &", "[i == 0]);
 
         unsigned size = FD_OP_SIZE(instr, i);
 
         if (op_type == FD_OT_REG) {
             unsigned type = FD_OP_REG_TYPE(instr, i);
             unsigned idx = FD_OP_REG(instr, i);
-            buf = fd_strplcpy(buf, reg_name(type, idx, size), end-buf);
+            buf = fd_format_reg(buf, type, idx, size);
         } else if (op_type == FD_OT_MEM) {
             unsigned idx_rt = FD_RT_GPL;
             unsigned idx_sz = FD_ADDRSIZE(instr);
@@ -308,6 +395,9 @@ fd_format_abs(const FdInstr* instr, uint64_t addr, char* buffer, size_t len)
                 break;
             default: break;
             }
+            unsigned bcstsz = FD_OP_BCSTSZ(instr, i);
+            if (bcstsz)
+                size = bcstsz;
             const char* ptrsize = NULL;
             switch (size) {
             default: break;
@@ -322,29 +412,29 @@ fd_format_abs(const FdInstr* instr, uint64_t addr, char* buffer, size_t len)
             case 64: ptrsize = "zmmword"; break;
             }
             if (ptrsize) {
-                buf = fd_strplcpy(buf, ptrsize, end-buf);
-                buf = fd_strplcpy(buf, " ptr ", end-buf);
+                buf = fd_strpcat(buf, ptrsize);
+                FD_STRPCAT(buf, " ptr ");
             }
             unsigned seg = FD_SEGMENT(instr);
             if (seg != FD_REG_NONE) {
-                buf = fd_strplcpy(buf, reg_name(FD_RT_SEG, seg, 2), end-buf);
-                buf = fd_strplcpy(buf, ":", end-buf);
+                buf = fd_format_reg(buf, FD_RT_SEG, seg, 2);
+                FD_STRPCAT(buf, ":");
             }
-            buf = fd_strplcpy(buf, "[", end-buf);
+            FD_STRPCAT(buf, "[");
 
             bool has_base = FD_OP_BASE(instr, i) != FD_REG_NONE;
             bool has_idx = FD_OP_INDEX(instr, i) != FD_REG_NONE;
             if (has_base)
-                buf = fd_strplcpy(buf, reg_name(FD_RT_GPL, FD_OP_BASE(instr, i), FD_ADDRSIZE(instr)), end-buf);
+                buf = fd_format_reg(buf, FD_RT_GPL, FD_OP_BASE(instr, i), FD_ADDRSIZE(instr));
             if (has_idx) {
                 if (has_base)
-                    buf = fd_strplcpy(buf, "+", end-buf);
-                buf = fd_strplcpy(buf, "1*\0002*\0004*\0008*" + 3*FD_OP_SCALE(instr, i), end-buf);
-                buf = fd_strplcpy(buf, reg_name(idx_rt, FD_OP_INDEX(instr, i), idx_sz), end-buf);
+                    FD_STRPCAT(buf, "+");
+                buf = fd_strpcat(buf, "1*\0002*\0004*\0008*" + 3*FD_OP_SCALE(instr, i));
+                buf = fd_format_reg(buf, idx_rt, FD_OP_INDEX(instr, i), idx_sz);
             }
             uint64_t disp = FD_OP_DISP(instr, i);
             if (disp && (has_base || has_idx)) {
-                buf = fd_strplcpy(buf, (int64_t) disp < 0 ? "-" : "+", end-buf);
+                buf = fd_strpcat(buf, (int64_t) disp < 0 ? "-" : "+");
                 if ((int64_t) disp < 0)
                     disp = -disp;
             }
@@ -353,8 +443,13 @@ fd_format_abs(const FdInstr* instr, uint64_t addr, char* buffer, size_t len)
             else if (FD_ADDRSIZE(instr) == 4)
                 disp &= 0xffffffff;
             if (disp || (!has_base && !has_idx))
-                buf = fd_strplcpy(buf, fd_format_hex(disp, tmp), end-buf);
-            buf = fd_strplcpy(buf, "]", end-buf);
+                buf = fd_format_hex(buf, disp);
+            FD_STRPCAT(buf, "]");
+            if (bcstsz) {
+                unsigned count = FD_OP_SIZE(instr, i) / bcstsz;
+                buf = fd_strpcat(buf, count == 2 ? "{1to2}" : count == 4 ? "{1to4}" :
+                                      count == 8 ? "{1to8}" : "{1to16}");
+            }
         } else if (op_type == FD_OT_IMM || op_type == FD_OT_OFF) {
             size_t immediate = FD_OP_IMM(instr, i);
             // Some instructions have actually two immediate operands which are
@@ -380,8 +475,8 @@ fd_format_abs(const FdInstr* instr, uint64_t addr, char* buffer, size_t len)
                 // immediate is masked below.
                 break;
             }
-            buf = fd_strplcpy(buf, fd_format_hex(splitimm, tmp), end-buf);
-            buf = fd_strplcpy(buf, splitsep, end-buf);
+            buf = fd_format_hex(buf, splitimm);
+            buf = fd_strpcat(buf, splitsep);
 
         nosplitimm:
             if (op_type == FD_OT_OFF)
@@ -392,7 +487,91 @@ fd_format_abs(const FdInstr* instr, uint64_t addr, char* buffer, size_t len)
                 immediate &= 0xffff;
             else if (size == 4)
                 immediate &= 0xffffffff;
-            buf = fd_strplcpy(buf, fd_format_hex(immediate, tmp), end-buf);
+            buf = fd_format_hex(buf, immediate);
         }
+
+        if (i == 0 && FD_MASKREG(instr)) {
+            FD_STRPCAT(buf, "{");
+            buf = fd_format_reg(buf, FD_RT_MASK, FD_MASKREG(instr), 0);
+            FD_STRPCAT(buf, "}");
+        }
+        if (i == 0 && FD_MASKZERO(instr))
+            FD_STRPCAT(buf, "{z}");
+    }
+
+    // Rounding control precedes an immediate operand, if there is one.
+    if (FD_ROUNDCONTROL(instr) != FD_RC_MXCSR) {
+        bool has_imm = false;
+        for (int i = 0; i < 4; i++)
+            has_imm |= FD_OP_TYPE(instr, i) == FD_OT_IMM;
+        if (!has_imm)
+            buf = fd_format_rc(buf, FD_ROUNDCONTROL(instr));
+    }
+
+    return buf;
+}
+
+size_t
+fd_format_ex(const FdInstr* instr, uint64_t addr, char* buffer, size_t len)
+{
+    if (!len)
+        return 0;
+
+    char tmp[FMT_BUF_SIZE];
+    size_t fmt_len = fd_format_impl(instr, addr, tmp) - tmp;
+    if (fmt_len > len - 1)
+        fmt_len = len - 1;
+    __builtin_memcpy(buffer, tmp, fmt_len);
+    buffer[fmt_len] = 0;
+    return fmt_len;
+}
+
+void
+fd_format(const FdInstr* instr, char* buffer, size_t len)
+{
+    fd_format_ex(instr, 0, buffer, len);
+}
+
+void
+fd_format_abs(const FdInstr* instr, uint64_t addr, char* buffer, size_t len)
+{
+    fd_format_ex(instr, addr, buffer, len);
+}
+
+size_t
+fd_format_block(const FdInstr* instrs, size_t count, uint64_t addr,
+                const char* sep, char* buffer, size_t len, size_t* formatted)
+{
+    size_t sep_len = 0;
+    while (sep[sep_len])
+        sep_len++;
+
+    char* buf = buffer;
+    char* end = buffer + len;
+    size_t i;
+    for (i = 0; i < count; i++)
+    {
+        // Format directly into the output buffer if the formatted instruction
+        // fits in any case, otherwise check whether it actually fits.
+        char tmp[FMT_BUF_SIZE];
+        bool direct = (size_t) (end - buf) >= FMT_BUF_SIZE + sep_len + 1;
+        char* fmt = direct ? buf : tmp;
+        size_t fmt_len = fd_format_impl(&instrs[i], addr, fmt) - fmt;
+        if (!direct)
+        {
+            if (fmt_len + sep_len + 1 > (size_t) (end - buf))
+                break;
+            __builtin_memcpy(buf, tmp, fmt_len);
+        }
+        buf += fmt_len;
+        for (size_t j = 0; j < sep_len; j++)
+            *buf++ = sep[j];
+        addr += FD_SIZE(&instrs[i]);
     }
+
+    if (buf != end)
+        *buf = 0;
+    if (formatted)
+        *formatted = i;
+    return buf - buffer;
 }
@@ -0,0 +1,184 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <fadec.h>
+
+
+#define LIKELY(x) __builtin_expect((x), 1)
+#define UNLIKELY(x) __builtin_expect((x), 0)
+
+#define OT_MASK(ot) (1u << (ot))
+
+static int
+match_compile_op(FdMatchOp* op, const FdOpPattern* pat)
+{
+    unsigned check = pat->check;
+    // Operand types for which the predicate can hold; never FD_OT_NONE.
+    unsigned type_mask = OT_MASK(FD_OT_REG) | OT_MASK(FD_OT_IMM) |
+                         OT_MASK(FD_OT_MEM) | OT_MASK(FD_OT_OFF);
+    if (check & FD_MATCH_OPTYPE)
+        type_mask &= pat->type < 8 ? OT_MASK(pat->type) : 0;
+    if (check & FD_MATCH_REGTYPE)
+        type_mask &= OT_MASK(FD_OT_REG);
+    if (check & FD_MATCH_REG)
+        type_mask &= OT_MASK(FD_OT_REG) | OT_MASK(FD_OT_MEM);
+    if (check & (FD_MATCH_INDEX | FD_MATCH_DISP))
+        type_mask &= OT_MASK(FD_OT_MEM);
+    if (check & FD_MATCH_IMM)
+        type_mask &= OT_MASK(FD_OT_IMM) | OT_MASK(FD_OT_OFF);
+    if (!type_mask || pat->idx < -1 || pat->idx > 3 ||
+        ((check & (FD_MATCH_DISP | FD_MATCH_IMM)) && pat->min > pat->max))
+        return FD_ERR_INTERNAL;
+
+    *op = (FdMatchOp) {
+        .check = check,
+        .op_mask = pat->idx < 0 ? 0xf : 1 << pat->idx,
+        .type_mask = type_mask,
+        .size = pat->size,
+        .reg_type = pat->reg_type,
+        .reg = pat->reg,
+        .index = pat->index,
+        .min = pat->min,
+        .max = pat->max,
+    };
+    return 0;
+}
+
+int
+fd_matcher_compile(FdMatcher* matcher, const FdPattern* patterns,
+                   size_t count)
+{
+    if (count > FD_MATCH_MAX_PATTERNS)
+        return FD_ERR_INTERNAL;
+
+    for (unsigned t = 0; t < FD_TYPE_COUNT; t++)
+        matcher->type_patterns[t] = 0;
+    matcher->op_patterns = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        const FdPattern* pattern = &patterns[i];
+        uint32_t bit = (uint32_t) 1 << i;
+        for (size_t j = 0; j < pattern->type_count; j++)
+        {
+            if (pattern->types[j] >= FD_TYPE_COUNT)
+                return FD_ERR_INTERNAL;
+            matcher->type_patterns[pattern->types[j]] |= bit;
+        }
+        if (!pattern->type_count)
+            for (unsigned t = 0; t < FD_TYPE_COUNT; t++)
+                matcher->type_patterns[t] |= bit;
+
+        // Compiled predicates are packed, so that evaluation stops at the
+        // first unused entry.
+        unsigned op_count = 0;
+        for (unsigned j = 0; j < 4; j++)
+        {
+            if (!pattern->ops[j].check)
+                continue;
+            if (match_compile_op(&matcher->ops[i][op_count++], &pattern->ops[j]))
+                return FD_ERR_INTERNAL;
+        }
+        if (op_count)
+            matcher->op_patterns |= bit;
+        if (op_count < 4)
+            matcher->ops[i][op_count].check = 0;
+    }
+    return 0;
+}
+
+static bool
+match_op(const FdMatchOp* op, const FdInstr* instr, unsigned idx)
+{
+    unsigned ot = FD_OP_TYPE(instr, idx);
+    if (!(op->type_mask & OT_MASK(ot)))
+        return false;
+    if ((op->check & FD_MATCH_SIZE) && FD_OP_SIZE(instr, idx) != op->size)
+        return false;
+    if ((op->check & FD_MATCH_REGTYPE) &&
+        FD_OP_REG_TYPE(instr, idx) != op->reg_type)
+        return false;
+    // FD_OP_REG and FD_OP_BASE are the same field.
+    if ((op->check & FD_MATCH_REG) && FD_OP_REG(instr, idx) != op->reg)
+        return false;
+    if ((op->check & FD_MATCH_INDEX) && FD_OP_INDEX(instr, idx) != op->index)
+        return false;
+    if (op->check & FD_MATCH_DISP)
+    {
+        int64_t disp = FD_OP_DISP(instr, idx);
+        if (disp < op->min || disp > op->max)
+            return false;
+    }
+    if (op->check & FD_MATCH_IMM)
+    {
+        int64_t imm = FD_OP_IMM(instr, idx);
+        if (imm < op->min || imm > op->max)
+            return false;
+    }
+    return true;
+}
+
+static bool
+match_pattern(const FdMatchOp* ops, const FdInstr* instr)
+{
+    for (unsigned i = 0; i < 4 && ops[i].check; i++)
+    {
+        bool found = false;
+        for (unsigned idx = 0; idx < 4 && !found; idx++)
+            if (ops[i].op_mask >> idx & 1)
+                found = match_op(&ops[i], instr, idx);
+        if (!found)
+            return false;
+    }
+    return true;
+}
+
+size_t
+fd_match(const FdMatcher* matcher, const uint8_t* buf, size_t len, int mode,
+         FdMatch* matches, size_t max, size_t* consumed)
+{
+    size_t count = 0;
+    size_t off = 0;
+    while (off < len && count < max)
+    {
+        FdHeader hdr;
+        int res = fd_decode_header(buf + off, len - off, mode, &hdr);
+        if (UNLIKELY(res == FD_ERR_INTERNAL))
+            break;
+        if (UNLIKELY(res < 0))
+        {
+            off += 1;
+            continue;
+        }
+
+        uint32_t candidates = matcher->type_patterns[FD_TYPE(&hdr)];
+        if (LIKELY(!candidates))
+        {
+            off += res;
+            continue;
+        }
+
+        // Patterns without operand predicates match on the type alone.
+        uint32_t patterns = candidates & ~matcher->op_patterns;
+        uint32_t pending = candidates & matcher->op_patterns;
+        if (pending)
+        {
+            FdInstr instr;
+            fd_header_expand(buf + off, &hdr, &instr);
+            while (pending)
+            {
+                unsigned i = __builtin_ctz(pending);
+                pending &= pending - 1;
+                if (match_pattern(matcher->ops[i], &instr))
+                    patterns |= (uint32_t) 1 << i;
+            }
+        }
+        if (patterns)
+            matches[count++] = (FdMatch) { .offset = off, .patterns = patterns };
+        off += res;
+    }
+
+    if (consumed)
+        *consumed = off;
+    return count;
+}
@@ -29,7 +29,9 @@ INSTR_FLAGS_FIELDS, INSTR_FLAGS_SIZES = zip(*[
     ("op0_regty", 3),
     ("op1_regty", 3),
     ("op2_regty", 3),
-    ("unused", 5),
+    ("evex_bcst", 2),
+    ("evex_rc", 2),
+    ("fast", 1), # Only set in the fast table, see decode_table.
     ("modrm", 1),
     ("ign66", 1),
 ][::-1])
@@ -78,7 +80,7 @@ ENCODINGS = {
 }
 
 OPKIND_REGEX = re.compile(r"^([A-Z]+)([0-9]+)?$")
-OPKIND_DEFAULTS = {"GP": -1, "IMM": -1, "SEG": -1, "MEM": -1, "XMM": -2, "MMX": 8, "FPU": 10}
+OPKIND_DEFAULTS = {"GP": -1, "IMM": -1, "SEG": -1, "MEM": -1, "XMM": -2, "MMX": 8, "FPU": 10, "MASK": -1}
 OPKIND_KINDS = ("IMM", "MEM", "GP", "MMX", "XMM", "SEG", "FPU", "MEM", "MASK", "CR", "DR", "TMM", "BND")
 class OpKind(NamedTuple):
     size: int
@@ -196,6 +198,10 @@ class InstrDesc(NamedTuple):
         if "INSTR_WIDTH" in self.flags: extraflags["instr_width"] = 1
         if "LOCK" in self.flags:        extraflags["lock"] = 1
         if "VSIB" in self.flags:        extraflags["vsib"] = 1
+        if "BCST_4" in self.flags:      extraflags["evex_bcst"] = 1
+        if "BCST_8" in self.flags:      extraflags["evex_bcst"] = 2
+        if "SAE" in self.flags:         extraflags["evex_rc"] = 1
+        if "ER" in self.flags:          extraflags["evex_rc"] = 2
         if modrm:                       extraflags["modrm"] = 1
 
         if "USE66" not in self.flags and (ign66 or "IGN66" in self.flags):
@@ -209,6 +215,69 @@ class InstrDesc(NamedTuple):
         # First 2 bytes are the mnemonic, last 6 bytes are the encoding.
         return ("FDI_"+self.mnemonic,) + enc
 
+class DataFlow(NamedTuple):
+    """Register and flag usage of a mnemonic, see the end of instrs.txt."""
+    access: int # 2 bits per operand: 1 = read, 2 = written
+    misc: int
+    flags_r: int = 0
+    flags_w: int = 0
+    regs_r: int = 0
+    regs_w: int = 0
+
+    ACCESS = {"-": 0, "r": 1, "w": 2, "rw": 3}
+    FLAGS = {"c": 0, "p": 2, "a": 4, "z": 6, "s": 7, "t": 8, "i": 9, "d": 10,
+             "o": 11}
+    GPREGS = ["ax", "cx", "dx", "bx", "sp", "bp", "si", "di"] + \
+             [f"r{i}" for i in range(8, 16)]
+    MISC = {"REPCX": 1, "NODX8": 2, "BYOPS": 4, "VSIB": 8}
+
+    @classmethod
+    def parse_regs(cls, regs):
+        mask = 0
+        for reg in regs.split(","):
+            first, last = (reg.split("-") + [None])[:2]
+            if first.startswith("xmm"):
+                first = int(first[3:])
+                last = int(last.lstrip("xm")) if last else first
+                mask |= ((1 << last - first + 1) - 1) << 16 + first
+            else:
+                first = cls.GPREGS.index(first)
+                last = cls.GPREGS.index(last) if last else first
+                mask |= ((1 << last - first + 1) - 1) << first
+        return mask
+
+    @classmethod
+    def parse(cls, tokens):
+        access = [cls.ACCESS[t] for t in tokens if t in cls.ACCESS]
+        values = {"access": sum(a << 2*i for i, a in enumerate(access)), "misc": 0}
+        for token in tokens:
+            if token in cls.ACCESS:
+                continue
+            if token in cls.MISC:
+                values["misc"] |= cls.MISC[token]
+                continue
+            key, value = token.split("=")
+            if key in ("FR", "FW"):
+                flags = cls.FLAGS.keys() if value == "*" else value
+                values["flags_" + key[1].lower()] = sum(1 << cls.FLAGS[f] for f in flags)
+            elif key in ("R", "W"):
+                values["regs_" + key.lower()] = cls.parse_regs(value)
+            else:
+                raise Exception(f"invalid data flow attribute: {token}")
+        return cls(**values), len(access)
+
+    @classmethod
+    def default(cls, opcode, desc):
+        # First operand written, all other operands read. Legacy SSE/MMX
+        # instructions and FMA instructions are destructive.
+        access = 0x56
+        if ((not opcode.vex and not opcode.evex and desc.operands and
+             desc.operands[0].kind in ("XMM", "MMX") and
+             desc.encoding in ("RM", "RMI", "RMA", "MI")) or
+            desc.mnemonic.startswith(("VFM", "VFNM"))):
+            access |= 1
+        return cls(access, 0)
+
 class EntryKind(Enum):
     NONE = 0
     INSTR = 1
@@ -224,7 +293,7 @@ class EntryKind(Enum):
         return self == EntryKind.INSTR or self == EntryKind.WEAKINSTR
 
 opcode_regex = re.compile(
-    r"^(?:(?P<prefixes>(?P<vex>VEX\.)?(?P<legacy>NP|66|F2|F3|NFx)\." +
+    r"^(?:(?P<prefixes>(?P<vex>E?VEX\.)?(?P<legacy>NP|66|F2|F3|NFx)\." +
                      r"(?:W(?P<rexw>[01]|IG)\.)?(?:L(?P<vexl>[01]|IG)\.)?))?" +
      r"(?P<escape>0f38|0f3a|0f|)" +
      r"(?P<opcode>[0-9a-f]{2})" +
@@ -238,6 +307,7 @@ class Opcode(NamedTuple):
     modreg: Union[None, Tuple[Union[None, int], str]] # (modreg, "r"/"m"/"rm"), None
     opcext: Union[None, int] # 0xc0-0xff, or 0
     vex: bool
+    evex: bool
     vexl: Union[str, None] # 0, 1, IG, None = used, both
     rexw: Union[str, None] # 0, 1, IG, None = used, both
 
@@ -262,7 +332,8 @@ class Opcode(NamedTuple):
             extended=match.group("extended") is not None,
             modreg=modreg,
             opcext=int(match.group("opcext") or "0", 16) or None,
-            vex=match.group("vex") is not None,
+            vex=match.group("vex") == "VEX.",
+            evex=match.group("vex") == "EVEX.",
             vexl=match.group("vexl"),
             rexw=match.group("rexw"),
         )
@@ -272,7 +343,7 @@ class Trie:
                   EntryKind.TABLE_PREFIX, EntryKind.TABLE16,
                   EntryKind.TABLE8E, EntryKind.TABLE_VEX)
     TABLE_LENGTH = {
-        EntryKind.TABLE_ROOT: 8,
+        EntryKind.TABLE_ROOT: 12,
         EntryKind.TABLE256: 256,
         EntryKind.TABLE_PREFIX: 4,
         EntryKind.TABLE16: 16,
@@ -298,7 +369,7 @@ class Trie:
         return elem[0], new_num
 
     def _transform_opcode(self, opc):
-        troot = [opc.escape | opc.vex << 2]
+        troot = [opc.escape | opc.vex << 2 | opc.evex << 3]
         t256 = [opc.opc + i for i in range(8 if opc.extended else 1)]
         tprefix, t16, t8e, tvex = None, None, None, None
         if opc.prefix == "NFx":
@@ -313,6 +384,7 @@ class Trie:
             mod = {"m": [0], "r": [1<<3], "rm": [0, 1<<3]}[opc.modreg[1]]
             reg = [opc.modreg[0]] if opc.modreg[0] is not None else list(range(8))
             t16 = [x + y for x in mod for y in reg]
+        # For EVEX, L0 matches EVEX.L'L == 0 and L1 all larger vector lengths.
         if opc.vexl in ("0", "1") or opc.rexw in ("0", "1"):
             rexw = {"0": [0], "1": [1<<0], "IG": [0, 1<<0]}[opc.rexw or "IG"]
             vexl = {"0": [0], "1": [1<<1], "IG": [0, 1<<1]}[opc.vexl or "IG"]
@@ -373,14 +445,58 @@ class Trie:
                 else:
                     entries[unique_entry] = num
 
-    def compile(self):
+    def weights(self, leaf_weight):
+        """Weight of every node: sum of leaf_weight(descidx) in the subtree."""
+        weights = [None] * len(self.trie)
+        def walk(num):
+            if weights[num] is None:
+                weights[num] = sum(leaf_weight(e[1]) if e[0].is_instr else walk(e[1])
+                                   for e in self.trie[num] if e)
+            return weights[num]
+        walk(0)
+        return weights
+
+    def remap_descs(self, perm):
+        for entry in self.trie:
+            for i, elem in enumerate(entry or ()):
+                if elem and elem[0].is_instr:
+                    entry[i] = elem[0], perm[elem[1]]
+
+    LINE_ENTRIES = 32 # 64-byte cache line
+
+    def _pack(self, nums, weights, offsets):
+        # Place hot nodes first and never let a node that fits into a cache
+        # line straddle one; larger nodes start at a cache line. Padding is
+        # filled by later, smaller nodes.
+        gaps = []
+        last_off = 0
+        for num in sorted(nums, key=lambda num: -weights[num]):
+            size = (len(self.trie[num]) + 3) & ~3
+            for i, (gap_off, gap_size) in enumerate(gaps):
+                if gap_size >= size:
+                    offsets[num] = gap_off
+                    gaps[i] = gap_off + size, gap_size - size
+                    break
+            else:
+                pad = -last_off % self.LINE_ENTRIES
+                if pad and (size > self.LINE_ENTRIES or size > pad):
+                    gaps.append((last_off, pad))
+                    last_off += pad
+                offsets[num] = last_off
+                last_off += size
+            gaps = [gap for gap in gaps if gap[1]]
+        return last_off
+
+    def compile(self, weights=None):
         offsets = [None] * len(self.trie)
         last_off = 0
-        for num, entry in enumerate(self.trie[1:], start=1):
-            if not entry:
-                continue
-            offsets[num] = last_off
-            last_off += (len(entry) + 3) & ~3
+        nums = [num for num, entry in enumerate(self.trie) if num and entry]
+        if weights:
+            last_off = self._pack(nums, weights, offsets)
+        else:
+            for num in nums:
+                offsets[num] = last_off
+                last_off += (len(self.trie[num]) + 3) & ~3
         if last_off >= 0x8000:
             raise Exception(f"maximum table size exceeded: {last_off:#x}")
 
@@ -395,8 +511,31 @@ class Trie:
 
         stats = {k: len(v) for k, v in self.kindmap.items()}
         print("%d bytes" % (2*len(data)), stats)
+        self.offsets = offsets
         return tuple(data), [offsets[v] for _, v in self.trie[0]]
 
+    def footprint(self, hot_desc):
+        """Number of table cache lines touched when decoding hot descriptors."""
+        memo = {}
+        def walk(num):
+            if num not in memo:
+                hot, lines = False, set()
+                for i, elem in enumerate(self.trie[num]):
+                    if not elem:
+                        continue
+                    if elem[0].is_instr:
+                        sub_hot, sub_lines = hot_desc(elem[1]), set()
+                    else:
+                        sub_hot, sub_lines = walk(elem[1])
+                    if sub_hot:
+                        hot = True
+                        lines |= sub_lines
+                        if num: # trie[0] is not part of the table
+                            lines.add((self.offsets[num] + i) // self.LINE_ENTRIES)
+                memo[num] = hot, lines
+            return memo[num]
+        return len(walk(0)[1])
+
 def parse_mnemonics(mnemonics):
     mktree = lambda: defaultdict(mktree)
     tree = mktree()
@@ -414,17 +553,27 @@ def parse_mnemonics(mnemonics):
     merged_str = "".join(sorted(tree_walk(tree)))
     cstr = '"' + merged_str[:-1].replace("\0", '\\0') + '"'
     tab = [merged_str.index(m + "\0") for m in mnemonics]
-    return cstr, ",".join(map(str, tab))
+    return cstr, ",".join(map(str, tab)), len(merged_str)
 
 DECODE_TABLE_TEMPLATE = """// Auto-generated file -- do not modify!
 #if defined(FD_DECODE_TABLE_DATA)
 {hex_table}
 #elif defined(FD_DECODE_TABLE_DESCS)
 {descs}
+#elif defined(FD_DECODE_TABLE_FAST_DESCS)
+{fast_descs}
+#elif defined(FD_DECODE_TABLE_LENGTHS)
+{lengths}
+#elif defined(FD_DECODE_TABLE_REGS)
+{regs}
+#elif defined(FD_DECODE_TABLE_REGS_IDX)
+{regs_idx}
 #elif defined(FD_DECODE_TABLE_STRTAB1)
 {mnemonics[0]}
 #elif defined(FD_DECODE_TABLE_STRTAB2)
 {mnemonics[1]}
+#elif defined(FD_DECODE_TABLE_PREFIXES)
+{prefix_table}
 #elif defined(FD_DECODE_TABLE_DEFINES)
 {defines}
 #else
@@ -432,8 +581,179 @@ DECODE_TABLE_TEMPLATE = """// Auto-generated file -- do not modify!
 #endif
 """
 
-def decode_table(entries, modes):
-    mnems = sorted({desc.mnemonic for _, _, desc in entries})
+def prefix_table(mode):
+    """Classify legacy and REX prefixes for the decoder. Non-prefix bytes are
+    zero; otherwise: bits 0-1 are 1 for REX, 2 for F3, 3 for F2; bits 2-4 are
+    the segment register plus one, or 7 for ignored segment overrides; bits
+    5/6/7 indicate 66/67/F0."""
+    table = [0] * 256
+    for seg, byte in enumerate((0x26, 0x2e, 0x36, 0x3e, 0x64, 0x65)):
+        # ES/CS/SS/DS overrides are ignored in 64-bit mode.
+        table[byte] = (7 if mode == 64 and seg < 4 else seg + 1) << 2
+    table[0xf3], table[0xf2] = 2, 3
+    table[0x66], table[0x67], table[0xf0] = 0x20, 0x40, 0x80
+    if mode == 64:
+        for byte in range(0x40, 0x50):
+            table[byte] = 1
+    return table
+
+def length_table(trie, descs, root, mode):
+    """Lengths of instructions without prefixes (except for a single REX) for
+    the length-only decoder, indexed by escape (none/0f) and opcode byte like
+    the fast descriptors. Zero entries require the full decoder; otherwise:
+    bits 0-3 are the length of escape, opcode, and immediate; bit 4 indicates
+    a ModRM byte; bit 5 indicates that ModRM must be a memory operand; bit 6
+    indicates that the length differs with REX.W. Mirrors decode.c."""
+    def desc_length(desc, rexw):
+        mnem, imm_control = desc[0][4:], desc[1] >> 12 & 7
+        opsize = desc[2] >> 8 & 3
+        op_size = 1 if opsize == 1 else 8 if mode == 64 and (rexw or opsize) else 4
+        if imm_control < 2: imm_size = 0
+        elif imm_control == 2: imm_size = mode // 8
+        elif imm_control == 3 or imm_control & 1: imm_size = 1
+        elif mnem in ("RET", "RETF", "SSE_EXTRQ", "SSE_INSERTQ"): imm_size = 2
+        elif mnem in ("JMPF", "CALLF"): imm_size = op_size + 2
+        elif mnem == "ENTER": imm_size = 3
+        elif mnem == "MOVABS": imm_size = op_size
+        else: imm_size = 4
+        return desc[3] >> 14 & 1, imm_size
+
+    # Descriptor for a ModRM extension index (see decode.c) without mandatory
+    # prefix; None if undefined, False if the full decoder is required.
+    def resolve(elem, t16_idx, rexw):
+        while elem and not elem[0].is_instr:
+            table = trie.trie[elem[1]]
+            if elem[0] == EntryKind.TABLE_PREFIX: elem = table[0]
+            elif elem[0] == EntryKind.TABLE16: elem = table[t16_idx]
+            elif elem[0] == EntryKind.TABLE_VEX: elem = table[rexw]
+            else: return False # TABLE8E
+        return descs[elem[1]] if elem else None
+
+    def entry(escape, elem, rexw):
+        variants = [resolve(elem, i, rexw) for i in range(16)]
+        present = [desc for desc in variants if desc]
+        if False in variants or not present or any(desc[0] in
+                ("FDI_3DNOW", "FDI_MOV_CR", "FDI_MOV_DR") for desc in present):
+            return 0
+        lengths = {desc_length(desc, rexw) for desc in present}
+        if len(lengths) != 1:
+            return 0
+        modrm, imm_size = lengths.pop()
+        if len(present) == 16:
+            mem_only = 0
+        elif all(variants[:8]) and not any(variants[8:]):
+            mem_only = 1
+        else:
+            return 0
+        return 1 + escape + imm_size | modrm << 4 | mem_only << 5
+
+    prefixes = prefix_table(mode)
+    table = []
+    for escape in range(2):
+        for byte, elem in enumerate(trie.trie[trie.trie[root][escape][1]]):
+            if (escape == 0 and (prefixes[byte] or byte in (0x0f, 0x62, 0xc4, 0xc5)) or
+                escape == 1 and byte in (0x38, 0x3a)):
+                table.append(0)
+                continue
+            value = entry(escape, elem, 0)
+            if value and mode == 64 and entry(escape, elem, 1) != value:
+                value |= 0x40
+            table.append(value)
+    return table
+
+def intel_mnemonic(mnemonic):
+    return (mnemonic.replace("SSE_", "").replace("MMX_", "")
+            .replace("MOVABS", "MOV").replace("RESERVED_", "")
+            .replace("JMPF", "JMP FAR").replace("CALLF", "CALL FAR")
+            .replace("_S2G", "").replace("_G2S", "")
+            .replace("_CR", "").replace("_DR", "")
+            .replace("REP_", "REP ")
+            .lower())
+
+# Approximate instruction frequencies (per mille) in x86-64 compiler output,
+# used for the table layout if no other profile is given. Keyed by fdi_name.
+DEFAULT_PROFILE = {
+    "mov": 330, "lea": 55, "call": 45, "add": 40, "cmp": 40, "test": 35,
+    "push": 30, "pop": 30, "jmp": 30, "jz": 30, "jnz": 28, "movzx": 20,
+    "sub": 15, "xor": 15, "nop": 15, "ret": 12, "and": 10, "endbr64": 8,
+    "movsx": 6, "shl": 6, "or": 5, "shr": 5, "jle": 4, "jg": 4, "jl": 3,
+    "jge": 3, "ja": 3, "jbe": 3, "jc": 2, "jnc": 2, "js": 2, "jns": 2,
+    "imul": 4, "sar": 3, "movaps": 4, "movq": 4, "movsd": 4, "movups": 3,
+    "movss": 3, "pxor": 3, "xorps": 3, "setz": 3, "setnz": 2, "cmovz": 2,
+    "cmovnz": 2, "inc": 2, "dec": 2, "leave": 2, "movdqa": 2, "movdqu": 2,
+    "movd": 2, "addsd": 2, "mulsd": 2, "ucomisd": 1, "cvtsi2sd": 1,
+}
+
+def load_profile(name):
+    """Load an instruction histogram: "builtin" or a file with lines of the
+    form "<count> <fdi_name>", e.g. from "sort | uniq -c"."""
+    if name == "builtin":
+        return DEFAULT_PROFILE
+    profile = Counter()
+    with open(name) as f:
+        for line in f:
+            if line.strip() and line.lstrip()[0] != "#":
+                count, mnem = line.split(maxsplit=1)
+                profile[mnem.strip().lower()] += int(count)
+    return profile
+
+def regs_table(entries, mnems, flow):
+    """Data flow entry for every mnemonic. Mnemonics with different entries
+    depending on the number of operands (BYOPS) refer to the entry for one
+    operand, followed by the entries for two and three operands."""
+    opcounts = defaultdict(int)
+    flow_entries = {}
+    for _, opcode, desc in entries:
+        opcounts[desc.mnemonic] = max(opcounts[desc.mnemonic], len(desc.operands))
+        default = DataFlow.default(opcode, desc)
+        if "VSIB" in desc.flags:
+            default = default._replace(misc=default.misc | DataFlow.MISC["VSIB"])
+        if desc.mnemonic in flow_entries:
+            prev = flow_entries[desc.mnemonic]
+            default = default._replace(access=default.access | prev.access,
+                                       misc=default.misc | prev.misc)
+        flow_entries[desc.mnemonic] = default
+
+    variants = defaultdict(dict)
+    for mnem, (row, opcount) in flow.items():
+        mnem, _, form = mnem.partition("/")
+        if mnem not in flow_entries:
+            continue # e.g., undocumented instructions
+        if opcount != (int(form) if form else opcounts[mnem]):
+            raise Exception(f"wrong operand count for data flow of {mnem}")
+        misc = row.misc | flow_entries[mnem].misc & DataFlow.MISC["VSIB"]
+        if form:
+            misc |= DataFlow.MISC["BYOPS"]
+            variants[mnem][int(form)] = row._replace(misc=misc)
+        else:
+            flow_entries[mnem] = row._replace(misc=misc)
+
+    table, table_map = [], {}
+    def add(*rows):
+        if rows not in table_map:
+            table_map[rows] = len(table)
+            table.extend(rows)
+        return table_map[rows]
+    indices = []
+    for mnem in mnems:
+        if mnem in variants:
+            forms = variants[mnem]
+            if sorted(forms) != list(range(1, len(forms) + 1)):
+                raise Exception(f"missing data flow forms for {mnem}")
+            indices.append(add(*(forms[i] for i in sorted(forms))))
+        elif mnem not in flow_entries:
+            indices.append(0) # excluded extension, never decoded
+        else:
+            indices.append(add(flow_entries[mnem]))
+    if len(table) > 256:
+        raise Exception("too many distinct data flow entries")
+    return table, indices
+
+def decode_table(entries, modes, profile=None, flow={}, mnems=None):
+    # Mnemonics of excluded ISA extensions are kept, so that FdInstrType does
+    # not depend on the configuration; only their names are omitted.
+    present_mnems = {desc.mnemonic for _, _, desc in entries}
+    mnems = sorted(mnems or present_mnems)
     decode_mnems_lines = [f"FD_MNEMONIC({m},{i})\n" for i, m in enumerate(mnems)]
 
     trie = Trie(root_count=len(modes))
@@ -451,40 +771,132 @@ def decode_table(entries, modes):
                 trie.add_opcode(opcode, desc_idx, i, weak)
 
     trie.deduplicate()
-    table_data, root_offsets = trie.compile()
 
-    mnemonics_intel = [m.replace("SSE_", "").replace("MMX_", "")
-                        .replace("MOVABS", "MOV").replace("RESERVED_", "")
-                        .replace("JMPF", "JMP FAR").replace("CALLF", "CALL FAR")
-                        .replace("_S2G", "").replace("_G2S", "")
-                        .replace("_CR", "").replace("_DR", "")
-                        .replace("REP_", "REP ")
-                        .lower() for m in mnems]
+    # With a profile, order nodes and descriptors by weight. The weight of a
+    # mnemonic is split evenly among all table entries referring to it.
+    desc_mnem = lambda idx: intel_mnemonic(descs[idx][0][4:])
+    leaves = Counter(elem[1] for entry in trie.trie for elem in entry or ()
+                     if elem and elem[0].is_instr)
+    mnem_leaves = Counter()
+    for idx, count in leaves.items():
+        mnem_leaves[desc_mnem(idx)] += count
+    leaf_weight = lambda idx: ((profile or {}).get(desc_mnem(idx), 0) /
+                               max(mnem_leaves[desc_mnem(idx)], 1))
+    weights = None
+    if profile:
+        weights = trie.weights(leaf_weight)
+        order = sorted(range(len(descs)), key=lambda idx: -leaf_weight(idx) * leaves[idx])
+        trie.remap_descs({old: new for new, old in enumerate(order)})
+        descs = [descs[idx] for idx in order]
+
+    table_data, root_offsets = trie.compile(weights)
+    print("%d descriptors, %d bytes" % (len(descs), 8 * len(descs)))
+
+    # Cache line footprint of the mnemonics covering 90% of the profile.
+    hot_profile = profile or DEFAULT_PROFILE
+    hot_mnems, hot_sum = set(), 0
+    for mnem, count in sorted(hot_profile.items(), key=lambda kv: -kv[1]):
+        if hot_sum >= 0.9 * sum(hot_profile.values()):
+            break
+        hot_mnems.add(mnem)
+        hot_sum += count
+    hot_desc = lambda idx: desc_mnem(idx) in hot_mnems
+    hot_desc_lines = {idx * 8 // 64 for idx in leaves if hot_desc(idx)}
+    print("%s layout: %d hot mnemonics touch %d table and %d descriptor cache lines" %
+          ("profile" if profile else "default", len(hot_mnems),
+           trie.footprint(hot_desc), len(hot_desc_lines)))
+
+    # One-byte and 0f opcodes that need no further table lookup (i.e., no
+    # mandatory prefix, ModRM extension, or VEX.W/L) have their descriptor in
+    # the fast table, indexed by escape and opcode byte. Other entries are
+    # zero, i.e., without the fast flag.
+    fast_descs = []
+    for _, root in trie.trie[0]:
+        for escape in range(2):
+            for elem in trie.trie[trie.trie[root][escape][1]]:
+                if elem and elem[0].is_instr:
+                    desc = descs[elem[1]]
+                    fast_descs.append(desc[:3] + (desc[3] | 0x2000,)) # fast
+                else:
+                    fast_descs.append((0, 0, 0, 0))
+    print("%d fast descriptors, %d bytes" %
+          (sum(desc[0] != 0 for desc in fast_descs), 8 * len(fast_descs)))
+
+    lengths = [l for i, (_, root) in enumerate(trie.trie[0])
+               for l in length_table(trie, descs, root, modes[i])]
+    print("%d of %d opcodes in length table" %
+          (sum(l != 0 for l in lengths), len(lengths)))
+
+    mnemonics_intel = [intel_mnemonic(m) if m in present_mnems else ""
+                       for m in mnems]
+    mnemonics = parse_mnemonics(mnemonics_intel)
+    regs, regs_idx = regs_table(entries, mnems, flow)
+    print("%d data flow entries" % len(regs))
+
+    sizes = {
+        "table": 2 * len(table_data),
+        "descs": 8 * len(descs),
+        "fast descs": 8 * len(fast_descs),
+        "lengths": len(lengths),
+        "mnemonics": mnemonics[2] + 2 * len(mnems),
+    }
+    print("%d of %d mnemonics, %d bytes in total:" %
+          (len(present_mnems), len(mnems), sum(sizes.values())),
+          ", ".join(f"{k} {v}" for k, v in sizes.items()))
 
     defines = ["FD_TABLE_OFFSET_%d %d"%k for k in zip(modes, root_offsets)]
+    defines += ["FD_PREFIX_OFFSET_%d %d"%(mode, 256 * i) for i, mode in enumerate(modes)]
+    defines += ["FD_FAST_OFFSET_%d %d"%(mode, 512 * i) for i, mode in enumerate(modes)]
+    prefixes = [b for mode in modes for b in prefix_table(mode)]
 
     return "".join(decode_mnems_lines), DECODE_TABLE_TEMPLATE.format(
         hex_table="".join(f"{e:#06x}," for e in table_data),
         descs="\n".join("{{{0},{1},{2},{3}}},".format(*desc) for desc in descs),
-        mnemonics=parse_mnemonics(mnemonics_intel),
+        fast_descs="\n".join("{{{0},{1},{2},{3}}},".format(*desc) for desc in fast_descs),
+        lengths="".join(f"{l:#04x}," for l in lengths),
+        regs="\n".join(f"{{{e.regs_r:#x},{e.regs_w:#x},{e.flags_r:#x},{e.flags_w:#x},{e.access:#x},{e.misc}}},"
+                       for e in regs),
+        regs_idx="".join(f"{idx}," for idx in regs_idx),
+        mnemonics=mnemonics,
+        prefix_table="".join(f"{e:#04x}," for e in prefixes),
         defines="\n".join("#define " + line for line in defines),
     )
 
-def encode_table(entries):
+def encode_mnemonics(entries, mode, fd_map=None):
     mnemonics = defaultdict(list)
     mnemonics["FE_NOP"].append(("NP", 0, 0, "0x90"))
     for weak, opcode, desc in entries:
-        if "ONLY32" in desc.flags or desc.mnemonic[:9] == "RESERVED_":
+        if "ONLY%d"%(96-mode) in desc.flags or desc.mnemonic[:9] == "RESERVED_":
+            continue
+        # The encoder does not support EVEX encodings and mask registers.
+        if opcode.evex or any(op.kind == "MASK" for op in desc.operands):
+            continue
+        # REX.W is not available in 32-bit mode. VEX.W1 variants for 32-bit
+        # mode only exist for decoding, as VEX.W is ignored there.
+        if mode == 32 and opcode.rexw == "1" and (not opcode.vex or "ONLY32" in desc.flags):
+            continue
+        # Segment registers are encoded in the opcode, only keep the opcode
+        # for the first register of a group.
+        if desc.encoding == "S" and opcode.opc & 0x18:
+            continue
+        # Far direct branches (ptr16:16/ptr16:32 immediates) are not encodable.
+        if desc.mnemonic in ("CALLF", "JMPF") and desc.encoding == "I":
             continue
 
         opsizes = {8} if "SIZE_8" in desc.flags else {16, 32, 64}
+        if mode == 32:
+            opsizes -= {64}
         hasvex, vecsizes = False, {128}
 
         opc_i = opcode.opc
         if opcode.opcext:
             opc_i |= opcode.opcext << 8
         if opcode.modreg and opcode.modreg[0] is not None:
-            opc_i |= opcode.modreg[0] << 8
+            # Without operands, the register form needs a complete ModRM byte.
+            if desc.encoding == "NP" and opcode.modreg[1] == "r":
+                opc_i |= (0xc0 | opcode.modreg[0] << 3) << 8
+            else:
+                opc_i |= opcode.modreg[0] << 8
         opc_flags = ""
         opc_flags += ["","|OPC_0F","|OPC_0F38","|OPC_0F3A"][opcode.escape]
         if "VSIB" in desc.flags:
@@ -508,8 +920,12 @@ def encode_table(entries):
             opsizes -= {32 if opcode.rexw == "1" else 64}
             if opcode.rexw == "1": opc_flags += "|OPC_REXW"
 
-        if "DEF64" in desc.flags:
-            opsizes -= {32}
+        # Default operand size of DEF64/FORCE64 instructions. Push/pop of
+        # segment registers are named like DEF64 instructions in both modes.
+        defsz = 64 if mode == 64 else 32
+        def64 = "DEF64" in desc.flags or desc.encoding == "S"
+        if def64:
+            opsizes -= {96-defsz}
         if "INSTR_WIDTH" not in desc.flags and all(op.size != OpKind.SZ_OP for op in desc.operands):
             opsizes = {0}
         if "VSIB" not in desc.flags and all(op.size != OpKind.SZ_VEC for op in desc.operands):
@@ -523,7 +939,7 @@ def encode_table(entries):
         prepend_vecsize = hasvex and max(vecsizes) > 0 and not separate_opsize
 
         if "FORCE64" in desc.flags:
-            opsizes = {64}
+            opsizes = {defsz}
             prepend_opsize = False
 
         modrm_type = opcode.modreg[1] if opcode.modreg else "rm"
@@ -553,7 +969,7 @@ def encode_table(entries):
             # Construct mnemonic name
             mnem_name = {"MOVABS": "MOV", "XCHG_NOP": "XCHG"}.get(desc.mnemonic, desc.mnemonic)
             name = "FE_" + prefix[0] + mnem_name
-            if prepend_opsize and not ("DEF64" in desc.flags and opsize == 64):
+            if prepend_opsize and not (def64 and opsize == defsz):
                 name += f"_{opsize}"[name[-1] not in "0123456789":]
             if prepend_vecsize:
                 name += f"_{vecsize}"[name[-1] not in "0123456789":]
@@ -562,54 +978,282 @@ def encode_table(entries):
                 if separate_opsize:
                     name += f"{op.abssize(opsize//8, vecsize//8)*8}"
             mnemonics[name].append((desc.encoding, imm_size, tys_i, opc_s))
+            if fd_map is not None:
+                # Without a size in the mnemonic, the operand and vector size
+                # are implied; instructions that ignore VEX.L use 128 bits.
+                gpsize = opsize or (64 if def64 or opcode.rexw == "1" else 32)
+                vecsz = vecsize or (256 if opcode.vexl == "1" else 128)
+                fd_map.append((desc, ots, opsize, gpsize, vecsz, prefix[0], name))
 
-    descs = ""
-    alt_index = 0
     for mnem, variants in mnemonics.items():
         dedup = []
         for variant in variants:
-            # TODO: when adapting to 32-bit mode, handle S encodings.
-            if not any(x[:3] == variant[:3] for x in dedup):
+            # Segment registers are split into groups with different opcodes.
+            key = 4 if variant[0] == "S" else 3
+            if not any(x[:key] == variant[:key] for x in dedup):
                 dedup.append(variant)
 
         enc_prio = ["O", "OA", "OI", "IA", "M", "MI", "MR", "RM"]
         dedup.sort(key=lambda e: (e[1], e[0] in enc_prio and enc_prio.index(e[0])))
+        mnemonics[mnem] = dedup
+    return mnemonics
 
-        indices = [mnem] + [f"FE_MNEM_MAX+{alt_index+i}" for i in range(len(dedup) - 1)]
+def encode_descs(mnemonics):
+    descs = ""
+    alt_index = 0
+    for mnem, variants in mnemonics.items():
+        indices = [mnem] + [f"FE_MNEM_MAX+{alt_index+i}" for i in range(len(variants) - 1)]
         alt_list = indices[1:] + ["0"]
         alt_index += len(alt_list) - 1
-        for idx, alt, (enc, immsz, tys_i, opc_s) in zip(indices, alt_list, dedup):
+        for idx, alt, (enc, immsz, tys_i, opc_s) in zip(indices, alt_list, variants):
             descs += f"[{idx}] = {{ .enc = ENC_{enc}, .immsz = {immsz}, .tys = {tys_i:#x}, .opc = {opc_s}, .alt = {alt} }},\n"
+    return descs
+
+# Decoded operand type and register type of encoder operand types, see
+# FD_OT_* and FD_RT_*. Other register kinds are not supported by the encoder.
+FD_MAP_OTS = {"r": 1, "i": 2, "m": 3, "o": 4}
+FD_MAP_REGTYS = {"GP": 1, "SEG": 3, "FPU": 4, "MMX": 5, "XMM": 6}
+FD_MAP_PREFIXES = {"": 0, "LOCK_": 1, "REP_": 2, "REPZ_": 2, "REPNZ_": 3}
+
+def encode_fd_map(variants):
+    """Map from decoded instructions (type, operand kinds, sizes, prefixes) to
+    64-bit encoder mnemonics, see relocate.c."""
+    candidates = defaultdict(dict)
+    for desc, ots, opsize, gpsize, vecsize, prefix, name in variants:
+        # Memory offsets (moffs) are decoded as memory operands, which can be
+        # encoded with the ModRM form as well.
+        if "a" in ots or any(ot == "r" and op.kind not in FD_MAP_REGTYS
+                             for ot, op in zip(ots, desc.operands)):
+            continue
+        ops = 0
+        for i, (ot, op) in enumerate(zip(ots, desc.operands)):
+            regty = FD_MAP_REGTYS[op.kind] if ot == "r" else 0
+            ops |= (FD_MAP_OTS[ot] << 4 | regty) << 8 * i
+        attrs = FD_MAP_PREFIXES[prefix] | ("VSIB" in desc.flags) << 2
+        sizes = [op.abssize(gpsize // 8, vecsize // 8) for op in desc.operands]
+        sizes += [0] * (4 - len(sizes))
+        sizes.append(opsize // 8 if "INSTR_WIDTH" in desc.flags else 0)
+        mnem = {"XCHG_NOP": "XCHG"}.get(desc.mnemonic, desc.mnemonic)
+        candidates[mnem, ops, attrs].setdefault(name, set()).add(tuple(sizes))
+
+    # Mnemonics which only differ in operand sizes (e.g., ADD32rr/ADD64rr,
+    # FLD m32/m64, MOVZX r16,m8/r16,m16) are distinguished by the operand sizes,
+    # where the fifth size is the instruction width. All sizes must match, the
+    # encoder cannot reproduce, e.g., MMX PINSRW with REX.W or VCMPSS with VEX.L.
+    groups = defaultdict(dict)
+    groups["NOP"][0, 0, 0] = "FE_NOP"
+    for (mnem, ops, attrs), names in candidates.items():
+        for name, variants in names.items():
+            for sizes in sorted(variants):
+                size_codes = sum(sizes[i].bit_length() << 3 * i for i in range(5)
+                                 if sizes[i] in (1, 2, 4, 8, 16, 32, 64))
+                groups[mnem].setdefault((ops, size_codes, attrs), name)
+
+    # Index 0 is a sentinel for types without entries. Within a type, more
+    # specific entries come first, as prefix/size 0 matches everything.
+    idx, table = "", "{ 0xffffffff, 0, 0, 0x80 },\n"
+    count = 1
+    for mnem, keys in sorted(groups.items()):
+        keys = sorted(keys.items(), key=lambda k: (not k[0][2] & 3,
+                      -sum(k[0][1] >> 3 * i & 7 != 0 for i in range(5))))
+        idx += f"[FDI_{mnem}] = {count},\n"
+        for i, ((ops, size_codes, attrs), name) in enumerate(keys):
+            attrs |= 0x80 if i == len(keys) - 1 else 0
+            table += f"{{ {ops:#x}, {name}, {size_codes:#x}, {attrs:#x} }},\n"
+        count += len(keys)
+    return idx, table
+
+ENCODE_TABLE_TEMPLATE = """// Auto-generated file -- do not modify!
+#if defined(FE_ENCODE_TABLE_64)
+{descs64}
+#elif defined(FE_ENCODE_TABLE_32)
+{descs32}
+#elif defined(FE_ENCODE_FD_MAP_IDX)
+{fd_map_idx}
+#elif defined(FE_ENCODE_FD_MAP)
+{fd_map}
+#else
+#error "unspecified encode table"
+#endif
+"""
 
-    mnem_list = sorted(mnemonics.keys())
+def encode_table(entries, modes):
+    # The 64-bit encoder is always available; without 32-bit support, all
+    # mnemonics are invalid in 32-bit mode.
+    fd_map = []
+    tables = {mode: encode_mnemonics(entries, mode, fd_map if mode == 64 else None)
+                    if mode == 64 or mode in modes else {}
+              for mode in (32, 64)}
+    mnem_list = sorted(set().union(*tables.values()))
     mnem_tab = "".join(f"FE_MNEMONIC({m},{i})\n" for i, m in enumerate(mnem_list))
-    return mnem_tab, descs
+
+    inline_cases = "".join(encode_inline(mnem, *variants[0])
+                           for mnem, variants in tables[64].items())
+
+    # Every table must have an entry for all mnemonics.
+    descs = {}
+    for mode, mnemonics in tables.items():
+        descs[mode] = encode_descs(mnemonics)
+        if mnem_list[-1] not in mnemonics:
+            descs[mode] += f"[{mnem_list[-1]}] = {{ 0 }},\n"
+    fd_map_idx, fd_map = encode_fd_map(fd_map)
+    descs = ENCODE_TABLE_TEMPLATE.format(descs64=descs[64], descs32=descs[32],
+                                         fd_map_idx=fd_map_idx, fd_map=fd_map)
+    return mnem_tab, descs, inline_cases
+
+# Operand check and register index bit 3 for inline encoding.
+INLINE_REGTYS = {1: ("FE_INL_GP", True), 5: ("FE_INL_MMX", False),
+                 6: ("FE_INL_XMM", True)}
+
+def encode_inline(mnem, enc, immsz, tys_i, opc_s):
+    """
+    Generate a case for the inline encoder which handles the first variant of
+    mnem, if it is a simple register/immediate-only legacy encoding. If the
+    operand checks fail, the case falls through to the table-based encoder,
+    which tries all variants. The emitted code must exactly match encode.c.
+    """
+    opc, *flags = opc_s.split("|")
+    opc = int(opc, 16)
+    flags = set(flags)
+    # Memory operands, VEX, and second opcode bytes are left to the table.
+    if flags - {"OPC_0F", "OPC_0F38", "OPC_0F3A", "OPC_66", "OPC_F2",
+                "OPC_F3", "OPC_REXW"}:
+        return ""
+    if enc not in ("NP", "MR", "RM", "MI", "RMI", "O", "OI", "I"):
+        return ""
+    if (opc & 0xc000) == 0xc000 or (enc == "NP" and opc & 0xff00):
+        return ""
+    if enc in ("O", "OI") and (opc & ~7) == 0x90 and not flags: # XCHG with AX
+        return ""
+    if immsz not in (0, 1, 2, 4, 8) or (immsz == 0) != (enc in ("NP", "MR", "RM", "O")):
+        return ""
+
+    tys = [(tys_i >> (4 * i)) & 0xf for i in range(4)]
+    ops = {"NP": (), "MR": ("rm", "reg"), "RM": ("reg", "rm"),
+           "MI": ("rm", "imm"), "RMI": ("reg", "rm", "imm"), "O": ("o",),
+           "OI": ("o", "imm"), "I": ("imm",)}[enc]
+    conds, rex_bits = [], []
+    if (opc & ~7) == 0x90 and not flags: # see fe_enc64_impl
+        conds.append("op0 != FE_AX")
+    reg, rm = f"{(opc >> 8) & 7}", None
+    for i, kind in enumerate(ops):
+        if kind == "imm":
+            if immsz < 8:
+                conds.append(f"(int{immsz*8}_t) op{i} == op{i}")
+            continue
+        if tys[i] not in INLINE_REGTYS:
+            return ""
+        check, extended = INLINE_REGTYS[tys[i]]
+        conds.append(f"{check}(op{i})")
+        if kind == "reg":
+            reg = f"(op{i} & 7)"
+            if extended: rex_bits.append(f"(op{i} >> 1 & 4)")
+        else:
+            rm = f"(op{i} & 7)"
+            if extended: rex_bits.append(f"(op{i} >> 3 & 1)")
+    if any(tys[len(ops):]) or (enc in ("NP", "I") and immsz == 0 and any(tys)):
+        return ""
+
+    res = f"case {mnem}:\n"
+    if conds:
+        res += f"    if ({' && '.join(conds)}) {{\n"
+    else:
+        res += "    {\n"
+    res += "        uint8_t* p = *buf;\n"
+    for prefix in ("66", "F2", "F3"):
+        if "OPC_" + prefix in flags:
+            res += f"        *p++ = 0x{prefix.lower()};\n"
+    if "OPC_REXW" in flags:
+        res += f"        *p++ = {' | '.join(['0x48'] + rex_bits)};\n"
+    elif rex_bits:
+        res += f"        if ({' | '.join(rex_bits)})\n"
+        res += f"            *p++ = {' | '.join(['0x40'] + rex_bits)};\n"
+    for esc, seq in (("OPC_0F", "0x0f"), ("OPC_0F38", "0x0f; *p++ = 0x38"),
+                     ("OPC_0F3A", "0x0f; *p++ = 0x3a")):
+        if esc in flags:
+            res += f"        *p++ = {seq};\n"
+    if enc in ("O", "OI"):
+        res += f"        *p++ = 0x{opc & 0xf8:02x} | {rm};\n"
+    else:
+        res += f"        *p++ = 0x{opc & 0xff:02x};\n"
+    if enc in ("MR", "RM", "MI", "RMI"):
+        res += f"        *p++ = 0xc0 | {reg} << 3 | {rm};\n"
+    if immsz:
+        imm = f"op{ops.index('imm')}"
+        for i in range(immsz):
+            res += f"        *p++ = {imm}{f' >> {8*i}' if i else ''};\n"
+    res += "        *buf = p;\n"
+    res += "        return 0;\n"
+    res += "    }\n"
+    res += "    break;\n"
+    return res
+
+# ISA extension groups, see "%ext" lines in instrs.txt. The base group is always
+# included.
+EXTENSIONS = ("base", "system", "x87", "mmx", "3dnow", "sse", "avx", "avx512",
+              "bmi")
+
+def parse_extensions(arg):
+    exts = set(EXTENSIONS if arg == "all" else arg.split(",")) | {"base"}
+    if not exts <= set(EXTENSIONS):
+        raise argparse.ArgumentTypeError("unknown extensions: " +
+                                         ",".join(sorted(exts - set(EXTENSIONS))))
+    return exts
 
 if __name__ == "__main__":
     parser = argparse.ArgumentParser()
     parser.add_argument("--32", dest="modes", action="append_const", const=32)
     parser.add_argument("--64", dest="modes", action="append_const", const=64)
     parser.add_argument("--with-undoc", action="store_true")
+    parser.add_argument("--profile", type=load_profile, metavar="builtin|FILE",
+                        help="order decode tables by instruction frequency")
+    parser.add_argument("--extensions", type=parse_extensions, default="all",
+                        metavar="all|EXT,...",
+                        help="decode only these ISA extensions (%s)" %
+                             ", ".join(EXTENSIONS))
     parser.add_argument("table", type=argparse.FileType('r'))
     parser.add_argument("decode_mnems", type=argparse.FileType('w'))
     parser.add_argument("decode_table", type=argparse.FileType('w'))
     parser.add_argument("encode_mnems", type=argparse.FileType('w'))
     parser.add_argument("encode_table", type=argparse.FileType('w'))
+    parser.add_argument("encode_inline", type=argparse.FileType('w'))
     args = parser.parse_args()
 
-    entries = []
+    entries, flow, all_mnems = [], {}, set()
+    decode_entries, ext = [], None
     for line in args.table.read().splitlines():
         if not line or line[0] == "#": continue
+        if line[0] == "%":
+            directive, ext = line[1:].split()
+            if directive != "ext" or ext not in EXTENSIONS:
+                raise Exception(f"invalid directive {line}")
+            continue
+        if line[0] == "@":
+            mnem, *tokens = line[1:].split()
+            flow[mnem] = DataFlow.parse(tokens)
+            continue
         line, weak = (line, False) if line[0] != "*" else (line[1:], True)
         opcode_string, desc_string = tuple(line.split(maxsplit=1))
         opcode, desc = Opcode.parse(opcode_string), InstrDesc.parse(desc_string)
+        all_mnems.add(desc.mnemonic)
         if "UNDOC" not in desc.flags or args.with_undoc:
             entries.append((weak, opcode, desc))
-
-    fd_mnem_list, fd_table = decode_table(entries, args.modes)
+            # The encoder always supports all extensions.
+            if ext in args.extensions:
+                decode_entries.append((weak, opcode, desc))
+
+    for mnem in flow:
+        if mnem.partition("/")[0] not in all_mnems:
+            raise Exception(f"data flow for unknown mnemonic {mnem}")
+
+    print("extensions:", ",".join(e for e in EXTENSIONS if e in args.extensions))
+    fd_mnem_list, fd_table = decode_table(decode_entries, args.modes,
+                                          args.profile, flow,
+                                          {d.mnemonic for _, _, d in entries})
     args.decode_mnems.write(fd_mnem_list)
     args.decode_table.write(fd_table)
 
-    fe_mnem_list, fe_code = encode_table(entries)
+    fe_mnem_list, fe_code, fe_inline = encode_table(entries, args.modes)
     args.encode_mnems.write(fe_mnem_list)
     args.encode_table.write(fe_code)
+    args.encode_inline.write(fe_inline)
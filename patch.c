@@ -0,0 +1,182 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <fadec.h>
+#include <fadec-enc.h>
+
+
+#define UNLIKELY(x) __builtin_expect((x), 0)
+
+int
+fe_patch_window(const uint8_t* code, size_t len, size_t min_size)
+{
+    size_t size = 0;
+    while (size < min_size)
+    {
+        int res = fd_insn_length(code + size, len - size, 64);
+        if (UNLIKELY(res < 0))
+            return -1;
+        size += res;
+    }
+    // An instruction never exceeds len, so size <= len.
+    return size <= FE_PATCH_MAX_SIZE ? (int) size : -1;
+}
+
+void
+fe_patch_nops(uint8_t* buf, size_t len)
+{
+    // Recommended NOP sequences (0f 1f /0 with increasing displacement size
+    // and SIB byte), 10 and 11 bytes with additional 66/2e prefixes.
+    static const uint8_t nops[11][11] = {
+        {0x90},
+        {0x66, 0x90},
+        {0x0f, 0x1f, 0x00},
+        {0x0f, 0x1f, 0x40, 0x00},
+        {0x0f, 0x1f, 0x44, 0x00, 0x00},
+        {0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00},
+        {0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00},
+        {0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+        {0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+        {0x66, 0x2e, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+        {0x66, 0x66, 0x2e, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+    };
+    while (len)
+    {
+        size_t size = len < 11 ? len : 11;
+        for (size_t i = 0; i < size; i++)
+            buf[i] = nops[size - 1][i];
+        buf += size;
+        len -= size;
+    }
+}
+
+int
+fe_patch_relocate(uint8_t** buf, uint64_t buf_addr, const uint8_t* code,
+                  size_t len, uint64_t code_addr)
+{
+    uint8_t* start = *buf;
+    for (size_t off = 0; off < len;)
+    {
+        FdHeader hdr;
+        FdInstr instr;
+        int res = fd_decode_header(code + off, len - off, 64, &hdr);
+        if (UNLIKELY(res < 0))
+            goto fail;
+        fd_header_expand(code + off, &hdr, &instr);
+
+        uint64_t src = code_addr + off;
+        uint64_t dst = buf_addr + (*buf - start);
+        if (FD_OP_TYPE(&instr, 0) == FD_OT_OFF)
+        {
+            if (fe_relocate64(buf, dst, &instr, src))
+                goto fail;
+            off += res;
+            continue;
+        }
+
+        for (int i = 0; i < res; i++)
+            (*buf)[i] = code[off + i];
+        for (int i = 0; i < 4; i++)
+        {
+            if (FD_OP_TYPE(&instr, i) != FD_OT_MEM ||
+                FD_OP_BASE(&instr, i) != FD_REG_IP)
+                continue;
+            int64_t disp = FD_OP_DISP(&instr, i) + (int64_t) (src - dst);
+            if (disp != (int32_t) disp)
+                goto fail;
+            uint8_t* field = *buf + FD_HDR_DISP_OFF(&hdr);
+            for (int j = 0; j < 4; j++)
+                field[j] = disp >> 8 * j;
+        }
+        *buf += res;
+        off += res;
+    }
+    return 0;
+
+fail:
+    *buf = start;
+    return -1;
+}
+
+int
+fe_patch_writes(FePatch* patch, const uint8_t* code)
+{
+    uint64_t addr = patch->addr;
+    uint64_t end = addr + patch->size;
+    if (UNLIKELY(!patch->size || patch->size > FE_PATCH_MAX_SIZE))
+        return -1;
+
+    // Current bytes of the window with the new bytes in [from, end).
+#define PATCH_BYTE(a, from) ((a) >= (from) && (a) < end ? \
+                             patch->code[(a) - addr] : code[(int64_t) ((a) - addr)])
+
+    FePatchWrite* writes = patch->writes;
+    unsigned count = 0;
+    unsigned block = (addr ^ (end - 1)) < 8 ? 8 : (addr ^ (end - 1)) < 16 ? 16 : 0;
+    if (block)
+    {
+        // The window is inside an aligned block, use a single store.
+        uint64_t base = addr & -(uint64_t) block;
+        writes[count] = (FePatchWrite) { .addr = base, .size = block, .sync = 1 };
+        for (unsigned i = 0; i < block; i++)
+            writes[count].bytes[i] = PATCH_BYTE(base + i, addr);
+        count++;
+    }
+    else
+    {
+        writes[count++] = (FePatchWrite) {
+            .addr = addr, .size = 1, .sync = 1, .bytes = {0xcc}
+        };
+        // Write the remaining bytes in aligned 8-byte stores, the first byte
+        // remains INT3 until all other bytes are written.
+        for (uint64_t base = (addr + 1) & -8ull; base < end; base += 8)
+        {
+            FePatchWrite* write = &writes[count++];
+            *write = (FePatchWrite) { .addr = base, .size = 8 };
+            for (unsigned i = 0; i < 8; i++)
+                write->bytes[i] = base + i == addr ? 0xcc
+                                                   : PATCH_BYTE(base + i, addr);
+        }
+        writes[count - 1].sync = 1;
+        writes[count++] = (FePatchWrite) {
+            .addr = addr, .size = 1, .sync = 1, .bytes = {patch->code[0]}
+        };
+    }
+#undef PATCH_BYTE
+
+    patch->write_count = count;
+    return 0;
+}
+
+int
+fe_patch_plan(FePatch* patch, const uint8_t* code, size_t len, uint64_t addr,
+              const FeInstr* instrs, size_t count)
+{
+    uint8_t* cur = patch->code;
+    for (size_t i = 0; i < count; i++)
+    {
+        // Ensure that no instruction exceeds the window.
+        uint8_t tmp[FE_MAX_INSTR_SIZE];
+        uint8_t* tmp_cur = tmp;
+        const FeInstr* instr = &instrs[i];
+        uint64_t instr_addr = addr + (cur - patch->code);
+        if (fe_enc64_at(&tmp_cur, instr_addr, instr->mnem, instr->ops[0],
+                        instr->ops[1], instr->ops[2], instr->ops[3]))
+            return -1;
+        if (tmp_cur - tmp > patch->code + FE_PATCH_MAX_SIZE - cur)
+            return -1;
+        for (uint8_t* p = tmp; p < tmp_cur; p++)
+            *cur++ = *p;
+    }
+
+    size_t new_size = cur - patch->code;
+    int size = fe_patch_window(code, len, new_size ? new_size : 1);
+    if (size < 0)
+        return -1;
+    fe_patch_nops(cur, size - new_size);
+
+    patch->addr = addr;
+    patch->size = size;
+    return fe_patch_writes(patch, code);
+}
@@ -0,0 +1,113 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <fadec.h>
+
+
+// See DataFlow in parseinstrs.py.
+struct InstrRegs
+{
+    uint32_t regs_r;
+    uint32_t regs_w;
+    uint16_t flags_r;
+    uint16_t flags_w;
+    uint8_t access;
+    uint8_t misc;
+};
+
+#define REGS_REPCX 1
+#define REGS_NODX8 2
+#define REGS_BYOPS 4
+#define REGS_VSIB 8
+
+static uint64_t
+fd_reg_mask(const FdInstr* instr, int idx)
+{
+    unsigned reg = FD_OP_REG(instr, idx);
+    switch (FD_OP_REG_TYPE(instr, idx)) {
+    case FD_RT_GPL: return reg < 16 ? FD_REGMASK_GP(reg) : 0;
+    case FD_RT_GPH: return FD_REGMASK_GP(reg - 4);
+    case FD_RT_VEC: return FD_REGMASK_VEC(reg);
+    case FD_RT_MASK: return FD_REGMASK_MASK(reg);
+    case FD_RT_MMX: return FD_REGMASK_MMX(reg);
+    default: return 0;
+    }
+}
+
+void
+fd_instr_regs(const FdInstr* instr, uint64_t* read_mask, uint64_t* write_mask,
+              uint32_t* flags_rw)
+{
+    static const struct InstrRegs regs[] = {
+#define FD_DECODE_TABLE_REGS
+#include <fadec-table.inc>
+#undef FD_DECODE_TABLE_REGS
+    };
+    static const uint8_t regs_idx[] = {
+#define FD_DECODE_TABLE_REGS_IDX
+#include <fadec-table.inc>
+#undef FD_DECODE_TABLE_REGS_IDX
+    };
+
+    unsigned opcount = 0;
+    while (opcount < 4 && FD_OP_TYPE(instr, opcount) != FD_OT_NONE)
+        opcount++;
+
+    const struct InstrRegs* entry = &regs[regs_idx[FD_TYPE(instr)]];
+    if (entry->misc & REGS_BYOPS)
+        entry += opcount ? opcount - 1 : 0;
+
+    uint64_t read = entry->regs_r;
+    uint64_t write = entry->regs_w;
+    if ((entry->misc & REGS_NODX8) && FD_OP_SIZE(instr, 0) == 1)
+    {
+        read &= ~FD_REGMASK_GP(FD_REG_DX);
+        write &= ~FD_REGMASK_GP(FD_REG_DX);
+    }
+    if ((entry->misc & REGS_REPCX) && (FD_HAS_REP(instr) || FD_HAS_REPNZ(instr)))
+    {
+        read |= FD_REGMASK_GP(FD_REG_CX);
+        write |= FD_REGMASK_GP(FD_REG_CX);
+    }
+
+    for (unsigned i = 0; i < opcount; i++)
+    {
+        unsigned access = entry->access >> 2 * i & 3;
+        if (FD_OP_TYPE(instr, i) == FD_OT_REG)
+        {
+            uint64_t mask = fd_reg_mask(instr, i);
+            // Writes to 8/16-bit registers keep the remaining bits.
+            unsigned reg_type = FD_OP_REG_TYPE(instr, i);
+            bool partial = reg_type == FD_RT_GPH ||
+                           (reg_type == FD_RT_GPL && FD_OP_SIZE(instr, i) < 4);
+            if ((access & 1) || ((access & 2) && partial))
+                read |= mask;
+            if (access & 2)
+                write |= mask;
+        }
+        else if (FD_OP_TYPE(instr, i) == FD_OT_MEM)
+        {
+            // Address registers are always read, FD_REG_IP is not tracked.
+            if (FD_OP_BASE(instr, i) < 16)
+                read |= FD_REGMASK_GP(FD_OP_BASE(instr, i));
+            if (FD_OP_INDEX(instr, i) != FD_REG_NONE)
+                read |= entry->misc & REGS_VSIB ?
+                        FD_REGMASK_VEC(FD_OP_INDEX(instr, i)) :
+                        FD_REGMASK_GP(FD_OP_INDEX(instr, i));
+        }
+    }
+
+    // With merge-masking, the unselected elements of the destination remain.
+    if (FD_MASKREG(instr))
+    {
+        read |= FD_REGMASK_MASK(FD_MASKREG(instr));
+        if (!FD_MASKZERO(instr) && FD_OP_TYPE(instr, 0) == FD_OT_REG &&
+            FD_OP_REG_TYPE(instr, 0) == FD_RT_VEC)
+            read |= fd_reg_mask(instr, 0);
+    }
+
+    *read_mask = read;
+    *write_mask = write;
+    *flags_rw = entry->flags_r | (uint32_t) entry->flags_w << 16;
+}
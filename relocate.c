@@ -0,0 +1,219 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <fadec.h>
+#include <fadec-enc.h>
+
+
+#define UNLIKELY(x) __builtin_expect((x), 0)
+
+// Mapping from decoded instructions to 64-bit encoder mnemonics, generated by
+// parseinstrs.py. For every instruction type, entries are ordered from most to
+// least specific and the last one is marked with FD_MAP_LAST. ops has one byte
+// per operand with the operand type (FD_OT_*) in bits 4-6 and the register type
+// (FD_RT_*, GPH as GPL) in bits 0-3. sizes has 3 bits per operand and a fifth
+// field for the instruction width, each log2(size)+1 or 0 for any size.
+struct FdMapEntry {
+    uint32_t ops;
+    uint16_t mnem;
+    uint16_t sizes;
+    uint8_t attrs;
+};
+
+// Required REP/LOCK prefix: 0 = any, 1 = LOCK, 2 = REP/REPZ, 3 = REPNZ.
+#define FD_MAP_PREFIX(attrs) ((attrs) & 3)
+// Memory operand has a vector index register.
+#define FD_MAP_VSIB(attrs) (((attrs) >> 2) & 1)
+#define FD_MAP_LAST 0x80
+
+static const uint16_t fd_map_idx[] = {
+#define FE_ENCODE_FD_MAP_IDX
+#include <fadec-enc-cases.inc>
+#undef FE_ENCODE_FD_MAP_IDX
+};
+
+static const struct FdMapEntry fd_map[] = {
+#define FE_ENCODE_FD_MAP
+#include <fadec-enc-cases.inc>
+#undef FE_ENCODE_FD_MAP
+};
+
+static unsigned
+fd_map_size_code(unsigned size)
+{
+    return size ? __builtin_ctz(size) + 1 : 0;
+}
+
+static bool
+fd_map_match(const struct FdMapEntry* entry, uint32_t ops, unsigned sizes,
+             unsigned prefix)
+{
+    if (entry->ops != ops)
+        return false;
+    unsigned entry_prefix = FD_MAP_PREFIX(entry->attrs);
+    // Expand non-zero size fields into a mask of 3 bits each.
+    unsigned mask = entry->sizes | entry->sizes >> 1 | entry->sizes >> 2;
+    mask = (mask & 011111) * 7;
+    return (sizes & mask) == entry->sizes &&
+           (!entry_prefix || entry_prefix == prefix);
+}
+
+// Whether a REP/REPNZ prefix changes the instruction: string instructions
+// have entries that require it, and it is an XACQUIRE/XRELEASE hint for some
+// memory operations.
+static bool
+fd_map_rep_used(const FdInstr* instr, unsigned type)
+{
+    for (const struct FdMapEntry* entry = &fd_map[fd_map_idx[type]];; entry++)
+    {
+        if (FD_MAP_PREFIX(entry->attrs) >= 2)
+            return true;
+        if (entry->attrs & FD_MAP_LAST)
+            break;
+    }
+    if (FD_HAS_LOCK(instr))
+        return true;
+    if (FD_OP_TYPE(instr, 0) != FD_OT_MEM)
+        return false;
+    return type == FDI_XCHG ||
+           (type == FDI_MOV && FD_OP_TYPE(instr, 1) == FD_OT_IMM);
+}
+
+int
+fe_from_fd(FeInstr* out, const FdInstr* instr, uint64_t addr)
+{
+    unsigned type = FD_TYPE(instr);
+    if (UNLIKELY(!FD_IS64(instr) || instr->evex ||
+                 type >= sizeof fd_map_idx / sizeof fd_map_idx[0]))
+        return -1;
+
+    uint32_t ops = 0;
+    unsigned sizes = fd_map_size_code(FD_OPSIZE(instr)) << 12;
+    for (int i = 0; i < 4; i++)
+    {
+        unsigned ot = FD_OP_TYPE(instr, i);
+        unsigned rt = ot == FD_OT_REG ? FD_OP_REG_TYPE(instr, i) : 0;
+        // Without masking, broadcast, or rounding, EVEX is only visible in the
+        // vector registers: VEX cannot encode ZMM and registers 16-31.
+        if (UNLIKELY(rt == FD_RT_VEC && (FD_OP_REG(instr, i) >= 16 ||
+                                         FD_OP_SIZE(instr, i) == 64)))
+            return -1;
+        if (UNLIKELY(ot == FD_OT_MEM && FD_OP_INDEX(instr, i) >= 16 &&
+                     FD_OP_INDEX(instr, i) != FD_REG_NONE))
+            return -1;
+        ops |= (ot << 4 | (rt == FD_RT_GPH ? FD_RT_GPL : rt)) << 8 * i;
+        if (ot != FD_OT_NONE)
+            sizes |= fd_map_size_code(FD_OP_SIZE(instr, i)) << 3 * i;
+    }
+    unsigned prefix = FD_HAS_LOCK(instr) ? 1 : FD_HAS_REP(instr) ? 2 :
+                      FD_HAS_REPNZ(instr) ? 3 : 0;
+
+    const struct FdMapEntry* entry = &fd_map[fd_map_idx[type]];
+    while (!fd_map_match(entry, ops, sizes, prefix))
+        if (entry++->attrs & FD_MAP_LAST)
+            return -1;
+    // Other REP/REPNZ prefixes are ignored and can be dropped.
+    if (UNLIKELY((FD_HAS_REP(instr) || FD_HAS_REPNZ(instr)) &&
+                 FD_MAP_PREFIX(entry->attrs) < 2 && fd_map_rep_used(instr, type)))
+        return -1;
+
+    uint64_t mnem = entry->mnem;
+    if (FD_SEGMENT(instr) != FD_REG_NONE)
+        mnem |= FE_SEG(FD_SEGMENT(instr));
+    if (FD_ADDRSIZE(instr) == 4)
+        mnem |= FE_ADDR32;
+    out->mnem = mnem;
+
+    for (int i = 0; i < 4; i++)
+    {
+        FeOp op = 0;
+        switch (FD_OP_TYPE(instr, i))
+        {
+        case FD_OT_REG:
+            op = FD_OP_REG_TYPE(instr, i) << 8 | FD_OP_REG(instr, i);
+            break;
+        case FD_OT_IMM:
+            op = FD_OP_IMM(instr, i);
+            break;
+        case FD_OT_OFF:
+            op = addr + FD_SIZE(instr) + FD_OP_IMM(instr, i);
+            break;
+        case FD_OT_MEM: {
+            unsigned base = FD_OP_BASE(instr, i);
+            unsigned idx = FD_OP_INDEX(instr, i);
+            int64_t disp = FD_OP_DISP(instr, i);
+            // RIP-relative offsets for the encoder are relative to the start
+            // of the instruction.
+            if (base == FD_REG_IP)
+                disp += FD_SIZE(instr);
+            // Memory offsets (moffs) can have a 64-bit address.
+            if (UNLIKELY(disp != (int32_t) disp))
+                return -1;
+            unsigned fe_base = base == FD_REG_NONE ? 0 :
+                               base == FD_REG_IP ? FE_IP : FE_AX + base;
+            unsigned fe_idx = idx == FD_REG_NONE ? 0 :
+                              FD_MAP_VSIB(entry->attrs) ? FE_XMM0 + idx :
+                              FE_AX + idx;
+            unsigned scale = fe_idx ? 1 << FD_OP_SCALE(instr, i) : 0;
+            op = FE_MEM(fe_base, scale, fe_idx, disp);
+            break;
+        }
+        default:
+            break;
+        }
+        out->ops[i] = op;
+    }
+    return 0;
+}
+
+int
+fe_relocate64(uint8_t** buf, uint64_t buf_addr, const FdInstr* instr,
+              uint64_t instr_addr)
+{
+    FeInstr fe;
+    if (fe_from_fd(&fe, instr, instr_addr))
+        return -1;
+
+    for (int i = 0; i < 4; i++)
+    {
+        if (FD_OP_TYPE(instr, i) != FD_OT_MEM ||
+            FD_OP_BASE(instr, i) != FD_REG_IP)
+            continue;
+        // The encoder subtracts the size of the new instruction, which is at
+        // most FE_MAX_INSTR_SIZE bytes.
+        int64_t off = (int32_t) fe.ops[i] + (int64_t) (instr_addr - buf_addr);
+        if (off > INT32_MAX || off < INT32_MIN + FE_MAX_INSTR_SIZE)
+            return -1;
+        fe.ops[i] = FE_MEM(FE_IP, 0, 0, off);
+    }
+
+    uint8_t* start = *buf;
+    if (!fe_enc64_at(buf, buf_addr, fe.mnem, fe.ops[0], fe.ops[1], fe.ops[2],
+                     fe.ops[3]))
+        return 0;
+
+    unsigned type = FD_TYPE(instr);
+    if (type != FDI_JCXZ && type != FDI_LOOP && type != FDI_LOOPZ &&
+        type != FDI_LOOPNZ)
+        goto fail;
+
+    // JRCXZ and LOOP only have an 8-bit offset. Branch to a near jump to the
+    // target and skip it with a short jump otherwise. The length of the first
+    // branch depends on its prefixes, so it is encoded twice.
+    if (fe_enc64_at(buf, buf_addr, fe.mnem, buf_addr))
+        goto fail;
+    uint64_t skip_addr = buf_addr + (*buf - start);
+    uint64_t jmp_addr = skip_addr + 2;
+    uint64_t end_addr = jmp_addr + 5;
+    *buf = start;
+    if (fe_enc64_at(buf, buf_addr, fe.mnem, jmp_addr) ||
+        fe_enc64_at(buf, skip_addr, FE_JMP, end_addr) ||
+        fe_enc64_at(buf, jmp_addr, FE_JMP|FE_JMPL, fe.ops[0]))
+        goto fail;
+    return 0;
+
+fail:
+    *buf = start;
+    return -1;
+}
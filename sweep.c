@@ -0,0 +1,137 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <fadec.h>
+#include <fadec-sweep.h>
+
+
+// Chunk boundaries are aligned such that every thread writes to different
+// cache lines of the bitmap (512 bytes of code are 64 bytes of bitmap).
+#define CHUNK_ALIGN 512
+// Smaller chunks are not worth the overhead of a thread.
+#define CHUNK_MIN 65536
+#define MAX_THREADS 256
+
+struct SweepChunk {
+    const uint8_t* buffer;
+    size_t len;
+    int mode;
+    uint8_t* starts;
+    size_t start;
+    size_t end;
+    // Offset of the first instruction after the chunk, i.e. at or after end.
+    size_t exit;
+};
+
+#define BIT_TEST(starts, off) (((starts)[(off) / 8] >> ((off) % 8)) & 1)
+#define BIT_SET(starts, off) ((starts)[(off) / 8] |= 1 << ((off) % 8))
+#define BIT_CLEAR(starts, off) ((starts)[(off) / 8] &= ~(1 << ((off) % 8)))
+
+static void*
+sweep_chunk(void* arg)
+{
+    struct SweepChunk* chunk = arg;
+    const uint8_t* buffer = chunk->buffer;
+    uint8_t* starts = chunk->starts;
+
+    memset(starts + chunk->start / 8, 0, (chunk->end + 7) / 8 - chunk->start / 8);
+
+    size_t off = chunk->start;
+    while (off < chunk->end)
+    {
+        int res = fd_insn_length(buffer + off, chunk->len - off, chunk->mode);
+        if (res > 0)
+        {
+            BIT_SET(starts, off);
+            off += res;
+        }
+        else
+            off++;
+    }
+    chunk->exit = off;
+    return NULL;
+}
+
+// Re-decode the beginning of a chunk from the actual entry point (the exit of
+// the previous chunk) until reaching an instruction of the speculative sweep.
+// From there on, both sweeps are identical. Returns the exit of the chunk.
+static size_t
+sweep_repair(struct SweepChunk* chunk, size_t entry)
+{
+    const uint8_t* buffer = chunk->buffer;
+    uint8_t* starts = chunk->starts;
+
+    // Drop instructions which overlap with the last one of the previous chunk.
+    for (size_t off = chunk->start; off < entry; off++)
+        BIT_CLEAR(starts, off);
+
+    size_t off = entry;
+    while (off < chunk->end && !BIT_TEST(starts, off))
+    {
+        int res = fd_insn_length(buffer + off, chunk->len - off, chunk->mode);
+        if (res > 0)
+        {
+            BIT_SET(starts, off);
+            for (size_t i = off + 1; i < off + res && i < chunk->end; i++)
+                BIT_CLEAR(starts, i);
+            off += res;
+        }
+        else
+            off++;
+    }
+
+    return off < chunk->end ? chunk->exit : off;
+}
+
+size_t
+fd_sweep_parallel(const uint8_t* buffer, size_t len, int mode,
+                  uint8_t* starts, unsigned threads)
+{
+    size_t max_threads = len / CHUNK_MIN;
+    if (max_threads > threads)
+        max_threads = threads;
+    if (max_threads > MAX_THREADS)
+        max_threads = MAX_THREADS;
+    if (max_threads <= 1)
+        return fd_sweep(buffer, len, mode, starts);
+
+    size_t chunk_size = (len / max_threads + CHUNK_ALIGN - 1) & -CHUNK_ALIGN;
+
+    struct SweepChunk chunks[MAX_THREADS];
+    pthread_t tids[MAX_THREADS];
+    bool started[MAX_THREADS];
+    size_t count = 0;
+    for (size_t start = 0; start < len; start += chunk_size, count++)
+    {
+        struct SweepChunk* chunk = &chunks[count];
+        chunk->buffer = buffer;
+        chunk->len = len;
+        chunk->mode = mode;
+        chunk->starts = starts;
+        chunk->start = start;
+        chunk->end = len - start > chunk_size ? start + chunk_size : len;
+        // The first chunk is handled by this thread.
+        started[count] = count > 0 &&
+                         !pthread_create(&tids[count], NULL, sweep_chunk, chunk);
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (started[i])
+            pthread_join(tids[i], NULL);
+        else
+            sweep_chunk(&chunks[i]);
+    }
+
+    size_t entry = chunks[0].exit;
+    for (size_t i = 1; i < count; i++)
+        entry = sweep_repair(&chunks[i], entry);
+
+    size_t instrs = 0;
+    for (size_t i = 0; i < (len + 7) / 8; i++)
+        instrs += __builtin_popcount(starts[i]);
+    return instrs;
+}
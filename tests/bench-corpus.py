@@ -0,0 +1,98 @@
+#!/usr/bin/python3
+
+# Generate a synthetic 64-bit instruction corpus for the benchmark from
+# instrs.txt: one or more concrete encodings per opcode entry, cycling through
+# register and different memory operand forms. Candidates are emitted as
+# length-prefixed byte strings; the benchmark drops those which do not decode
+# exactly (e.g., due to unusual operand constraints).
+
+import argparse
+import os
+import sys
+
+sys.dont_write_bytecode = True
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+from parseinstrs import ENCODINGS, InstrDesc, Opcode
+
+MODRM_FORMS = (
+    lambda reg, i: bytes([0xc0 | reg << 3 | (i * 3) & 7]),           # register
+    lambda reg, i: bytes([0x40 | reg << 3 | 3, 0x10]),               # [rbx+0x10]
+    lambda reg, i: bytes([0x84 | reg << 3, 0x48, 0x00, 0x01, 0, 0]), # [rax+2*rcx+0x100]
+    lambda reg, i: bytes([0x05 | reg << 3, 0x40, 0, 0, 0]),          # [rip+0x40]
+)
+
+def encode_entry(opcode, desc, idx):
+    flags = ENCODINGS[desc.encoding]
+    if "ONLY32" in desc.flags:
+        return None
+
+    legacy = {"66": b"\x66", "F2": b"\xf2", "F3": b"\xf3"}.get(opcode.prefix, b"")
+    rexw = opcode.rexw == "1"
+    if opcode.vex:
+        pp = {"66": 1, "F3": 2, "F2": 3}.get(opcode.prefix, 0)
+        vexl = opcode.vexl == "1"
+        res = bytes([0xc4, 0xe0 | opcode.escape, rexw << 7 | 0x78 | vexl << 2 | pp])
+    elif opcode.evex:
+        pp = {"66": 1, "F3": 2, "F2": 3}.get(opcode.prefix, 0)
+        vecl = {"0": 0, "1": 2}.get(opcode.vexl, idx % 3)
+        res = bytes([0x62, 0xf0 | opcode.escape, rexw << 7 | 0x7c | pp,
+                     vecl << 5 | 0x08 | idx & 1]) # Alternate k0/k1 masking
+    else:
+        res = legacy + (b"\x48" if rexw else b"")
+        res += [b"", b"\x0f", b"\x0f\x38", b"\x0f\x3a"][opcode.escape]
+
+    res += bytes([opcode.opc + (idx & 7 if opcode.extended else 0)])
+
+    if opcode.opcext:
+        res += bytes([opcode.opcext])
+    elif flags.modrm:
+        reg, rm = opcode.modreg or (None, "rm")
+        reg = reg if reg is not None else idx % 7
+        if "VSIB" in desc.flags:
+            form = 2
+        elif rm == "r":
+            form = 0
+        elif rm == "m":
+            form = 1 + idx % 3
+        else:
+            form = idx % 4
+        res += MODRM_FORMS[form](reg, idx)
+
+    if "SIZE_8" in desc.flags:
+        opsz = 1
+    elif rexw or "DEF64" in desc.flags or "FORCE64" in desc.flags:
+        opsz = 8
+    else:
+        opsz = 4
+    if flags.imm_control == 2:
+        res += bytes(range(1, 9))
+    elif flags.imm_control >= 3:
+        res += bytes(range(1, 1 + desc.imm_size(opsz)))
+    return res if len(res) <= 15 else None
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--copies", type=int, default=2)
+    parser.add_argument("table", type=argparse.FileType('r'))
+    parser.add_argument("out", type=argparse.FileType('w'))
+    args = parser.parse_args()
+
+    candidates = []
+    for line in args.table.read().splitlines():
+        if not line or line[0] in "#@%": continue
+        line = line[1:] if line[0] == "*" else line
+        opcode_string, desc_string = tuple(line.split(maxsplit=1))
+        opcode, desc = Opcode.parse(opcode_string), InstrDesc.parse(desc_string)
+        if "UNDOC" in desc.flags:
+            continue
+        for i in range(args.copies):
+            enc = encode_entry(opcode, desc, len(candidates) + i)
+            if enc:
+                candidates.append(enc)
+
+    data = b"".join(bytes([len(c)]) + c for c in candidates)
+    lines = [", ".join(f"0x{b:02x}" for b in data[i:i+16])
+             for i in range(0, len(data), 16)]
+    args.out.write("static const uint8_t bench_corpus[] = {\n    ")
+    args.out.write(",\n    ".join(lines))
+    args.out.write(",\n};\n")
@@ -0,0 +1,691 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <fadec.h>
+#include <fadec-enc.h>
+#include <fadec-enc-inline.h>
+
+#include "bench-corpus.inc"
+
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_RDTSC 1
+#else
+#define HAVE_RDTSC 0
+#endif
+
+enum {
+    CLASS_LEGACY,
+    CLASS_0F,
+    CLASS_0F38,
+    CLASS_VEX,
+    CLASS_EVEX,
+    CLASS_ALL,
+    CLASS_COUNT,
+};
+
+static const char* const class_names[CLASS_COUNT] = {
+    "legacy", "0f", "0f38/3a", "vex", "evex", "all",
+};
+
+typedef struct {
+    uint8_t* buf;
+    size_t size;
+    size_t capacity;
+    size_t count;
+} Corpus;
+
+typedef uint64_t (*BenchFn)(const Corpus* corpus, int mode);
+
+static volatile uint64_t sink;
+static uint64_t bench_ns = 50000000;
+
+static
+uint64_t
+time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static
+uint64_t
+time_tsc(void)
+{
+#if HAVE_RDTSC
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static
+void
+corpus_append(Corpus* corpus, const uint8_t* buf, size_t len)
+{
+    if (corpus->size + len > corpus->capacity) {
+        corpus->capacity = corpus->capacity * 2 + len + 4096;
+        corpus->buf = realloc(corpus->buf, corpus->capacity);
+        if (!corpus->buf) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(corpus->buf + corpus->size, buf, len);
+    corpus->size += len;
+    corpus->count++;
+}
+
+// Classify an instruction by the path it takes through the decode table.
+static
+int
+classify(const uint8_t* buf, size_t len, int mode)
+{
+    size_t i = 0;
+    while (i < len && (buf[i] == 0x66 || buf[i] == 0x67 || buf[i] == 0xf0 ||
+                       buf[i] == 0xf2 || buf[i] == 0xf3 || buf[i] == 0x26 ||
+                       buf[i] == 0x2e || buf[i] == 0x36 || buf[i] == 0x3e ||
+                       buf[i] == 0x64 || buf[i] == 0x65))
+        i++;
+    while (mode == 64 && i < len && (buf[i] & 0xf0) == 0x40)
+        i++;
+    if (i + 1 >= len)
+        return CLASS_LEGACY;
+    if ((buf[i] == 0xc4 || buf[i] == 0xc5) && (mode == 64 || buf[i+1] >= 0xc0))
+        return CLASS_VEX;
+    if (buf[i] == 0x62 && (mode == 64 || buf[i+1] >= 0xc0))
+        return CLASS_EVEX;
+    if (buf[i] == 0x0f)
+        return buf[i+1] == 0x38 || buf[i+1] == 0x3a ? CLASS_0F38 : CLASS_0F;
+    return CLASS_LEGACY;
+}
+
+static
+void
+corpus_add(Corpus* corpora, const uint8_t* buf, size_t len, int mode)
+{
+    corpus_append(&corpora[classify(buf, len, mode)], buf, len);
+    corpus_append(&corpora[CLASS_ALL], buf, len);
+}
+
+// Decode a raw code blob; undecodable bytes are skipped.
+static
+size_t
+corpus_add_blob(Corpus* corpora, const uint8_t* buf, size_t len, int mode)
+{
+    size_t skipped = 0;
+    for (size_t off = 0; off < len;) {
+        int res = fd_insn_length(buf + off, len - off, mode);
+        if (res > 0) {
+            corpus_add(corpora, buf + off, res, mode);
+            off += res;
+        } else {
+            skipped++;
+            off++;
+        }
+    }
+    return skipped;
+}
+
+static
+int
+corpus_add_file(Corpus* corpora, const char* path, int mode)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    Corpus raw = {0};
+    uint8_t chunk[65536];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), f)) > 0)
+        corpus_append(&raw, chunk, read);
+    fclose(f);
+
+    size_t skipped = corpus_add_blob(corpora, raw.buf, raw.size, mode);
+    printf("%s: %zu bytes, %zu undecodable bytes skipped\n", path, raw.size,
+           skipped);
+    free(raw.buf);
+    return 0;
+}
+
+// Add the synthetic corpus; candidates which don't decode exactly are dropped.
+static
+void
+corpus_add_synthetic(Corpus* corpora)
+{
+    size_t total = 0;
+    size_t valid = 0;
+    for (size_t off = 0; off < sizeof(bench_corpus); off += 1 + bench_corpus[off]) {
+        const uint8_t* buf = &bench_corpus[off + 1];
+        size_t len = bench_corpus[off];
+        total++;
+        if (fd_insn_length(buf, len, 64) == (int) len) {
+            corpus_add(corpora, buf, len, 64);
+            valid++;
+        }
+    }
+    printf("synthetic: %zu of %zu candidates valid\n", valid, total);
+}
+
+static
+uint64_t
+bench_decode(const Corpus* corpus, int mode)
+{
+    uint64_t sum = 0;
+    FdInstr instr;
+    for (size_t off = 0; off < corpus->size;) {
+        int res = fd_decode(corpus->buf + off, corpus->size - off, mode, 0, &instr);
+        off += res > 0 ? res : 1;
+        if (res > 0)
+            sum += FD_TYPE(&instr);
+    }
+    return sum;
+}
+
+static
+uint64_t
+bench_block(const Corpus* corpus, int mode)
+{
+    uint64_t sum = 0;
+    FdInstr instrs[64];
+    for (size_t off = 0; off < corpus->size;) {
+        size_t consumed;
+        size_t count = fd_decode_block(corpus->buf + off, corpus->size - off,
+                                       mode, instrs, 64, &consumed);
+        off += consumed ? consumed : 1;
+        for (size_t i = 0; i < count; i++)
+            sum += FD_TYPE(&instrs[i]);
+    }
+    return sum;
+}
+
+static
+uint64_t
+bench_block_lite(const Corpus* corpus, int mode)
+{
+    uint64_t sum = 0;
+    FdInstrLite instrs[64];
+    for (size_t off = 0; off < corpus->size;) {
+        size_t consumed;
+        size_t count = fd_decode_block_lite(corpus->buf + off,
+                                            corpus->size - off, mode, instrs,
+                                            64, &consumed);
+        off += consumed ? consumed : 1;
+        for (size_t i = 0; i < count; i++)
+            sum += FD_TYPE(&instrs[i]);
+    }
+    return sum;
+}
+
+static
+uint64_t
+bench_length(const Corpus* corpus, int mode)
+{
+    uint64_t sum = 0;
+    for (size_t off = 0; off < corpus->size;) {
+        int res = fd_insn_length(corpus->buf + off, corpus->size - off, mode);
+        off += res > 0 ? res : 1;
+        sum += res;
+    }
+    return sum;
+}
+
+static
+uint64_t
+bench_header(const Corpus* corpus, int mode)
+{
+    uint64_t sum = 0;
+    FdHeader hdr;
+    for (size_t off = 0; off < corpus->size;) {
+        int res = fd_decode_header(corpus->buf + off, corpus->size - off, mode, &hdr);
+        off += res > 0 ? res : 1;
+        if (res > 0)
+            sum += FD_TYPE(&hdr);
+    }
+    return sum;
+}
+
+static
+uint64_t
+bench_match(const Corpus* corpus, int mode)
+{
+    static const uint16_t call[] = {FDI_CALL, FDI_JMP};
+    static const FdPattern patterns[] = {
+        { call, 2, {{ .check = FD_MATCH_OPTYPE, .idx = 0, .type = FD_OT_MEM }} },
+    };
+    static FdMatcher matcher;
+    if (fd_matcher_compile(&matcher, patterns, 1))
+        return 0;
+
+    uint64_t sum = 0;
+    FdMatch matches[64];
+    for (size_t off = 0; off < corpus->size;) {
+        size_t consumed;
+        sum += fd_match(&matcher, corpus->buf + off, corpus->size - off, mode,
+                        matches, 64, &consumed);
+        if (!consumed)
+            break;
+        off += consumed;
+    }
+    return sum;
+}
+
+static
+uint64_t
+bench_sweep(const Corpus* corpus, int mode)
+{
+    uint8_t* starts = malloc((corpus->size + 7) / 8);
+    if (!starts)
+        return 0;
+    uint64_t sum = fd_sweep(corpus->buf, corpus->size, mode, starts);
+    free(starts);
+    return sum;
+}
+
+static
+uint64_t
+bench_format(const Corpus* corpus, int mode)
+{
+    uint64_t sum = 0;
+    FdInstr instr;
+    char fmt[128];
+    for (size_t off = 0; off < corpus->size;) {
+        int res = fd_decode(corpus->buf + off, corpus->size - off, mode, 0, &instr);
+        off += res > 0 ? res : 1;
+        if (res > 0) {
+            fd_format(&instr, fmt, sizeof(fmt));
+            sum += fmt[0];
+        }
+    }
+    return sum;
+}
+
+static
+uint64_t
+bench_format_block(const Corpus* corpus, int mode)
+{
+    uint64_t sum = 0;
+    FdInstr instrs[64];
+    static char fmt[64 * 128];
+    for (size_t off = 0; off < corpus->size;) {
+        size_t consumed;
+        size_t count = fd_decode_block(corpus->buf + off, corpus->size - off,
+                                       mode, instrs, 64, &consumed);
+        sum += fd_format_block(instrs, count, off, "\n", fmt, sizeof(fmt), NULL);
+        off += consumed ? consumed : 1;
+    }
+    return sum;
+}
+
+#define ENCODE_REPS 64
+#define ENCODE_COUNT 16
+
+static
+uint64_t
+bench_encode(const Corpus* corpus, int mode)
+{
+    (void) corpus; (void) mode;
+    uint8_t buf[ENCODE_COUNT * 15];
+    int failed = 0;
+    for (int i = 0; i < ENCODE_REPS; i++) {
+        uint8_t* cur = buf;
+        failed |= fe_enc64(&cur, FE_PUSHr, FE_BP);
+        failed |= fe_enc64(&cur, FE_MOV64rr, FE_BP, FE_SP);
+        failed |= fe_enc64(&cur, FE_SUB64ri, FE_SP, 0x40 + i);
+        failed |= fe_enc64(&cur, FE_MOV64rm, FE_AX, FE_MEM(FE_DI, 8, FE_SI, 0x10));
+        failed |= fe_enc64(&cur, FE_MOV64mr, FE_MEM(FE_SP, 0, 0, 8), FE_AX);
+        failed |= fe_enc64(&cur, FE_LEA64rm, FE_CX, FE_MEM(FE_AX, 2, FE_R9, -i));
+        failed |= fe_enc64(&cur, FE_MOVZXr32m8, FE_DX, FE_MEM(FE_CX, 0, 0, 1));
+        failed |= fe_enc64(&cur, FE_ADD64ri, FE_AX, 0x12345678);
+        failed |= fe_enc64(&cur, FE_IMUL64rr, FE_R10, FE_AX);
+        failed |= fe_enc64(&cur, FE_SHL64ri, FE_R10, 3);
+        failed |= fe_enc64(&cur, FE_XOR32rr, FE_R11, FE_R11);
+        failed |= fe_enc64(&cur, FE_CMP32ri, FE_DX, 0x7f);
+        failed |= fe_enc64(&cur, FE_JNZ, (intptr_t) buf);
+        failed |= fe_enc64(&cur, FE_SSE_ADDPSrr, FE_XMM0, FE_XMM9);
+        failed |= fe_enc64(&cur, FE_POPr, FE_BP);
+        failed |= fe_enc64(&cur, FE_RET);
+        sink += cur - buf;
+    }
+    return failed;
+}
+
+static
+uint64_t
+bench_encode_inl(const Corpus* corpus, int mode)
+{
+    (void) corpus; (void) mode;
+    uint8_t buf[ENCODE_COUNT * 15];
+    int failed = 0;
+    for (int i = 0; i < ENCODE_REPS; i++) {
+        uint8_t* cur = buf;
+        failed |= fe_enc64_inl(&cur, FE_PUSHr, FE_BP);
+        failed |= fe_enc64_inl(&cur, FE_MOV64rr, FE_BP, FE_SP);
+        failed |= fe_enc64_inl(&cur, FE_SUB64ri, FE_SP, 0x40 + i);
+        failed |= fe_enc64_inl(&cur, FE_MOV64rm, FE_AX, FE_MEM(FE_DI, 8, FE_SI, 0x10));
+        failed |= fe_enc64_inl(&cur, FE_MOV64mr, FE_MEM(FE_SP, 0, 0, 8), FE_AX);
+        failed |= fe_enc64_inl(&cur, FE_LEA64rm, FE_CX, FE_MEM(FE_AX, 2, FE_R9, -i));
+        failed |= fe_enc64_inl(&cur, FE_MOVZXr32m8, FE_DX, FE_MEM(FE_CX, 0, 0, 1));
+        failed |= fe_enc64_inl(&cur, FE_ADD64ri, FE_AX, 0x12345678);
+        failed |= fe_enc64_inl(&cur, FE_IMUL64rr, FE_R10, FE_AX);
+        failed |= fe_enc64_inl(&cur, FE_SHL64ri, FE_R10, 3);
+        failed |= fe_enc64_inl(&cur, FE_XOR32rr, FE_R11, FE_R11);
+        failed |= fe_enc64_inl(&cur, FE_CMP32ri, FE_DX, 0x7f);
+        failed |= fe_enc64_inl(&cur, FE_JNZ, (intptr_t) buf);
+        failed |= fe_enc64_inl(&cur, FE_SSE_ADDPSrr, FE_XMM0, FE_XMM9);
+        failed |= fe_enc64_inl(&cur, FE_POPr, FE_BP);
+        failed |= fe_enc64_inl(&cur, FE_RET);
+        sink += cur - buf;
+    }
+    return failed;
+}
+
+static
+uint64_t
+bench_encode_size(const Corpus* corpus, int mode)
+{
+    (void) corpus; (void) mode;
+    static uint8_t buf[16];
+    FeInstr instrs[ENCODE_COUNT] = {
+        { FE_PUSHr, { FE_BP } },
+        { FE_MOV64rr, { FE_BP, FE_SP } },
+        { FE_SUB64ri, { FE_SP, 0x40 } },
+        { FE_MOV64rm, { FE_AX, FE_MEM(FE_DI, 8, FE_SI, 0x10) } },
+        { FE_MOV64mr, { FE_MEM(FE_SP, 0, 0, 8), FE_AX } },
+        { FE_LEA64rm, { FE_CX, FE_MEM(FE_AX, 2, FE_R9, 0) } },
+        { FE_MOVZXr32m8, { FE_DX, FE_MEM(FE_CX, 0, 0, 1) } },
+        { FE_ADD64ri, { FE_AX, 0x12345678 } },
+        { FE_IMUL64rr, { FE_R10, FE_AX } },
+        { FE_SHL64ri, { FE_R10, 3 } },
+        { FE_XOR32rr, { FE_R11, FE_R11 } },
+        { FE_CMP32ri, { FE_DX, 0x7f } },
+        { FE_JNZ, { (intptr_t) buf } },
+        { FE_SSE_ADDPSrr, { FE_XMM0, FE_XMM9 } },
+        { FE_POPr, { FE_BP } },
+        { FE_RET, { 0 } },
+    };
+    int failed = 0;
+    for (int i = 0; i < ENCODE_REPS; i++) {
+        instrs[2].ops[1] = 0x40 + i;
+        instrs[5].ops[1] = FE_MEM(FE_AX, 2, FE_R9, -i);
+        ptrdiff_t size = fe_enc64_size_block(instrs, ENCODE_COUNT, buf);
+        failed |= size < 0;
+        sink += size;
+    }
+    return failed;
+}
+
+static
+int
+bench_cb_rewind(FeCodeBuf* cb, size_t size)
+{
+    (void) size;
+    cb->cur = cb->base;
+    return 0;
+}
+
+static
+uint64_t
+bench_encode_cb(const Corpus* corpus, int mode)
+{
+    (void) corpus; (void) mode;
+    static uint8_t buf[4096];
+    FeCodeBuf cb;
+    fe_cb_init(&cb, buf, sizeof buf, bench_cb_rewind, NULL);
+    for (int i = 0; i < ENCODE_REPS; i++) {
+        if (fe_cb_reserve(&cb, ENCODE_COUNT))
+            break;
+        fe_cb_enc64(&cb, FE_PUSHr, FE_BP);
+        fe_cb_enc64(&cb, FE_MOV64rr, FE_BP, FE_SP);
+        fe_cb_enc64(&cb, FE_SUB64ri, FE_SP, 0x40 + i);
+        fe_cb_enc64(&cb, FE_MOV64rm, FE_AX, FE_MEM(FE_DI, 8, FE_SI, 0x10));
+        fe_cb_enc64(&cb, FE_MOV64mr, FE_MEM(FE_SP, 0, 0, 8), FE_AX);
+        fe_cb_enc64(&cb, FE_LEA64rm, FE_CX, FE_MEM(FE_AX, 2, FE_R9, -i));
+        fe_cb_enc64(&cb, FE_MOVZXr32m8, FE_DX, FE_MEM(FE_CX, 0, 0, 1));
+        fe_cb_enc64(&cb, FE_ADD64ri, FE_AX, 0x12345678);
+        fe_cb_enc64(&cb, FE_IMUL64rr, FE_R10, FE_AX);
+        fe_cb_enc64(&cb, FE_SHL64ri, FE_R10, 3);
+        fe_cb_enc64(&cb, FE_XOR32rr, FE_R11, FE_R11);
+        fe_cb_enc64(&cb, FE_CMP32ri, FE_DX, 0x7f);
+        fe_cb_enc64(&cb, FE_JNZ, (intptr_t) cb.base);
+        fe_cb_enc64(&cb, FE_SSE_ADDPSrr, FE_XMM0, FE_XMM9);
+        fe_cb_enc64(&cb, FE_POPr, FE_BP);
+        fe_cb_enc64(&cb, FE_RET);
+    }
+    sink += cb.cur - cb.base;
+    return FE_CB_ERROR(&cb);
+}
+
+static
+uint64_t
+bench_encode_asm(const Corpus* corpus, int mode)
+{
+    (void) corpus; (void) mode;
+    static uint8_t buf[ENCODE_REPS * ENCODE_COUNT * 15];
+    uint64_t labels[2 * ENCODE_REPS + 1];
+    FeAsmFixup fixups[2 * ENCODE_REPS];
+    FeCodeBuf cb;
+    FeAsm as;
+    fe_cb_init(&cb, buf, sizeof buf, NULL, NULL);
+    fe_asm_init(&as, &cb, labels, 2 * ENCODE_REPS + 1, fixups, 2 * ENCODE_REPS);
+    FeLabel next = fe_asm_label(&as);
+    for (int i = 0; i < ENCODE_REPS; i++) {
+        FeLabel loop = fe_asm_label(&as);
+        if (fe_cb_reserve(&cb, ENCODE_COUNT))
+            break;
+        fe_asm_bind(&as, next);
+        next = fe_asm_label(&as);
+        fe_cb_enc64(&cb, FE_PUSHr, FE_BP);
+        fe_cb_enc64(&cb, FE_MOV64rr, FE_BP, FE_SP);
+        fe_cb_enc64(&cb, FE_SUB64ri, FE_SP, 0x40 + i);
+        fe_asm_bind(&as, loop);
+        fe_cb_enc64(&cb, FE_MOV64rm, FE_AX, FE_MEM(FE_DI, 8, FE_SI, 0x10));
+        fe_cb_enc64(&cb, FE_MOV64mr, FE_MEM(FE_SP, 0, 0, 8), FE_AX);
+        fe_cb_enc64(&cb, FE_LEA64rm, FE_CX, FE_MEM(FE_AX, 2, FE_R9, -i));
+        fe_cb_enc64(&cb, FE_MOVZXr32m8, FE_DX, FE_MEM(FE_CX, 0, 0, 1));
+        fe_cb_enc64(&cb, FE_ADD64ri, FE_AX, 0x12345678);
+        fe_cb_enc64(&cb, FE_IMUL64rr, FE_R10, FE_AX);
+        fe_cb_enc64(&cb, FE_SHL64ri, FE_R10, 3);
+        fe_cb_enc64(&cb, FE_XOR32rr, FE_R11, FE_R11);
+        fe_cb_enc64(&cb, FE_CMP32ri, FE_DX, 0x7f);
+        fe_asm_jmp(&as, FE_JNZ, loop);
+        fe_cb_enc64(&cb, FE_SSE_ADDPSrr, FE_XMM0, FE_XMM9);
+        fe_cb_enc64(&cb, FE_POPr, FE_BP);
+        fe_asm_jmp(&as, FE_JMP, next);
+    }
+    fe_asm_bind(&as, next);
+    int res = fe_asm_finalize(&as);
+    sink += cb.cur - cb.base;
+    return res || FE_CB_ERROR(&cb);
+}
+
+// Results for comparison with a baseline from a previous run.
+typedef struct {
+    char cls[16];
+    char name[16];
+    double ns_per_instr;
+} Result;
+
+#define MAX_RESULTS 128
+static Result results[MAX_RESULTS];
+static size_t result_count;
+
+static
+void
+run(const char* cls, const char* name, BenchFn fn, const Corpus* corpus,
+    size_t count, int mode)
+{
+    if (!count)
+        return;
+
+    // Take the fastest pass to reduce noise from interrupts and frequency
+    // changes; the first pass warms up the caches.
+    uint64_t best_ns = UINT64_MAX;
+    uint64_t best_tsc = UINT64_MAX;
+    uint64_t total = 0;
+    sink += fn(corpus, mode);
+    while (total < bench_ns) {
+        uint64_t ns = time_ns();
+        uint64_t tsc = time_tsc();
+        sink += fn(corpus, mode);
+        tsc = time_tsc() - tsc;
+        ns = time_ns() - ns;
+        best_ns = ns < best_ns ? ns : best_ns;
+        best_tsc = tsc < best_tsc ? tsc : best_tsc;
+        total += ns + 1;
+    }
+
+    double ns_per_instr = (double) best_ns / count;
+    printf("%-8s %-11s %7zu %9.2f Minstr/s %7.2f ns/instr", cls, name, count,
+           1000 / ns_per_instr, ns_per_instr);
+    if (HAVE_RDTSC)
+        printf(" %7.1f cycles/instr", (double) best_tsc / count);
+    printf("\n");
+
+    if (result_count < MAX_RESULTS) {
+        Result* result = &results[result_count++];
+        snprintf(result->cls, sizeof result->cls, "%s", cls);
+        snprintf(result->name, sizeof result->name, "%s", name);
+        result->ns_per_instr = ns_per_instr;
+    }
+}
+
+static
+int
+results_save(const char* path)
+{
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    for (size_t i = 0; i < result_count; i++)
+        fprintf(f, "%s %s %.3f\n", results[i].cls, results[i].name,
+                results[i].ns_per_instr);
+    if (fclose(f)) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+// Compare the results with a baseline file written by results_save. Returns
+// the number of benchmarks that are slower by more than threshold percent, or
+// -1 if the baseline cannot be read.
+static
+int
+results_compare(const char* path, double threshold)
+{
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    int regressions = 0;
+    size_t compared = 0;
+    char cls[16], name[16];
+    double base;
+    while (fscanf(f, "%15s %15s %lf", cls, name, &base) == 3) {
+        for (size_t i = 0; i < result_count; i++) {
+            const Result* result = &results[i];
+            if (strcmp(result->cls, cls) || strcmp(result->name, name))
+                continue;
+            double change = (result->ns_per_instr / base - 1) * 100;
+            compared++;
+            if (change > threshold) {
+                printf("REGRESSION %-8s %-11s %7.2f -> %7.2f ns/instr (%+.1f%%)\n",
+                       cls, name, base, result->ns_per_instr, change);
+                regressions++;
+            }
+            break;
+        }
+    }
+    fclose(f);
+    printf("baseline: %zu benchmarks compared, %d slower by more than %.1f%%\n",
+           compared, regressions, threshold);
+    return regressions;
+}
+
+int
+main(int argc, char** argv)
+{
+    int mode = 64;
+    Corpus corpora[CLASS_COUNT] = {{0}};
+    int have_files = 0;
+    const char* save_path = NULL;
+    const char* baseline_path = NULL;
+    double threshold = 10;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-32") || !strcmp(argv[i], "-64")) {
+            mode = !strcmp(argv[i], "-32") ? 32 : 64;
+        } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            bench_ns = strtoull(argv[++i], NULL, 0) * 1000000;
+        } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            save_path = argv[++i];
+        } else if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+            baseline_path = argv[++i];
+        } else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+            threshold = strtod(argv[++i], NULL);
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "usage: %s [-32|-64] [-t ms] [-s save-file] "
+                    "[-b baseline-file [-r max-regression-percent]] "
+                    "[raw-code-file...]\n", argv[0]);
+            return 1;
+        } else {
+            if (corpus_add_file(corpora, argv[i], mode) < 0)
+                return 1;
+            have_files = 1;
+        }
+    }
+
+    // The synthetic corpus contains 64-bit encodings only.
+    if (!have_files && mode == 64)
+        corpus_add_synthetic(corpora);
+    if (!corpora[CLASS_ALL].count) {
+        puts("No instructions to benchmark (mode not supported?)");
+        return 0;
+    }
+
+    if (bench_encode(NULL, 64) || bench_encode_inl(NULL, 64) ||
+        bench_encode_size(NULL, 64) || bench_encode_cb(NULL, 64) ||
+        bench_encode_asm(NULL, 64)) {
+        puts("Encoding failed");
+        return 1;
+    }
+
+    printf("%-8s %-11s %7s\n", "class", "benchmark", "instrs");
+    for (int cls = 0; cls < CLASS_COUNT; cls++) {
+        const Corpus* corpus = &corpora[cls];
+        run(class_names[cls], "decode", bench_decode, corpus, corpus->count, mode);
+        run(class_names[cls], "block", bench_block, corpus, corpus->count, mode);
+        run(class_names[cls], "block-lite", bench_block_lite, corpus, corpus->count, mode);
+        run(class_names[cls], "length", bench_length, corpus, corpus->count, mode);
+        run(class_names[cls], "header", bench_header, corpus, corpus->count, mode);
+        run(class_names[cls], "match", bench_match, corpus, corpus->count, mode);
+        run(class_names[cls], "sweep", bench_sweep, corpus, corpus->count, mode);
+        run(class_names[cls], "format", bench_format, corpus, corpus->count, mode);
+        run(class_names[cls], "format-blk", bench_format_block, corpus, corpus->count, mode);
+    }
+    run("mix", "encode", bench_encode, NULL, ENCODE_REPS * ENCODE_COUNT, 64);
+    run("mix", "encode-inl", bench_encode_inl, NULL, ENCODE_REPS * ENCODE_COUNT, 64);
+    run("mix", "encode-size", bench_encode_size, NULL, ENCODE_REPS * ENCODE_COUNT, 64);
+    run("mix", "encode-cb", bench_encode_cb, NULL, ENCODE_REPS * ENCODE_COUNT, 64);
+    run("mix", "encode-asm", bench_encode_asm, NULL, ENCODE_REPS * ENCODE_COUNT, 64);
+
+    for (int cls = 0; cls < CLASS_COUNT; cls++)
+        free(corpora[cls].buf);
+
+    if (save_path && results_save(save_path))
+        return 1;
+    if (baseline_path && results_compare(baseline_path, threshold))
+        return 1;
+    return 0;
+}
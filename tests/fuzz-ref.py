@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+
+import argparse
+import re
+import subprocess
+import sys
+import tempfile
+from collections import Counter
+from pathlib import Path
+
+SLOT_SIZE = 32
+
+# objdump prints prefixes that do not directly precede the opcode as separate
+# instructions, e.g. REX prefixes followed by other prefixes.
+PREFIX_RE = re.compile(r"^(?:(?:rex(?:\.[WRXB]+)?|data16|addr32|[c-gs]s|lock|"
+                       r"rep|repz|repnz|bnd|notrack|xacquire|xrelease)\s*)+$")
+
+LEGACY_PREFIXES = {0x26, 0x2e, 0x36, 0x3e, 0x64, 0x65, 0x66, 0x67, 0xf0, 0xf2, 0xf3}
+
+# Prefixes which the CPU ignores, but objdump rejects: opcode bytes and the set
+# of ignored prefixes.
+IGNORED_PREFIXES = [
+    (b"\x0f\x09", {0x66, 0xf2}), # WBINVD, F3 is WBNOINVD
+    (b"\x0f\xbc", {0xf2}), # BSF, F3 is TZCNT
+    (b"\x0f\xbd", {0xf2}), # BSR, F3 is LZCNT
+    (b"\x0f\x01\xd9", {0x66, 0xf2}), # VMMCALL
+    (b"\x0f\x01\xfd", {0x66, 0xf2}), # RDPRU
+]
+
+def known_divergence(instr):
+    """Whether fadec and objdump are known to disagree on an instruction."""
+    prefixes, rex, i = set(), False, 0
+    while i < len(instr) and (instr[i] in LEGACY_PREFIXES or instr[i] & 0xf0 == 0x40):
+        # A REX prefix followed by other prefixes is ignored by the CPU,
+        # objdump rejects the instruction.
+        if rex:
+            return True
+        rex = instr[i] & 0xf0 == 0x40
+        if not rex:
+            prefixes.add(instr[i])
+        i += 1
+    opc = instr[i:]
+    modrm = opc[2] if len(opc) > 2 else 0
+    # 0f 0d with mod=3 is a reserved NOP, objdump only knows the prefetches.
+    if opc[:2] == b"\x0f\x0d" and modrm >= 0xc0:
+        return True
+    # MFENCE and SFENCE ignore ModRM.rm, objdump only accepts rm=0.
+    if opc[:2] == b"\x0f\xae" and modrm >= 0xf0 and modrm & 7:
+        return True
+    return any(opc.startswith(o) and prefixes & p for o, p in IGNORED_PREFIXES)
+
+def instr_starts(lines, regex):
+    """Map from instruction address to the disassembled text."""
+    starts = {}
+    for line in lines:
+        match = regex.match(line)
+        if match:
+            starts[int(match.group(1), 16)] = match.group(2).strip()
+    return starts
+
+def slot_lengths(starts, count):
+    """Length and text of the first instruction of every slot."""
+    addrs = sorted(starts)
+    next_addr = dict(zip(addrs, addrs[1:] + [count * SLOT_SIZE]))
+    slots = []
+    for i in range(count):
+        addr = i * SLOT_SIZE
+        if addr not in starts:
+            slots.append((0, "(none)"))
+            continue
+        text = starts[addr]
+        while PREFIX_RE.match(starts[addr]) and next_addr[addr] in starts:
+            addr = next_addr[addr]
+            text += " " + starts[addr]
+        slots.append((next_addr[addr] - i * SLOT_SIZE, text))
+    return slots
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Compare instruction lengths "
+                                     "of fuzzer inputs with objdump.")
+    parser.add_argument("fuzz", help="standalone fuzz driver")
+    parser.add_argument("fadec_dis", help="fadec-dis tool")
+    parser.add_argument("objdump", help="GNU objdump")
+    parser.add_argument("-n", type=int, default=20000, help="fuzzer iterations")
+    parser.add_argument("-s", type=int, default=1, help="fuzzer seed")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as tmp:
+        slot_file = Path(tmp) / "slots.bin"
+        subprocess.run([args.fuzz, "-n", str(args.n), "-s", str(args.s),
+                        "-w", slot_file], check=True, stdout=subprocess.DEVNULL)
+        count = slot_file.stat().st_size // SLOT_SIZE
+        code = slot_file.read_bytes()
+        fadec = subprocess.run([args.fadec_dis, "-64", slot_file], check=True,
+                               capture_output=True, text=True).stdout
+        ref = subprocess.run([args.objdump, "-D", "-b", "binary", "-m",
+                              "i386:x86-64", "-M", "intel,intel64",
+                              "--insn-width=16",
+                              slot_file], check=True, capture_output=True,
+                             text=True).stdout
+
+    fadec_slots = slot_lengths(instr_starts(fadec.splitlines(),
+                               re.compile(r"^([0-9a-f]+)  (.*)$")), count)
+    ref_slots = slot_lengths(instr_starts(ref.splitlines(),
+                             re.compile(r"^ *([0-9a-f]+):\t[0-9a-f ]+\t(.*)$")),
+                             count)
+
+    # Both disassemblers resynchronize at every slot, as the NOP padding is
+    # longer than any instruction. Every mismatch fails, except for encodings
+    # where fadec and objdump are known to disagree.
+    mismatches, known = Counter(), 0
+    for i, ((length, text), (ref_length, ref_text)) in enumerate(zip(fadec_slots, ref_slots)):
+        if length == ref_length and ref_text != "(bad)":
+            continue
+        instr = code[i * SLOT_SIZE:i * SLOT_SIZE + length]
+        if known_divergence(instr):
+            known += 1
+            continue
+        mnem = next((w for w in ref_text.split(" ") if not PREFIX_RE.match(w)), "")
+        if not mismatches[mnem]:
+            print(f"{instr.hex(' ')}: {text} ({length}) / {ref_text} ({ref_length})")
+        mismatches[mnem] += 1
+
+    total = sum(mismatches.values())
+    print(f"{count} instructions, {total} mismatches, {known} known divergences")
+    sys.exit(total > 0)
@@ -0,0 +1,314 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fadec.h>
+#include <fadec-enc.h>
+
+
+// Differential fuzzing of the decoder: all decoding entry points must agree
+// with fd_decode, and instructions supported by the encoder must survive a
+// round-trip through fe_from_fd. With -DFUZZ_LIBFUZZER, only the libFuzzer
+// entry point is compiled; otherwise, a standalone driver mutates the
+// instructions of the benchmark corpus.
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+static const uint64_t fuzz_addr = 0x400000;
+
+static
+void
+fuzz_fail(const char* what, const uint8_t* data, size_t size, int mode,
+          const char* exp, const char* got)
+{
+    printf("Failed %s (%d-bit):", what, mode);
+    for (size_t i = 0; i < size; i++)
+        printf(" %02x", data[i]);
+    printf("\n  exp: %s\n  got: %s\n", exp, got);
+    fflush(stdout);
+    abort();
+}
+
+// Known differences between equivalent instructions after a round-trip.
+static
+bool
+fuzz_equivalent(const FdInstr* exp, const FdInstr* got, const char* exp_str,
+                const char* got_str)
+{
+    if (!strcmp(exp_str, got_str))
+        return true;
+    unsigned type = FD_TYPE(exp);
+    // Dropping redundant prefixes changes RIP-relative offsets.
+    if (FD_SIZE(got) != FD_SIZE(exp) &&
+        (strstr(exp_str, "[rip") || strstr(exp_str, "[eip")))
+        return true;
+    // The encoder uses 90 for XCHG with AX, which is decoded as NOP.
+    if (type == FDI_XCHG && FD_TYPE(got) == FDI_NOP &&
+        FD_OP_REG(exp, 0) == FD_REG_AX && FD_OP_REG(exp, 1) == FD_REG_AX)
+        return FD_OP_TYPE(exp, 0) == FD_OT_REG && FD_OP_TYPE(exp, 1) == FD_OT_REG;
+    // PEXTRW has register forms with a 32-bit and a 64-bit destination, both
+    // are zero-extended.
+    if ((type == FDI_SSE_PEXTRW || type == FDI_VPEXTRW) && FD_TYPE(got) == type)
+        return FD_OP_TYPE(exp, 0) == FD_OT_REG &&
+               FD_OP_REG(got, 0) == FD_OP_REG(exp, 0) &&
+               FD_OP_REG(got, 1) == FD_OP_REG(exp, 1) &&
+               FD_OP_IMM(got, 2) == FD_OP_IMM(exp, 2);
+    return false;
+}
+
+static
+void
+fuzz_roundtrip(const uint8_t* data, size_t size, const FdInstr* instr,
+               const char* exp)
+{
+    // Not every decodable instruction has an encoder mnemonic, and memory
+    // offsets (moffs) can have a 64-bit address.
+    FeInstr fe;
+    if (fe_from_fd(&fe, instr, fuzz_addr))
+        return;
+
+    uint8_t out[16];
+    uint8_t* cur = out;
+    if (fe_enc64_at(&cur, fuzz_addr, fe.mnem, fe.ops[0], fe.ops[1], fe.ops[2],
+                    fe.ops[3])) {
+        // JRCXZ and LOOP only have an 8-bit offset, which can be out of range
+        // after dropping redundant prefixes.
+        unsigned type = FD_TYPE(instr);
+        if (type == FDI_JCXZ || type == FDI_LOOP || type == FDI_LOOPZ ||
+            type == FDI_LOOPNZ)
+            return;
+        fuzz_fail("round-trip encode", data, size, 64, exp, "(none)");
+    }
+
+    FdInstr got_instr;
+    char got[128];
+    if (fd_decode(out, cur - out, 64, 0, &got_instr) != cur - out)
+        fuzz_fail("round-trip decode", data, size, 64, exp, "(bad)");
+    fd_format_ex(&got_instr, fuzz_addr, got, sizeof got);
+    if (!fuzz_equivalent(instr, &got_instr, exp, got))
+        fuzz_fail("round-trip", data, size, 64, exp, got);
+}
+
+static
+void
+fuzz_mode(const uint8_t* data, size_t size, int mode)
+{
+    FdInstr instr;
+    char exp[128], got[128];
+    int res = fd_decode(data, size, mode, 0, &instr);
+    if (res == FD_ERR_INTERNAL)
+        return; // Mode not supported.
+    if (res > 0)
+        fd_format_ex(&instr, fuzz_addr, exp, sizeof exp);
+    else
+        snprintf(exp, sizeof exp, "error %d", res);
+
+    int len = fd_insn_length(data, size, mode);
+    if (len != res) {
+        snprintf(got, sizeof got, "length %d", len);
+        fuzz_fail("length", data, size, mode, exp, got);
+    }
+
+    FdHeader hdr;
+    int hdr_res = fd_decode_header(data, size, mode, &hdr);
+    if (hdr_res != res) {
+        snprintf(got, sizeof got, "header %d", hdr_res);
+        fuzz_fail("header", data, size, mode, exp, got);
+    }
+
+    FdInstrLite lite;
+    int lite_res = fd_decode_lite(data, size, mode, &lite);
+    if (lite_res != res) {
+        snprintf(got, sizeof got, "lite %d", lite_res);
+        fuzz_fail("lite", data, size, mode, exp, got);
+    }
+
+    FdInstr block;
+    size_t consumed;
+    size_t count = fd_decode_block(data, size, mode, &block, 1, &consumed);
+    if (count != (res > 0) || consumed != (size_t) (res > 0 ? res : 0)) {
+        snprintf(got, sizeof got, "block %zu/%zu", count, consumed);
+        fuzz_fail("block", data, size, mode, exp, got);
+    }
+
+    if (res <= 0)
+        return;
+
+    FdInstr other;
+    fd_header_expand(data, &hdr, &other);
+    fd_format_ex(&other, fuzz_addr, got, sizeof got);
+    if (FD_TYPE(&hdr) != FD_TYPE(&instr) || strcmp(exp, got))
+        fuzz_fail("header expand", data, size, mode, exp, got);
+
+    fd_lite_expand(&lite, &other);
+    fd_format_ex(&other, fuzz_addr, got, sizeof got);
+    if (strcmp(exp, got))
+        fuzz_fail("lite expand", data, size, mode, exp, got);
+
+    fd_format_ex(&block, fuzz_addr, got, sizeof got);
+    if (strcmp(exp, got))
+        fuzz_fail("block", data, size, mode, exp, got);
+
+    // Truncated output must be a null-terminated prefix.
+    size_t exp_len = strlen(exp);
+    for (size_t i = 1; i <= exp_len; i++) {
+        size_t got_len = fd_format_ex(&instr, fuzz_addr, got, i);
+        if (got_len != i - 1 || got[i - 1] || strncmp(exp, got, i - 1))
+            fuzz_fail("format truncation", data, size, mode, exp, got);
+    }
+
+    if (mode == 64)
+        fuzz_roundtrip(data, size, &instr, exp);
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    fuzz_mode(data, size, 32);
+    fuzz_mode(data, size, 64);
+    return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+
+#include "bench-corpus.inc"
+
+static uint64_t fuzz_state;
+
+static
+uint64_t
+fuzz_rand(void)
+{
+    // xorshift64*
+    fuzz_state ^= fuzz_state >> 12;
+    fuzz_state ^= fuzz_state << 25;
+    fuzz_state ^= fuzz_state >> 27;
+    return fuzz_state * 0x2545f4914f6cdd1dull;
+}
+
+static
+size_t
+fuzz_mutate(uint8_t* buf, size_t len, size_t cap)
+{
+    static const uint8_t prefixes[] = {
+        0x26, 0x2e, 0x36, 0x3e, 0x64, 0x65, 0x66, 0x67, 0xf0, 0xf2, 0xf3,
+        0x40, 0x41, 0x44, 0x48, 0x4f,
+    };
+    unsigned count = 1 + fuzz_rand() % 3;
+    for (unsigned i = 0; i < count; i++) {
+        uint64_t r = fuzz_rand();
+        size_t pos = len ? (r >> 8) % len : 0;
+        switch (r % 5) {
+        case 0: // Flip a bit.
+            if (len)
+                buf[pos] ^= 1 << (r >> 32) % 8;
+            break;
+        case 1: // Replace a byte.
+            if (len)
+                buf[pos] = r >> 32;
+            break;
+        case 2: // Insert a prefix.
+            if (len < cap) {
+                memmove(buf + 1, buf, len++);
+                buf[0] = prefixes[(r >> 32) % sizeof prefixes];
+            }
+            break;
+        case 3: // Truncate.
+            len = pos;
+            break;
+        default: // Append a random byte.
+            if (len < cap)
+                buf[len++] = r >> 32;
+            break;
+        }
+    }
+    return len;
+}
+
+static
+int
+fuzz_file(const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    uint8_t buf[4096];
+    size_t len = fread(buf, 1, sizeof buf, f);
+    fclose(f);
+    LLVMFuzzerTestOneInput(buf, len);
+    return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    unsigned long iterations = 100000;
+    uint64_t seed = 1;
+    const char* slot_path = NULL;
+    int have_files = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            iterations = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+            slot_path = argv[++i];
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "usage: %s [-n iterations] [-s seed] "
+                    "[-w slot-file] [input-file...]\n", argv[0]);
+            return 1;
+        } else {
+            if (fuzz_file(argv[i]) < 0)
+                return 1;
+            have_files = 1;
+        }
+    }
+    if (have_files)
+        return 0;
+    // xorshift requires a non-zero state.
+    fuzz_state = seed << 1 | 1;
+
+    // Instructions that are valid in 64-bit mode are written to the slot file
+    // for comparison with a reference disassembler, each padded to 32 bytes
+    // with NOPs, so that the reference resynchronizes at every slot.
+    FILE* slots = NULL;
+    if (slot_path && !(slots = fopen(slot_path, "wb"))) {
+        perror(slot_path);
+        return 1;
+    }
+
+    static size_t offsets[sizeof bench_corpus / 2];
+    size_t corpus_count = 0;
+    for (size_t off = 0; off < sizeof bench_corpus; off += 1 + bench_corpus[off])
+        offsets[corpus_count++] = off;
+
+    for (unsigned long i = 0; i < iterations; i++) {
+        uint8_t buf[15];
+        size_t off = offsets[fuzz_rand() % corpus_count];
+        size_t len = bench_corpus[off] < sizeof buf ? bench_corpus[off] : sizeof buf;
+        memcpy(buf, &bench_corpus[off + 1], len);
+        len = fuzz_mutate(buf, len, sizeof buf);
+        LLVMFuzzerTestOneInput(buf, len);
+
+        int res = fd_insn_length(buf, len, 64);
+        if (slots && res > 0) {
+            uint8_t slot[32];
+            memset(slot, 0x90, sizeof slot);
+            memcpy(slot, buf, res);
+            fwrite(slot, 1, sizeof slot, slots);
+        }
+    }
+    if (slots && fclose(slots)) {
+        perror(slot_path);
+        return 1;
+    }
+
+    printf("%lu inputs OK\n", iterations);
+    return 0;
+}
+
+#endif
@@ -21,6 +21,7 @@ test(const void* buf, size_t buf_len, unsigned mode, const char* exp_fmt)
 {
     FdInstr instr;
     char fmt[128];
+    int fmt_ok = 1;
 
     int retval = fd_decode(buf, buf_len, mode, 0, &instr);
 
@@ -31,23 +32,480 @@ test(const void* buf, size_t buf_len, unsigned mode, const char* exp_fmt)
     } else if (retval == FD_ERR_UD) {
         strcpy(fmt, "UD");
     } else {
-        fd_format(&instr, fmt, sizeof(fmt));
+        size_t fmt_len = fd_format_ex(&instr, 0, fmt, sizeof(fmt));
+        // Truncated strings must be a prefix of the full string.
+        char fmt_short[8];
+        size_t short_len = fd_format_ex(&instr, 0, fmt_short, sizeof(fmt_short));
+        fmt_ok = fmt_len == strlen(fmt) && short_len == strlen(fmt_short) &&
+                 short_len == (fmt_len < 7 ? fmt_len : 7) &&
+                 !strncmp(fmt, fmt_short, short_len);
+    }
+
+    // The length-only decoder must agree on both lengths and errors, also with
+    // trailing bytes, where common instructions take a table-driven path.
+    int length = fd_insn_length(buf, buf_len, mode);
+    int length_padded = retval;
+    uint8_t padded[15] = {0};
+    if (buf_len < sizeof(padded) && retval != FD_ERR_PARTIAL) {
+        memcpy(padded, buf, buf_len);
+        length_padded = fd_insn_length(padded, sizeof(padded), mode);
+    }
+
+    // The compact representation must format identically after expansion.
+    FdInstrLite lite;
+    char fmt_lite[128];
+    int retval_lite = fd_decode_lite(buf, buf_len, mode, &lite);
+    if (retval_lite < 0) {
+        strcpy(fmt_lite, fmt);
+    } else {
+        FdInstr expanded;
+        fd_lite_expand(&lite, &expanded);
+        fd_format(&expanded, fmt_lite, sizeof(fmt_lite));
+    }
+
+    // The header must agree with the full decoder and expand to the same
+    // instruction.
+    FdHeader hdr;
+    int retval_hdr = fd_decode_header(buf, buf_len, mode, &hdr);
+    int hdr_ok = retval_hdr == retval;
+    if (hdr_ok && retval >= 0) {
+        FdInstr expanded;
+        char fmt_hdr[128];
+        hdr_ok = FD_TYPE(&hdr) == FD_TYPE(&instr) &&
+                 FD_SIZE(&hdr) == retval &&
+                 FD_SEGMENT(&hdr) == FD_SEGMENT(&instr) &&
+                 !FD_HAS_REP(&hdr) == !FD_HAS_REP(&instr) &&
+                 !FD_HAS_REPNZ(&hdr) == !FD_HAS_REPNZ(&instr) &&
+                 !FD_HAS_LOCK(&hdr) == !FD_HAS_LOCK(&instr) &&
+                 !FD_IS64(&hdr) == !FD_IS64(&instr) &&
+                 fd_header_expand(buf, &hdr, &expanded) == retval;
+        if (hdr_ok) {
+            fd_format(&expanded, fmt_hdr, sizeof(fmt_hdr));
+            hdr_ok = !strcmp(fmt_hdr, fmt);
+        }
     }
 
-    if ((retval < 0 || (unsigned) retval == buf_len) && !strcmp(fmt, exp_fmt))
+    if ((retval < 0 || (unsigned) retval == buf_len) && !strcmp(fmt, exp_fmt) &&
+        length == retval && length_padded == retval && retval_lite == retval && !strcmp(fmt_lite, fmt) &&
+        fmt_ok && hdr_ok)
         return 0;
 
     printf("Failed case (%u-bit): ", mode);
     print_hex(buf, buf_len);
     printf("\n  Exp (%2zu): %s", buf_len, exp_fmt);
-    printf("\n  Got (%2d): %s\n", retval, fmt);
+    printf("\n  Got (%2d): %s", retval, fmt);
+    printf("\n  Length: %d (padded: %d)", length, length_padded);
+    printf("\n  Lite (%2d): %s", retval_lite, fmt_lite);
+    printf("\n  Header (%2d): %s", retval_hdr, hdr_ok ? "ok" : "wrong");
+    printf("\n  Format length: %s\n", fmt_ok ? "ok" : "wrong");
+    return -1;
+}
+
+static
+int
+test_block(const void* buf, size_t buf_len, unsigned mode, size_t exp_count,
+           size_t exp_consumed)
+{
+    FdInstr instrs[16];
+    size_t consumed;
+    size_t count = fd_decode_block(buf, buf_len, mode, instrs, 16, &consumed);
+
+    if (count == 0 && fd_decode(buf, buf_len, mode, 0, &instrs[0]) == FD_ERR_INTERNAL)
+        return 0; // not compiled with this arch-mode (32/64 bit)
+    if (count != exp_count || consumed != exp_consumed)
+        goto fail;
+
+    // Every instruction must match the result of a single fd_decode call.
+    // Formatting the block must give the concatenation of all instructions.
+    char fmt_exp[16 * 130] = "";
+    size_t fmt_exp_len = 0;
+    size_t off = 0;
+    for (size_t i = 0; i < count; i++) {
+        FdInstr instr;
+        char fmt_blk[128], fmt_single[128];
+        int retval = fd_decode((const uint8_t*) buf + off, buf_len - off, mode,
+                               0, &instr);
+        if (retval <= 0 || FD_SIZE(&instrs[i]) != retval)
+            goto fail;
+        fd_format(&instrs[i], fmt_blk, sizeof(fmt_blk));
+        fd_format(&instr, fmt_single, sizeof(fmt_single));
+        if (strcmp(fmt_blk, fmt_single))
+            goto fail;
+        fmt_exp_len += fd_format_ex(&instr, 0x1000 + off, fmt_exp + fmt_exp_len,
+                                    sizeof(fmt_exp) - fmt_exp_len);
+        fmt_exp[fmt_exp_len++] = ';';
+        fmt_exp[fmt_exp_len++] = ' ';
+        fmt_exp[fmt_exp_len] = 0;
+        off += retval;
+    }
+
+    char fmt_block[sizeof(fmt_exp)];
+    size_t formatted;
+    if (fd_format_block(instrs, count, 0x1000, "; ", fmt_block,
+                        sizeof(fmt_block), &formatted) != fmt_exp_len ||
+        formatted != count || strcmp(fmt_block, fmt_exp))
+        goto fail;
+    // With a small buffer, only the first instruction fits.
+    if (count > 1) {
+        size_t first_len = strchr(fmt_exp, ';') - fmt_exp + 2;
+        if (fd_format_block(instrs, count, 0x1000, "; ", fmt_block,
+                            first_len + 2, &formatted) != first_len ||
+            formatted != 1 || strncmp(fmt_block, fmt_exp, first_len))
+            goto fail;
+    }
+    return 0;
+
+fail:
+    printf("Failed block case (%u-bit): ", mode);
+    print_hex(buf, buf_len);
+    printf("\n  Exp: %zu instrs, %zu bytes", exp_count, exp_consumed);
+    printf("\n  Got: %zu instrs, %zu bytes\n", count, consumed);
+    return -1;
+}
+
+static
+int
+test_header(const void* buf, size_t buf_len, unsigned mode, unsigned exp_modrm,
+            unsigned exp_sib, unsigned exp_disp, unsigned exp_imm)
+{
+    FdHeader hdr;
+    int retval = fd_decode_header(buf, buf_len, mode, &hdr);
+    if (retval == FD_ERR_INTERNAL)
+        return 0; // not compiled with this arch-mode (32/64 bit)
+    if ((unsigned) retval == buf_len && FD_HDR_MODRM_OFF(&hdr) == exp_modrm &&
+        FD_HDR_SIB_OFF(&hdr) == exp_sib && FD_HDR_DISP_OFF(&hdr) == exp_disp &&
+        FD_HDR_IMM_OFF(&hdr) == exp_imm)
+        return 0;
+
+    printf("Failed header case (%u-bit): ", mode);
+    print_hex(buf, buf_len);
+    printf("\n  Exp: modrm %u sib %u disp %u imm %u", exp_modrm, exp_sib,
+           exp_disp, exp_imm);
+    printf("\n  Got (%2d): modrm %u sib %u disp %u imm %u\n", retval,
+           FD_HDR_MODRM_OFF(&hdr), FD_HDR_SIB_OFF(&hdr), FD_HDR_DISP_OFF(&hdr),
+           FD_HDR_IMM_OFF(&hdr));
+    return -1;
+}
+
+static
+int
+test_stream(const void* buf, size_t buf_len, unsigned mode)
+{
+    FdInstr instr;
+    if (fd_decode(buf, buf_len, mode, 0, &instr) == FD_ERR_INTERNAL)
+        return 0; // not compiled with this arch-mode (32/64 bit)
+
+    // Reference: sequential decoding, skipping one byte on errors.
+    size_t exp_offs[64];
+    char exp_fmts[64][128];
+    size_t exp_count = 0;
+    for (size_t off = 0; off < buf_len;) {
+        int retval = fd_decode((const uint8_t*) buf + off, buf_len - off, mode,
+                               0, &instr);
+        if (retval == FD_ERR_PARTIAL && buf_len - off < 15)
+            break;
+        if (retval > 0) {
+            exp_offs[exp_count] = off;
+            fd_format(&instr, exp_fmts[exp_count++], sizeof(exp_fmts[0]));
+        }
+        off += retval > 0 ? (size_t) retval : 1;
+    }
+
+    // Decoding from chunks of any size must give the same result.
+    for (size_t chunk_size = 1; chunk_size <= buf_len; chunk_size++) {
+        FdStream stream;
+        fd_stream_init(&stream, mode);
+        size_t count = 0;
+        for (size_t off = 0; off < buf_len; off += chunk_size) {
+            size_t len = buf_len - off < chunk_size ? buf_len - off : chunk_size;
+            fd_stream_feed(&stream, (const uint8_t*) buf + off, len);
+            while (1) {
+                size_t instr_off = FD_STREAM_OFFSET(&stream);
+                int retval = fd_stream_next(&stream, &instr);
+                if (retval == 0)
+                    break;
+                if (retval < 0) {
+                    fd_stream_skip(&stream, 1);
+                    continue;
+                }
+
+                char fmt[128];
+                fd_format(&instr, fmt, sizeof(fmt));
+                if (count >= exp_count || instr_off != exp_offs[count] ||
+                    strcmp(fmt, exp_fmts[count])) {
+                    printf("Failed stream case (%u-bit, chunk size %zu): ",
+                           mode, chunk_size);
+                    print_hex(buf, buf_len);
+                    printf("\n  Got: %s at %zu\n", fmt, instr_off);
+                    return -1;
+                }
+                count++;
+            }
+        }
+        if (count != exp_count) {
+            printf("Failed stream case (%u-bit, chunk size %zu): ", mode,
+                   chunk_size);
+            print_hex(buf, buf_len);
+            printf("\n  Exp: %zu instrs\n  Got: %zu instrs\n", exp_count, count);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static
+int
+test_cache_decode(FdDecodeCache* cache, const void* buf, size_t buf_len,
+                  unsigned mode, uint64_t address, int exp_hit)
+{
+    FdInstr instr, exp_instr;
+    char fmt[128] = "", exp_fmt[128] = "";
+    uint64_t hits = FD_CACHE_HITS(cache);
+    uint64_t misses = FD_CACHE_MISSES(cache);
+
+    int retval = fd_cache_decode(cache, buf, buf_len, mode, address, &instr);
+    int exp_retval = fd_decode(buf, buf_len, mode, 0, &exp_instr);
+    if (exp_retval == FD_ERR_INTERNAL)
+        return 0; // not compiled with this arch-mode (32/64 bit)
+    if (retval > 0)
+        fd_format(&instr, fmt, sizeof(fmt));
+    if (exp_retval > 0)
+        fd_format(&exp_instr, exp_fmt, sizeof(exp_fmt));
+
+    int hit = FD_CACHE_HITS(cache) - hits;
+    if (retval == exp_retval && !strcmp(fmt, exp_fmt) && hit == exp_hit &&
+        FD_CACHE_MISSES(cache) - misses == (uint64_t) !exp_hit)
+        return 0;
+
+    printf("Failed cache case (%u-bit, address %#" PRIx64 "): ", mode, address);
+    print_hex(buf, buf_len);
+    printf("\n  Exp (%2d): %s, hit %d", exp_retval, exp_fmt, exp_hit);
+    printf("\n  Got (%2d): %s, hit %d\n", retval, fmt, hit);
     return -1;
 }
 
+static
+int
+test_regs(const void* buf, size_t buf_len, unsigned mode, uint64_t exp_read,
+          uint64_t exp_write, uint32_t exp_flags)
+{
+    FdInstr instr;
+    int retval = fd_decode(buf, buf_len, mode, 0, &instr);
+    if (retval == FD_ERR_INTERNAL)
+        return 0; // not compiled with this arch-mode (32/64 bit)
+
+    uint64_t read = 0, write = 0;
+    uint32_t flags = 0;
+    if (retval > 0)
+        fd_instr_regs(&instr, &read, &write, &flags);
+    if (retval > 0 && read == exp_read && write == exp_write && flags == exp_flags)
+        return 0;
+
+    printf("Failed regs case (%u-bit): ", mode);
+    print_hex(buf, buf_len);
+    printf("\n  Exp: r=%016"PRIx64" w=%016"PRIx64" f=%08"PRIx32, exp_read,
+           exp_write, exp_flags);
+    printf("\n  Got: r=%016"PRIx64" w=%016"PRIx64" f=%08"PRIx32"\n", read,
+           write, flags);
+    return -1;
+}
+
+static
+int
+test_cfg(const void* buf, size_t buf_len, unsigned mode, const size_t* entries,
+         size_t entry_count, size_t max_blocks, const char* exp)
+{
+    static const char* kinds[] = {
+        "fall", "jmp", "ijmp", "jcc", "call", "icall", "ret", "trap", "inv", "end",
+    };
+    uint8_t visited[64];
+    FdBlock blocks[64];
+    char fmt[1024] = "";
+    if (fd_decode(buf, buf_len, mode, 0, &(FdInstr) {0}) == FD_ERR_INTERNAL)
+        return 0; // not compiled with this arch-mode (32/64 bit)
+
+    size_t count = fd_cfg(buf, buf_len, mode, entries, entry_count, visited,
+                          blocks, max_blocks);
+    size_t fmt_len = 0;
+    for (size_t i = 0; i < count; i++) {
+        fmt_len += snprintf(fmt + fmt_len, sizeof(fmt) - fmt_len, "%s%zx-%zx %s",
+                            i ? "; " : "", blocks[i].start, blocks[i].end,
+                            kinds[blocks[i].kind]);
+        if (blocks[i].kind == FD_BLOCK_JUMP || blocks[i].kind == FD_BLOCK_COND ||
+            blocks[i].kind == FD_BLOCK_CALL)
+            fmt_len += snprintf(fmt + fmt_len, sizeof(fmt) - fmt_len, ":%zx",
+                                blocks[i].target);
+        fmt_len += snprintf(fmt + fmt_len, sizeof(fmt) - fmt_len, " %u",
+                            (unsigned) blocks[i].count);
+    }
+    if (!strcmp(fmt, exp))
+        return 0;
+
+    printf("Failed cfg case (%u-bit): ", mode);
+    print_hex(buf, buf_len);
+    printf("\n  Exp: %s", exp);
+    printf("\n  Got: %s\n", fmt);
+    return -1;
+}
+
+static
+int
+test_cache(void)
+{
+    int failed = 0;
+    static uint64_t mem[64 * FD_CACHE_ENTRY_SIZE / 8];
+    FdDecodeCache cache;
+
+    if (fd_cache_init(&cache, (char*) mem + 4, sizeof(mem) - 4, 4) != FD_ERR_INTERNAL ||
+        fd_cache_init(&cache, mem, FD_CACHE_ENTRY_SIZE * 3, 4) != FD_ERR_INTERNAL ||
+        fd_cache_init(&cache, mem, sizeof(mem), 4) != 0) {
+        puts("Failed cache init");
+        return -1;
+    }
+
+#define TEST_CACHE(buf, mode, address, exp_hit) \
+        failed |= test_cache_decode(&cache, buf, sizeof(buf) - 1, mode, address, exp_hit)
+    TEST_CACHE("\x48\x89\xc8", 64, 0x1000, 0);
+    TEST_CACHE("\x48\x89\xc8", 64, 0x1000, 1);
+    TEST_CACHE("\x48\x89\xc8\x90", 64, 0x1000, 1);
+    TEST_CACHE("\x48\x89\xc8", 32, 0x1000, 0); // different mode
+    TEST_CACHE("\x48\x89\xc8", 32, 0x1000, 1);
+    TEST_CACHE("\x48\x89\xc8", 64, 0x1000, 1);
+    TEST_CACHE("\x48\x89", 64, 0x1000, 0); // partial
+    TEST_CACHE("\x48\x89\xc1", 64, 0x1000, 0); // code changed
+    TEST_CACHE("\x48\x89\xc1", 64, 0x1000, 1);
+    TEST_CACHE("\x0f\x0b", 64, 0x1003, 0);
+    TEST_CACHE("\x06", 64, 0x1005, 0); // errors are not cached
+    TEST_CACHE("\x06", 64, 0x1005, 0);
+
+    fd_cache_invalidate(&cache, 0x1003, 0); // empty range
+    TEST_CACHE("\x48\x89\xc1", 64, 0x1000, 1);
+    TEST_CACHE("\x0f\x0b", 64, 0x1003, 1);
+    fd_cache_invalidate(&cache, 0x1003, 1);
+    TEST_CACHE("\x48\x89\xc1", 64, 0x1000, 1);
+    TEST_CACHE("\x0f\x0b", 64, 0x1003, 0);
+    fd_cache_invalidate(&cache, 0x1002, 1);
+    TEST_CACHE("\x48\x89\xc1", 64, 0x1000, 0);
+    TEST_CACHE("\x0f\x0b", 64, 0x1003, 1);
+    TEST_CACHE("\x48\x89\xc8", 32, 0x1000, 1); // dec eax, one byte only
+    fd_cache_invalidate(&cache, 0, UINT64_MAX); // full scan
+    TEST_CACHE("\x48\x89\xc1", 64, 0x1000, 0);
+    TEST_CACHE("\x0f\x0b", 64, 0x1003, 0);
+    TEST_CACHE("\x48\x89\xc8", 32, 0x1000, 0);
+
+    // More instructions than entries evict each other, but never give wrong
+    // results.
+    for (uint64_t addr = 0; addr < 1000; addr++)
+        TEST_CACHE("\x66\x90", 64, addr, 0);
+    TEST_CACHE("\x66\x90", 64, 999, 1);
+#undef TEST_CACHE
+
+    return failed;
+}
+
 #define TEST1(mode, buf, exp_fmt) test(buf, sizeof(buf)-1, mode, exp_fmt)
 #define TEST32(...) failed |= TEST1(32, __VA_ARGS__)
 #define TEST64(...) failed |= TEST1(64, __VA_ARGS__)
 #define TEST(...) failed |= TEST1(32, __VA_ARGS__) | TEST1(64, __VA_ARGS__)
+#define TEST_BLOCK1(mode, buf, cnt, cons) test_block(buf, sizeof(buf)-1, mode, cnt, cons)
+#define TEST_BLOCK32(...) failed |= TEST_BLOCK1(32, __VA_ARGS__)
+#define TEST_BLOCK64(...) failed |= TEST_BLOCK1(64, __VA_ARGS__)
+#define TEST_BLOCK(...) failed |= TEST_BLOCK1(32, __VA_ARGS__) | TEST_BLOCK1(64, __VA_ARGS__)
+#define TEST_HEADER1(mode, buf, ...) test_header(buf, sizeof(buf)-1, mode, __VA_ARGS__)
+#define TEST_HEADER32(...) failed |= TEST_HEADER1(32, __VA_ARGS__)
+#define TEST_HEADER64(...) failed |= TEST_HEADER1(64, __VA_ARGS__)
+#define TEST_HEADER(...) failed |= TEST_HEADER1(32, __VA_ARGS__) | TEST_HEADER1(64, __VA_ARGS__)
+#define TEST_STREAM1(mode, buf) test_stream(buf, sizeof(buf)-1, mode)
+#define TEST_STREAM32(...) failed |= TEST_STREAM1(32, __VA_ARGS__)
+#define TEST_STREAM64(...) failed |= TEST_STREAM1(64, __VA_ARGS__)
+#define TEST_STREAM(...) failed |= TEST_STREAM1(32, __VA_ARGS__) | TEST_STREAM1(64, __VA_ARGS__)
+#define TEST_REGS1(mode, buf, r, w, f) test_regs(buf, sizeof(buf)-1, mode, r, w, f)
+#define TEST_REGS32(...) failed |= TEST_REGS1(32, __VA_ARGS__)
+#define TEST_REGS64(...) failed |= TEST_REGS1(64, __VA_ARGS__)
+#define TEST_REGS(...) failed |= TEST_REGS1(32, __VA_ARGS__) | TEST_REGS1(64, __VA_ARGS__)
+#define TEST_CFG1(mode, buf, max, exp, ...) \
+        test_cfg(buf, sizeof(buf)-1, mode, (const size_t[]) {__VA_ARGS__}, \
+                 sizeof((const size_t[]) {__VA_ARGS__}) / sizeof(size_t), max, exp)
+#define TEST_CFG32(...) failed |= TEST_CFG1(32, __VA_ARGS__)
+#define TEST_CFG64(...) failed |= TEST_CFG1(64, __VA_ARGS__)
+#define TEST_CFG(...) failed |= TEST_CFG1(32, __VA_ARGS__) | TEST_CFG1(64, __VA_ARGS__)
+
+static
+int
+test_match(void)
+{
+    static const uint16_t mov[] = {FDI_MOV};
+    static const uint16_t call[] = {FDI_CALL};
+    static const uint16_t call_ret[] = {FDI_CALL, FDI_RET};
+    static const FdPattern patterns[] = {
+        // mov with memory operand [rsp+disp], disp > 0x100
+        { mov, 1, {{ .check = FD_MATCH_REG | FD_MATCH_DISP, .idx = -1,
+                     .reg = FD_REG_SP, .min = 0x101, .max = INT64_MAX }} },
+        // call via memory
+        { call, 1, {{ .check = FD_MATCH_OPTYPE, .idx = 0, .type = FD_OT_MEM }} },
+        // any call or return, type only
+        { call_ret, 2, {{ 0 }} },
+        // any instruction with a 32-bit immediate in [0x10, 0x20]
+        { NULL, 0, {{ .check = FD_MATCH_IMM | FD_MATCH_SIZE, .idx = -1,
+                      .size = 4, .min = 0x10, .max = 0x20 }} },
+    };
+    static const uint8_t code[] =
+        "\x48\x8b\x84\x24\x00\x02\x00\x00" // mov rax, [rsp+0x200]
+        "\x48\x8b\x44\x24\x08" // mov rax, [rsp+8]
+        "\xff\x15\x00\x00\x00\x00" // call [rip]
+        "\xe8\x00\x00\x00\x00" // call rel
+        "\x06\x90\xc3" // UD, nop, ret
+        "\x48\x89\x04\x24" // mov [rsp], rax
+        "\x83\xc0\x18"; // add eax, 0x18
+    static const FdMatch exp[] = {{0, 1}, {13, 6}, {19, 4}, {26, 4}, {31, 8}};
+
+    FdInstr instr;
+    if (fd_decode(code, sizeof(code) - 1, 64, 0, &instr) == FD_ERR_INTERNAL)
+        return 0; // not compiled with 64-bit mode
+
+    FdMatcher matcher;
+    if (fd_matcher_compile(&matcher, patterns, 4)) {
+        puts("Failed match compile");
+        return -1;
+    }
+
+    FdMatch matches[8];
+    size_t count = 0;
+    size_t off = 0;
+    // Resume after every two matches.
+    while (off < sizeof(code) - 1) {
+        size_t consumed;
+        size_t res = fd_match(&matcher, code + off, sizeof(code) - 1 - off, 64,
+                              matches + count, 2, &consumed);
+        if (res > 2 || consumed == 0)
+            break;
+        for (size_t i = count; i < count + res; i++)
+            matches[i].offset += off;
+        count += res;
+        off += consumed;
+    }
+
+    int failed = count != sizeof(exp) / sizeof(exp[0]);
+    for (size_t i = 0; !failed && i < count; i++)
+        failed = matches[i].offset != exp[i].offset ||
+                 matches[i].patterns != exp[i].patterns;
+
+    // Predicates that can never hold are rejected.
+    static const FdPattern invalid[] = {
+        { NULL, 0, {{ .check = FD_MATCH_OPTYPE | FD_MATCH_DISP, .idx = 0,
+                      .type = FD_OT_REG, .min = 0, .max = 0 }} },
+    };
+    failed |= fd_matcher_compile(&matcher, invalid, 1) != FD_ERR_INTERNAL;
+    failed |= fd_matcher_compile(&matcher, patterns, FD_MATCH_MAX_PATTERNS + 1) != FD_ERR_INTERNAL;
+
+    if (failed) {
+        printf("Failed match case: %zu matches\n", count);
+        for (size_t i = 0; i < count; i++)
+            printf("  %zu: %#" PRIx32 "\n", matches[i].offset, matches[i].patterns);
+        return -1;
+    }
+    return 0;
+}
 
 int
 main(int argc, char** argv)
@@ -234,6 +692,9 @@ main(int argc, char** argv)
     TEST("\x66\xb8\xf0\xf0", "mov ax, 0xf0f0");
     TEST("\xb8\xf0\xf0\xab\xff", "mov eax, 0xffabf0f0");
     TEST64("\x48\xb8\xf0\xf0\xab\xff\x00\x12\x12\xcd", "mov rax, 0xcd121200ffabf0f0");
+    TEST32("\xa1\xf0\xf0\xab\xff", "mov eax, dword ptr [0xffabf0f0]");
+    TEST64("\xa1\xf0\xf0\xab\xff\x00\x12\x12\xcd", "mov eax, dword ptr [0xcd121200ffabf0f0]");
+    TEST64("\x67\xa1\xf0\xf0\xab\xff", "mov eax, dword ptr [0xffabf0f0]");
     TEST64("\xcd\x80", "int 0x80");
 
     TEST("\x66\xc8\x00\x00\x00", "enterw 0x0, 0x0");
@@ -421,6 +882,34 @@ main(int argc, char** argv)
     TEST("\xc5\xf2\x10\x04\x25\x34\x12\x00\x00", "UD"); // VEX.vvvv != 0
     TEST("\xc5\xfa\x11\x04\x25\x34\x12\x00\x00", "vmovss dword ptr [0x1234], xmm0");
     TEST("\xc5\xf2\x11\x04\x25\x34\x12\x00\x00", "UD"); // VEX.vvvv != 0
+    TEST("\xc5\xf3\x11\xc2", "vmovsd xmm2, xmm1, xmm0");
+    TEST("\xc5\xf7\x11\xc2", "vmovsd xmm2, xmm1, xmm0"); // VEX.L=1
+    TEST64("\xc4\xe2\x79\x2c\x02", "vmaskmovps xmm0, xmm0, xmmword ptr [rdx]");
+    TEST("\xc4\xe2\x79\x2c\xc2", "UD"); // must have memory operand
+    TEST64("\xc4\xe2\x7d\x2e\x02", "vmaskmovps ymmword ptr [rdx], ymm0, ymm0");
+    TEST("\xc4\xe2\x7d\x2e\xc2", "UD"); // must have memory operand
+    TEST64("\xc4\xe2\xf9\x8c\x02", "vpmaskmovq xmm0, xmm0, xmmword ptr [rdx]");
+    TEST("\xc4\xe2\xf9\x8c\xc2", "UD"); // must have memory operand
+    TEST64("\xc4\xe2\x79\x8e\x02", "vpmaskmovd xmmword ptr [rdx], xmm0, xmm0");
+    TEST("\xc4\xe2\x79\x8e\xc2", "UD"); // must have memory operand
+    TEST("\xc4\xe2\x79\x46\xc2", "vpsravd xmm0, xmm0, xmm2");
+    TEST("\xc4\xe2\xf9\x46\xc2", "UD"); // VPSRAVQ only exists with EVEX
+    TEST("\xc5\xf3\xd0\xc2", "vaddsubps xmm0, xmm1, xmm2");
+    TEST("\xc5\xf0\xd0\xc2", "UD"); // VADDSUBPS requires F2
+    TEST64("\xc5\xfb\xf0\x02", "vlddqu xmm0, xmmword ptr [rdx]");
+    TEST("\xc5\xfb\xf0\xc2", "UD"); // must have memory operand
+    TEST("\xc5\xf9\xf7\xc2", "vmaskmovdqu xmm0, xmm2");
+    TEST("\xc5\xf8\xf7\xc2", "UD"); // VMASKMOVDQU requires 66
+    TEST("\xc5\xf9\xf7\x02", "UD"); // must have register operand
+    TEST64("\xc4\xe2\x7d\x1a\x02", "vbroadcastf128 ymm0, xmmword ptr [rdx]");
+    TEST("\xc4\xe2\x7d\x1a\xc2", "UD"); // must have memory operand
+    TEST("\xc4\xe3\xfd\x00\xd1\x01", "vpermq ymm2, ymm1, 0x1");
+    TEST("\xc4\xe3\xf5\x00\xd1\x01", "UD"); // VEX.vvvv != 0
+    TEST("\xc4\xe3\xfd\x01\xd1\x01", "vpermpd ymm2, ymm1, 0x1");
+    TEST("\xc4\xe3\x79\x08\xc1\x01", "vroundps xmm0, xmm1, 0x1");
+    TEST("\xc4\xe3\x71\x09\xc1\x01", "UD"); // VEX.vvvv != 0
+    TEST("\xc4\xe3\x71\x41\xc2\x01", "vdppd xmm0, xmm1, xmm2, 0x1");
+    TEST("\xc4\xe3\x75\x41\xc2\x01", "UD"); // VEX.L != 0
     TEST("\xc5\xf2\x2a\xc0", "vcvtsi2ss xmm0, xmm1, eax");
     TEST32("\xc4\xe1\xf2\x2a\xc0", "vcvtsi2ss xmm0, xmm1, eax");
     TEST64("\xc4\xe1\xf2\x2a\xc0", "vcvtsi2ss xmm0, xmm1, rax");
@@ -505,6 +994,86 @@ main(int argc, char** argv)
     TEST("\xc4\xe2\x79\x5a\x20", "UD"); // VEX.L != 1
     TEST("\xc4\xe2\xfd\x5a\x20", "UD"); // VEX.W != 0
 
+    // EVEX
+    TEST("\x62\xf1\x6c\x48\x58\xcb", "vaddps zmm1, zmm2, zmm3");
+    TEST("\x62\xf1\x6c\x28\x58\xcb", "vaddps ymm1, ymm2, ymm3");
+    TEST("\x62\xf1\x6c\x08\x58\xcb", "vaddps xmm1, xmm2, xmm3");
+    TEST("\x62\xf1\x6c\x49\x58\xcb", "vaddps zmm1{k1}, zmm2, zmm3");
+    TEST("\x62\xf1\x6c\xcf\x58\xcb", "vaddps zmm1{k7}{z}, zmm2, zmm3");
+    TEST("\x62\xf1\x6c\x18\x58\xcb", "vaddps zmm1, zmm2, zmm3, {rn-sae}");
+    TEST("\x62\xf1\x6c\x38\x58\xcb", "vaddps zmm1, zmm2, zmm3, {rd-sae}");
+    TEST("\x62\xf1\x6c\x58\x58\xcb", "vaddps zmm1, zmm2, zmm3, {ru-sae}");
+    TEST("\x62\xf1\x6c\x78\x58\xcb", "vaddps zmm1, zmm2, zmm3, {rz-sae}");
+    TEST("\x62\xf1\x6c\x68\x58\xcb", "UD"); // EVEX.L'L = 3
+    TEST("\x62\xf1\x6c\xc8\x58\xcb", "UD"); // EVEX.z without mask
+    TEST64("\x62\xf1\x7c\x49\x11\x00", "vmovups zmmword ptr [rax]{k1}, zmm0");
+    TEST("\x62\xf1\x7c\xc9\x11\x00", "UD"); // EVEX.z with memory destination
+    TEST64("\x62\xf1\x7e\x89\x10\x00", "vmovss xmm0{k1}{z}, dword ptr [rax]");
+    TEST("\x62\xf1\x7c\x49\xc2\xcb\x00", "vcmpps k1{k1}, zmm0, zmm3, 0x0");
+    TEST("\x62\xf1\x7c\xc9\xc2\xcb\x00", "UD"); // EVEX.z with mask destination
+    TEST("\x62\xf1\x6e\x28\xc2\xcb\x00", "vcmpss k1, xmm2, xmm3, 0x0"); // EVEX.L'L ignored
+    TEST("\x62\xf1\x6e\x18\xc2\xcb\x00", "vcmpss k1, xmm2, xmm3, {sae}, 0x0");
+    TEST("\x62\xf1\x7d\x08\x6e\xc8", "vmovd xmm1, eax");
+    TEST("\x62\xf1\x7d\x09\x6e\xc8", "UD"); // VMOVD with mask
+    TEST("\x62\xf1\xfe\x09\x7e\xc8", "UD"); // VMOVQ with mask
+    TEST64("\x62\xf1\x6c\x48\x58\x48\x01", "vaddps zmm1, zmm2, zmmword ptr [rax+0x40]");
+    TEST64("\x62\xf1\x6c\x28\x58\x48\x01", "vaddps ymm1, ymm2, ymmword ptr [rax+0x20]");
+    TEST64("\x62\xf1\x6c\x48\x58\x48\xff", "vaddps zmm1, zmm2, zmmword ptr [rax-0x40]");
+    TEST64("\x62\xf1\x6c\x48\x58\x88\x44\x00\x00\x00", "vaddps zmm1, zmm2, zmmword ptr [rax+0x44]");
+    TEST64("\x62\xf1\x6c\x58\x58\x48\x11", "vaddps zmm1, zmm2, dword ptr [rax+0x44]{1to16}");
+    TEST64("\x62\xf1\x6c\x38\x58\x48\x11", "vaddps ymm1, ymm2, dword ptr [rax+0x44]{1to8}");
+    TEST64("\x62\xf1\x6c\x18\x58\x48\x11", "vaddps xmm1, xmm2, dword ptr [rax+0x44]{1to4}");
+    TEST64("\x62\xf1\xed\x58\x58\x48\x09", "vaddpd zmm1, zmm2, qword ptr [rax+0x48]{1to8}");
+    TEST64("\x62\xf1\xed\x18\x58\x48\xf7", "vaddpd xmm1, xmm2, qword ptr [rax-0x48]{1to2}");
+    TEST64("\x62\x81\x6c\x20\x58\xcf", "vaddps ymm17, ymm18, ymm31");
+    TEST64("\x62\x01\x2c\x00\x58\xcb", "vaddps xmm25, xmm26, xmm27");
+    TEST64("\x62\x11\x6c\x40\x58\x4c\xb7\x02", "vaddps zmm9, zmm18, zmmword ptr [r15+4*r14+0x80]");
+    TEST32("\x62\xf1\x6c\x40\x58\xcb", "vaddps zmm1, zmm2, zmm3"); // EVEX.V' ignored
+    TEST32("\x62\xf1\x6c\x48\x58\x48\x01", "vaddps zmm1, zmm2, zmmword ptr [eax+0x40]");
+    TEST("\x62\xf1\x6e\x78\x58\xcb", "vaddss xmm1, xmm2, xmm3, {rz-sae}");
+    TEST64("\x62\xf1\x6e\x0a\x58\x48\x02", "vaddss xmm1{k2}, xmm2, dword ptr [rax+0x8]");
+    TEST64("\x62\xf1\xef\x08\x58\x48\x01", "vaddsd xmm1, xmm2, qword ptr [rax+0x8]");
+    TEST("\x62\xf1\x6c\x18\x5f\xcb", "vmaxps zmm1, zmm2, zmm3, {sae}");
+    TEST64("\x62\xf1\x6c\x1a\xc2\xcb\x03", "vcmpps k1{k2}, zmm2, zmm3, {sae}, 0x3");
+    TEST64("\x62\xf1\xed\x38\xc2\x68\x20\x01", "vcmppd k5, ymm2, qword ptr [rax+0x100]{1to4}, 0x1");
+    TEST64("\x62\xf1\x7c\x48\x10\x07", "vmovups zmm0, zmmword ptr [rdi]");
+    TEST64("\x62\xe1\x7c\x08\x10\x47\x01", "vmovups xmm16, xmmword ptr [rdi+0x10]");
+    TEST64("\x62\xf1\x7e\x08\x10\x48\x01", "vmovss xmm1, dword ptr [rax+0x4]");
+    TEST64("\x62\xe1\x7e\x08\x11\x48\x01", "vmovss dword ptr [rax+0x4], xmm17");
+    TEST("\x62\xf1\x7e\x18\x10\x40\x01", "UD"); // EVEX.b without broadcast
+    TEST("\x62\xf1\x7c\x58\x10\xc1", "UD"); // EVEX.b without rounding
+    TEST64("\x62\xe1\x7d\x08\x6e\xc8", "vmovd xmm17, eax");
+    TEST64("\x62\xe1\xfd\x08\x6e\xc8", "vmovq xmm17, rax");
+    TEST32("\x62\xf1\xfd\x08\x6e\xc8", "vmovd xmm1, eax");
+    TEST("\x62\xf1\x7d\x28\x6e\xc8", "UD"); // EVEX.L'L != 0
+    TEST64("\x62\xf2\x7d\x48\x7c\xc8", "vpbroadcastd zmm1, eax");
+    TEST64("\x62\xf2\x7d\x48\x18\x48\x01", "vbroadcastss zmm1, dword ptr [rax+0x4]");
+    TEST64("\x62\xf3\x6d\x28\x18\x48\x01\x01", "vinsertf32x4 ymm1, ymm2, xmmword ptr [rax+0x10], 0x1");
+    TEST("\x62\xf3\x6d\x08\x18\xcb\x01", "UD"); // EVEX.L'L = 0
+    TEST("\x62\xf3\xfd\x48\x1b\xc8\x01", "vextractf64x4 ymm0, zmm1, 0x1");
+    TEST("\x62\xf3\xfd\x28\x1b\xc8\x01", "UD"); // EVEX.L'L = 1
+    TEST("\x62\xf3\xed\x28\x3a\xcb\x01", "UD"); // EVEX.L'L = 1
+    TEST("\x62\xf3\xfd\x18\x09\xca\x04", "vrndscalepd zmm1, zmm2, {sae}, 0x4");
+    TEST64("\x62\xf1\xf5\x58\x72\x00\x03", "vprorq zmm1, qword ptr [rax]{1to8}, 0x3");
+    TEST("\x62\xf3\x6d\x48\x25\xcb\xff", "vpternlogd zmm1, zmm2, zmm3, 0xff");
+    TEST("\x62\xf1\x6d\x48\x66\xcb", "vpcmpgtd k1, zmm2, zmm3");
+    TEST("\x62", "PARTIAL");
+    TEST64("\x62\xf1\x6c\x48\x58", "PARTIAL");
+    TEST32("\x62\xf1\x6c\x48\x58", "PARTIAL");
+    TEST("\x62\xf1\x6c\x48", "PARTIAL");
+    TEST("\x66\x62\xf1\x6c\x48\x58\xcb", "UD"); // EVEX + 66
+    TEST64("\x48\x62\xf1\x6c\x48\x58\xcb", "UD"); // EVEX + REX
+    TEST("\x62\xf0\x6c\x48\x58\xcb", "UD"); // EVEX.mm = 0
+    TEST("\x62\xf5\x6c\x48\x58\xcb", "UD"); // EVEX.P0[3:2] != 0
+    TEST("\x62\xf1\x68\x48\x58\xcb", "UD"); // EVEX.P1[2] != 1
+    TEST("\x62\xf1\x7c\x40\x10\xc1", "UD"); // EVEX.V' != 1
+    TEST("\xc5\xf8\x90\xca", "kmovw k1, k2");
+    TEST64("\xc5\xf8\x90\x08", "kmovw k1, word ptr [rax]");
+    TEST("\xc5\xf8\x92\xc8", "kmovw k1, eax");
+    TEST("\xc5\xf8\x93\xc1", "kmovw eax, k1");
+    TEST("\xc5\xec\x41\xcb", "kandw k1, k2, k3");
+    TEST("\xc5\xf8\x98\xca", "kortestw k1, k2");
+
     // Intel-Syntax special cases
     TEST("\x66\x98", "cbw");
     TEST("\x98", "cwde");
@@ -616,6 +1185,175 @@ main(int argc, char** argv)
     TEST("\xf2\x0f\xa7\xe8", "UD");
     TEST("\xf3\x0f\xa7\xe8", "rep xcryptofb");
 
+    // Block decoding
+    TEST_BLOCK("", 0, 0);
+    TEST_BLOCK("\x90\x90\xc3", 3, 3);
+    TEST_BLOCK("\x66\x0f\x10\xc1\x90", 2, 5);
+    TEST_BLOCK64("\x48\x89\xc8\x48\x8b\x04\x24\xc3", 3, 8);
+    TEST_BLOCK64("\x48\x89\xc8\x06\x90", 1, 3); // stops at first UD
+    TEST_BLOCK32("\x06\x90", 2, 2);
+    TEST_BLOCK("\x90\x90\x0f", 2, 2); // stops before partial instruction
+    TEST_BLOCK("\x90\x90\x90\x90\x90\x90\x90\x90\x90\x90\x90\x90\x90\x90\x90\x90\x90", 16, 16);
+
+    failed |= test_cache();
+    failed |= test_match();
+
+    // Header offsets: modrm, sib, disp, imm
+    TEST_HEADER("\x90", 0, 0, 0, 0);
+    TEST_HEADER("\x66\x05\x34\x12", 0, 0, 0, 2); // add ax, 0x1234
+    TEST_HEADER("\x01\xc8", 1, 0, 0, 0); // add eax, ecx
+    TEST_HEADER("\x8b\x44\x24\x08", 1, 2, 3, 0); // mov eax, [esp+8]
+    TEST_HEADER("\x2e\xc7\x80\x78\x56\x34\x12\x01\x00\x00\x00", 2, 0, 3, 7);
+    TEST_HEADER("\x0f\x3a\x0f\xc1\x04", 3, 0, 0, 4); // palignr mm0, mm1, 4
+    TEST_HEADER("\xc4\xe3\x79\x4b\xc1\x20", 4, 0, 0, 5); // vblendvpd
+    TEST_HEADER("\xeb\xfe", 0, 0, 0, 1); // jmp $
+    TEST_HEADER32("\xa1\x78\x56\x34\x12", 0, 0, 1, 0); // mov eax, [moffs]
+    TEST_HEADER64("\x48\x8b\x05\x78\x56\x34\x12", 2, 0, 3, 0); // rip-relative
+    TEST_HEADER64("\x62\xf1\x7c\x48\x10\x44\x24\x01", 5, 6, 7, 0);
+
+    TEST_STREAM("\x90\xc3");
+    TEST_STREAM("\x66\x0f\x10\xc1\x90\xf3\x0f\x10\x04\x24\x05\x01\x02\x03\x04");
+    TEST_STREAM64("\x48\xb8\xf0\xf0\xab\xff\x00\x12\x12\xcd\x48\x89\xc8\xc3");
+    TEST_STREAM64("\x48\x89\xc8\x06\x90\xc4\xe2\x79\x18\x04\x24\x0f"); // UD, partial
+    TEST_STREAM32("\x06\x9a\x67\x45\x23\x01\x23\x00\x0f\x0b");
+    TEST_STREAM("\x66\x66\x66\x66\x66\x66\x66\x66\x66\x66\x66\x66\x66\x66\x66\x90\x90"); // too long
+    // Errors and skips within an instruction that straddles chunks.
+    TEST_STREAM64("\xc4\xc3\xc3\x00\x90\x90");
+    TEST_STREAM("\x0f\x90\x90\x0f\x0f\x90\xc3\xc3\x90");
+
+    // Register and flag usage
+#define GP(reg) FD_REGMASK_GP(FD_REG_ ## reg)
+#define VEC(reg) FD_REGMASK_VEC(reg)
+#define OSZAPC (FD_EFL_OF|FD_EFL_SF|FD_EFL_ZF|FD_EFL_AF|FD_EFL_PF|FD_EFL_CF)
+    TEST_REGS("\x01\xc8", GP(AX)|GP(CX), GP(AX), OSZAPC << 16); // add eax, ecx
+    TEST_REGS("\x11\xc8", GP(AX)|GP(CX), GP(AX), FD_EFL_CF|OSZAPC << 16); // adc
+    TEST_REGS("\x39\xc8", GP(AX)|GP(CX), 0, OSZAPC << 16); // cmp eax, ecx
+    TEST_REGS("\x89\xc8", GP(CX), GP(AX), 0); // mov eax, ecx
+    TEST_REGS("\x66\x89\xc8", GP(AX)|GP(CX), GP(AX), 0); // mov ax, cx
+    TEST_REGS("\x88\xc4", GP(AX), GP(AX), 0); // mov ah, al
+    TEST_REGS("\x8b\x04\xc8", GP(AX)|GP(CX), GP(AX), 0); // mov eax, [eax+ecx*8]
+    TEST_REGS("\x8d\x44\x8b\x04", GP(BX)|GP(CX), GP(AX), 0); // lea eax, [ebx+ecx*4+4]
+    TEST_REGS("\x89\x04\x24", GP(AX)|GP(SP), 0, 0); // mov [esp], eax
+    TEST_REGS("\xf7\xe1", GP(AX)|GP(CX), GP(AX)|GP(DX), OSZAPC << 16); // mul ecx
+    TEST_REGS("\xf6\xe1", GP(AX)|GP(CX), GP(AX), OSZAPC << 16); // mul cl
+    TEST_REGS("\xf7\xf9", GP(AX)|GP(CX)|GP(DX), GP(AX)|GP(DX), OSZAPC << 16); // idiv ecx
+    TEST_REGS("\xf7\xe9", GP(AX)|GP(CX), GP(AX)|GP(DX), OSZAPC << 16); // imul ecx
+    TEST_REGS("\x0f\xaf\xc1", GP(AX)|GP(CX), GP(AX), OSZAPC << 16); // imul eax, ecx
+    TEST_REGS("\x6b\xc1\x08", GP(CX), GP(AX), OSZAPC << 16); // imul eax, ecx, 8
+    TEST_REGS("\x99", GP(AX), GP(DX), 0); // cdq
+    TEST_REGS("\xa4", GP(SI)|GP(DI), GP(SI)|GP(DI), FD_EFL_DF); // movsb
+    TEST_REGS("\xf3\xa4", GP(SI)|GP(DI)|GP(CX), GP(SI)|GP(DI)|GP(CX), FD_EFL_DF); // rep movsb
+    TEST_REGS("\xf3\xaa", GP(AX)|GP(DI)|GP(CX), GP(DI)|GP(CX), FD_EFL_DF); // rep stosb
+    TEST_REGS("\xf2\xae", GP(AX)|GP(DI)|GP(CX), GP(DI)|GP(CX), FD_EFL_DF|OSZAPC << 16); // repnz scasb
+    TEST_REGS("\x74\x00", 0, 0, FD_EFL_ZF); // jz
+    TEST_REGS("\x7f\x00", 0, 0, FD_EFL_ZF|FD_EFL_SF|FD_EFL_OF); // jg
+    TEST_REGS("\x0f\x44\xc1", GP(AX)|GP(CX), GP(AX), FD_EFL_ZF); // cmovz eax, ecx
+    TEST_REGS("\x0f\x94\xc0", GP(AX), GP(AX), FD_EFL_ZF); // setz al
+    TEST_REGS("\x50", GP(AX)|GP(SP), GP(SP), 0); // push eax
+    TEST_REGS("\x58", GP(SP), GP(AX)|GP(SP), 0); // pop eax
+    TEST_REGS("\xc3", GP(SP), GP(SP), 0); // ret
+    TEST_REGS("\xff\xd0", GP(AX)|GP(SP), GP(SP), 0); // call eax
+    TEST_REGS("\x9c", GP(SP), GP(SP), 0xfd5); // pushf
+    TEST_REGS("\x0f\xa2", GP(AX)|GP(CX), GP(AX)|GP(BX)|GP(CX)|GP(DX), 0); // cpuid
+    TEST_REGS("\xf5", 0, 0, FD_EFL_CF|FD_EFL_CF << 16); // cmc
+    TEST_REGS("\xd3\xe0", GP(AX)|GP(CX), GP(AX), OSZAPC|OSZAPC << 16); // shl eax, cl
+    TEST_REGS("\xd1\xc0", GP(AX), GP(AX), FD_EFL_OF|FD_EFL_CF|(FD_EFL_OF|FD_EFL_CF) << 16); // rol eax, 1
+    TEST_REGS("\xfc", 0, 0, FD_EFL_DF << 16); // cld
+    TEST_REGS("\x0f\x0b", 0, 0, 0); // ud2
+    TEST_REGS32("\x60", 0xff, GP(SP), 0); // pusha
+    TEST_REGS64("\x48\x01\xc8", GP(AX)|GP(CX), GP(AX), OSZAPC << 16); // add rax, rcx
+    TEST_REGS64("\x4d\x01\xc8", GP(R8)|GP(R9), GP(R8), OSZAPC << 16); // add r8, r9
+    TEST_REGS64("\x48\x8b\x05\x00\x00\x00\x00", 0, GP(AX), 0); // mov rax, [rip]
+    TEST_REGS64("\x0f\x05", 0, GP(CX)|GP(R11), 0xfd5|0xfd5 << 16); // syscall
+    TEST_REGS("\x66\x0f\x58\xc1", VEC(0)|VEC(1), VEC(0), 0); // addpd xmm0, xmm1
+    TEST_REGS("\x0f\x28\xc1", VEC(1), VEC(0), 0); // movaps xmm0, xmm1
+    TEST_REGS("\x66\x0f\x2e\xc1", VEC(0)|VEC(1), 0, OSZAPC << 16); // ucomisd xmm0, xmm1
+    TEST_REGS("\x66\x0f\x38\x10\xc1", VEC(0)|VEC(1), VEC(0), 0); // pblendvb xmm0, xmm1
+    TEST_REGS("\x66\x0f\x3a\x63\xc1\x00", VEC(0)|VEC(1), GP(CX), OSZAPC << 16); // pcmpistri
+    TEST_REGS("\x66\x0f\x7e\xc0", VEC(0), GP(AX), 0); // movd eax, xmm0
+    TEST_REGS("\x0f\xfe\xc1", FD_REGMASK_MMX(0)|FD_REGMASK_MMX(1), FD_REGMASK_MMX(0), 0); // paddd mm0, mm1
+    TEST_REGS("\xc5\xf0\x58\xc2", VEC(1)|VEC(2), VEC(0), 0); // vaddps xmm0, xmm1, xmm2
+    TEST_REGS("\xc4\xe2\x71\xa8\xc2", VEC(0)|VEC(1)|VEC(2), VEC(0), 0); // vfmadd213ps
+    TEST_REGS("\xc4\xe2\x69\x92\x04\xc8", GP(AX)|VEC(0)|VEC(1)|VEC(2), VEC(0)|VEC(2), 0); // vgatherdps xmm0, [eax+xmm1*8], xmm2
+    TEST_REGS("\xc5\xf8\x77", 0xffff0000, 0xffff0000, 0); // vzeroupper
+    TEST_REGS("\x62\xf1\x74\x09\x58\xc2", FD_REGMASK_MASK(1)|VEC(0)|VEC(1)|VEC(2), VEC(0), 0); // vaddps xmm0{k1}, xmm1, xmm2
+    TEST_REGS("\x62\xf1\x74\x89\x58\xc2", FD_REGMASK_MASK(1)|VEC(1)|VEC(2), VEC(0), 0); // vaddps xmm0{k1}{z}, xmm1, xmm2
+    TEST_REGS64("\x62\xe1\x74\x08\x58\xc2", VEC(1)|VEC(2), VEC(16), 0); // vaddps xmm16, xmm1, xmm2
+    TEST_REGS("\xc5\xfc\x45\xc1", FD_REGMASK_MASK(0)|FD_REGMASK_MASK(1), FD_REGMASK_MASK(0), 0); // korw k0, k0, k1
+#undef GP
+#undef VEC
+#undef OSZAPC
+
+    // xor eax, eax; inc eax; cmp eax, 10; jne 2; ret
+    TEST_CFG("\x31\xc0\xff\xc0\x83\xf8\x0a\x75\xf9\xc3", 16,
+             "0-2 fall 1; 2-9 jcc:2 3; 9-a ret 1", 0);
+    // call 8; jmp c; (data); ud2; int3; int3; jmp eax/rax
+    TEST_CFG("\xe8\x03\x00\x00\x00\xeb\x05\xff\x0f\x0b\xcc\xcc\xff\xe0", 16,
+             "0-5 call:8 1; 5-7 jmp:c 1; 8-a trap 1; c-e ijmp 1", 0);
+    TEST_CFG("\xe8\x03\x00\x00\x00\xeb\x05\xff\x0f\x0b\xcc\xcc\xff\xe0", 3, "", 0);
+    TEST_CFG("\x90\x90\x90\xc3", 16, "0-3 fall 3; 3-4 ret 1", 3, 0);
+    TEST_CFG("\x90\x90\x90\xc3", 16, "0-1 fall 1; 1-4 ret 3", 0, 1, 1, 9);
+    TEST_CFG("\x90\x90", 16, "0-2 end 2", 0);
+    TEST_CFG("\x90\xe8\x00", 16, "0-1 end 1", 0);
+    TEST_CFG("\xeb\x10", 16, "0-2 jmp:12 1", 0);
+    TEST_CFG64("\x90\x06", 16, "0-1 inv 1", 0);
+    TEST_CFG("\x74\x01\x90\xc3", 16, "0-2 jcc:3 1; 2-3 fall 1; 3-4 ret 1", 0);
+    TEST_CFG("\xe2\xfe\xc3", 16, "0-2 jcc:0 1; 2-3 ret 1", 0); // loop 0
+    // mov eax, 0x90909090; ret, with an entry inside the immediate
+    TEST_CFG("\xb8\x90\x90\x90\x90\xc3", 16,
+             "0-5 fall 1; 1-5 fall 4; 5-6 ret 1", 0, 1);
+    {
+        // Blocks are discovered in reverse order and must be sorted.
+        uint8_t code[96];
+        size_t entries[48];
+        char exp[1024];
+        size_t exp_len = 0;
+        for (size_t i = 0; i < 48; i++) {
+            code[2 * i] = 0x90;
+            code[2 * i + 1] = 0xc3;
+            entries[i] = 94 - 2 * i;
+            exp_len += snprintf(exp + exp_len, sizeof(exp) - exp_len, "%s%zx-%zx ret 2",
+                                i ? "; " : "", 2 * i, 2 * i + 2);
+        }
+        failed |= test_cfg(code, sizeof(code), 64, entries, 48, 64, exp);
+    }
+
+    // Decoder statistics are only available with the meson option with_stats.
+    FdStats stats_before, stats_after;
+    if (!fd_stats(&stats_before)) {
+        FdInstr instr;
+        fd_decode((const uint8_t*) "\x66\x90", 2, 64, 0, &instr);
+        fd_decode((const uint8_t*) "\x0f\x1f\x44\x00\x00", 5, 64, 0, &instr);
+        fd_decode((const uint8_t*) "\xc4\xe2\x7d\x18\x04\x24", 6, 64, 0, &instr);
+        fd_decode((const uint8_t*) "\x0f", 1, 64, 0, &instr);
+        fd_decode((const uint8_t*) "\x06", 1, 64, 0, &instr);
+        fd_decode((const uint8_t*) "\xf0\x90", 2, 64, 0, &instr);
+        fd_insn_length((const uint8_t*) "\xf0\x90", 2, 64);
+        fd_stats(&stats_after);
+#define TEST_STAT(field, exp) do { \
+            if (stats_after.field - stats_before.field != (exp)) { \
+                printf("Failed case (stats): %s\n  Exp: %u\n  Got: %" PRIu64 "\n", \
+                       #field, (exp), stats_after.field - stats_before.field); \
+                failed = 1; \
+            } \
+        } while (0)
+        TEST_STAT(decoded, 3);
+        TEST_STAT(errors[FD_STAT_ERR_PARTIAL_PREFIX], 1);
+        TEST_STAT(errors[FD_STAT_ERR_UD_OPCODE], 1);
+        TEST_STAT(errors[FD_STAT_ERR_UD_LOCK], 1);
+        TEST_STAT(prefix_bytes[0], 4);
+        TEST_STAT(prefix_bytes[1], 2);
+        TEST_STAT(prefix_66, 1);
+        TEST_STAT(prefix_lock, 1);
+        TEST_STAT(escape[FD_STAT_ESC_NONE], 3);
+        TEST_STAT(escape[FD_STAT_ESC_0F], 1);
+        TEST_STAT(escape[FD_STAT_ESC_VEX3], 1);
+        TEST_STAT(sib, 2);
+        TEST_STAT(disp[0], 1);
+        TEST_STAT(disp[1], 1);
+#undef TEST_STAT
+    }
+
     puts(failed ? "Some tests FAILED" : "All tests PASSED");
     return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
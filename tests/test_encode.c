@@ -5,7 +5,9 @@
 #include <inttypes.h>
 #include <time.h>
 
+#include <fadec.h>
 #include <fadec-enc.h>
+#include <fadec-enc-inline.h>
 
 
 static
@@ -18,16 +20,25 @@ print_hex(const uint8_t* buf, size_t len)
 
 static
 int
-test(uint8_t* buf, const char* name, uint64_t mnem, uint64_t op0, uint64_t op1, uint64_t op2, uint64_t op3, const void* exp, size_t exp_len)
+test(uint8_t* buf, const char* name, int mode, uint64_t mnem, uint64_t op0, uint64_t op1, uint64_t op2, uint64_t op3, const void* exp, size_t exp_len)
 {
     memset(buf, 0, 16);
 
     uint8_t* inst = buf;
-    int res = fe_enc64(&inst, mnem, op0, op1, op2, op3);
+    int res = mode == 32 ? fe_enc32(&inst, mnem, op0, op1, op2, op3)
+                         : fe_enc64(&inst, mnem, op0, op1, op2, op3);
     if ((res != 0) != (exp_len == 0)) goto fail;
     if (inst - buf != (ptrdiff_t) exp_len) goto fail;
     if (memcmp(buf, exp, exp_len)) goto fail;
 
+    if (mode == 32)
+        return 0;
+    int size = fe_enc64_size(buf, mnem, op0, op1, op2, op3);
+    if (size != (exp_len ? (int) exp_len : -1)) {
+        printf("Failed case %s: size %d\n", name, size);
+        return -1;
+    }
+
     return 0;
 
 fail:
@@ -40,9 +51,599 @@ fail:
     return -1;
 }
 
-#define TEST2(str, exp, exp_len, mnem, op0, op1, op2, op3, ...) test(buf, str, mnem, op0, op1, op2, op3, exp, exp_len)
-#define TEST1(str, exp, ...) TEST2(str, exp, sizeof(exp)-1, __VA_ARGS__, 0, 0, 0, 0, 0)
-#define TEST(exp, ...) failed |= TEST1(#__VA_ARGS__, exp, __VA_ARGS__)
+#define TEST2(str, mode, exp, exp_len, mnem, op0, op1, op2, op3, ...) test(buf, str, mode, mnem, op0, op1, op2, op3, exp, exp_len)
+#define TEST1(str, mode, exp, ...) TEST2(str, mode, exp, sizeof(exp)-1, __VA_ARGS__, 0, 0, 0, 0, 0)
+#define TEST(exp, ...) failed |= TEST1(#__VA_ARGS__, 64, exp, __VA_ARGS__)
+#define TEST32(exp, ...) failed |= enc32 ? TEST1(#__VA_ARGS__, 32, exp, __VA_ARGS__) : 0
+
+static
+int
+cb_grow_chain(FeCodeBuf* cb, size_t size)
+{
+    // Chain into the next 64-byte chunk of the pool.
+    uint8_t* pool_end = cb->user;
+    uint8_t* next = cb->base + 64;
+    if (size > 64 - FE_CB_CHAIN_RESERVE || next + 64 > pool_end)
+        return -1;
+    return fe_cb_chain(cb, next, 64);
+}
+
+static
+int
+cb_grow_realloc(FeCodeBuf* cb, size_t size)
+{
+    size_t used = cb->cur - cb->base;
+    size_t len = 2 * (cb->end - cb->base + FE_CB_CHAIN_RESERVE) + size;
+    uint8_t* buf = realloc(cb->base, len);
+    if (!buf)
+        return -1;
+    cb->base = buf;
+    cb->cur = buf + used;
+    cb->end = buf + len - FE_CB_CHAIN_RESERVE;
+    return 0;
+}
+
+static
+int
+test_codebuf(void)
+{
+    static const uint8_t add_rax_rcx[3] = {0x48, 0x01, 0xc8};
+    int failed = 0;
+    FeCodeBuf cb;
+
+    // Moving growth: all instructions must be contiguous.
+    if (fe_cb_init(&cb, malloc(16), 16, cb_grow_realloc, NULL))
+        failed = 1;
+    for (unsigned i = 0; i < 1000; i += 4) {
+        if (fe_cb_reserve(&cb, 4)) {
+            failed = 1;
+            break;
+        }
+        fe_cb_enc64(&cb, FE_ADD64rr, FE_AX, FE_CX);
+        fe_cb_enc64(&cb, FE_ADD64rr, FE_AX, FE_CX);
+        fe_cb_enc64(&cb, FE_ADD64rr, FE_AX, FE_CX);
+        fe_cb_enc64(&cb, FE_ADD64rr, FE_AX, FE_CX);
+    }
+    if (FE_CB_ERROR(&cb) || cb.cur - cb.base != 3000)
+        failed = 1;
+    for (unsigned i = 0; !failed && i < 1000; i++)
+        if (memcmp(cb.base + 3 * i, add_rax_rcx, 3))
+            failed = 1;
+    free(cb.base);
+    if (failed) {
+        puts("Failed case codebuf realloc");
+        return -1;
+    }
+
+    // Chained growth: follow the jumps between the chunks.
+    static uint8_t pool[64 * 32];
+    memset(pool, 0, sizeof pool);
+    fe_cb_init(&cb, pool, 64, cb_grow_chain, pool + sizeof pool);
+    for (unsigned i = 0; i < 300; i += 2) {
+        if (fe_cb_reserve(&cb, 2)) {
+            failed = 1;
+            break;
+        }
+        fe_cb_enc64(&cb, FE_ADD64rr, FE_AX, FE_CX);
+        fe_cb_enc64(&cb, FE_ADD64rr, FE_AX, FE_CX);
+    }
+    // Errors do not advance the position and are sticky.
+    uint8_t* cur = cb.cur;
+    fe_cb_enc64(&cb, FE_ADD8rr, FE_SI, FE_AH);
+    if (!FE_CB_ERROR(&cb) || cb.cur != cur)
+        failed = 1;
+    fe_cb_enc64(&cb, FE_ADD64rr, FE_AX, FE_CX);
+    if (!FE_CB_ERROR(&cb))
+        failed = 1;
+    fe_cb_clear_error(&cb);
+
+    unsigned count = 0;
+    for (const uint8_t* pc = pool; pc != cb.cur && !failed;) {
+        if (!memcmp(pc, add_rax_rcx, 3)) {
+            count++;
+            pc += 3;
+        } else if (pc[0] == 0xeb) {
+            pc += 2 + (int8_t) pc[1];
+        } else if (pc[0] == 0xe9) {
+            int32_t off;
+            memcpy(&off, pc + 1, 4);
+            pc += 5 + off;
+        } else {
+            failed = 1;
+        }
+        if (pc < pool || pc >= pool + sizeof pool)
+            failed = 1;
+    }
+    if (failed || count != 301) {
+        printf("Failed case codebuf chain: %u instrs\n", count);
+        return -1;
+    }
+
+    // Not enough pool space left: the last chunk has room for 59 bytes, the
+    // 16th instruction cannot be reserved anymore.
+    fe_cb_init(&cb, pool + sizeof pool - 64, 64, cb_grow_chain, pool + sizeof pool);
+    for (unsigned i = 0; i < 16 && !fe_cb_reserve(&cb, 1); i++)
+        fe_cb_enc64(&cb, FE_ADD64rr, FE_AX, FE_CX);
+    if (!FE_CB_ERROR(&cb) || cb.cur - cb.base != 3 * 15) {
+        puts("Failed case codebuf overflow");
+        return -1;
+    }
+
+    return 0;
+}
+
+static
+int
+check_code(const char* name, const FeCodeBuf* cb, const void* exp, size_t exp_len)
+{
+    if ((size_t) (cb->cur - cb->base) == exp_len && !memcmp(cb->base, exp, exp_len))
+        return 0;
+    printf("Failed case %s:\n", name);
+    printf("  Exp (%2zu): ", exp_len);
+    print_hex(exp, exp_len);
+    printf("\n  Got (%2zd): ", cb->cur - cb->base);
+    print_hex(cb->base, cb->cur - cb->base);
+    printf("\n");
+    return -1;
+}
+
+static
+int
+test_asm(void)
+{
+    static uint8_t code[4096];
+    uint64_t labels[8];
+    FeAsmFixup fixups[8];
+    FeCodeBuf cb;
+    FeAsm as;
+    int failed = 0;
+
+    memset(code, 0, sizeof code);
+    fe_cb_init(&cb, code, sizeof code, NULL, NULL);
+    fe_asm_init(&as, &cb, labels, 8, fixups, 8);
+    FeLabel loop = fe_asm_label(&as);
+    FeLabel end = fe_asm_label(&as);
+    FeLabel func = fe_asm_label(&as);
+    FeLabel data = fe_asm_label(&as);
+    FeLabel ext = fe_asm_label_abs(&as, (uintptr_t) code + 0x1000);
+    fe_cb_reserve(&cb, 10);
+    fe_asm_bind(&as, loop);
+    fe_cb_enc64(&cb, FE_ADD64rr, FE_AX, FE_CX);
+    fe_asm_jmp(&as, FE_JNZ, loop);
+    fe_asm_jmp(&as, FE_JMP, end);
+    fe_asm_jmp(&as, FE_CALL, func);
+    fe_asm_enc64_ref(&as, data, FE_LEA64rm, FE_AX, FE_MEM(FE_IP, 0, 0, 8));
+    fe_asm_jmp(&as, FE_JCXZ, loop);
+    fe_asm_jmp(&as, FE_CALL, ext);
+    fe_asm_bind(&as, end);
+    fe_cb_enc64(&cb, FE_RET);
+    fe_asm_bind(&as, func);
+    fe_cb_enc64(&cb, FE_RET);
+    fe_asm_bind(&as, data);
+    fe_cb_enc64(&cb, FE_NOP);
+    failed |= fe_asm_finalize(&as);
+    failed |= check_code("asm labels", &cb, "\x48\x01\xc8\x75\xfb\xeb\x13"
+                         "\xe8\x0f\x00\x00\x00\x48\x8d\x05\x11\x00\x00\x00"
+                         "\xe3\xeb\xe8\xe6\x0f\x00\x00\xc3\xc3\x90", 29);
+    if (FE_ASM_LABEL_OFFSET(&as, loop) != 0 || FE_ASM_LABEL_OFFSET(&as, end) != 26 ||
+        FE_ASM_LABEL_OFFSET(&as, func) != 27 || FE_ASM_LABEL_OFFSET(&as, data) != 28) {
+        puts("Failed case asm label offsets");
+        failed = -1;
+    }
+
+    // The jz only fits into rel8 after shrinking the jmp; the jnz is too far.
+    memset(code, 0, sizeof code);
+    fe_cb_init(&cb, code, sizeof code, NULL, NULL);
+    fe_asm_init(&as, &cb, labels, 8, fixups, 8);
+    FeLabel near = fe_asm_label(&as);
+    FeLabel far = fe_asm_label(&as);
+    FeLabel next = fe_asm_label(&as);
+    fe_cb_reserve(&cb, 260);
+    fe_asm_jmp(&as, FE_JZ, near);
+    for (unsigned i = 0; i < 10; i++)
+        fe_cb_enc64(&cb, FE_NOP);
+    fe_asm_jmp(&as, FE_JMP, next);
+    fe_asm_bind(&as, next);
+    for (unsigned i = 0; i < 109; i++)
+        fe_cb_enc64(&cb, FE_NOP);
+    fe_asm_bind(&as, near);
+    fe_asm_jmp(&as, FE_JNZ, far);
+    for (unsigned i = 0; i < 128; i++)
+        fe_cb_enc64(&cb, FE_NOP);
+    fe_asm_bind(&as, far);
+    failed |= fe_asm_finalize(&as);
+    if (cb.cur - cb.base != 2 + 10 + 2 + 109 + 6 + 128 ||
+        memcmp(code, "\x74\x79", 2) || memcmp(code + 12, "\xeb\x00", 2) ||
+        memcmp(code + 123, "\x0f\x85\x80\x00\x00\x00", 6)) {
+        puts("Failed case asm relaxation");
+        failed = -1;
+    }
+
+    // Chain of jumps where each one only fits into rel8 after the next one
+    // was shrunk, one per pass. Only the last four jumps are shrunk.
+    uint64_t chain_labels[8];
+    FeAsmFixup chain_fixups[8];
+    FeLabel targets[8];
+    memset(code, 0, sizeof code);
+    fe_cb_init(&cb, code, sizeof code, NULL, NULL);
+    fe_asm_init(&as, &cb, chain_labels, 8, chain_fixups, 8);
+    for (unsigned i = 0; i < 8; i++)
+        targets[i] = fe_asm_label(&as);
+    for (unsigned i = 0; i < 8; i++) {
+        fe_cb_reserve(&cb, 63);
+        if (i >= 2)
+            fe_asm_bind(&as, targets[i - 2]);
+        fe_asm_jmp(&as, FE_JMP, targets[i]);
+        for (unsigned j = 0; j < 62; j++)
+            fe_cb_enc64(&cb, FE_NOP);
+    }
+    fe_asm_bind(&as, targets[6]);
+    fe_cb_reserve(&cb, 62);
+    for (unsigned j = 0; j < 62; j++)
+        fe_cb_enc64(&cb, FE_NOP);
+    fe_asm_bind(&as, targets[7]);
+    failed |= fe_asm_finalize(&as);
+    size_t pos = 0;
+    for (unsigned i = 0; i < 8; i++) {
+        int64_t target = FE_ASM_LABEL_OFFSET(&as, targets[i]);
+        int ok;
+        if (i < 4) {
+            int32_t rel;
+            memcpy(&rel, code + pos + 1, 4);
+            ok = code[pos] == 0xe9 && (int64_t) pos + 5 + rel == target;
+            pos += 5;
+        } else {
+            ok = code[pos] == 0xeb && (int64_t) pos + 2 + (int8_t) code[pos + 1] == target;
+            pos += 2;
+        }
+        if (!ok) {
+            printf("Failed case asm relaxation chain: jump %u\n", i);
+            failed = -1;
+        }
+        pos += 62;
+    }
+    if (cb.cur - cb.base != (ptrdiff_t) pos + 62) {
+        puts("Failed case asm relaxation chain size");
+        failed = -1;
+    }
+
+    // Unbound labels, label references without memory operand.
+    fe_cb_init(&cb, code, sizeof code, NULL, NULL);
+    fe_asm_init(&as, &cb, labels, 8, fixups, 8);
+    fe_cb_reserve(&cb, 2);
+    fe_asm_jmp(&as, FE_JMP, fe_asm_label(&as));
+    if (!fe_asm_finalize(&as)) {
+        puts("Failed case asm unbound label");
+        failed = -1;
+    }
+    fe_cb_init(&cb, code, sizeof code, NULL, NULL);
+    fe_asm_init(&as, &cb, labels, 8, fixups, 8);
+    fe_cb_reserve(&cb, 2);
+    FeLabel label = fe_asm_label(&as);
+    fe_asm_bind(&as, label);
+    fe_asm_enc64_ref(&as, label, FE_ADD64rr, FE_AX, FE_CX);
+    if (!FE_CB_ERROR(&cb) || cb.cur != cb.base) {
+        puts("Failed case asm reference without memory operand");
+        failed = -1;
+    }
+
+    return failed;
+}
+
+static
+int
+test_size_block(void)
+{
+    uint8_t buf[64];
+    uint8_t* cur = buf;
+    // The jmp fits into rel8 only at the start of the buffer.
+    FeInstr instrs[] = {
+        { FE_PUSHr, { FE_R12 } },
+        { FE_MOV64rm, { FE_AX, FE_MEM(FE_SP, 0, 0, 0x100) } },
+        { FE_ADD32ri, { FE_AX, 0x80 } },
+        { FE_JMP, { (intptr_t) buf - 0x60 } },
+        { FE_RET, { 0 } },
+    };
+    size_t count = sizeof instrs / sizeof instrs[0];
+    for (size_t i = 0; i < count; i++)
+        if (fe_enc64(&cur, instrs[i].mnem, instrs[i].ops[0], instrs[i].ops[1],
+                     instrs[i].ops[2], instrs[i].ops[3]))
+            return -1;
+    ptrdiff_t size = fe_enc64_size_block(instrs, count, buf);
+    if (size != cur - buf || size != 2 + 8 + 5 + 2 + 1) {
+        printf("Failed case size block: %td, exp %td\n", size, cur - buf);
+        return -1;
+    }
+    // The jump needs rel32 when the code is placed further away.
+    if (fe_enc64_size_block(instrs, count, buf + 0x20) != size + 3) {
+        puts("Failed case size block rel32");
+        return -1;
+    }
+    instrs[2].ops[0] = FE_XMM0;
+    if (fe_enc64_size_block(instrs, count, buf) >= 0) {
+        puts("Failed case size block invalid");
+        return -1;
+    }
+    return 0;
+}
+
+static
+int
+check_bytes(const char* name, const uint8_t* got, size_t got_len, const void* exp, size_t exp_len)
+{
+    if (got_len == exp_len && !memcmp(got, exp, exp_len))
+        return 0;
+    printf("Failed case %s:\n", name);
+    printf("  Exp (%2zu): ", exp_len);
+    print_hex(exp, exp_len);
+    printf("\n  Got (%2zu): ", got_len);
+    print_hex(got, got_len);
+    printf("\n");
+    return -1;
+}
+
+static
+int
+test_patch(void)
+{
+    int failed = 0;
+    uint8_t buf[64];
+    uint8_t* cur = buf;
+
+    failed |= fe_enc64_at(&cur, 0x1000, FE_JMP, 0x1010);
+    failed |= fe_enc64_at(&cur, 0x1002, FE_JMP, 0x2000);
+    failed |= fe_enc64_at(&cur, 0x1007, FE_LEA64rm, FE_AX, FE_MEM(FE_IP, 0, 0, 0x1000));
+    failed |= check_bytes("enc at", buf, cur - buf, "\xeb\x0e\xe9\xf9\x0f\x00\x00"
+                          "\x48\x8d\x05\xf9\x0f\x00\x00", 14);
+
+    fe_patch_nops(buf, 13);
+    failed |= check_bytes("nops", buf, 13, "\x66\x66\x2e\x0f\x1f\x84\x00\x00"
+                          "\x00\x00\x00\x66\x90", 13);
+
+    // The remaining functions decode 64-bit code.
+    if (fd_insn_length((const uint8_t*) "\x90", 1, 64) == FD_ERR_INTERNAL)
+        return failed; // not compiled with 64-bit decoding
+
+    // jmp 0x1012; lea rax, [rip+0x100]; jz 0x100d; moved to 0x2000.
+    static const uint8_t reloc[] = "\xeb\x10\x48\x8d\x05\x00\x01\x00\x00\x74\x02";
+    cur = buf;
+    failed |= fe_patch_relocate(&cur, 0x2000, reloc, sizeof reloc - 1, 0x1000);
+    failed |= check_bytes("relocate", buf, cur - buf, "\xe9\x0d\xf0\xff\xff"
+                          "\x48\x8d\x05\xfd\xf0\xff\xff\x0f\x84\xfb\xef\xff\xff", 18);
+    // jrcxz is emitted as jrcxz to a near jump.
+    cur = buf;
+    failed |= fe_patch_relocate(&cur, 0x2000, (const uint8_t*) "\x90\xe3\x00", 3, 0x1000);
+    failed |= check_bytes("relocate jrcxz", buf, cur - buf, "\x90\xe3\x02\xeb\x05"
+                          "\xe9\xf9\xef\xff\xff", 10);
+    // Prefixes make the first branch longer: fs jrcxz and jecxz.
+    cur = buf;
+    failed |= fe_patch_relocate(&cur, 0x2000, (const uint8_t*) "\x64\xe3\x00", 3, 0x1000);
+    failed |= check_bytes("relocate fs jrcxz", buf, cur - buf, "\x64\xe3\x02"
+                          "\xeb\x05\xe9\xf9\xef\xff\xff", 10);
+    cur = buf;
+    failed |= fe_patch_relocate(&cur, 0x2000, (const uint8_t*) "\x67\xe3\x00", 3, 0x1000);
+    failed |= check_bytes("relocate jecxz", buf, cur - buf, "\x67\xe3\x02"
+                          "\xeb\x05\xe9\xf9\xef\xff\xff", 10);
+    // The RIP-relative target is out of range.
+    cur = buf;
+    if (!fe_patch_relocate(&cur, 0x100002000, reloc + 2, 7, 0x1000) || cur != buf) {
+        puts("Failed case relocate out of range");
+        failed = -1;
+    }
+
+    // Code at 0x1000: mov rax, rcx; nop; ret; and the same again at 0x100e.
+    uint8_t mem[64];
+    memset(mem, 0xcc, sizeof mem);
+    memcpy(mem, "\x48\x89\xc8\x90\xc3", 5);
+    memcpy(mem + 0xe, "\x48\x89\xc8\x90\xc3", 5);
+    if (fe_patch_window(mem, 5, 4) != 4 || fe_patch_window(mem, 4, 5) >= 0) {
+        puts("Failed case patch window");
+        failed = -1;
+    }
+
+    // The window is inside an 8-byte block: single store.
+    FePatch patch;
+    FeInstr jmp = { FE_JMP, { 0x2000 } };
+    if (fe_patch_plan(&patch, mem, 16, 0x1000, &jmp, 1) || patch.size != 5 ||
+        patch.write_count != 1 || patch.writes[0].addr != 0x1000 ||
+        patch.writes[0].size != 8 || !patch.writes[0].sync) {
+        puts("Failed case patch single store");
+        failed = -1;
+    }
+    failed |= check_bytes("patch single store", patch.writes[0].bytes, 8,
+                          "\xe9\xfb\x0f\x00\x00\xcc\xcc\xcc", 8);
+
+    // The new code is shorter than the first instruction: pad with NOPs.
+    FeInstr nop = { FE_NOP, { 0 } };
+    if (fe_patch_plan(&patch, mem, 16, 0x1000, &nop, 1) || patch.size != 3) {
+        puts("Failed case patch padding");
+        failed = -1;
+    }
+    failed |= check_bytes("patch padding", patch.writes[0].bytes, 8,
+                          "\x90\x66\x90\x90\xc3\xcc\xcc\xcc", 8);
+
+    // The window crosses a 16-byte boundary: INT3 protocol.
+    static const uint64_t exp_addrs[] = { 0x100e, 0x1008, 0x1010, 0x100e };
+    static const uint8_t exp_sizes[] = { 1, 8, 8, 1 };
+    static const uint8_t exp_syncs[] = { 1, 0, 1, 1 };
+    if (fe_patch_plan(&patch, mem + 0xe, 16, 0x100e, &jmp, 1) ||
+        patch.size != 5 || patch.write_count != 4) {
+        puts("Failed case patch int3");
+        return -1;
+    }
+    for (unsigned i = 0; i < 4; i++) {
+        if (patch.writes[i].addr != exp_addrs[i] ||
+            patch.writes[i].size != exp_sizes[i] ||
+            patch.writes[i].sync != exp_syncs[i]) {
+            printf("Failed case patch int3 write %u\n", i);
+            failed = -1;
+        }
+    }
+    failed |= check_bytes("patch int3 0", patch.writes[0].bytes, 1, "\xcc", 1);
+    failed |= check_bytes("patch int3 1", patch.writes[1].bytes, 8,
+                          "\xcc\xcc\xcc\xcc\xcc\xcc\xcc\xed", 8);
+    failed |= check_bytes("patch int3 2", patch.writes[2].bytes, 8,
+                          "\x0f\x00\x00\xcc\xcc\xcc\xcc\xcc", 8);
+    failed |= check_bytes("patch int3 3", patch.writes[3].bytes, 1, "\xe9", 1);
+    return failed;
+}
+
+// Decoding an encoded instruction and converting it back with fe_from_fd must
+// give an equivalent instruction.
+static
+int
+test_from_fd(void)
+{
+    static const FeOp ops[] = {
+        FE_AX, FE_R9, FE_SP, FE_AH, FE_FS, FE_ST1, FE_MM3, FE_XMM9,
+        FE_MEM(FE_R12, 4, FE_R9, 0x1234), FE_MEM(FE_IP, 0, 0, 0x100),
+        FE_MEM(0, 2, FE_XMM3, 8), 1, -1, 0x80, 0x12345678,
+    };
+    static const FeOp ops3[] = { 0, FE_XMM2, 3 };
+    const uint64_t addr = 0x400000;
+    int failed = 0;
+    if (fd_insn_length((const uint8_t*) "\x90", 1, 64) == FD_ERR_INTERNAL)
+        return 0; // not compiled with 64-bit decoding
+    for (unsigned mnem = 0; mnem < FE_MNEM_MAX; mnem++) {
+        for (size_t i = 0; i < sizeof ops / sizeof ops[0]; i++) {
+            for (size_t j = 0; j < sizeof ops / sizeof ops[0]; j++) {
+                for (size_t k = 0; k < sizeof ops3 / sizeof ops3[0]; k++) {
+                    uint8_t buf[16], out[16];
+                    uint8_t* cur = buf;
+                    if (fe_enc64_at(&cur, addr, mnem, ops[i], ops[j], ops3[k]))
+                        continue;
+                    FdInstr instr;
+                    if (fd_decode(buf, cur - buf, 64, 0, &instr) != cur - buf)
+                        continue;
+                    char exp[128], got[128] = "(none)";
+                    fd_format_ex(&instr, addr, exp, sizeof exp);
+                    FeInstr fe;
+                    if (fe_from_fd(&fe, &instr, addr)) {
+                        // Memory offsets with a 64-bit address are unsupported.
+                        if (FD_OP_TYPE(&instr, 0) == FD_OT_MEM || FD_OP_TYPE(&instr, 1) == FD_OT_MEM)
+                            continue;
+                        goto fail;
+                    }
+                    uint8_t* out_cur = out;
+                    if (fe_enc64_at(&out_cur, addr, fe.mnem, fe.ops[0], fe.ops[1],
+                                    fe.ops[2], fe.ops[3]))
+                        goto fail;
+                    if (fd_decode(out, out_cur - out, 64, 0, &instr) != out_cur - out)
+                        goto fail;
+                    fd_format_ex(&instr, addr, got, sizeof got);
+                    if (!strcmp(exp, got))
+                        continue;
+                    // Dropping redundant prefixes changes RIP-relative offsets.
+                    if (out_cur - out != cur - buf && strstr(exp, "[rip"))
+                        continue;
+                fail:
+                    printf("Failed case from_fd %u: %s -> %s\n", mnem, exp, got);
+                    failed = -1;
+                }
+            }
+        }
+    }
+
+    // Relocation of a short jump, a RIP-relative operand, and loop.
+    static const uint8_t code[] = "\xeb\x10\x48\x8b\x05\x00\x01\x00\x00\xe2\xfe";
+    uint8_t buf[64];
+    uint8_t* cur = buf;
+    for (unsigned off = 0; off < sizeof code - 1;) {
+        FdInstr instr;
+        int res = fd_decode(code + off, sizeof code - 1 - off, 64, 0, &instr);
+        if (res < 0 || fe_relocate64(&cur, 0x2000 + (cur - buf), &instr, 0x1000 + off))
+            return -1;
+        off += res;
+    }
+    failed |= check_bytes("relocate64", buf, cur - buf, "\xe9\x0d\xf0\xff\xff"
+                          "\x48\x8b\x05\xfd\xf0\xff\xff\xe2\x02\xeb\x05"
+                          "\xe9\xf4\xef\xff\xff", 21);
+
+    // Instructions the encoder cannot reproduce must be rejected instead of
+    // dropping EVEX registers, meaningful prefixes, or operand sizes.
+    static const struct {
+        const char* code;
+        unsigned len;
+        int supported;
+    } cases[] = {
+        { "\x62\xe1\x7c\x08\x58\xc0", 6, 0 }, // vaddps xmm16, xmm0, xmm0
+        { "\x62\xf1\x7c\x48\x58\xc0", 6, 0 }, // vaddps zmm0, zmm0, zmm0
+        { "\xf3\xab", 2, 1 }, // rep stosd
+        { "\xf2\xab", 2, 0 }, // repnz stosd
+        { "\xf2\xf0\x01\x08", 4, 0 }, // xacquire lock add [rax], ecx
+        { "\xf3\xc7\x00\x01\x00\x00\x00", 7, 0 }, // xrelease mov [rax], 1
+        { "\xf3\x48\x89\xc8", 4, 1 }, // mov rax, rcx with ignored rep
+        { "\x66\x0f\xc4\xc1\x01", 5, 1 }, // pinsrw xmm0, ecx, 1
+        { "\x49\x0f\xc4\xcc\x01", 5, 0 }, // pinsrw mm1, r12, 1
+        { "\xc5\xf2\xc2\xc2\x00", 5, 1 }, // vcmpss xmm0, xmm1, xmm2, 0
+        { "\xc5\xf6\xc2\xc2\x00", 5, 0 }, // vcmpss with VEX.L=1
+    };
+    for (size_t i = 0; i < sizeof cases / sizeof cases[0]; i++) {
+        FdInstr instr;
+        FeInstr fe;
+        const uint8_t* bytes = (const uint8_t*) cases[i].code;
+        int res = fd_decode(bytes, cases[i].len, 64, 0, &instr);
+        if (res == FD_ERR_UD)
+            continue; // excluded ISA extension
+        if (res != (int) cases[i].len ||
+            (fe_from_fd(&fe, &instr, 0) == 0) != cases[i].supported) {
+            printf("Failed case from_fd support: ");
+            print_hex(bytes, cases[i].len);
+            printf("\n");
+            failed = -1;
+        }
+    }
+    return failed;
+}
+
+// The inline encoder must produce the same result as the table-based encoder
+// for all mnemonics and operands.
+static
+int
+test_inline(void)
+{
+    static const FeOp ops[] = {
+        FE_AX, FE_CX, FE_SP, FE_DI, FE_R8, FE_R15, FE_AH, FE_ES, FE_FS,
+        FE_ST1, FE_MM3, FE_XMM0, FE_XMM9, FE_XMM15, FE_MEM(FE_AX, 0, 0, 0),
+        0, 1, -1, 0x7f, 0x80, -0x81, 0x8000, 0x12345678, 0x80000000,
+        0x123456789,
+    };
+    int failed = 0;
+    for (unsigned mnem = 0; mnem < FE_MNEM_MAX; mnem++) {
+        for (size_t i = 0; i < sizeof ops / sizeof ops[0]; i++) {
+            for (size_t j = 0; j < sizeof ops / sizeof ops[0]; j++) {
+                for (int k = 0; k < 2; k++) {
+                    uint8_t exp[16] = {0}, got[16] = {0};
+                    uint8_t* exp_cur = exp;
+                    uint8_t* got_cur = got;
+                    int exp_res = fe_enc64_impl(&exp_cur, mnem, ops[i], ops[j], k, 0);
+                    int got_res = fe_enc64_inl_impl(&got_cur, mnem, ops[i], ops[j], k, 0);
+                    if (exp_res != got_res || exp_cur - exp != got_cur - got ||
+                        memcmp(exp, got, sizeof exp)) {
+                        printf("Failed case inline %u (%zu, %zu, %d)\n", mnem, i, j, k);
+                        printf("  Exp (%2zd): ", exp_cur - exp);
+                        print_hex(exp, exp_cur - exp);
+                        printf("\n  Got (%2zd): ", got_cur - got);
+                        print_hex(got, got_cur - got);
+                        printf("\n");
+                        failed = -1;
+                    }
+                }
+            }
+        }
+    }
+
+    uint8_t buf[16];
+    uint8_t* cur = buf;
+    failed |= fe_enc64_inl(&cur, FE_ADD64rr, FE_R9, FE_CX);
+    failed |= fe_enc64_inl(&cur, FE_SUB64ri, FE_SP, 0x20);
+    failed |= fe_enc64_inl(&cur, FE_RET);
+    if (failed || cur - buf != 8 || memcmp(buf, "\x49\x01\xc9\x48\x83\xec\x20\xc3", 8)) {
+        puts("Failed case inline constant");
+        failed = -1;
+    }
+    return failed;
+}
 
 int
 main(int argc, char** argv)
@@ -114,6 +715,25 @@ main(int argc, char** argv)
     TEST("\x48\xc7\xc0\x00\x00\x00\x80", FE_MOV64ri, FE_AX, (int32_t) 0x80000000);
     TEST("\x48\xb8\x00\x00\x00\x00\x00\x00\x00\x80", FE_MOV64ri, FE_AX, INT64_MIN);
     TEST("\x48\xb8\x00\x00\x00\x80\x00\x00\x00\x00", FE_MOV64ri, FE_AX, 0x80000000);
+    TEST("\xb8\x00\x00\x00\x80", FE_MOV64ri|FE_OPTSIZE, FE_AX, 0x80000000);
+    TEST("\x41\xb8\x01\x00\x00\x00", FE_MOV64ri|FE_OPTSIZE, FE_R8, 1);
+    TEST("\x48\xc7\xc0\xff\xff\xff\xff", FE_MOV64ri|FE_OPTSIZE, FE_AX, -1);
+    TEST("\x48\xb8\x05\x00\x01\x00\xff\x00\x00\x00", FE_MOV64ri|FE_OPTSIZE, FE_AX, 0xff00010005);
+    TEST("\x81\xe1\xff\x00\x00\x00", FE_AND64ri|FE_OPTSIZE, FE_CX, 0xff);
+    TEST("\x48\x83\xe1\xf0", FE_AND64ri|FE_OPTSIZE, FE_CX, -0x10);
+    TEST("\xa8\x10", FE_TEST64ri|FE_OPTSIZE, FE_AX, 0x10);
+    TEST("\x40\xf6\xc6\x10", FE_TEST64ri|FE_OPTSIZE, FE_SI, 0x10);
+    TEST("\x41\xf6\xc4\x10", FE_TEST64ri|FE_OPTSIZE, FE_R12, 0x10);
+    TEST("\xa9\x00\x10\x00\x00", FE_TEST64ri|FE_OPTSIZE, FE_AX, 0x1000);
+    TEST("\x48\xf7\xc1\x00\x00\x00\x80", FE_TEST64ri|FE_OPTSIZE, FE_CX, (int32_t) 0x80000000);
+    TEST("\xf6\x47\x08\x01", FE_TEST64mi|FE_OPTSIZE, FE_MEM(FE_DI, 0, 0, 8), 1);
+    TEST("\x31\xc0", FE_XOR64rr|FE_OPTSIZE, FE_AX, FE_AX);
+    TEST("\x48\x31\xc8", FE_XOR64rr|FE_OPTSIZE, FE_AX, FE_CX);
+    TEST("\x29\xd2", FE_SUB64rr|FE_OPTSIZE, FE_DX, FE_DX);
+    TEST("\xc4\xc1\x78\x29\xc8", FE_VMOVAPS128rr, FE_XMM8, FE_XMM1);
+    TEST("\xc5\x78\x28\xc1", FE_VMOVAPS128rr|FE_OPTSIZE, FE_XMM8, FE_XMM1);
+    TEST("\xeb\x7f", FE_JMP|FE_OPTSIZE, (intptr_t) buf + 129);
+    TEST("\x48\x03\x05\xf9\x00\x00\x00", FE_ADD64rm|FE_OPTSIZE, FE_AX, FE_MEM(FE_IP, 0, 0, 0x100));
     TEST("\xb0\xff", FE_MOV8ri, FE_AX, (int8_t) 0xff);
     TEST("\xb4\xff", FE_MOV8ri, FE_AH, -1);
     TEST("\xb7\x64", FE_MOV8ri, FE_BH, 0x64);
@@ -142,6 +762,8 @@ main(int argc, char** argv)
     TEST("\xf3\x0f\xbc\xc2", FE_TZCNT32rr, FE_AX, FE_DX);
     TEST("\x66\xf3\x0f\xbc\xc2", FE_TZCNT16rr, FE_AX, FE_DX);
     TEST("\x0f\x01\xd0", FE_XGETBV);
+    TEST("\x0f\xae\xe8", FE_LFENCE);
+    TEST("\x0f\xae\xf8", FE_SFENCE);
     TEST("\x41\x90", FE_XCHG32rr, FE_R8, FE_AX);
     TEST("\x91", FE_XCHG32rr, FE_CX, FE_AX);
     TEST("\x66\x90", FE_XCHG16rr, FE_AX, FE_AX);
@@ -242,13 +864,19 @@ main(int argc, char** argv)
     TEST("\xc5\xf4\x58\xc2", FE_VADDPS256rrr, FE_XMM0, FE_XMM1, FE_XMM2);
     TEST("\xc4\xc1\x74\x58\xc0", FE_VADDPS256rrr, FE_XMM0, FE_XMM1, FE_XMM8);
     TEST("\xc4\x62\x7d\x19\xc2", FE_VBROADCASTSD256rr, FE_XMM8, FE_XMM2);
-    TEST("\xc4\x62\x7d\x1a\xc2", FE_VBROADCASTF128_256rr, FE_XMM8, FE_XMM2);
+    TEST("\xc4\x62\x7d\x1a\x02", FE_VBROADCASTF128_256rm, FE_XMM8, FE_MEM(FE_DX, 0, 0, 0));
+    TEST("\xc4\xe3\xfd\x00\xd1\x01", FE_VPERMQ256rri, FE_XMM2, FE_XMM1, 1);
+    TEST("\xc4\xe3\x79\x08\xc1\x01", FE_VROUNDPS128rri, FE_XMM0, FE_XMM1, 1);
+    TEST("\xc5\xf3\xd0\xc2", FE_VADDSUBPS128rrr, FE_XMM0, FE_XMM1, FE_XMM2);
+    TEST("\xc5\xf9\xf7\xc1", FE_VMASKMOVDQU128rr, FE_XMM0, FE_XMM1);
     TEST("\xc4\xe2\x71\x9d\xc2", FE_VFNMADD132SSrrr, FE_XMM0, FE_XMM1, FE_XMM2);
     TEST("\xc4\xe2\xf1\x9d\xc2", FE_VFNMADD132SDrrr, FE_XMM0, FE_XMM1, FE_XMM2);
+    TEST("\xc4\xe2\x71\x2e\x10", FE_VMASKMOVPS128mrr, FE_MEM(FE_AX, 0, 0, 0), FE_XMM1, FE_XMM2);
 
     // Test RVMR encoding
     TEST("\xc4\xe3\x71\x4a\xc2\x30", FE_VBLENDVPS128rrrr, FE_XMM0, FE_XMM1, FE_XMM2, FE_XMM3);
     TEST("\xc4\xe3\x75\x4a\xc2\x30", FE_VBLENDVPS256rrrr, FE_XMM0, FE_XMM1, FE_XMM2, FE_XMM3);
+    TEST("\xc4\xe3\x71\x4a\xc2\x80", FE_VBLENDVPS128rrrr, FE_XMM0, FE_XMM1, FE_XMM2, FE_XMM8);
     TEST("\xc4\xe3\x71\x4a\x05\x00\x00\x00\x00\x20", FE_VBLENDVPS128rrmr, FE_XMM0, FE_XMM1, FE_MEM(FE_IP, 0, 0, 10), FE_XMM2);
     TEST("\xc4\xe3\x75\x4a\x05\x00\x00\x00\x00\x20", FE_VBLENDVPS256rrmr, FE_XMM0, FE_XMM1, FE_MEM(FE_IP, 0, 0, 10), FE_XMM2);
 
@@ -319,6 +947,47 @@ main(int argc, char** argv)
     TEST("\xf0\x0f\xc1\x01", FE_LOCK_XADD32mr, FE_MEM(FE_CX, 0, 0, 0), FE_AX);
     TEST("\x64\x67\xf0\x41\x81\x84\x00\x00\xff\xff\xff\x78\x56\x34\x12", FE_LOCK_ADD32mi|FE_ADDR32|FE_SEG(FE_FS), FE_MEM(FE_R8, 1, FE_AX, -0x100), 0x12345678);
 
+    // 32-bit mode, skipped if not compiled with 32-bit support.
+    uint8_t* nop = buf;
+    int enc32 = !fe_enc32(&nop, FE_NOP);
+    TEST32("\x40", FE_INC32r, FE_AX);
+    TEST32("\x66\x40", FE_INC16r, FE_AX);
+    TEST32("", FE_INC32r, FE_R8);
+    TEST32("", FE_ADD64rr, FE_AX, FE_CX);
+    TEST32("", FE_ADD8rr, FE_SI, FE_AX);
+    TEST32("\x00\xe0", FE_ADD8rr, FE_AX, FE_AH);
+    TEST32("\x50", FE_PUSHr, FE_AX);
+    TEST32("\x66\x50", FE_PUSH16r, FE_AX);
+    TEST32("\x06", FE_PUSHr, FE_ES);
+    TEST32("\x0e", FE_PUSHr, FE_CS);
+    TEST32("\x0f\xa0", FE_PUSHr, FE_FS);
+    TEST32("\x0f\xa8", FE_PUSHr, FE_GS);
+    TEST32("\x1f", FE_POPr, FE_DS);
+    TEST32("", FE_POPr, FE_CS);
+    TEST32("\xff\xd0", FE_CALLr, FE_AX);
+    TEST32("\xe8\xfb\xff\xff\xff", FE_CALL, (intptr_t) buf);
+    TEST32("\xeb\xfe", FE_JMP, (intptr_t) buf);
+    TEST32("\xe3\xfe", FE_JCXZ|FE_ADDR32, (intptr_t) buf);
+    TEST32("\x01\x05\x78\x56\x34\x12", FE_ADD32mr, FE_MEM(0, 0, 0, 0x12345678), FE_AX);
+    TEST32("\x01\x04\x85\x00\x00\x00\x00", FE_ADD32mr, FE_MEM(0, 4, FE_AX, 0), FE_AX);
+    TEST32("\x01\x44\x24\x08", FE_ADD32mr, FE_MEM(FE_SP, 0, 0, 8), FE_AX);
+    TEST32("", FE_ADD32mr, FE_MEM(FE_IP, 0, 0, 0), FE_AX);
+    TEST32("", FE_ADD32mr, FE_MEM(FE_R8, 0, 0, 0), FE_AX);
+    TEST32("\x01\x00", FE_ADD32mr|FE_ADDR32, FE_MEM(FE_AX, 0, 0, 0), FE_AX);
+    TEST32("\xa1\x00\x00\x00\x80", FE_MOV32ra, FE_AX, 0x80000000);
+    TEST32("\xc5\xf0\x58\xc2", FE_VADDPS128rrr, FE_XMM0, FE_XMM1, FE_XMM2);
+    TEST32("", FE_VADDPS128rrr, FE_XMM0, FE_XMM9, FE_XMM2);
+    TEST32("", FE_VADDPS128rrr, FE_XMM8, FE_XMM1, FE_XMM2);
+    TEST32("\xf6\xc1\x01", FE_TEST32ri|FE_OPTSIZE, FE_CX, 1);
+    TEST32("\xf7\xc6\x01\x00\x00\x00", FE_TEST32ri|FE_OPTSIZE, FE_SI, 1); // no SIL
+
+    failed |= test_codebuf();
+    failed |= test_asm();
+    failed |= test_inline();
+    failed |= test_size_block();
+    failed |= test_patch();
+    failed |= test_from_fd();
+
     puts(failed ? "Some tests FAILED" : "All tests PASSED");
     return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,80 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fadec.h>
+
+
+// Decoding with a subset of ISA extensions: opcodes of excluded extensions
+// must decode as UD, all others must still decode. The first argument is the
+// list of extensions the library was built with, as in the meson option.
+
+static const struct {
+    const char* ext;
+    const char* code;
+    unsigned len;
+    const char* fmt;
+} cases[] = {
+    { "base", "\x01\xc8", 2, "add eax, ecx" },
+    { "base", "\x0f\xaf\xc1", 3, "imul eax, ecx" },
+    { "system", "\x0f\x01\xd0", 3, "xgetbv" },
+    { "x87", "\xd9\xc1", 2, "fld st(1)" },
+    { "mmx", "\x0f\xfc\xc1", 3, "paddb mm0, mm1" },
+    { "3dnow", "\x0f\x0f\xc1\x9e", 4, "3dnow mm0, mm1, 0x9e" },
+    { "sse", "\x0f\x58\xc1", 3, "addps xmm0, xmm1" },
+    { "sse", "\x66\x0f\xfc\xc1", 4, "paddb xmm0, xmm1" },
+    { "avx", "\xc5\xf0\x58\xc2", 4, "vaddps xmm0, xmm1, xmm2" },
+    { "avx512", "\x62\xf1\x74\x08\x58\xc2", 6, "vaddps xmm0, xmm1, xmm2" },
+    { "bmi", "\xc4\xe2\x70\xf2\xc2", 5, "andn eax, ecx, edx" },
+};
+
+static
+bool
+has_extension(const char* list, const char* ext)
+{
+    if (!strcmp(ext, "base") || !strcmp(list, "all"))
+        return true;
+    size_t len = strlen(ext);
+    for (const char* cur = list; cur; cur = strchr(cur, ',')) {
+        cur += *cur == ',';
+        if (!strncmp(cur, ext, len) && (cur[len] == ',' || !cur[len]))
+            return true;
+    }
+    return false;
+}
+
+int
+main(int argc, char** argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s extensions\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int failed = 0;
+    for (unsigned mode = 32; mode <= 64; mode += 32) {
+        for (size_t i = 0; i < sizeof cases / sizeof cases[0]; i++) {
+            const uint8_t* code = (const uint8_t*) cases[i].code;
+            FdInstr instr;
+            int retval = fd_decode(code, cases[i].len, mode, 0, &instr);
+            if (retval == FD_ERR_INTERNAL)
+                break; // not compiled with this arch-mode (32/64 bit)
+
+            char fmt[128] = "UD";
+            if (retval > 0)
+                fd_format(&instr, fmt, sizeof fmt);
+            bool included = has_extension(argv[1], cases[i].ext);
+            if (included ? retval != (int) cases[i].len || strcmp(fmt, cases[i].fmt)
+                         : retval != FD_ERR_UD) {
+                printf("Failed case %s (%u-bit): exp %s, got %s (%d)\n",
+                       cases[i].ext, mode, included ? cases[i].fmt : "UD",
+                       fmt, retval);
+                failed = 1;
+            }
+        }
+    }
+
+    puts(failed ? "Some tests FAILED" : "All tests PASSED");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fadec.h>
+#include <fadec-enc.h>
+#include <fadec-sweep.h>
+
+
+static
+int
+test(const uint8_t* buf, size_t len, int mode, unsigned threads)
+{
+    size_t bitmap_size = (len + 7) / 8;
+    uint8_t* exp = malloc(bitmap_size + 1);
+    uint8_t* got = malloc(bitmap_size + 1);
+    if (!exp || !got) {
+        perror("malloc");
+        exit(1);
+    }
+    // Poison the bitmap, all bits must be written.
+    memset(got, 0xa5, bitmap_size + 1);
+
+    size_t exp_count = fd_sweep(buf, len, mode, exp);
+    size_t got_count = fd_sweep_parallel(buf, len, mode, got, threads);
+
+    int res = 0;
+    if (exp_count != got_count || memcmp(exp, got, bitmap_size) ||
+        got[bitmap_size] != 0xa5) {
+        printf("Failed case (%d-bit, %zu bytes, %u threads)\n", mode, len, threads);
+        printf("  Exp: %zu instrs\n  Got: %zu instrs\n", exp_count, got_count);
+        res = -1;
+    }
+    free(exp);
+    free(got);
+    return res;
+}
+
+// Generate a mix of valid code and random garbage, so that speculative sweeps
+// start in the middle of instructions and have to resynchronize.
+static
+void
+generate(uint8_t* buf, size_t len)
+{
+    uint8_t* cur = buf;
+    uint8_t* end = buf + len - 16;
+    while (cur < end) {
+        int kind = rand() % 8;
+        int reg = rand() % 16;
+        int64_t imm = rand() - RAND_MAX / 2;
+        switch (kind) {
+        default: // random byte
+            *cur++ = rand();
+            break;
+        case 0: fe_enc64(&cur, FE_MOV64ri, reg, imm * imm); break;
+        case 1: fe_enc64(&cur, FE_ADD32mi, FE_MEM(reg, 4, FE_CX, imm), 0x1234); break;
+        case 2: fe_enc64(&cur, FE_SSE_MOVAPSrm, reg, FE_MEM(FE_SP, 0, 0, imm)); break;
+        case 3: fe_enc64(&cur, FE_LEA64rm, reg, FE_MEM(FE_IP, 0, 0, (intptr_t) cur)); break;
+        case 4: fe_enc64(&cur, FE_NOP); break;
+        case 5: fe_enc64(&cur, FE_PUSHr, reg); break;
+        }
+    }
+    while (cur < buf + len)
+        *cur++ = rand();
+}
+
+int
+main(int argc, char** argv)
+{
+    (void) argc; (void) argv;
+
+    int failed = 0;
+    size_t len = 8 << 20;
+    uint8_t* buf = malloc(len);
+    if (!buf) {
+        perror("malloc");
+        return 1;
+    }
+
+    srand(1);
+    generate(buf, len);
+    for (unsigned threads = 1; threads <= 8; threads++) {
+        failed |= test(buf, len, 64, threads);
+        failed |= test(buf, len, 32, threads);
+    }
+    failed |= test(buf, len, 64, 64);
+    failed |= test(buf, 300000, 64, 4);
+    failed |= test(buf, 262145, 64, 4);
+    failed |= test(buf + 1, 200003, 64, 3);
+    failed |= test(buf, 100, 64, 4);
+    failed |= test(buf, 0, 64, 4);
+
+    // Sweeps over "mov eax, imm32" with different offsets never synchronize.
+    memset(buf, 0xb8, len);
+    failed |= test(buf, len, 64, 5);
+    failed |= test(buf, len, 32, 3);
+    // Sequences of prefixes which are too long are skipped byte by byte.
+    memset(buf, 0x66, len);
+    failed |= test(buf, len, 64, 5);
+
+    free(buf);
+
+    puts(failed ? "Some tests FAILED" : "All tests PASSED");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
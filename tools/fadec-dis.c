@@ -0,0 +1,428 @@
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fadec.h>
+#include <fadec-sweep.h>
+
+
+// Output is collected in a large buffer and written once per megabyte.
+#define OUT_FLUSH (1 << 20)
+// Space for one line: address, formatted instruction, newline.
+#define OUT_LINE 160
+// Code bytes per chunk when formatting with multiple threads.
+#define CHUNK_SIZE (256 << 10)
+
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+    // File descriptor to flush to, or -1 to grow the buffer instead.
+    int fd;
+} OutBuf;
+
+typedef struct {
+    const char* name;
+    const uint8_t* code;
+    size_t len;
+    uint64_t addr;
+    int mode;
+} Region;
+
+static
+int
+out_write(int fd, const char* buf, size_t len)
+{
+    while (len) {
+        ssize_t res = write(fd, buf, len);
+        if (res < 0) {
+            perror("write");
+            return -1;
+        }
+        buf += res;
+        len -= res;
+    }
+    return 0;
+}
+
+static
+int
+out_reserve(OutBuf* out, size_t size)
+{
+    if (out->len + size <= out->cap)
+        return 0;
+    if (out->fd >= 0 && out->len >= OUT_FLUSH) {
+        if (out_write(out->fd, out->data, out->len))
+            return -1;
+        out->len = 0;
+        if (size <= out->cap)
+            return 0;
+    }
+    size_t cap = out->cap ? out->cap : OUT_FLUSH + OUT_LINE;
+    while (cap < out->len + size)
+        cap *= 2;
+    char* data = realloc(out->data, cap);
+    if (!data) {
+        perror("realloc");
+        return -1;
+    }
+    out->data = data;
+    out->cap = cap;
+    return 0;
+}
+
+static
+void
+out_hex(OutBuf* out, uint64_t value, unsigned digits)
+{
+    static const char hex[] = "0123456789abcdef";
+    char* p = out->data + out->len;
+    for (unsigned i = 0; i < digits; i++)
+        p[i] = hex[(value >> 4 * (digits - 1 - i)) & 0xf];
+    out->len += digits;
+}
+
+// Disassemble the instructions starting in [start, end) of a region. If the
+// instruction boundaries are known, an instruction from before start which
+// extends into the range is skipped; it is part of the previous range.
+static
+int
+dis_range(const Region* region, const uint8_t* starts, size_t start,
+          size_t end, OutBuf* out)
+{
+    unsigned digits = region->mode == 64 ? 16 : 8;
+    size_t off = start;
+    for (size_t i = start > 14 ? start - 14 : 0; starts && i < start; i++) {
+        if (!(starts[i / 8] >> (i % 8) & 1))
+            continue;
+        int res = fd_insn_length(region->code + i, region->len - i, region->mode);
+        if (res > 0 && i + res > off)
+            off = i + res;
+    }
+
+    while (off < end) {
+        if (out_reserve(out, OUT_LINE))
+            return -1;
+        uint64_t addr = region->addr + off;
+        out_hex(out, addr, digits);
+        out->data[out->len++] = ' ';
+        out->data[out->len++] = ' ';
+
+        FdInstr instr;
+        int res = fd_decode(region->code + off, region->len - off, region->mode,
+                            0, &instr);
+        if (res > 0) {
+            out->len += fd_format_ex(&instr, addr, out->data + out->len,
+                                     OUT_LINE - digits - 3);
+            off += res;
+        } else {
+            memcpy(out->data + out->len, "(bad)", 5);
+            out->len += 5;
+            off++;
+        }
+        out->data[out->len++] = '\n';
+    }
+    return 0;
+}
+
+typedef struct {
+    const Region* region;
+    const uint8_t* starts;
+    size_t start;
+    size_t end;
+    OutBuf out;
+    int res;
+} DisChunk;
+
+static
+void*
+dis_chunk(void* arg)
+{
+    DisChunk* chunk = arg;
+    chunk->res = dis_range(chunk->region, chunk->starts, chunk->start,
+                           chunk->end, &chunk->out);
+    return NULL;
+}
+
+// With multiple threads, the parallel sweep determines the instruction
+// boundaries, so that chunks can be disassembled independently. The output of
+// each round of chunks is written in order.
+static
+int
+dis_region_parallel(const Region* region, unsigned threads, OutBuf* out)
+{
+    uint8_t* starts = malloc((region->len + 7) / 8);
+    DisChunk* chunks = calloc(threads, sizeof(DisChunk));
+    pthread_t* tids = calloc(threads, sizeof(pthread_t));
+    int res = -1;
+    if (!starts || !chunks || !tids) {
+        perror("malloc");
+        goto out;
+    }
+    fd_sweep_parallel(region->code, region->len, region->mode, starts, threads);
+
+    if (out_write(out->fd, out->data, out->len))
+        goto out;
+    out->len = 0;
+
+    res = 0;
+    for (size_t off = 0; off < region->len && !res;) {
+        unsigned count = 0;
+        for (; count < threads && off < region->len; count++) {
+            DisChunk* chunk = &chunks[count];
+            chunk->region = region;
+            chunk->starts = starts;
+            chunk->start = off;
+            off = region->len - off > CHUNK_SIZE ? off + CHUNK_SIZE : region->len;
+            chunk->end = off;
+            chunk->out.len = 0;
+            chunk->out.fd = -1;
+        }
+        // The first chunk is disassembled by this thread.
+        bool started[count];
+        for (unsigned i = 1; i < count; i++)
+            started[i] = !pthread_create(&tids[i], NULL, dis_chunk, &chunks[i]);
+        dis_chunk(&chunks[0]);
+        for (unsigned i = 1; i < count; i++) {
+            if (started[i])
+                pthread_join(tids[i], NULL);
+            else
+                dis_chunk(&chunks[i]);
+        }
+        for (unsigned i = 0; i < count && !res; i++)
+            res = chunks[i].res ||
+                  out_write(out->fd, chunks[i].out.data, chunks[i].out.len);
+    }
+
+out:
+    for (unsigned i = 0; chunks && i < threads; i++)
+        free(chunks[i].out.data);
+    free(tids);
+    free(chunks);
+    free(starts);
+    return res;
+}
+
+static
+int
+dis_region(const Region* region, unsigned threads, OutBuf* out)
+{
+    size_t name_len = strlen(region->name);
+    if (out_reserve(out, name_len + 32))
+        return -1;
+    out->len += sprintf(out->data + out->len, "\nDisassembly of %s:\n",
+                        region->name);
+    if (threads > 1)
+        return dis_region_parallel(region, threads, out);
+    return dis_range(region, NULL, 0, region->len, out);
+}
+
+static
+uint64_t
+load_le(const uint8_t* buf, unsigned size)
+{
+    uint64_t value = 0;
+    for (unsigned i = 0; i < size; i++)
+        value |= (uint64_t) buf[i] << 8 * i;
+    return value;
+}
+
+// Checked little-endian load from the file, zero if out of bounds.
+#define LOAD(off, size) \
+        ((off) <= len && (size) <= len - (off) ? load_le(buf + (off), size) : 0)
+
+typedef int (*RegionFn)(const Region* region, void* ctx);
+
+static
+int
+parse_elf(const uint8_t* buf, size_t len, RegionFn fn, void* ctx)
+{
+    bool is64 = buf[4] == 2;
+    unsigned machine = LOAD(18, 2);
+    if (buf[5] != 1 || (machine != (is64 ? 62 : 3))) {
+        fputs("unsupported ELF file (x86 little-endian only)\n", stderr);
+        return -1;
+    }
+    int mode = is64 ? 64 : 32;
+    unsigned word = is64 ? 8 : 4;
+
+    uint64_t shoff = LOAD(is64 ? 0x28 : 0x20, word);
+    unsigned shentsize = LOAD(is64 ? 0x3a : 0x2e, 2);
+    unsigned shnum = LOAD(is64 ? 0x3c : 0x30, 2);
+    unsigned shstrndx = LOAD(is64 ? 0x3e : 0x32, 2);
+    uint64_t strtab = LOAD(shoff + shstrndx * shentsize + (is64 ? 24 : 16), word);
+    uint64_t strtab_size = LOAD(shoff + shstrndx * shentsize + (is64 ? 32 : 20), word);
+
+    bool found = false;
+    for (unsigned i = 0; i < shnum; i++) {
+        uint64_t sh = shoff + i * shentsize;
+        uint64_t name = LOAD(sh, 4);
+        uint64_t type = LOAD(sh + 4, 4);
+        uint64_t flags = LOAD(sh + 8, word);
+        uint64_t addr = LOAD(sh + (is64 ? 16 : 12), word);
+        uint64_t off = LOAD(sh + (is64 ? 24 : 16), word);
+        uint64_t size = LOAD(sh + (is64 ? 32 : 20), word);
+        // SHT_NOBITS, SHF_EXECINSTR
+        if (type == 8 || !(flags & 4) || !size || off > len || size > len - off)
+            continue;
+        Region region = {".text", buf + off, size, addr, mode};
+        if (name < strtab_size && strtab <= len && strtab_size <= len - strtab &&
+            memchr(buf + strtab + name, 0, strtab_size - name))
+            region.name = (const char*) buf + strtab + name;
+        found = true;
+        if (fn(&region, ctx))
+            return -1;
+    }
+    if (found)
+        return 0;
+
+    // Without section headers, use executable loadable segments.
+    uint64_t phoff = LOAD(is64 ? 0x20 : 0x1c, word);
+    unsigned phentsize = LOAD(is64 ? 0x36 : 0x2a, 2);
+    unsigned phnum = LOAD(is64 ? 0x38 : 0x2c, 2);
+    for (unsigned i = 0; i < phnum; i++) {
+        uint64_t ph = phoff + i * phentsize;
+        uint64_t type = LOAD(ph, 4);
+        uint64_t flags = LOAD(ph + (is64 ? 4 : 24), 4);
+        uint64_t off = LOAD(ph + (is64 ? 8 : 4), word);
+        uint64_t addr = LOAD(ph + (is64 ? 16 : 8), word);
+        uint64_t size = LOAD(ph + (is64 ? 32 : 16), word);
+        // PT_LOAD, PF_X
+        if (type != 1 || !(flags & 1) || off > len || size > len - off)
+            continue;
+        Region region = {"executable segment", buf + off, size, addr, mode};
+        if (fn(&region, ctx))
+            return -1;
+    }
+    return 0;
+}
+
+static
+int
+parse_pe(const uint8_t* buf, size_t len, RegionFn fn, void* ctx)
+{
+    uint64_t pe = LOAD(0x3c, 4);
+    unsigned machine = LOAD(pe + 4, 2);
+    if (LOAD(pe, 4) != 0x4550 || (machine != 0x8664 && machine != 0x14c)) {
+        fputs("unsupported PE file (x86 only)\n", stderr);
+        return -1;
+    }
+    int mode = machine == 0x8664 ? 64 : 32;
+    unsigned nsections = LOAD(pe + 6, 2);
+    unsigned opt_size = LOAD(pe + 20, 2);
+    uint64_t opt = pe + 24;
+    unsigned magic = LOAD(opt, 2);
+    uint64_t image_base = magic == 0x20b ? LOAD(opt + 24, 8) : LOAD(opt + 28, 4);
+
+    for (unsigned i = 0; i < nsections; i++) {
+        uint64_t sh = opt + opt_size + i * 40;
+        uint64_t vsize = LOAD(sh + 8, 4);
+        uint64_t vaddr = LOAD(sh + 12, 4);
+        uint64_t size = LOAD(sh + 16, 4);
+        uint64_t off = LOAD(sh + 20, 4);
+        uint64_t flags = LOAD(sh + 36, 4);
+        // IMAGE_SCN_MEM_EXECUTE, IMAGE_SCN_CNT_CODE
+        if (!(flags & 0x20000020) || sh + 40 > len || off > len ||
+            size > len - off)
+            continue;
+        if (vsize && vsize < size)
+            size = vsize; // the remaining bytes are file alignment padding
+        char name[9] = {0};
+        memcpy(name, buf + sh, 8);
+        Region region = {name, buf + off, size, image_base + vaddr, mode};
+        if (fn(&region, ctx))
+            return -1;
+    }
+    return 0;
+}
+
+typedef struct {
+    unsigned threads;
+    OutBuf out;
+} DisCtx;
+
+static
+int
+dis_region_cb(const Region* region, void* arg)
+{
+    DisCtx* ctx = arg;
+    return dis_region(region, ctx->threads, &ctx->out);
+}
+
+static
+int
+dis_file(const char* path, int raw_mode, DisCtx* ctx)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    size_t len = st.st_size;
+    if (!len) {
+        close(fd);
+        return 0;
+    }
+    const uint8_t* buf = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+        perror(path);
+        return -1;
+    }
+    madvise((void*) buf, len, MADV_SEQUENTIAL);
+
+    int res;
+    if (len >= 0x40 && !memcmp(buf, "\x7f" "ELF", 4))
+        res = parse_elf(buf, len, dis_region_cb, ctx);
+    else if (len >= 0x40 && !memcmp(buf, "MZ", 2))
+        res = parse_pe(buf, len, dis_region_cb, ctx);
+    else
+        res = dis_region(&(Region) {path, buf, len, 0, raw_mode}, ctx->threads,
+                         &ctx->out);
+
+    munmap((void*) buf, len);
+    return res;
+}
+
+int
+main(int argc, char** argv)
+{
+    int raw_mode = 64;
+    DisCtx ctx = { .threads = 1, .out = { .fd = STDOUT_FILENO } };
+    int files = 0;
+    int res = 0;
+
+    for (int i = 1; i < argc && !res; i++) {
+        if (!strcmp(argv[i], "-32") || !strcmp(argv[i], "-64")) {
+            raw_mode = !strcmp(argv[i], "-32") ? 32 : 64;
+        } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            ctx.threads = strtoul(argv[++i], NULL, 0);
+            ctx.threads = ctx.threads ? ctx.threads : 1;
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "usage: %s [-32|-64] [--threads n] file...\n", argv[0]);
+            return 1;
+        } else {
+            res = dis_file(argv[i], raw_mode, &ctx);
+            files++;
+        }
+    }
+    if (!files) {
+        fprintf(stderr, "usage: %s [-32|-64] [--threads n] file...\n", argv[0]);
+        return 1;
+    }
+
+    if (!res)
+        res = out_write(ctx.out.fd, ctx.out.data, ctx.out.len);
+    free(ctx.out.data);
+    return res ? 1 : 0;
+}